@@ -0,0 +1,103 @@
+/*
+ * Benchmarks for DHCP4 Server Addresses
+ *
+ * This measures the lookup of server identifiers in the address set of a
+ * server connection, as done for every REQUEST, once through the hashed index
+ * of the set, and once with a plain scan of the address list for comparison.
+ * Half of the looked up identifiers belong to the server, the other half do
+ * not, like REQUESTs selecting other servers on a shared link.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <c-stdaux.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "n-dhcp4-private.h"
+
+#define BENCH_N_LOOKUPS (1U << 22)
+#define BENCH_N_KEYS (1024)
+
+static NDhcp4SConnectionIp *bench_find_scan(NDhcp4SConnection *connection, struct in_addr addr) {
+        NDhcp4SConnectionIp *ip;
+
+        c_list_for_each_entry(ip, &connection->ip_list, connection_link)
+                if (ip->ip.s_addr == addr.s_addr)
+                        return ip;
+
+        return NULL;
+}
+
+static uint64_t bench_lookup(NDhcp4SConnection *connection, const struct in_addr *keys, bool scan) {
+        uint64_t ts;
+        size_t n_found = 0;
+
+        ts = n_dhcp4_gettime(CLOCK_MONOTONIC);
+
+        for (size_t i = 0; i < BENCH_N_LOOKUPS; ++i) {
+                if (scan)
+                        n_found += !!bench_find_scan(connection, keys[i % BENCH_N_KEYS]);
+                else
+                        n_found += !!n_dhcp4_s_connection_find_ip(connection, keys[i % BENCH_N_KEYS]);
+        }
+
+        c_assert(n_found == BENCH_N_LOOKUPS / 2);
+
+        return n_dhcp4_gettime(CLOCK_MONOTONIC) - ts;
+}
+
+static void bench_set(size_t n_ips) {
+        NDhcp4SConnection connection = N_DHCP4_S_CONNECTION_NULL(connection);
+        struct in_addr keys[BENCH_N_KEYS];
+        NDhcp4SConnectionIp *ips;
+        uint64_t nsec_scan, nsec_index;
+        int r;
+
+        /* one address on each /24 of 10.0.0.0/8, like secondary addresses of a router */
+
+        ips = calloc(n_ips, sizeof(*ips));
+        c_assert(ips);
+
+        for (size_t i = 0; i < n_ips; ++i) {
+                n_dhcp4_s_connection_ip_init(&ips[i], (struct in_addr){ htonl(10 << 24 | i << 8 | 1) });
+                r = n_dhcp4_s_connection_ip_link(&ips[i], &connection);
+                c_assert(!r);
+        }
+
+        /* alternate between own and foreign identifiers */
+
+        for (size_t i = 0; i < BENCH_N_KEYS; ++i) {
+                if (i % 2)
+                        keys[i] = (struct in_addr){ htonl(10 << 24 | (i / 2 % n_ips) << 8 | 2) };
+                else
+                        keys[i] = ips[i / 2 % n_ips].ip;
+        }
+
+        nsec_scan = bench_lookup(&connection, keys, true);
+        nsec_index = bench_lookup(&connection, keys, false);
+
+        fprintf(stderr,
+                "%5zu addresses: list-scan %8.1f ns/lookup, hashed %6.1f ns/lookup\n",
+                n_ips,
+                (double)nsec_scan / BENCH_N_LOOKUPS,
+                (double)nsec_index / BENCH_N_LOOKUPS);
+
+        for (size_t i = 0; i < n_ips; ++i) {
+                n_dhcp4_s_connection_ip_unlink(&ips[i]);
+                n_dhcp4_s_connection_ip_deinit(&ips[i]);
+        }
+
+        n_dhcp4_s_connection_deinit(&connection);
+        free(ips);
+}
+
+int main(int argc, char **argv) {
+        static const size_t sizes[] = { 1, 16, 256, 1024 };
+
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); ++i)
+                bench_set(sizes[i]);
+
+        return 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * Benchmarks for DHCP4 Event Queues
+ *
+ * This raises events on a client and a server in rounds, like a dispatch
+ * would, and pops all of them again, like the caller would afterwards. It
+ * measures the time and the allocations per event, once with the event cache
+ * of the object in place, and once with it disabled for comparison. The heap
+ * allocator is wrapped to count allocations. The cache of clients is kept
+ * small, so rounds larger than it still allocate for the excess events.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <c-stdaux.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "n-dhcp4-private.h"
+
+#define BENCH_N_EVENTS (1U << 22)
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+
+static size_t bench_n_allocations;
+
+void *malloc(size_t size) {
+        ++bench_n_allocations;
+        return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+        ++bench_n_allocations;
+        return __libc_calloc(n, size);
+}
+
+static void bench_report(const char *name, size_t n_round, bool cache, uint64_t nsec, size_t n_allocations) {
+        fprintf(stderr,
+                "%s, %3zu events/round, %s: %6.1f ns/event, %4.2f allocations/event\n",
+                name,
+                n_round,
+                cache ? "cached  " : "uncached",
+                (double)nsec / BENCH_N_EVENTS,
+                (double)n_allocations / BENCH_N_EVENTS);
+}
+
+static void bench_client(size_t n_round, bool cache) {
+        NDhcp4Client client = N_DHCP4_CLIENT_NULL(client);
+        NDhcp4ClientEvent *event;
+        NDhcp4CEventNode *node;
+        uint64_t ts;
+        CList *link;
+        int r;
+
+        if (!cache)
+                client.event_cache.max_nodes = 0;
+
+        bench_n_allocations = 0;
+        ts = n_dhcp4_gettime(CLOCK_MONOTONIC);
+
+        for (size_t i = 0; i < BENCH_N_EVENTS; i += n_round) {
+                for (size_t j = 0; j < n_round; ++j) {
+                        r = n_dhcp4_client_raise(&client, NULL, N_DHCP4_CLIENT_EVENT_DOWN);
+                        c_assert(!r);
+                }
+
+                for (size_t j = 0; j < n_round; ++j) {
+                        r = n_dhcp4_client_pop_event(&client, &event);
+                        c_assert(!r && event);
+                }
+
+                r = n_dhcp4_client_pop_event(&client, &event);
+                c_assert(!r && !event);
+        }
+
+        bench_report("client", n_round, cache, n_dhcp4_gettime(CLOCK_MONOTONIC) - ts, bench_n_allocations);
+
+        while ((link = n_dhcp4_event_cache_pop(&client.event_cache))) {
+                node = c_container_of(link, NDhcp4CEventNode, client_link);
+                free(node);
+        }
+}
+
+static void bench_server(size_t n_round, bool cache) {
+        NDhcp4Server server = N_DHCP4_SERVER_NULL(server);
+        NDhcp4ServerEvent *event;
+        NDhcp4SEventNode *node;
+        uint64_t ts;
+        CList *link;
+        int r;
+
+        if (!cache)
+                server.event_cache.max_nodes = 0;
+
+        /* popping the last event arms the timer, which stays disarmed without leases */
+        n_dhcp4_timer_wheel_init(&server.timers, N_DHCP4_SERVER_TIMER_SHIFT, n_dhcp4_gettime(CLOCK_BOOTTIME));
+
+        bench_n_allocations = 0;
+        ts = n_dhcp4_gettime(CLOCK_MONOTONIC);
+
+        for (size_t i = 0; i < BENCH_N_EVENTS; i += n_round) {
+                for (size_t j = 0; j < n_round; ++j) {
+                        r = n_dhcp4_server_raise(&server, NULL, N_DHCP4_SERVER_EVENT_DISCOVER);
+                        c_assert(!r);
+                }
+
+                for (size_t j = 0; j < n_round; ++j) {
+                        r = n_dhcp4_server_pop_event(&server, &event);
+                        c_assert(!r && event);
+                }
+
+                r = n_dhcp4_server_pop_event(&server, &event);
+                c_assert(!r && !event);
+        }
+
+        bench_report("server", n_round, cache, n_dhcp4_gettime(CLOCK_MONOTONIC) - ts, bench_n_allocations);
+
+        while ((link = n_dhcp4_event_cache_pop(&server.event_cache))) {
+                node = c_container_of(link, NDhcp4SEventNode, server_link);
+                free(node);
+        }
+
+        n_dhcp4_timer_wheel_deinit(&server.timers);
+}
+
+int main(int argc, char **argv) {
+        static const size_t rounds[] = { 1, 4, 32, 128 };
+
+        for (size_t i = 0; i < sizeof(rounds) / sizeof(*rounds); ++i) {
+                bench_client(rounds[i], false);
+                bench_client(rounds[i], true);
+        }
+
+        for (size_t i = 0; i < sizeof(rounds) / sizeof(*rounds); ++i) {
+                bench_server(rounds[i], false);
+                bench_server(rounds[i], true);
+        }
+
+        return 0;
+}
@@ -0,0 +1,208 @@
+/*
+ * Benchmarks for DHCP4 Lease Memory
+ *
+ * This measures the heap memory of 100k leases held at the same time, each
+ * with the message it was created from. Client leases keep the ACK of the
+ * server, server leases keep the REQUEST of the client. For comparison, the
+ * same messages are held in the former layout of incoming messages, which
+ * carried a full table of all possible options.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <c-stdaux.h>
+#include <endian.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "n-dhcp4-private.h"
+
+#define BENCH_N_LEASES (100000)
+
+typedef struct BenchMessage {
+        NDhcp4Header header;
+        uint8_t sname[64];
+        uint8_t file[128];
+        uint32_t magic;
+        uint8_t options[312];
+} BenchMessage;
+
+/* the former layout of incoming messages, with a full table of options */
+typedef struct BenchIncoming {
+        struct {
+                uint8_t *value;
+                size_t size;
+        } options[_N_DHCP4_OPTION_N];
+        struct {
+                uint8_t type;
+                uint64_t start_time;
+                uint64_t base_time;
+        } userdata;
+        size_t n_message;
+        NDhcp4Message message;
+} BenchIncoming;
+
+static size_t bench_append(BenchMessage *m, size_t pos, uint8_t option, const void *data, size_t n_data) {
+        m->options[pos++] = option;
+        m->options[pos++] = n_data;
+        memcpy(m->options + pos, data, n_data);
+        return pos + n_data;
+}
+
+static size_t bench_append_u32(BenchMessage *m, size_t pos, uint8_t option, uint32_t u32) {
+        u32 = htobe32(u32);
+        return bench_append(m, pos, option, &u32, sizeof(u32));
+}
+
+/* an ACK as sent by common servers, with a handful of network parameters */
+static void bench_message_ack(BenchMessage *m) {
+        size_t pos = 0;
+
+        memset(m, 0, sizeof(*m));
+        m->header.op = N_DHCP4_OP_BOOTREPLY;
+        m->header.yiaddr = htobe32(10 << 24 | 100);
+        m->magic = htobe32(N_DHCP4_MESSAGE_MAGIC);
+
+        pos = bench_append(m, pos, N_DHCP4_OPTION_MESSAGE_TYPE, (uint8_t []){ N_DHCP4_MESSAGE_ACK }, 1);
+        pos = bench_append_u32(m, pos, N_DHCP4_OPTION_SERVER_IDENTIFIER, 10 << 24 | 1);
+        pos = bench_append_u32(m, pos, N_DHCP4_OPTION_IP_ADDRESS_LEASE_TIME, 3600);
+        pos = bench_append_u32(m, pos, N_DHCP4_OPTION_RENEWAL_T1_TIME, 1800);
+        pos = bench_append_u32(m, pos, N_DHCP4_OPTION_REBINDING_T2_TIME, 3150);
+        pos = bench_append_u32(m, pos, N_DHCP4_OPTION_SUBNET_MASK, 0xff000000);
+        pos = bench_append_u32(m, pos, N_DHCP4_OPTION_ROUTER, 10 << 24 | 1);
+        pos = bench_append_u32(m, pos, N_DHCP4_OPTION_DOMAIN_NAME_SERVER, 10 << 24 | 1);
+        pos = bench_append(m, pos, N_DHCP4_OPTION_DOMAIN_NAME, "example.org", strlen("example.org"));
+        m->options[pos++] = N_DHCP4_OPTION_END;
+}
+
+/* a REQUEST as sent by common clients, with a unique client identifier */
+static void bench_message_request(BenchMessage *m, uint32_t id) {
+        uint8_t client_id[7] = { 1, 0x02 };
+        size_t pos = 0;
+
+        memcpy(client_id + 2, &id, sizeof(id));
+
+        memset(m, 0, sizeof(*m));
+        m->header.op = N_DHCP4_OP_BOOTREQUEST;
+        m->magic = htobe32(N_DHCP4_MESSAGE_MAGIC);
+
+        pos = bench_append(m, pos, N_DHCP4_OPTION_MESSAGE_TYPE, (uint8_t []){ N_DHCP4_MESSAGE_REQUEST }, 1);
+        pos = bench_append(m, pos, N_DHCP4_OPTION_CLIENT_IDENTIFIER, client_id, sizeof(client_id));
+        pos = bench_append_u32(m, pos, N_DHCP4_OPTION_REQUESTED_IP_ADDRESS, 10 << 24 | 100);
+        pos = bench_append_u32(m, pos, N_DHCP4_OPTION_SERVER_IDENTIFIER, 10 << 24 | 1);
+        pos = bench_append(m, pos, N_DHCP4_OPTION_MAXIMUM_MESSAGE_SIZE, (uint8_t []){ 0x05, 0xdc }, 2);
+        pos = bench_append(m, pos, N_DHCP4_OPTION_PARAMETER_REQUEST_LIST,
+                           (uint8_t []){ 1, 3, 6, 12, 15, 28, 42, 51, 54, 58, 59, 119 }, 12);
+        m->options[pos++] = N_DHCP4_OPTION_END;
+}
+
+static size_t bench_heap(void) {
+        return mallinfo2().uordblks;
+}
+
+static void bench_report(const char *name, size_t n_before) {
+        size_t n = bench_heap() - n_before;
+
+        fprintf(stderr,
+                "%-14s %8.1f MiB for %u leases (%6.1f bytes/lease)\n",
+                name,
+                (double)n / (1024 * 1024),
+                BENCH_N_LEASES,
+                (double)n / BENCH_N_LEASES);
+}
+
+static void bench_former(void) {
+        BenchIncoming **messages;
+        BenchMessage m;
+        size_t n_heap, size;
+
+        messages = calloc(BENCH_N_LEASES, sizeof(*messages));
+        c_assert(messages);
+
+        bench_message_ack(&m);
+
+        /* mirrors the allocation of the former n_dhcp4_incoming_new() */
+        size = sizeof(BenchIncoming) + sizeof(m) - sizeof(NDhcp4Message);
+        size += sizeof(m) - sizeof(NDhcp4Header);
+
+        n_heap = bench_heap();
+
+        for (size_t i = 0; i < BENCH_N_LEASES; ++i) {
+                messages[i] = calloc(1, size);
+                c_assert(messages[i]);
+                memcpy(&messages[i]->message, &m, sizeof(m));
+        }
+
+        bench_report("former ACK", n_heap);
+
+        for (size_t i = 0; i < BENCH_N_LEASES; ++i)
+                free(messages[i]);
+        free(messages);
+}
+
+static void bench_client(void) {
+        NDhcp4ClientLease **leases;
+        NDhcp4Incoming *message;
+        BenchMessage m;
+        size_t n_heap;
+        int r;
+
+        leases = calloc(BENCH_N_LEASES, sizeof(*leases));
+        c_assert(leases);
+
+        bench_message_ack(&m);
+
+        n_heap = bench_heap();
+
+        for (size_t i = 0; i < BENCH_N_LEASES; ++i) {
+                r = n_dhcp4_incoming_new(&message, &m, sizeof(m));
+                c_assert(!r);
+
+                r = n_dhcp4_client_lease_new(&leases[i], message);
+                c_assert(!r);
+        }
+
+        bench_report("client lease", n_heap);
+
+        for (size_t i = 0; i < BENCH_N_LEASES; ++i)
+                n_dhcp4_client_lease_unref(leases[i]);
+        free(leases);
+}
+
+static void bench_server(void) {
+        NDhcp4ServerLease **leases;
+        NDhcp4Incoming *message;
+        BenchMessage m;
+        size_t n_heap;
+        int r;
+
+        leases = calloc(BENCH_N_LEASES, sizeof(*leases));
+        c_assert(leases);
+
+        n_heap = bench_heap();
+
+        for (size_t i = 0; i < BENCH_N_LEASES; ++i) {
+                bench_message_request(&m, i);
+
+                r = n_dhcp4_incoming_new(&message, &m, sizeof(m));
+                c_assert(!r);
+
+                r = n_dhcp4_server_lease_new(&leases[i], message);
+                c_assert(!r);
+        }
+
+        bench_report("server lease", n_heap);
+
+        for (size_t i = 0; i < BENCH_N_LEASES; ++i)
+                n_dhcp4_server_lease_unref(leases[i]);
+        free(leases);
+}
+
+int main(int argc, char **argv) {
+        bench_former();
+        bench_client();
+        bench_server();
+
+        return 0;
+}
@@ -0,0 +1,321 @@
+/*
+ * Benchmarks for DHCP4 Message Parsing
+ *
+ * This measures parsing of incoming messages, once with the option linearizer
+ * of the library, and once with the former linearizer, which rescans all
+ * sections of the message for every distinct option, for comparison. The
+ * library linearizer is measured both on a copy of the message, and parsing
+ * the message in place. The
+ * messages are the ones of test-message.c, plus synthetic requests with many
+ * distinct and many repeated options. Both linearizers must produce the same
+ * options, which is verified before measuring.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <c-stdaux.h>
+#include <endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "n-dhcp4-private.h"
+
+#define BENCH_N_ROUNDS (100000)
+
+typedef struct BenchMessage {
+        NDhcp4Header header;
+        uint8_t sname[64];
+        uint8_t file[128];
+        uint32_t magic;
+        uint8_t options[1024];
+} BenchMessage;
+
+/* the former layout of incoming messages, with a full table of options */
+typedef struct BenchIncoming {
+        struct {
+                uint8_t *value;
+                size_t size;
+        } options[_N_DHCP4_OPTION_N];
+        size_t n_message;
+        NDhcp4Message message;
+} BenchIncoming;
+
+static void bench_prefetch(BenchIncoming *incoming, size_t *offset, uint8_t option, const uint8_t *raw, size_t n_raw) {
+        uint8_t o, l;
+        size_t pos;
+
+        for (pos = 0; pos < n_raw; ) {
+                o = raw[pos++];
+                if (o == N_DHCP4_OPTION_PAD)
+                        continue;
+                if (o == N_DHCP4_OPTION_END)
+                        return;
+                if (pos >= n_raw)
+                        return;
+
+                l = raw[pos++];
+                if (l > n_raw || pos > n_raw - l)
+                        return;
+
+                if (o == option) {
+                        memcpy((uint8_t *)&incoming->message + *offset, raw + pos, l);
+                        *offset += l;
+                }
+
+                pos += l;
+        }
+}
+
+static void bench_merge(BenchIncoming *incoming, size_t *offset, uint8_t overload, uint8_t option) {
+        uint8_t *m = (uint8_t *)&incoming->message;
+        size_t pos = *offset;
+
+        bench_prefetch(incoming, offset, option,
+                       m + offsetof(NDhcp4Message, options),
+                       incoming->n_message - offsetof(NDhcp4Message, options));
+
+        if (overload & N_DHCP4_OVERLOAD_FILE)
+                bench_prefetch(incoming, offset, option,
+                               m + offsetof(NDhcp4Message, file),
+                               sizeof(incoming->message.file));
+
+        if (overload & N_DHCP4_OVERLOAD_SNAME)
+                bench_prefetch(incoming, offset, option,
+                               m + offsetof(NDhcp4Message, sname),
+                               sizeof(incoming->message.sname));
+
+        incoming->options[option].value = m + pos;
+        incoming->options[option].size = *offset - pos;
+}
+
+static void bench_linearize(BenchIncoming *incoming) {
+        uint8_t *m, o, l, overload;
+        size_t i, pos, end, offset;
+
+        m = (uint8_t *)&incoming->message;
+        offset = incoming->n_message;
+
+        bench_merge(incoming, &offset, 0, N_DHCP4_OPTION_OVERLOAD);
+        if (incoming->options[N_DHCP4_OPTION_OVERLOAD].size >= 1)
+                overload = *incoming->options[N_DHCP4_OPTION_OVERLOAD].value;
+        else
+                overload = 0;
+
+        for (i = 0; i < 3; ++i) {
+                if (i == 0) {
+                        pos = offsetof(NDhcp4Message, options);
+                        end = incoming->n_message;
+                } else if (i == 1) {
+                        if (!(overload & N_DHCP4_OVERLOAD_FILE))
+                                continue;
+
+                        pos = offsetof(NDhcp4Message, file);
+                        end = pos + sizeof(incoming->message.file);
+                } else {
+                        if (!(overload & N_DHCP4_OVERLOAD_SNAME))
+                                continue;
+
+                        pos = offsetof(NDhcp4Message, sname);
+                        end = pos + sizeof(incoming->message.sname);
+                }
+
+                while (pos < end) {
+                        o = m[pos++];
+                        if (o == N_DHCP4_OPTION_PAD)
+                                continue;
+                        if (o == N_DHCP4_OPTION_END)
+                                break;
+                        if (pos >= end)
+                                break;
+
+                        l = m[pos++];
+                        if (l > end || pos > end - l)
+                                break;
+
+                        if (!incoming->options[o].value)
+                                bench_merge(incoming, &offset, overload, o);
+
+                        pos += l;
+                }
+        }
+}
+
+/* mirrors the former n_dhcp4_incoming_new(), with the former linearizer */
+static void bench_incoming_new(BenchIncoming **incomingp, const void *raw, size_t n_raw) {
+        BenchIncoming *incoming;
+        size_t size;
+
+        size = sizeof(*incoming) + n_raw - sizeof(NDhcp4Message);
+        size += n_raw - sizeof(NDhcp4Header);
+
+        incoming = calloc(1, size);
+        c_assert(incoming);
+
+        incoming->n_message = n_raw;
+        memcpy(&incoming->message, raw, n_raw);
+        c_assert(incoming->message.magic == htobe32(N_DHCP4_MESSAGE_MAGIC));
+
+        bench_linearize(incoming);
+
+        *incomingp = incoming;
+}
+
+static size_t bench_append(BenchMessage *m, size_t pos, uint8_t option, size_t n_data) {
+        m->options[pos++] = option;
+        m->options[pos++] = n_data;
+        for (size_t i = 0; i < n_data; ++i)
+                m->options[pos++] = option + i;
+        return pos;
+}
+
+static size_t bench_init(BenchMessage *m) {
+        memset(m, 0, sizeof(*m));
+        m->magic = htobe32(N_DHCP4_MESSAGE_MAGIC);
+        return 0;
+}
+
+/* the final message of test-message.c, with options in all three sections */
+static size_t bench_message_test(BenchMessage *m) {
+        size_t pos = bench_init(m);
+
+        m->options[pos++] = N_DHCP4_OPTION_OVERLOAD;
+        m->options[pos++] = 1;
+        m->options[pos++] = N_DHCP4_OVERLOAD_FILE | N_DHCP4_OVERLOAD_SNAME;
+        pos = bench_append(m, pos, 1, 1);
+        m->sname[0] = 1;
+        m->sname[1] = 1;
+        m->sname[2] = 0xcf;
+        m->file[0] = 2;
+        m->file[1] = 0;
+
+        return sizeof(*m);
+}
+
+/* a typical request: a handful of options, then END and padding */
+static size_t bench_message_small(BenchMessage *m) {
+        size_t pos = bench_init(m);
+
+        pos = bench_append(m, pos, N_DHCP4_OPTION_MESSAGE_TYPE, 1);
+        pos = bench_append(m, pos, N_DHCP4_OPTION_CLIENT_IDENTIFIER, 7);
+        pos = bench_append(m, pos, N_DHCP4_OPTION_MAXIMUM_MESSAGE_SIZE, 2);
+        pos = bench_append(m, pos, N_DHCP4_OPTION_PARAMETER_REQUEST_LIST, 12);
+        m->options[pos++] = N_DHCP4_OPTION_END;
+
+        return offsetof(BenchMessage, options) + 312;
+}
+
+/* a vendor-heavy request with 48 distinct options */
+static size_t bench_message_vendor(BenchMessage *m) {
+        size_t pos = bench_init(m);
+
+        for (unsigned int i = 0; i < 48; ++i)
+                pos = bench_append(m, pos, 128 + i, 16);
+        m->options[pos++] = N_DHCP4_OPTION_END;
+
+        return sizeof(*m);
+}
+
+/* 48 distinct options, each split into two instances */
+static size_t bench_message_split(BenchMessage *m) {
+        size_t pos = bench_init(m);
+
+        for (unsigned int i = 0; i < 96; ++i)
+                pos = bench_append(m, pos, 128 + i % 48, 8);
+        m->options[pos++] = N_DHCP4_OPTION_END;
+
+        return sizeof(*m);
+}
+
+static void bench_verify(const void *raw, size_t n_raw) {
+        _c_cleanup_(n_dhcp4_incoming_freep) NDhcp4Incoming *new = NULL;
+        BenchIncoming *old;
+        uint8_t *v_new;
+        size_t n_new;
+        int r;
+
+        bench_incoming_new(&old, raw, n_raw);
+        r = n_dhcp4_incoming_new(&new, raw, n_raw);
+        c_assert(!r);
+
+        for (unsigned int i = 0; i < _N_DHCP4_OPTION_N; ++i) {
+                r = n_dhcp4_incoming_query(new, i, &v_new, &n_new);
+
+                /* the former linearizer always set OVERLOAD, possibly empty */
+                if (i == N_DHCP4_OPTION_OVERLOAD && r == N_DHCP4_E_UNSET) {
+                        c_assert(old->options[i].value && !old->options[i].size);
+                        continue;
+                }
+
+                c_assert(!r == !!old->options[i].value);
+                if (!r) {
+                        c_assert(old->options[i].size == n_new);
+                        c_assert(!memcmp(old->options[i].value, v_new, n_new));
+                }
+        }
+
+        free(old);
+}
+
+static void bench_parse(const char *name, const void *raw, size_t n_raw) {
+        static uint8_t buf[2 * sizeof(BenchMessage)];
+        static NDhcp4Incoming view;
+        NDhcp4Incoming *incoming;
+        BenchIncoming *old;
+        uint64_t ts, nsec_old, nsec_new, nsec_view;
+        int r;
+
+        bench_verify(raw, n_raw);
+
+        ts = n_dhcp4_gettime(CLOCK_MONOTONIC);
+        for (unsigned int i = 0; i < BENCH_N_ROUNDS; ++i) {
+                bench_incoming_new(&old, raw, n_raw);
+                free(old);
+        }
+        nsec_old = n_dhcp4_gettime(CLOCK_MONOTONIC) - ts;
+
+        ts = n_dhcp4_gettime(CLOCK_MONOTONIC);
+        for (unsigned int i = 0; i < BENCH_N_ROUNDS; ++i) {
+                r = n_dhcp4_incoming_new(&incoming, raw, n_raw);
+                c_assert(!r);
+                n_dhcp4_incoming_free(incoming);
+        }
+        nsec_new = n_dhcp4_gettime(CLOCK_MONOTONIC) - ts;
+
+        memcpy(buf, raw, n_raw);
+
+        ts = n_dhcp4_gettime(CLOCK_MONOTONIC);
+        for (unsigned int i = 0; i < BENCH_N_ROUNDS; ++i) {
+                r = n_dhcp4_incoming_init_borrowed(&view, buf, sizeof(buf), n_raw);
+                c_assert(!r);
+                n_dhcp4_incoming_deinit(&view);
+        }
+        nsec_view = n_dhcp4_gettime(CLOCK_MONOTONIC) - ts;
+
+        fprintf(stderr,
+                "%-8s %5zu bytes: merge %8.1f ns/message, single-pass %8.1f ns/message, in place %8.1f ns/message\n",
+                name,
+                n_raw,
+                (double)nsec_old / BENCH_N_ROUNDS,
+                (double)nsec_new / BENCH_N_ROUNDS,
+                (double)nsec_view / BENCH_N_ROUNDS);
+}
+
+int main(int argc, char **argv) {
+        BenchMessage m;
+        size_t n;
+
+        n = bench_message_test(&m);
+        bench_parse("test", &m, n);
+
+        n = bench_message_small(&m);
+        bench_parse("small", &m, n);
+
+        n = bench_message_vendor(&m);
+        bench_parse("vendor", &m, n);
+
+        n = bench_message_split(&m);
+        bench_parse("split", &m, n);
+
+        return 0;
+}
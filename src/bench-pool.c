@@ -0,0 +1,124 @@
+/*
+ * Benchmarks for DHCP4 Server Address Pools
+ *
+ * This measures address allocation from a /16 pool that is 99% full, once
+ * through the summary hierarchy of the pool, and once with a plain scan of
+ * the free bitmap for comparison. Each round allocates all remaining free
+ * addresses and then releases them again.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <c-stdaux.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "n-dhcp4-private.h"
+
+#define BENCH_N_ROUNDS (256)
+#define BENCH_PREFIXLEN (16)
+
+static int bench_allocate_scan(NDhcp4ServerPool *pool, struct in_addr *addressp) {
+        uint64_t *bitmap = pool->levels[0];
+
+        for (size_t w = 0; w < pool->n_words; ++w) {
+                if (bitmap[w]) {
+                        addressp->s_addr = htonl(pool->base + w * 64 + __builtin_ctzll(bitmap[w]));
+                        return n_dhcp4_server_pool_claim(pool, *addressp);
+                }
+        }
+
+        return N_DHCP4_E_NO_SPACE;
+}
+
+static uint64_t bench_round(NDhcp4ServerPool *pool,
+                            struct in_addr *addresses,
+                            size_t n_addresses,
+                            bool scan) {
+        uint64_t ts, nsec;
+        int r;
+
+        ts = n_dhcp4_gettime(CLOCK_MONOTONIC);
+
+        for (size_t i = 0; i < n_addresses; ++i) {
+                if (scan)
+                        r = bench_allocate_scan(pool, &addresses[i]);
+                else
+                        r = n_dhcp4_server_pool_allocate(pool, &addresses[i]);
+                c_assert(!r);
+        }
+
+        nsec = n_dhcp4_gettime(CLOCK_MONOTONIC) - ts;
+
+        for (size_t i = 0; i < n_addresses; ++i)
+                n_dhcp4_server_pool_release(pool, addresses[i]);
+
+        return nsec;
+}
+
+static void bench_report(const char *name, uint64_t nsec, size_t n_addresses) {
+        double n = (double)BENCH_N_ROUNDS * n_addresses;
+
+        fprintf(stderr,
+                "%-12s %10.0f allocations/s (%.1f ns/allocation)\n",
+                name,
+                n * 1000.0 * 1000.0 * 1000.0 / nsec,
+                (double)nsec / n);
+}
+
+static void bench_allocate(void) {
+        _c_cleanup_(n_dhcp4_server_pool_freep) NDhcp4ServerPool *pool = NULL;
+        struct in_addr subnet = (struct in_addr){ htonl(172 << 24 | 16 << 16) };
+        struct in_addr last = (struct in_addr){ htonl(172 << 24 | 16 << 16 | 0xffff) };
+        struct in_addr address, *addresses;
+        size_t n_total, n_free = 0;
+        unsigned int seed = 0;
+        uint64_t nsec;
+        int r;
+
+        /* setup: fill the pool, then release a random 1% of it */
+
+        r = n_dhcp4_server_pool_new(&pool, subnet, BENCH_PREFIXLEN);
+        c_assert(!r);
+        r = n_dhcp4_server_pool_add_range(pool, subnet, last);
+        c_assert(!r);
+
+        n_total = (1U << (32 - BENCH_PREFIXLEN)) - 2;
+        addresses = calloc(n_total, sizeof(*addresses));
+        c_assert(addresses);
+
+        for (size_t i = 0; i < n_total; ++i) {
+                r = n_dhcp4_server_pool_allocate(pool, &address);
+                c_assert(!r);
+        }
+
+        while (n_free < n_total / 100) {
+                uint32_t i = 1 + rand_r(&seed) % n_total;
+
+                if (pool->allocated[i / 64] & (UINT64_C(1) << (i % 64))) {
+                        n_dhcp4_server_pool_release(pool, (struct in_addr){ htonl(pool->base + i) });
+                        ++n_free;
+                }
+        }
+
+        /* each round allocates all free addresses and releases them again */
+
+        nsec = 0;
+        for (unsigned int i = 0; i < BENCH_N_ROUNDS; ++i)
+                nsec += bench_round(pool, addresses, n_free, true);
+        bench_report("bitmap-scan", nsec, n_free);
+
+        nsec = 0;
+        for (unsigned int i = 0; i < BENCH_N_ROUNDS; ++i)
+                nsec += bench_round(pool, addresses, n_free, false);
+        bench_report("hierarchy", nsec, n_free);
+
+        free(addresses);
+}
+
+int main(int argc, char **argv) {
+        bench_allocate();
+
+        return 0;
+}
@@ -0,0 +1,179 @@
+/*
+ * Benchmarks for the DHCP4 Server
+ *
+ * This measures the receive throughput of the server UDP socket, comparing a
+ * single recvmsg(2) per datagram, which copies each message, with batched
+ * recvmmsg(2) calls, which parse the messages in place. Requests are sent in
+ * bursts across a veth pair, and only the receive side is timed.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <c-stdaux.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "n-dhcp4-private.h"
+#include "test.h"
+#include "util/link.h"
+#include "util/netns.h"
+
+#define BENCH_N_BURST (32)
+#define BENCH_N_ROUNDS (4096)
+
+static void bench_poll(int sk) {
+        int r;
+
+        r = poll(&(struct pollfd){ .fd = sk, .events = POLLIN }, 1, -1);
+        c_assert(r == 1);
+}
+
+static void bench_send_burst(int sk_client, NDhcp4Outgoing *outgoing) {
+        int r;
+
+        for (unsigned int i = 0; i < BENCH_N_BURST; ++i) {
+                r = n_dhcp4_c_socket_udp_send(sk_client, outgoing);
+                c_assert(!r);
+        }
+}
+
+static uint64_t bench_recv_single(int sk_server) {
+        static uint8_t buf[UINT16_MAX];
+        unsigned int n = 0;
+        uint64_t ts;
+        int r;
+
+        ts = n_dhcp4_gettime(CLOCK_MONOTONIC);
+
+        while (n < BENCH_N_BURST) {
+                _c_cleanup_(n_dhcp4_incoming_freep) NDhcp4Incoming *incoming = NULL;
+                struct sockaddr_in dest = {};
+
+                r = n_dhcp4_s_socket_udp_recv(sk_server, buf, sizeof(buf), &incoming, &dest);
+                if (r == N_DHCP4_E_AGAIN) {
+                        bench_poll(sk_server);
+                        continue;
+                }
+                c_assert(!r);
+                c_assert(incoming);
+                ++n;
+        }
+
+        return n_dhcp4_gettime(CLOCK_MONOTONIC) - ts;
+}
+
+static uint64_t bench_recv_batch(int sk_server) {
+        static uint8_t buf[N_DHCP4_S_CONNECTION_N_BATCH * N_DHCP4_S_CONNECTION_SLOT];
+        static NDhcp4Incoming incoming[N_DHCP4_S_CONNECTION_N_BATCH];
+        struct sockaddr_in dests[N_DHCP4_S_CONNECTION_N_BATCH];
+        size_t n_incoming, n = 0;
+        uint64_t ts;
+        int r;
+
+        ts = n_dhcp4_gettime(CLOCK_MONOTONIC);
+
+        while (n < BENCH_N_BURST) {
+                r = n_dhcp4_s_socket_udp_recv_batch(sk_server,
+                                                    buf,
+                                                    N_DHCP4_S_CONNECTION_SLOT,
+                                                    N_DHCP4_S_CONNECTION_N_BATCH,
+                                                    incoming,
+                                                    dests,
+                                                    &n_incoming);
+                if (r == N_DHCP4_E_AGAIN) {
+                        bench_poll(sk_server);
+                        continue;
+                }
+                c_assert(!r);
+
+                for (size_t i = 0; i < n_incoming; ++i) {
+                        c_assert(incoming[i].message);
+                        n_dhcp4_incoming_deinit(&incoming[i]);
+                }
+
+                n += n_incoming;
+        }
+
+        return n_dhcp4_gettime(CLOCK_MONOTONIC) - ts;
+}
+
+static void bench_report(const char *name, uint64_t nsec) {
+        double n = (double)BENCH_N_ROUNDS * BENCH_N_BURST;
+
+        fprintf(stderr,
+                "%-8s %10.0f packets/s (%.1f ns/packet)\n",
+                name,
+                n * 1000.0 * 1000.0 * 1000.0 / nsec,
+                (double)nsec / n);
+}
+
+static void bench_recv(void) {
+        _c_cleanup_(netns_closep) int ns_server = -1, ns_client = -1;
+        _c_cleanup_(link_deinit) Link link_server = LINK_NULL(link_server);
+        _c_cleanup_(link_deinit) Link link_client = LINK_NULL(link_client);
+        _c_cleanup_(n_dhcp4_outgoing_freep) NDhcp4Outgoing *outgoing = NULL;
+        _c_cleanup_(c_closep) int sk_server = -1, sk_client = -1;
+        struct in_addr addr_server = (struct in_addr){ htonl(10 << 24 | 1) };
+        struct in_addr addr_client = (struct in_addr){ htonl(10 << 24 | 2) };
+        uint8_t type = N_DHCP4_MESSAGE_DISCOVER;
+        uint64_t nsec;
+        int r, oldns;
+
+        /* setup */
+
+        netns_new(&ns_server);
+        netns_new(&ns_client);
+        link_new_veth(&link_server, &link_client, ns_server, ns_client);
+        link_add_ip4(&link_server, &addr_server, 8);
+        link_add_ip4(&link_client, &addr_client, 8);
+
+        netns_get(&oldns);
+
+        netns_set(ns_server);
+        r = n_dhcp4_s_socket_udp_new(&sk_server, link_server.ifindex, 0);
+        c_assert(!r);
+
+        netns_set(ns_client);
+        r = n_dhcp4_c_socket_udp_new(&sk_client, link_client.ifindex, &addr_client, &addr_server);
+        c_assert(!r);
+
+        netns_set(oldns);
+
+        r = n_dhcp4_outgoing_new(&outgoing, 0, 0);
+        c_assert(!r);
+        n_dhcp4_outgoing_get_header(outgoing)->op = N_DHCP4_OP_BOOTREQUEST;
+        r = n_dhcp4_outgoing_append(outgoing, N_DHCP4_OPTION_MESSAGE_TYPE, &type, sizeof(type));
+        c_assert(!r);
+
+        /* each round sends a burst and then times receiving it */
+
+        nsec = 0;
+        for (unsigned int i = 0; i < BENCH_N_ROUNDS; ++i) {
+                bench_send_burst(sk_client, outgoing);
+                nsec += bench_recv_single(sk_server);
+        }
+        bench_report("recvmsg", nsec);
+
+        nsec = 0;
+        for (unsigned int i = 0; i < BENCH_N_ROUNDS; ++i) {
+                bench_send_burst(sk_client, outgoing);
+                nsec += bench_recv_batch(sk_server);
+        }
+        bench_report("recvmmsg", nsec);
+
+        /* teardown */
+
+        link_del_ip4(&link_client, &addr_client, 8);
+        link_del_ip4(&link_server, &addr_server, 8);
+}
+
+int main(int argc, char **argv) {
+        test_setup();
+
+        bench_recv();
+
+        return 0;
+}
@@ -24,6 +24,7 @@
  * @client_config:              client configuration to use
  * @probe_config:               client probe configuration to use
  * @log_queue:                  the log queue for logging events
+ * @context:                    client context to share packet sockets in, or NULL
  * @fd_epoll:                   epoll context to attach to, or -1
  *
  * This initializes a new client connection using the configuration given in
@@ -36,7 +37,14 @@
  *
  * The new connection automatically attaches to the epoll context given as
  * @fd_epoll. The epoll FD is retained in the connection and the caller must
- * guarantee that it lives as long as the connection.
+ * guarantee that it lives as long as the connection. All events of the
+ * connection carry a pointer to the epoll_type field of @connection as epoll
+ * data, so several connections can share an epoll context.
+ *
+ * If @context is given, the connection does not open a packet socket of its
+ * own, but shares the one of @context for its interface, and is handed the
+ * replies to its requests by the context. @fd_epoll must be the epoll context
+ * of @context in that case.
  * The caller is explicitly allowed to pass -1 as @fd_epoll, in which case the
  * connection will initialize correctly, but will not be in a usable state.
  * That is, any call to n_dhcp4_c_connection_listen() will fail, since it will
@@ -49,11 +57,13 @@ int n_dhcp4_c_connection_init(NDhcp4CConnection *connection,
                               NDhcp4ClientConfig *client_config,
                               NDhcp4ClientProbeConfig *probe_config,
                               NDhcp4LogQueue *log_queue,
+                              NDhcp4ClientContext *context,
                               int fd_epoll) {
         *connection = (NDhcp4CConnection)N_DHCP4_C_CONNECTION_NULL(*connection);
         connection->client_config = client_config;
         connection->probe_config = probe_config;
         connection->fd_epoll = fd_epoll;
+        connection->context = context;
         connection->log_queue = log_queue;
 
         /*
@@ -139,7 +149,10 @@ static void n_dhcp4_c_connection_outgoing_set_secs(NDhcp4Outgoing *message) {
 }
 
 int n_dhcp4_c_connection_listen(NDhcp4CConnection *connection) {
+        _c_cleanup_(packet_ring_freep) struct packet_ring *ring = NULL;
         _c_cleanup_(c_closep) int fd_packet = -1;
+        NDhcp4SocketOffload offload;
+        unsigned int flags = 0;
         int r;
 
         if (connection->state == N_DHCP4_C_CONNECTION_STATE_PACKET)
@@ -152,6 +165,7 @@ int n_dhcp4_c_connection_listen(NDhcp4CConnection *connection) {
         if (connection->fd_packet >= 0) {
                 epoll_ctl(connection->fd_epoll, EPOLL_CTL_DEL, connection->fd_packet, NULL);
                 connection->fd_packet = c_close(connection->fd_packet);
+                connection->ring = packet_ring_free(connection->ring);
         }
 
         if (connection->fd_udp >= 0) {
@@ -159,7 +173,30 @@ int n_dhcp4_c_connection_listen(NDhcp4CConnection *connection) {
                 connection->fd_udp = c_close(connection->fd_udp);
         }
 
-        r = n_dhcp4_c_socket_packet_new(&fd_packet, connection->client_config->ifindex);
+        if (connection->client_config->checksum_offload)
+                flags |= N_DHCP4_SOCKET_FLAG_VNET_HDR;
+        if (connection->client_config->rx_ring)
+                flags |= N_DHCP4_C_SOCKET_FLAG_RX_RING;
+
+        if (connection->context) {
+                if (!connection->interface) {
+                        r = n_dhcp4_c_interface_acquire(&connection->interface,
+                                                        connection->context,
+                                                        connection->client_config->ifindex,
+                                                        flags);
+                        if (r)
+                                return r;
+                }
+
+                connection->state = N_DHCP4_C_CONNECTION_STATE_PACKET;
+                return 0;
+        }
+
+        r = n_dhcp4_c_socket_packet_new(&fd_packet,
+                                        connection->client_config->ifindex,
+                                        flags,
+                                        &offload,
+                                        &ring);
         if (r)
                 return r;
 
@@ -168,14 +205,17 @@ int n_dhcp4_c_connection_listen(NDhcp4CConnection *connection) {
                       fd_packet,
                       &(struct epoll_event){
                               .events = EPOLLIN,
-                              .data = { .u32 = N_DHCP4_CLIENT_EPOLL_IO },
+                              .data = { .ptr = &connection->epoll_type },
                       });
         if (r < 0)
                 return -errno;
 
         connection->state = N_DHCP4_C_CONNECTION_STATE_PACKET;
         connection->fd_packet = fd_packet;
+        connection->offload = offload;
+        connection->ring = ring;
         fd_packet = -1;
+        ring = NULL;
         return 0;
 }
 
@@ -199,11 +239,29 @@ int n_dhcp4_c_connection_connect(NDhcp4CConnection *connection,
                       fd_udp,
                       &(struct epoll_event){
                               .events = EPOLLIN,
-                              .data = { .u32 = N_DHCP4_CLIENT_EPOLL_IO },
+                              .data = { .ptr = &connection->epoll_type },
                       });
         if (r < 0)
                 return -errno;
 
+        if (connection->interface) {
+                /*
+                 * The shared packet socket stays open for the other
+                 * connections, so there is nothing to drain. Replies still
+                 * queued on it for us are dropped by the context.
+                 */
+                n_dhcp4_c_interface_unlink(connection->interface, connection);
+                n_dhcp4_c_interface_release(connection->interface);
+                connection->interface = NULL;
+
+                connection->state = N_DHCP4_C_CONNECTION_STATE_UDP;
+                connection->fd_udp = fd_udp;
+                fd_udp = -1;
+                connection->client_ip = client->s_addr;
+                connection->server_ip = server->s_addr;
+                return 0;
+        }
+
         r = packet_shutdown(connection->fd_packet);
         if (r < 0) {
                 epoll_ctl(connection->fd_epoll, EPOLL_CTL_DEL, fd_udp, NULL);
@@ -227,6 +285,13 @@ void n_dhcp4_c_connection_close(NDhcp4CConnection *connection) {
         if (connection->fd_packet >= 0) {
                 epoll_ctl(connection->fd_epoll, EPOLL_CTL_DEL, connection->fd_packet, NULL);
                 connection->fd_packet = c_close(connection->fd_packet);
+                connection->ring = packet_ring_free(connection->ring);
+        }
+
+        if (connection->interface) {
+                n_dhcp4_c_interface_unlink(connection->interface, connection);
+                n_dhcp4_c_interface_release(connection->interface);
+                connection->interface = NULL;
         }
 
         connection->fd_epoll = -1;
@@ -374,11 +439,13 @@ void n_dhcp4_c_connection_get_timeout(NDhcp4CConnection *connection,
 
 static int n_dhcp4_c_connection_packet_broadcast(NDhcp4CConnection *connection,
                                                  NDhcp4Outgoing *message) {
+        NDhcp4CInterface *interface = connection->interface;
         int r;
 
         c_assert(connection->state == N_DHCP4_C_CONNECTION_STATE_PACKET);
 
-        r = n_dhcp4_c_socket_packet_send(connection->fd_packet,
+        r = n_dhcp4_c_socket_packet_send(interface ? interface->fd_packet : connection->fd_packet,
+                                         interface ? &interface->offload : &connection->offload,
                                          connection->client_config->ifindex,
                                          connection->client_config->broadcast_mac,
                                          connection->client_config->n_broadcast_mac,
@@ -1006,6 +1073,7 @@ static int n_dhcp4_c_connection_send_request(NDhcp4CConnection *connection,
         char server_addr[INET_ADDRSTRLEN];
         char client_addr[INET_ADDRSTRLEN];
         char error_msg[128];
+        uint32_t xid;
         int r;
         bool broadcast = false;
 
@@ -1024,6 +1092,27 @@ static int n_dhcp4_c_connection_send_request(NDhcp4CConnection *connection,
                 request->userdata.base_time = timestamp;
                 n_dhcp4_outgoing_set_xid(request, n_dhcp4_client_probe_config_get_random(connection->probe_config));
 
+                /*
+                 * While on the packet socket, let the kernel drop all replies
+                 * that are not for this transaction, so replies to other
+                 * clients on the link never reach us. SELECT keeps the xid of
+                 * the DISCOVER it follows, so the filter stays valid for it.
+                 * On a shared packet socket, the context hands replies to us
+                 * by their xid instead.
+                 */
+                if (connection->state == N_DHCP4_C_CONNECTION_STATE_PACKET && connection->interface) {
+                        n_dhcp4_outgoing_get_xid(request, &xid);
+                        r = n_dhcp4_c_interface_link(connection->interface, connection, xid);
+                        if (r)
+                                return r;
+                } else if (connection->state == N_DHCP4_C_CONNECTION_STATE_PACKET) {
+                        r = n_dhcp4_c_socket_packet_filter(connection->fd_packet,
+                                                           &connection->offload,
+                                                           n_dhcp4_outgoing_peek_header(request));
+                        if (r)
+                                return r;
+                }
+
                 break;
         case N_DHCP4_C_MESSAGE_SELECT:
         case N_DHCP4_C_MESSAGE_DECLINE:
@@ -1138,6 +1227,10 @@ int n_dhcp4_c_connection_dispatch_timer(NDhcp4CConnection *connection,
 }
 
 /*
+ * Packets are received into @buf, which the caller provides, and parsed in
+ * place. Only a message that passed verification is copied out of @buf and
+ * returned in @messagep, everything else is dropped without allocating.
+ *
  * Returns:
  *  0                     on success
  *  N_DHCP4_E_MALFORMED   if a malformed packet was received
@@ -1145,24 +1238,25 @@ int n_dhcp4_c_connection_dispatch_timer(NDhcp4CConnection *connection,
  *  N_DHCP4_E_AGAIN       if there was another error (non fatal for the client)
  */
 int n_dhcp4_c_connection_dispatch_io(NDhcp4CConnection *connection,
+                                     uint8_t *buf,
+                                     size_t n_buf,
                                      NDhcp4Incoming **messagep) {
-        _c_cleanup_(n_dhcp4_incoming_freep) NDhcp4Incoming *message = NULL;
-        _c_cleanup_(c_freep) uint8_t *buffer = NULL;
-        char serv_addr[INET_ADDRSTRLEN];
-        char client_addr[INET_ADDRSTRLEN];
-        uint8_t type = 0;
+        _c_cleanup_(n_dhcp4_incoming_deinit) NDhcp4Incoming view = N_DHCP4_INCOMING_NULL(view);
+        NDhcp4Incoming *message = &view;
         int r;
 
-        buffer = malloc(UINT16_MAX);
-        if (!buffer)
-                return -ENOMEM;
-
         switch (connection->state) {
         case N_DHCP4_C_CONNECTION_STATE_PACKET:
+                /* replies on shared packet sockets are dispatched by the context */
+                if (connection->interface)
+                        return N_DHCP4_E_AGAIN;
+
                 r = n_dhcp4_c_socket_packet_recv(connection->fd_packet,
-                                                 buffer,
-                                                 UINT16_MAX,
-                                                 &message);
+                                                 &connection->offload,
+                                                 connection->ring,
+                                                 buf,
+                                                 n_buf,
+                                                 message);
                 if (!r)
                         break;
                 else if (r == N_DHCP4_E_MALFORMED)
@@ -1170,9 +1264,11 @@ int n_dhcp4_c_connection_dispatch_io(NDhcp4CConnection *connection,
                 return N_DHCP4_E_AGAIN;
         case N_DHCP4_C_CONNECTION_STATE_DRAINING:
                 r = n_dhcp4_c_socket_packet_recv(connection->fd_packet,
-                                                 buffer,
-                                                 UINT16_MAX,
-                                                 &message);
+                                                 &connection->offload,
+                                                 connection->ring,
+                                                 buf,
+                                                 n_buf,
+                                                 message);
                 if (!r)
                         break;
                 else if (r == N_DHCP4_E_MALFORMED)
@@ -1188,14 +1284,15 @@ int n_dhcp4_c_connection_dispatch_io(NDhcp4CConnection *connection,
                 r = epoll_ctl(connection->fd_epoll, EPOLL_CTL_DEL, connection->fd_packet, NULL);
                 c_assert(!r);
                 connection->fd_packet = c_close(connection->fd_packet);
+                connection->ring = packet_ring_free(connection->ring);
                 connection->state = N_DHCP4_C_CONNECTION_STATE_UDP;
 
                 /* fall-through */
         case N_DHCP4_C_CONNECTION_STATE_UDP:
                 r = n_dhcp4_c_socket_udp_recv(connection->fd_udp,
-                                              buffer,
-                                              UINT16_MAX,
-                                              &message);
+                                              buf,
+                                              n_buf,
+                                              message);
                 if (!r)
                         break;
                 else if (r == N_DHCP4_E_MALFORMED)
@@ -1206,6 +1303,24 @@ int n_dhcp4_c_connection_dispatch_io(NDhcp4CConnection *connection,
                 return -ENOTRECOVERABLE;
         }
 
+        return n_dhcp4_c_connection_dispatch_incoming(connection, message, messagep);
+}
+
+/*
+ * This handles a message received for @connection, either on its own sockets
+ * or on the shared packet socket of its interface. @message is a view of the
+ * receive buffer, and stays owned by the caller.
+ *
+ * Returns the same as n_dhcp4_c_connection_dispatch_io().
+ */
+int n_dhcp4_c_connection_dispatch_incoming(NDhcp4CConnection *connection,
+                                           NDhcp4Incoming *message,
+                                           NDhcp4Incoming **messagep) {
+        char serv_addr[INET_ADDRSTRLEN];
+        char client_addr[INET_ADDRSTRLEN];
+        uint8_t type = 0;
+        int r;
+
         r = n_dhcp4_c_connection_verify_incoming(connection, message, &type);
         if (r == N_DHCP4_E_MALFORMED || r == N_DHCP4_E_UNEXPECTED)
                 return r;
@@ -1217,16 +1332,16 @@ int n_dhcp4_c_connection_dispatch_io(NDhcp4CConnection *connection,
                             LOG_INFO,
                             "received %s of %s from %s",
                             message_type_to_str(type),
-                            inet_ntop(AF_INET, &message->message.header.yiaddr,
+                            inet_ntop(AF_INET, &message->message->header.yiaddr,
                                       client_addr, sizeof(client_addr)),
-                            inet_ntop(AF_INET, &message->message.header.siaddr,
+                            inet_ntop(AF_INET, &message->message->header.siaddr,
                                       serv_addr, sizeof(serv_addr)));
         } else {
                 n_dhcp4_log(connection->log_queue,
                             LOG_INFO,
                             "received %s from %s",
                             message_type_to_str(type),
-                            inet_ntop(AF_INET, &message->message.header.siaddr,
+                            inet_ntop(AF_INET, &message->message->header.siaddr,
                                       serv_addr, sizeof(serv_addr)));
         }
 
@@ -1260,21 +1375,23 @@ int n_dhcp4_c_connection_dispatch_io(NDhcp4CConnection *connection,
                  */
                 message->userdata.start_time = connection->request->userdata.start_time;
                 message->userdata.base_time = connection->request->userdata.base_time;
-
-                if (type != N_DHCP4_MESSAGE_OFFER) {
-                        /*
-                         * We only allow one reply to ACK or NAK, but for OFFER we must
-                         * accept several, so we do not free the pinned request.
-                         */
-                        connection->request = n_dhcp4_outgoing_free(connection->request);
-                }
-
                 break;
         default:
                 break;
         }
 
-        *messagep = message;
-        message = NULL;
+        /* the caller keeps the message, so it must not borrow from @buf */
+        r = n_dhcp4_incoming_dup(messagep, message);
+        if (r)
+                return r;
+
+        if (type == N_DHCP4_MESSAGE_ACK || type == N_DHCP4_MESSAGE_NAK) {
+                /*
+                 * We only allow one reply to ACK or NAK, but for OFFER we must
+                 * accept several, so we do not free the pinned request.
+                 */
+                connection->request = n_dhcp4_outgoing_free(connection->request);
+        }
+
         return 0;
 }
@@ -0,0 +1,332 @@
+/*
+ * DHCPv4 Client Interfaces
+ *
+ * Client connections of a client context do not open a packet socket each.
+ * Instead, all connections of a context on the same interface share a single
+ * packet socket, which is owned by the context. Replies to all of them are
+ * received once, rather than once per connection, and handed to the
+ * connection with a matching transaction id and hardware address.
+ *
+ * Connections are indexed by the xid of their pending request. Xids are
+ * chosen at random, so the xid alone spreads connections evenly across the
+ * index, and the hardware address only needs to be compared. Unlike the
+ * per-connection socket filters, the index cannot keep two connections with
+ * the same key apart, but the full verification of the reply by the
+ * connection rejects it, should this ever happen.
+ */
+
+#include <assert.h>
+#include <c-list.h>
+#include <c-stdaux.h>
+#include <errno.h>
+#include <net/if_arp.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include "n-dhcp4-private.h"
+#include "util/packet.h"
+
+static int n_dhcp4_c_interface_new(NDhcp4CInterface **interfacep,
+                                   NDhcp4ClientContext *context,
+                                   int ifindex,
+                                   unsigned int flags) {
+        _c_cleanup_(n_dhcp4_c_interface_freep) NDhcp4CInterface *interface = NULL;
+        int r;
+
+        interface = malloc(sizeof(*interface));
+        if (!interface)
+                return -ENOMEM;
+
+        *interface = (NDhcp4CInterface)N_DHCP4_C_INTERFACE_NULL(*interface);
+        interface->ifindex = ifindex;
+        interface->flags = flags;
+
+        r = n_dhcp4_c_socket_packet_new(&interface->fd_packet,
+                                        ifindex,
+                                        flags,
+                                        &interface->offload,
+                                        &interface->ring);
+        if (r)
+                return r;
+
+        r = epoll_ctl(context->fd_epoll,
+                      EPOLL_CTL_ADD,
+                      interface->fd_packet,
+                      &(struct epoll_event){
+                              .events = EPOLLIN,
+                              .data = { .ptr = &interface->epoll_type },
+                      });
+        if (r < 0)
+                return -errno;
+
+        interface->context = context;
+        c_list_link_tail(&context->interface_list, &interface->context_link);
+
+        *interfacep = interface;
+        interface = NULL;
+        return 0;
+}
+
+/**
+ * n_dhcp4_c_interface_free() - free client interface
+ * @interface:                  interface to operate on, or NULL
+ *
+ * This closes the shared packet socket of @interface and frees it. No
+ * connection must use @interface anymore.
+ *
+ * Return: NULL is returned.
+ */
+NDhcp4CInterface *n_dhcp4_c_interface_free(NDhcp4CInterface *interface) {
+        if (!interface)
+                return NULL;
+
+        c_assert(!interface->n_refs);
+        c_assert(!interface->n_connections);
+
+        if (interface->context) {
+                epoll_ctl(interface->context->fd_epoll, EPOLL_CTL_DEL, interface->fd_packet, NULL);
+                c_list_unlink(&interface->context_link);
+        }
+
+        packet_ring_free(interface->ring);
+        c_close(interface->fd_packet);
+        free(interface->index);
+        free(interface);
+
+        return NULL;
+}
+
+/**
+ * n_dhcp4_c_interface_acquire() - acquire shared packet socket
+ * @interfacep:                 output argument for the interface
+ * @context:                    client context to operate on
+ * @ifindex:                    interface index to listen on
+ * @flags:                      N_DHCP4_SOCKET_FLAG_* flags of the socket
+ *
+ * This returns the interface of @context that listens on @ifindex with a
+ * packet socket created with @flags, and creates it if there is none. The
+ * caller must release the interface with n_dhcp4_c_interface_release() once
+ * done.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int n_dhcp4_c_interface_acquire(NDhcp4CInterface **interfacep,
+                                NDhcp4ClientContext *context,
+                                int ifindex,
+                                unsigned int flags) {
+        NDhcp4CInterface *interface;
+        int r;
+
+        c_list_for_each_entry(interface, &context->interface_list, context_link)
+                if (interface->ifindex == ifindex && interface->flags == flags)
+                        goto out;
+
+        r = n_dhcp4_c_interface_new(&interface, context, ifindex, flags);
+        if (r)
+                return r;
+
+out:
+        ++interface->n_refs;
+        *interfacep = interface;
+        return 0;
+}
+
+/**
+ * n_dhcp4_c_interface_release() - release shared packet socket
+ * @interface:                  interface to operate on
+ *
+ * This drops a reference acquired via n_dhcp4_c_interface_acquire(). Once the
+ * last one is dropped, the interface is freed. While its context is being
+ * dispatched, pending epoll events may still point to the interface, so it is
+ * only freed once the dispatcher is done.
+ */
+void n_dhcp4_c_interface_release(NDhcp4CInterface *interface) {
+        c_assert(interface->n_refs);
+
+        if (!--interface->n_refs && !interface->context->dispatching)
+                n_dhcp4_c_interface_free(interface);
+}
+
+static bool n_dhcp4_c_interface_match(NDhcp4CConnection *connection,
+                                      uint32_t xid,
+                                      const uint8_t *chaddr,
+                                      size_t n_chaddr) {
+        if (connection->interface_xid != xid)
+                return false;
+
+        /* see n_dhcp4_c_connection_verify_incoming() for the use of chaddr */
+        switch (connection->client_config->transport) {
+        case N_DHCP4_TRANSPORT_ETHERNET:
+                return n_chaddr == ETH_ALEN && !memcmp(chaddr, connection->client_config->mac, ETH_ALEN);
+        case N_DHCP4_TRANSPORT_INFINIBAND:
+                return n_chaddr == 0;
+        default:
+                return false;
+        }
+}
+
+static size_t n_dhcp4_c_interface_home(NDhcp4CInterface *interface, uint32_t xid) {
+        uint64_t hash = (uint64_t)xid * UINT64_C(0x9e3779b97f4a7c15);
+
+        return (hash >> 32) & (interface->n_buckets - 1);
+}
+
+static void n_dhcp4_c_interface_insert(NDhcp4CInterface *interface, NDhcp4CConnection *connection) {
+        size_t i, mask = interface->n_buckets - 1;
+
+        for (i = n_dhcp4_c_interface_home(interface, connection->interface_xid); interface->index[i]; i = (i + 1) & mask)
+                ;
+
+        interface->index[i] = connection;
+}
+
+static void n_dhcp4_c_interface_remove(NDhcp4CInterface *interface, NDhcp4CConnection *connection) {
+        NDhcp4CConnection **index = interface->index;
+        size_t i, j, home, mask = interface->n_buckets - 1;
+
+        for (i = n_dhcp4_c_interface_home(interface, connection->interface_xid); index[i] != connection; i = (i + 1) & mask)
+                c_assert(index[i]);
+
+        /* backward-shift deletion, as in the lease table */
+        index[i] = NULL;
+        for (j = (i + 1) & mask; index[j]; j = (j + 1) & mask) {
+                home = n_dhcp4_c_interface_home(interface, index[j]->interface_xid);
+                if (((j - home) & mask) >= ((j - i) & mask)) {
+                        index[i] = index[j];
+                        index[j] = NULL;
+                        i = j;
+                }
+        }
+}
+
+static int n_dhcp4_c_interface_resize(NDhcp4CInterface *interface, size_t n_buckets) {
+        NDhcp4CConnection **index, **old = interface->index;
+        size_t n_old = interface->n_buckets;
+
+        index = calloc(n_buckets, sizeof(*index));
+        if (!index)
+                return -ENOMEM;
+
+        interface->index = index;
+        interface->n_buckets = n_buckets;
+
+        for (size_t i = 0; i < n_old; ++i)
+                if (old[i])
+                        n_dhcp4_c_interface_insert(interface, old[i]);
+
+        free(old);
+        return 0;
+}
+
+/**
+ * n_dhcp4_c_interface_link() - index connection on interface
+ * @interface:                  interface to operate on
+ * @connection:                 connection to index
+ * @xid:                        transaction id to index @connection by
+ *
+ * This indexes @connection, so replies with the transaction id @xid and the
+ * hardware address of @connection are handed to it. If @connection was
+ * indexed before, its previous transaction id is replaced.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int n_dhcp4_c_interface_link(NDhcp4CInterface *interface, NDhcp4CConnection *connection, uint32_t xid) {
+        int r;
+
+        n_dhcp4_c_interface_unlink(interface, connection);
+
+        /* keep the load factor of the index at or below 1/2 */
+        if ((interface->n_connections + 1) * 2 > interface->n_buckets) {
+                r = n_dhcp4_c_interface_resize(interface,
+                                               interface->n_buckets ?
+                                               interface->n_buckets * 2 :
+                                               N_DHCP4_C_INTERFACE_MIN_BUCKETS);
+                if (r)
+                        return r;
+        }
+
+        connection->interface_xid = xid;
+        connection->interface_indexed = true;
+        n_dhcp4_c_interface_insert(interface, connection);
+        ++interface->n_connections;
+
+        return 0;
+}
+
+/**
+ * n_dhcp4_c_interface_unlink() - remove connection from index
+ * @interface:                  interface to operate on
+ * @connection:                 connection to remove
+ *
+ * This removes @connection from the index of @interface, if it is indexed.
+ * Otherwise, this is a no-op.
+ */
+void n_dhcp4_c_interface_unlink(NDhcp4CInterface *interface, NDhcp4CConnection *connection) {
+        if (!connection->interface_indexed)
+                return;
+
+        n_dhcp4_c_interface_remove(interface, connection);
+        --interface->n_connections;
+        connection->interface_indexed = false;
+}
+
+/**
+ * n_dhcp4_c_interface_find() - find connection for reply
+ * @interface:                  interface to operate on
+ * @header:                     header of the reply
+ *
+ * Return: The connection indexed with the transaction id and hardware address
+ *         of @header, or NULL if there is none.
+ */
+NDhcp4CConnection *n_dhcp4_c_interface_find(NDhcp4CInterface *interface, const NDhcp4Header *header) {
+        NDhcp4CConnection *connection;
+        size_t i, mask = interface->n_buckets - 1;
+        size_t n_chaddr = header->hlen;
+
+        if (!interface->n_connections || n_chaddr > sizeof(header->chaddr))
+                return NULL;
+
+        for (i = n_dhcp4_c_interface_home(interface, header->xid); (connection = interface->index[i]); i = (i + 1) & mask)
+                if (n_dhcp4_c_interface_match(connection, header->xid, header->chaddr, n_chaddr))
+                        return connection;
+
+        return NULL;
+}
+
+/**
+ * n_dhcp4_c_interface_dispatch() - receive reply on shared packet socket
+ * @interface:                  interface to operate on
+ * @buf:                        buffer to receive into
+ * @n_buf:                      size of @buf
+ * @message:                    message view to initialize
+ * @connectionp:                output argument for the receiving connection
+ *
+ * This receives a single packet into @buf, and initializes @message as view
+ * of it, which the caller must deinitialize. The connection the packet is
+ * addressed to is returned in @connectionp, or NULL if there is none.
+ *
+ * Return: 0 on success, N_DHCP4_E_AGAIN if there was nothing to receive,
+ *         N_DHCP4_E_MALFORMED if a malformed packet was received, or another
+ *         error code on failure.
+ */
+int n_dhcp4_c_interface_dispatch(NDhcp4CInterface *interface,
+                                 uint8_t *buf,
+                                 size_t n_buf,
+                                 NDhcp4Incoming *message,
+                                 NDhcp4CConnection **connectionp) {
+        int r;
+
+        r = n_dhcp4_c_socket_packet_recv(interface->fd_packet,
+                                         &interface->offload,
+                                         interface->ring,
+                                         buf,
+                                         n_buf,
+                                         message);
+        if (r)
+                return r;
+
+        *connectionp = n_dhcp4_c_interface_find(interface, n_dhcp4_incoming_get_header(message));
+        return 0;
+}
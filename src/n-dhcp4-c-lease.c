@@ -283,14 +283,17 @@ _c_public_ int n_dhcp4_client_lease_get_server_identifier(NDhcp4ClientLease *lea
  */
 _c_public_ int n_dhcp4_client_lease_get_file(NDhcp4ClientLease *lease, const char **file) {
         NDhcp4Message *message;
+        uint8_t *overload;
+        size_t n_overload;
+        int r;
 
-        if (lease->message->options[N_DHCP4_OPTION_OVERLOAD].size > 0
-            && ((*lease->message->options[N_DHCP4_OPTION_OVERLOAD].value) & N_DHCP4_OVERLOAD_FILE)) {
+        r = n_dhcp4_incoming_query(lease->message, N_DHCP4_OPTION_OVERLOAD, &overload, &n_overload);
+        if (!r && n_overload > 0 && (*overload & N_DHCP4_OVERLOAD_FILE)) {
                 /* The field is overloaded to contain other options */
                 return N_DHCP4_E_UNSET;
         }
 
-        message = &lease->message->message;
+        message = lease->message->message;
 
         if (message->file[0] == '\0')
                 return N_DHCP4_E_UNSET;
@@ -384,8 +384,9 @@ uint32_t n_dhcp4_client_probe_config_get_random(NDhcp4ClientProbeConfig *config)
  *
  * This creates a new client probe object.
  *
- * If one is already running, the new one will be immediately (but asynchronously)
- * cancelled. Otherwise, a DISCOVER event is scheduled after a randomized delay.
+ * If one is already running, the new one is created detached, and the caller
+ * is expected to cancel it. Otherwise, a DISCOVER event is scheduled after a
+ * randomized delay.
  *
  * Return: 0 on success, or a negative error code on failure.
  */
@@ -400,8 +401,8 @@ int n_dhcp4_client_probe_new(NDhcp4ClientProbe **probep,
         /*
          * If there is already a probe attached, we create the new probe in
          * detached state. It will not be linked into the epoll context and not
-         * be useful in any way. We immediately raise the CANCELLED event to
-         * notify the caller about it.
+         * be useful in any way. The caller raises the CANCELLED event to
+         * notify the user about it.
          */
         active = !client->current_probe;
 
@@ -428,6 +429,7 @@ int n_dhcp4_client_probe_new(NDhcp4ClientProbe **probep,
                                       client->config,
                                       probe->config,
                                       &client->log_queue,
+                                      client->context,
                                       active ? client->fd_epoll : -1);
         if (r)
                 return r;
@@ -447,12 +449,6 @@ int n_dhcp4_client_probe_new(NDhcp4ClientProbe **probep,
                 if (probe->state == N_DHCP4_CLIENT_PROBE_STATE_INIT)
                         probe->ns_deferred = ns_now + (n_dhcp4_client_probe_config_get_random(probe->config) % (probe->config->ms_start_delay * 1000000ULL));
                 probe->client->current_probe = probe;
-        } else {
-                r = n_dhcp4_client_probe_raise(probe,
-                                               NULL,
-                                               N_DHCP4_CLIENT_EVENT_CANCELLED);
-                if (r)
-                        return r;
         }
 
         *probep = probe;
@@ -460,23 +456,10 @@ int n_dhcp4_client_probe_new(NDhcp4ClientProbe **probep,
         return 0;
 }
 
-/**
- * n_dhcp4_client_probe_free() - destroy a probe
- * @probe:                      probe to operate on, or NULL
- *
- * This destroys a probe object and deallocates all its resources.
- *
- * If @probe is NULL, this is a no-op.
- *
- * Return: NULL is returned.
- */
-_c_public_ NDhcp4ClientProbe *n_dhcp4_client_probe_free(NDhcp4ClientProbe *probe) {
+static void n_dhcp4_client_probe_destroy(NDhcp4ClientProbe *probe) {
         NDhcp4CEventNode *node, *t_node;
         NDhcp4ClientLease *lease, *t_lease;
 
-        if (!probe)
-                return NULL;
-
         c_list_for_each_entry_safe(lease, t_lease, &probe->lease_list, probe_link)
                 n_dhcp4_client_lease_unlink(lease);
 
@@ -494,10 +477,60 @@ _c_public_ NDhcp4ClientProbe *n_dhcp4_client_probe_free(NDhcp4ClientProbe *probe
         c_assert(c_list_is_empty(&probe->lease_list));
         c_assert(c_list_is_empty(&probe->event_list));
         free(probe);
+}
+
+/**
+ * n_dhcp4_client_probe_free() - destroy a probe
+ * @probe:                      probe to operate on, or NULL
+ *
+ * This destroys a probe object and deallocates all its resources.
+ *
+ * This may be called from within the event callback of the client. The probe
+ * is halted right away, but its memory is only released once the dispatch
+ * round is done, as the pending operations of the round might still refer to
+ * it.
+ *
+ * If @probe is NULL, this is a no-op.
+ *
+ * Return: NULL is returned.
+ */
+_c_public_ NDhcp4ClientProbe *n_dhcp4_client_probe_free(NDhcp4ClientProbe *probe) {
+        CList *reap_list;
 
+        if (!probe)
+                return NULL;
+
+        reap_list = n_dhcp4_client_get_reap_list(probe->client);
+        if (reap_list) {
+                if (probe == probe->client->current_probe)
+                        probe->client->current_probe = NULL;
+
+                n_dhcp4_c_connection_close(&probe->connection);
+                c_list_link_tail(reap_list, &probe->reap_link);
+                return NULL;
+        }
+
+        n_dhcp4_client_probe_destroy(probe);
         return NULL;
 }
 
+/**
+ * n_dhcp4_client_probe_reap() - destroy freed probes
+ * @reap_list:                  list of probes to operate on
+ *
+ * This destroys all probes that were freed while their client was dispatched,
+ * and are thus parked on @reap_list. The caller must pin the owner of
+ * @reap_list, as the probes might hold the last references to their clients.
+ */
+void n_dhcp4_client_probe_reap(CList *reap_list) {
+        NDhcp4ClientProbe *probe;
+
+        while ((probe = c_list_first_entry(reap_list, NDhcp4ClientProbe, reap_link))) {
+                c_list_unlink(&probe->reap_link);
+                n_dhcp4_client_probe_destroy(probe);
+        }
+}
+
 /**
  * n_dhcp4_client_probe_set_userdata() - set userdata pointer
  * @probe:                      the probe to operate on
@@ -523,43 +556,66 @@ _c_public_ void n_dhcp4_client_probe_get_userdata(NDhcp4ClientProbe *probe, void
 }
 
 /**
- * n_dhcp4_client_probe_raise() - XXX
+ * n_dhcp4_client_probe_emit() - pass event to the user
+ * @probe:                      probe to operate on
+ * @type:                       type of the event
+ * @lease:                      lease the event carries, or NULL
+ *
+ * This passes an event of @probe to the event callback of its client, if it
+ * has one. Otherwise, the event is queued on the client, and holds its own
+ * reference to @lease. The callback might free @probe, so this is the last
+ * thing a state transition does. Events of probes that were freed are
+ * dropped.
+ *
+ * Return: 0 on success, negative error code on failure.
  */
-int n_dhcp4_client_probe_raise(NDhcp4ClientProbe *probe, NDhcp4CEventNode **nodep, unsigned int event) {
+int n_dhcp4_client_probe_emit(NDhcp4ClientProbe *probe, unsigned int type, NDhcp4ClientLease *lease) {
+        NDhcp4ClientEvent event = { .event = type };
+        NDhcp4Client *client = probe->client;
         NDhcp4CEventNode *node;
         int r;
 
-        r = n_dhcp4_client_raise(probe->client, &node, event);
-        if (r)
-                return r;
+        if (c_list_is_linked(&probe->reap_link))
+                return 0;
 
-        switch (event) {
+        switch (type) {
         case N_DHCP4_CLIENT_EVENT_OFFER:
-                node->event.offer.probe = probe;
+                event.offer.probe = probe;
+                event.offer.lease = lease;
                 break;
         case N_DHCP4_CLIENT_EVENT_GRANTED:
-                node->event.granted.probe = probe;
+                event.granted.probe = probe;
+                event.granted.lease = lease;
                 break;
         case N_DHCP4_CLIENT_EVENT_RETRACTED:
-                node->event.retracted.probe = probe;
+                event.retracted.probe = probe;
                 break;
         case N_DHCP4_CLIENT_EVENT_EXTENDED:
-                node->event.extended.probe = probe;
+                event.extended.probe = probe;
+                event.extended.lease = lease;
                 break;
         case N_DHCP4_CLIENT_EVENT_EXPIRED:
-                node->event.expired.probe = probe;
+                event.expired.probe = probe;
                 break;
         case N_DHCP4_CLIENT_EVENT_CANCELLED:
-                node->event.cancelled.probe = probe;
+                event.cancelled.probe = probe;
                 break;
         default:
                 c_assert(0);
-                n_dhcp4_c_event_node_free(node);
                 return -ENOTRECOVERABLE;
         }
 
-        if (nodep)
-                *nodep = node;
+        if (client->config->event_fn) {
+                client->config->event_fn(client, &event, client->config->event_userdata);
+                return 0;
+        }
+
+        r = n_dhcp4_client_raise(client, &node, type);
+        if (r)
+                return r;
+
+        n_dhcp4_client_lease_ref(lease);
+        node->event = event;
         return 0;
 }
 
@@ -833,12 +889,6 @@ static int n_dhcp4_client_probe_transition_lifetime(NDhcp4ClientProbe *probe) {
 
                 /* XXX */
 
-                r = n_dhcp4_client_probe_raise(probe,
-                                               NULL,
-                                               N_DHCP4_CLIENT_EVENT_EXPIRED);
-                if (r)
-                        return r;
-
                 c_assert(probe->client->current_probe == probe);
 
                 probe->current_lease = n_dhcp4_client_lease_unref(probe->current_lease);
@@ -846,6 +896,10 @@ static int n_dhcp4_client_probe_transition_lifetime(NDhcp4ClientProbe *probe) {
                 probe->state = N_DHCP4_CLIENT_PROBE_STATE_INIT;
                 probe->ns_deferred =  n_dhcp4_gettime(CLOCK_BOOTTIME) + UINT64_C(1);
 
+                r = n_dhcp4_client_probe_emit(probe, N_DHCP4_CLIENT_EVENT_EXPIRED, NULL);
+                if (r)
+                        return r;
+
                 break;
 
         case N_DHCP4_CLIENT_PROBE_STATE_INIT:
@@ -865,18 +919,11 @@ static int n_dhcp4_client_probe_transition_lifetime(NDhcp4ClientProbe *probe) {
 static int n_dhcp4_client_probe_transition_offer(NDhcp4ClientProbe *probe, NDhcp4Incoming *message_take) {
         _c_cleanup_(n_dhcp4_incoming_freep) NDhcp4Incoming *message = message_take;
         _c_cleanup_(n_dhcp4_client_lease_unrefp) NDhcp4ClientLease *lease = NULL;
-        NDhcp4CEventNode *node;
         int r;
 
         switch (probe->state) {
         case N_DHCP4_CLIENT_PROBE_STATE_SELECTING:
 
-                r = n_dhcp4_client_probe_raise(probe,
-                                               &node,
-                                               N_DHCP4_CLIENT_EVENT_OFFER);
-                if (r)
-                        return r;
-
                 r = n_dhcp4_client_lease_new(&lease, message);
                 if (r)
                         return r;
@@ -885,7 +932,9 @@ static int n_dhcp4_client_probe_transition_offer(NDhcp4ClientProbe *probe, NDhcp
 
                 n_dhcp4_client_lease_link(lease, probe);
 
-                node->event.offer.lease = n_dhcp4_client_lease_ref(lease);
+                r = n_dhcp4_client_probe_emit(probe, N_DHCP4_CLIENT_EVENT_OFFER, lease);
+                if (r)
+                        return r;
 
                 break;
 
@@ -909,7 +958,6 @@ static int n_dhcp4_client_probe_transition_offer(NDhcp4ClientProbe *probe, NDhcp
 static int n_dhcp4_client_probe_transition_ack(NDhcp4ClientProbe *probe, NDhcp4Incoming *message_take) {
         _c_cleanup_(n_dhcp4_incoming_freep) NDhcp4Incoming *message = message_take;
         _c_cleanup_(n_dhcp4_client_lease_unrefp) NDhcp4ClientLease *lease = NULL;
-        NDhcp4CEventNode *node;
         struct in_addr client = {};
         struct in_addr server = {};
         int r;
@@ -927,12 +975,6 @@ static int n_dhcp4_client_probe_transition_ack(NDhcp4ClientProbe *probe, NDhcp4I
                 /* fall-through */
         case N_DHCP4_CLIENT_PROBE_STATE_RENEWING:
 
-                r = n_dhcp4_client_probe_raise(probe,
-                                               &node,
-                                               N_DHCP4_CLIENT_EVENT_EXTENDED);
-                if (r)
-                        return r;
-
                 r = n_dhcp4_client_lease_new(&lease, message);
                 if (r)
                         return r;
@@ -941,23 +983,21 @@ static int n_dhcp4_client_probe_transition_ack(NDhcp4ClientProbe *probe, NDhcp4I
 
                 n_dhcp4_client_lease_link(lease, probe);
 
-                node->event.extended.lease = n_dhcp4_client_lease_ref(lease);
                 n_dhcp4_client_lease_unref(probe->current_lease);
                 probe->current_lease = n_dhcp4_client_lease_ref(lease);
                 probe->state = N_DHCP4_CLIENT_PROBE_STATE_BOUND;
                 n_dhcp4_client_lease_get_yiaddr(lease, &probe->last_address);
                 probe->ns_nak_restart_delay = 0;
+
+                r = n_dhcp4_client_probe_emit(probe, N_DHCP4_CLIENT_EVENT_EXTENDED, lease);
+                if (r)
+                        return r;
+
                 break;
 
         case N_DHCP4_CLIENT_PROBE_STATE_REQUESTING:
         case N_DHCP4_CLIENT_PROBE_STATE_REBOOTING:
 
-                r = n_dhcp4_client_probe_raise(probe,
-                                               &node,
-                                               N_DHCP4_CLIENT_EVENT_GRANTED);
-                if (r)
-                        return r;
-
                 r = n_dhcp4_client_lease_new(&lease, message);
                 if (r)
                         return r;
@@ -966,10 +1006,14 @@ static int n_dhcp4_client_probe_transition_ack(NDhcp4ClientProbe *probe, NDhcp4I
 
                 n_dhcp4_client_lease_link(lease, probe);
 
-                node->event.granted.lease = n_dhcp4_client_lease_ref(lease);
                 probe->current_lease = n_dhcp4_client_lease_ref(lease);
                 probe->state = N_DHCP4_CLIENT_PROBE_STATE_GRANTED;
                 probe->ns_nak_restart_delay = 0;
+
+                r = n_dhcp4_client_probe_emit(probe, N_DHCP4_CLIENT_EVENT_GRANTED, lease);
+                if (r)
+                        return r;
+
                 break;
 
         case N_DHCP4_CLIENT_PROBE_STATE_INIT:
@@ -995,18 +1039,17 @@ static int n_dhcp4_client_probe_transition_nak(NDhcp4ClientProbe *probe) {
         case N_DHCP4_CLIENT_PROBE_STATE_RENEWING:
         case N_DHCP4_CLIENT_PROBE_STATE_REBINDING:
 
-                r = n_dhcp4_client_probe_raise(probe,
-                                               NULL,
-                                               N_DHCP4_CLIENT_EVENT_RETRACTED);
-                if (r)
-                        return r;
-
                 probe->current_lease = n_dhcp4_client_lease_unref(probe->current_lease);
                 probe->state = N_DHCP4_CLIENT_PROBE_STATE_INIT;
                 probe->ns_deferred = n_dhcp4_gettime(CLOCK_BOOTTIME) + probe->ns_nak_restart_delay;
                 probe->ns_nak_restart_delay = C_CLAMP(probe->ns_nak_restart_delay * 2u,
                                                       UINT64_C(2)   * UINT64_C(1000000000),
                                                       UINT64_C(300) * UINT64_C(1000000000));
+
+                r = n_dhcp4_client_probe_emit(probe, N_DHCP4_CLIENT_EVENT_RETRACTED, NULL);
+                if (r)
+                        return r;
+
                 break;
         case N_DHCP4_CLIENT_PROBE_STATE_SELECTING:
         case N_DHCP4_CLIENT_PROBE_STATE_INIT_REBOOT:
@@ -1221,6 +1264,10 @@ int n_dhcp4_client_probe_dispatch_timer(NDhcp4ClientProbe *probe, uint64_t ns_no
                 break;
         }
 
+        /* the event callback might have freed @probe */
+        if (c_list_is_linked(&probe->reap_link))
+                return 0;
+
         r = n_dhcp4_c_connection_dispatch_timer(&probe->connection, ns_now);
         if (r)
                 return r;
@@ -1231,37 +1278,11 @@ int n_dhcp4_client_probe_dispatch_timer(NDhcp4ClientProbe *probe, uint64_t ns_no
 /**
  * n_dhcp4_client_probe_dispatch_connection() - XXX
  */
-int n_dhcp4_client_probe_dispatch_io(NDhcp4ClientProbe *probe, uint32_t events) {
-        _c_cleanup_(n_dhcp4_incoming_freep) NDhcp4Incoming *message = NULL;
+static int n_dhcp4_client_probe_dispatch_reply(NDhcp4ClientProbe *probe, NDhcp4Incoming *reply) {
+        _c_cleanup_(n_dhcp4_incoming_freep) NDhcp4Incoming *message = reply;
         uint8_t type;
         int r;
 
-        r = n_dhcp4_c_connection_dispatch_io(&probe->connection, &message);
-        if (r) {
-                if (r == N_DHCP4_E_AGAIN)
-                        return 0;
-                else if (r == N_DHCP4_E_MALFORMED || r == N_DHCP4_E_UNEXPECTED) {
-                        /*
-                         * We fetched something from the sockets, which we
-                         * discarded. We don't know whether there is more data
-                         * to fetch, so we set the preempted flag to notify the
-                         * caller we want to be called again.
-                         */
-                        probe->client->preempted = true;
-                        return 0;
-                }
-
-                abort();
-                return r;
-        }
-
-        /*
-         * We fetched something from the sockets, which we will handle below.
-         * We don't know whether there is more data to fetch, so we set the
-         * preempted flag to notify the caller we want to be called again.
-         */
-        probe->client->preempted = true;
-
         r = n_dhcp4_incoming_query_message_type(message, &type);
         if (r == N_DHCP4_E_UNSET || r == N_DHCP4_E_MALFORMED)
                 /*
@@ -1299,6 +1320,74 @@ int n_dhcp4_client_probe_dispatch_io(NDhcp4ClientProbe *probe, uint32_t events)
         return 0;
 }
 
+int n_dhcp4_client_probe_dispatch_io(NDhcp4ClientProbe *probe, uint32_t events) {
+        _c_cleanup_(n_dhcp4_incoming_freep) NDhcp4Incoming *message = NULL;
+        int r;
+
+        r = n_dhcp4_c_connection_dispatch_io(&probe->connection,
+                                             probe->client->buf,
+                                             N_DHCP4_CLIENT_BUF_SIZE,
+                                             &message);
+        if (r) {
+                if (r == N_DHCP4_E_AGAIN)
+                        return 0;
+                else if (r == N_DHCP4_E_MALFORMED || r == N_DHCP4_E_UNEXPECTED) {
+                        /*
+                         * We fetched something from the sockets, which we
+                         * discarded. We don't know whether there is more data
+                         * to fetch, so we set the preempted flag to notify the
+                         * caller we want to be called again.
+                         */
+                        probe->client->preempted = true;
+                        return 0;
+                }
+
+                abort();
+                return r;
+        }
+
+        /*
+         * We fetched something from the sockets, which we will handle below.
+         * We don't know whether there is more data to fetch, so we set the
+         * preempted flag to notify the caller we want to be called again.
+         */
+        probe->client->preempted = true;
+
+        r = n_dhcp4_client_probe_dispatch_reply(probe, message);
+        message = NULL; /* consumed */
+        return r;
+}
+
+/**
+ * n_dhcp4_client_probe_dispatch_incoming() - dispatch reply from shared socket
+ * @probe:                      probe to operate on
+ * @message:                    received message
+ *
+ * This handles a message the client context received on the shared packet
+ * socket of the interface of @probe, and found to be addressed to @probe.
+ * @message stays owned by the caller.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int n_dhcp4_client_probe_dispatch_incoming(NDhcp4ClientProbe *probe, NDhcp4Incoming *message) {
+        _c_cleanup_(n_dhcp4_incoming_freep) NDhcp4Incoming *reply = NULL;
+        int r;
+
+        r = n_dhcp4_c_connection_dispatch_incoming(&probe->connection, message, &reply);
+        if (r) {
+                if (r == N_DHCP4_E_AGAIN ||
+                    r == N_DHCP4_E_MALFORMED ||
+                    r == N_DHCP4_E_UNEXPECTED)
+                        return 0;
+
+                return r;
+        }
+
+        r = n_dhcp4_client_probe_dispatch_reply(probe, reply);
+        reply = NULL; /* consumed */
+        return r;
+}
+
 /**
  * n_dhcp4_client_probe_update_mtu() - XXX
  */
@@ -5,6 +5,12 @@
  * object is simply a context to track running probes. It manages pending
  * events of all probes, as well as forwards the dispatching requests whenever
  * the dispatcher is run.
+ *
+ * By default, every client has an epoll context and a timerfd of its own.
+ * Alternatively, any number of clients can be created in a shared
+ * NDhcp4ClientContext object, which multiplexes the sockets of all its clients
+ * on a single epoll context, and their timeouts on a single timer wheel driven
+ * by a single timerfd.
  */
 
 #include <assert.h>
@@ -17,7 +23,6 @@
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/time.h>
-#include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
 #include "n-dhcp4.h"
@@ -90,10 +95,14 @@ int n_dhcp4_client_config_dup(NDhcp4ClientConfig *config, NDhcp4ClientConfig **d
         dup->ifindex = config->ifindex;
         dup->transport = config->transport;
         dup->request_broadcast = config->request_broadcast;
+        dup->checksum_offload = config->checksum_offload;
+        dup->rx_ring = config->rx_ring;
         memcpy(dup->mac, config->mac, sizeof(dup->mac));
         dup->n_mac = config->n_mac;
         memcpy(dup->broadcast_mac, config->broadcast_mac, sizeof(dup->broadcast_mac));
         dup->n_broadcast_mac = config->n_broadcast_mac;
+        dup->event_fn = config->event_fn;
+        dup->event_userdata = config->event_userdata;
 
         r = n_dhcp4_client_config_set_client_id(dup,
                                                 config->client_id,
@@ -161,6 +170,43 @@ _c_public_ void n_dhcp4_client_config_set_request_broadcast(NDhcp4ClientConfig *
         config->request_broadcast = request_broadcast;
 }
 
+/**
+ * n_dhcp4_client_config_set_checksum_offload() - set checksum-offload property
+ * @config:                           configuration to operate on
+ * @checksum_offload:                 value to set
+ *
+ * This sets the checksum_offload property of the given configuration object.
+ *
+ * The default is false. If set to true, the client leaves the UDP checksums
+ * of the packets it sends before it has an IP address to the kernel, which
+ * passes them on to the network device if it supports checksum offload. This
+ * is only available on ethernet devices. If the kernel does not support it,
+ * the client silently falls back to computing the checksums itself.
+ */
+_c_public_ void n_dhcp4_client_config_set_checksum_offload(NDhcp4ClientConfig *config, bool checksum_offload) {
+        config->checksum_offload = checksum_offload;
+}
+
+/**
+ * n_dhcp4_client_config_set_rx_ring() - set rx-ring property
+ * @config:                           configuration to operate on
+ * @rx_ring:                          value to set
+ *
+ * This sets the rx_ring property of the given configuration object.
+ *
+ * The default is false. If set to true, the client receives packets before it
+ * has an IP address through a ring buffer shared with the kernel, rather than
+ * with one system call per packet. This pays off on networks with many
+ * clients, where the client also has to look at the broadcast replies to all
+ * other clients. Packets are delivered in batches, which delays each by up to
+ * a few milliseconds. The ring is not used together with checksum offload. If
+ * the kernel does not support it, the client silently falls back to receiving
+ * packets one by one.
+ */
+_c_public_ void n_dhcp4_client_config_set_rx_ring(NDhcp4ClientConfig *config, bool rx_ring) {
+        config->rx_ring = rx_ring;
+}
+
 /**
  * n_dhcp4_client_config_set_mac() - set mac property
  * @config:                     client configuration to operate on
@@ -259,6 +305,34 @@ _c_public_ int n_dhcp4_client_config_set_client_id(NDhcp4ClientConfig *config, c
         return 0;
 }
 
+/**
+ * n_dhcp4_client_config_set_event_fn() - set event callback
+ * @config:                     configuration to operate on
+ * @fn:                         callback to set, or NULL
+ * @userdata:                   userdata to pass to @fn
+ *
+ * This sets the event callback of the given configuration object.
+ *
+ * By default, events are queued on the client and fetched with
+ * n_dhcp4_client_pop_event(). If a callback is set, each event is passed to
+ * it as soon as it is raised, and is not queued. This happens from within
+ * n_dhcp4_client_dispatch(), or n_dhcp4_client_context_dispatch()
+ * respectively, except for the CANCELLED event of a probe created while
+ * another one is running, which is passed to the callback from within
+ * n_dhcp4_client_probe(). An event is only valid for the duration of the
+ * callback. The callback may free probes, see n_dhcp4_client_probe_free(),
+ * and drop references to clients, but it must not dispatch the client.
+ *
+ * Logging events are still queued, if logging is enabled, and must be popped
+ * with n_dhcp4_client_pop_event().
+ */
+_c_public_ void n_dhcp4_client_config_set_event_fn(NDhcp4ClientConfig *config,
+                                                  NDhcp4ClientEventFn fn,
+                                                  void *userdata) {
+        config->event_fn = fn;
+        config->event_userdata = userdata;
+}
+
 /**
  * n_dhcp4_client_set_log_level() - set the logging level of the client
  * @client:                         the client to operate on
@@ -287,11 +361,15 @@ _c_public_ void n_dhcp4_client_set_log_level(NDhcp4Client *client, int level) {
 /**
  * n_dhcp4_c_event_node_new() - allocate new event
  * @nodep:                      output argument for new event
+ * @cache:                      event cache to allocate from, or NULL
  *
  * This allocates a new event node and returns it to the caller. The caller
  * fully owns the event-node and is reposonsible to either link it somewhere,
  * or release it.
  *
+ * If @cache is given, a node is reused from it if possible, and the node is
+ * returned to it once freed.
+ *
  * Event nodes can be linked on a client object, as well as optionally on a
  * probe object. As long as an event-node is linked, it will be retrievable by
  * the API user through n_dhcp4_client_pop_event(). Furthermore, destruction of
@@ -299,14 +377,21 @@ _c_public_ void n_dhcp4_client_set_log_level(NDhcp4Client *client, int level) {
  *
  * Return: 0 on success, negative error code on failure.
  */
-int n_dhcp4_c_event_node_new(NDhcp4CEventNode **nodep) {
+int n_dhcp4_c_event_node_new(NDhcp4CEventNode **nodep, NDhcp4EventCache *cache) {
         NDhcp4CEventNode *node;
-
-        node = calloc(1, sizeof(*node));
-        if (!node)
-                return -ENOMEM;
+        CList *link;
+
+        link = n_dhcp4_event_cache_pop(cache);
+        if (link) {
+                node = c_container_of(link, NDhcp4CEventNode, client_link);
+        } else {
+                node = malloc(sizeof(*node));
+                if (!node)
+                        return -ENOMEM;
+        }
 
         *node = (NDhcp4CEventNode)N_DHCP4_C_EVENT_NODE_NULL(*node);
+        node->cache = cache;
 
         *nodep = node;
         return 0;
@@ -353,11 +438,144 @@ NDhcp4CEventNode *n_dhcp4_c_event_node_free(NDhcp4CEventNode *node) {
 
         c_list_unlink(&node->probe_link);
         c_list_unlink(&node->client_link);
-        free(node);
+
+        if (!n_dhcp4_event_cache_push(node->cache, &node->client_link))
+                free(node);
 
         return NULL;
 }
 
+/**
+ * n_dhcp4_client_context_new() - allocate new client context
+ * @contextp:                   output argument for new client context
+ *
+ * This allocates a new client context and returns it in @contextp to the
+ * caller. The caller then owns a single ref-count to the object and is
+ * responsible to drop it, when no longer needed.
+ *
+ * A client context multiplexes any number of clients, created via
+ * n_dhcp4_client_new_in_context(), on a single epoll context and a single
+ * timer. Rather than polling and dispatching each client, the caller polls the
+ * FD of the context and dispatches the context. Each client still queues its
+ * own events.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+_c_public_ int n_dhcp4_client_context_new(NDhcp4ClientContext **contextp) {
+        _c_cleanup_(n_dhcp4_client_context_unrefp) NDhcp4ClientContext *context = NULL;
+        int r;
+
+        c_assert(contextp);
+
+        context = malloc(sizeof(*context));
+        if (!context)
+                return -ENOMEM;
+
+        *context = (NDhcp4ClientContext)N_DHCP4_CLIENT_CONTEXT_NULL(*context);
+
+        n_dhcp4_timer_wheel_init(&context->timers,
+                                 N_DHCP4_CLIENT_CONTEXT_TIMER_SHIFT,
+                                 n_dhcp4_gettime(CLOCK_BOOTTIME));
+
+        context->buf = malloc(N_DHCP4_CLIENT_BUF_SIZE);
+        if (!context->buf)
+                return -ENOMEM;
+
+        context->fd_epoll = epoll_create1(EPOLL_CLOEXEC);
+        if (context->fd_epoll < 0)
+                return -errno;
+
+        r = n_dhcp4_timerfd_new(&context->fd_timer);
+        if (r)
+                return r;
+
+        /* the timer is the only registration without a connection */
+        r = epoll_ctl(context->fd_epoll,
+                      EPOLL_CTL_ADD,
+                      context->fd_timer,
+                      &(struct epoll_event){
+                              .events = EPOLLIN,
+                              .data.ptr = NULL,
+                      });
+        if (r < 0) {
+                close(context->fd_timer);
+                context->fd_timer = -1;
+                return -errno;
+        }
+
+        *contextp = context;
+        context = NULL;
+        return 0;
+}
+
+static void n_dhcp4_client_context_free(NDhcp4ClientContext *context) {
+        NDhcp4CInterface *interface, *safe;
+
+        /* interfaces released during the last dispatch might still be around */
+        c_list_for_each_entry_safe(interface, safe, &context->interface_list, context_link)
+                n_dhcp4_c_interface_free(interface);
+
+        if (context->fd_timer >= 0) {
+                epoll_ctl(context->fd_epoll, EPOLL_CTL_DEL, context->fd_timer, NULL);
+                close(context->fd_timer);
+        }
+
+        if (context->fd_epoll >= 0)
+                close(context->fd_epoll);
+
+        free(context->buf);
+        n_dhcp4_timer_wheel_deinit(&context->timers);
+        free(context);
+}
+
+/**
+ * n_dhcp4_client_context_ref() - acquire client context reference
+ * @context:                    client context to operate on, or NULL
+ *
+ * This acquires a reference to the client context given as @context. If
+ * @context is NULL, this function is a no-op.
+ *
+ * Return: @context is returned.
+ */
+_c_public_ NDhcp4ClientContext *n_dhcp4_client_context_ref(NDhcp4ClientContext *context) {
+        if (context)
+                ++context->n_refs;
+        return context;
+}
+
+/**
+ * n_dhcp4_client_context_unref() - release client context reference
+ * @context:                    client context to operate on, or NULL
+ *
+ * This releases a reference to the client context given as @context. If
+ * @context is NULL, this is a no-op.
+ *
+ * Every client of a context pins it, so the context is only destroyed once
+ * the last reference is dropped and all its clients are gone.
+ *
+ * Return: NULL is returned.
+ */
+_c_public_ NDhcp4ClientContext *n_dhcp4_client_context_unref(NDhcp4ClientContext *context) {
+        if (context && !--context->n_refs)
+                n_dhcp4_client_context_free(context);
+        return NULL;
+}
+
+static void n_dhcp4_client_context_arm_timer(NDhcp4ClientContext *context) {
+        uint64_t timeout;
+
+        /* the dispatcher arms the timer once it is done with all clients */
+        if (context->dispatching)
+                return;
+
+        n_dhcp4_timer_wheel_get_timeout(&context->timers, &timeout);
+
+        if (timeout != context->scheduled_timeout) {
+                n_dhcp4_timerfd_arm(context->fd_timer, timeout);
+                context->scheduled_timeout = timeout;
+        }
+}
+
 /**
  * n_dhcp4_client_new() - allocate new client
  * @clientp:                    output argument for new client
@@ -373,10 +591,30 @@ NDhcp4CEventNode *n_dhcp4_c_event_node_free(NDhcp4CEventNode *node) {
  * Return: 0 on success, negative error code on failure.
  */
 _c_public_ int n_dhcp4_client_new(NDhcp4Client **clientp, NDhcp4ClientConfig *config) {
+        return n_dhcp4_client_new_in_context(clientp, config, NULL);
+}
+
+/**
+ * n_dhcp4_client_new_in_context() - allocate new client in a client context
+ * @clientp:                    output argument for new client
+ * @config:                     configuration to use
+ * @context:                    client context to use, or NULL
+ *
+ * This is the same as n_dhcp4_client_new(), but the new client is created in
+ * the client context given as @context, rather than with an epoll context and
+ * timer of its own. Its sockets and timeouts are dispatched as part of
+ * @context, and n_dhcp4_client_get_fd() and n_dhcp4_client_dispatch() refer to
+ * the FD of @context, and dispatch @context, respectively. The client pins
+ * @context for its entire lifetime.
+ *
+ * If @context is NULL, this is equivalent to n_dhcp4_client_new().
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+_c_public_ int n_dhcp4_client_new_in_context(NDhcp4Client **clientp,
+                                             NDhcp4ClientConfig *config,
+                                             NDhcp4ClientContext *context) {
         _c_cleanup_(n_dhcp4_client_unrefp) NDhcp4Client *client = NULL;
-        struct epoll_event ev = {
-                .events = EPOLLIN,
-        };
         int r;
 
         c_assert(clientp);
@@ -417,18 +655,36 @@ _c_public_ int n_dhcp4_client_new(NDhcp4Client **clientp, NDhcp4ClientConfig *co
         if (r)
                 return r;
 
+        if (context) {
+                client->context = n_dhcp4_client_context_ref(context);
+                client->buf = context->buf;
+                client->fd_epoll = context->fd_epoll;
+
+                *clientp = client;
+                client = NULL;
+                return 0;
+        }
+
+        client->buf = malloc(N_DHCP4_CLIENT_BUF_SIZE);
+        if (!client->buf)
+                return -ENOMEM;
+
         client->fd_epoll = epoll_create1(EPOLL_CLOEXEC);
         if (client->fd_epoll < 0)
                 return -errno;
 
-        client->fd_timer = timerfd_create(CLOCK_BOOTTIME, TFD_CLOEXEC | TFD_NONBLOCK);
-        if (client->fd_timer < 0 && errno == EINVAL)
-                client->fd_timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
-        if (client->fd_timer < 0)
-                return -errno;
+        r = n_dhcp4_timerfd_new(&client->fd_timer);
+        if (r)
+                return r;
 
-        ev.data.u32 = N_DHCP4_CLIENT_EPOLL_TIMER;
-        r = epoll_ctl(client->fd_epoll, EPOLL_CTL_ADD, client->fd_timer, &ev);
+        /* the timer is the only registration without a connection */
+        r = epoll_ctl(client->fd_epoll,
+                      EPOLL_CTL_ADD,
+                      client->fd_timer,
+                      &(struct epoll_event){
+                              .events = EPOLLIN,
+                              .data.ptr = NULL,
+                      });
         if (r < 0) {
                 close(client->fd_timer);
                 client->fd_timer = -1;
@@ -448,13 +704,25 @@ static void n_dhcp4_client_free(NDhcp4Client *client) {
         c_list_for_each_entry_safe(node, t_node, &client->event_list, client_link)
                 n_dhcp4_c_event_node_free(node);
 
-        if (client->fd_timer >= 0) {
-                epoll_ctl(client->fd_epoll, EPOLL_CTL_DEL, client->fd_timer, NULL);
-                close(client->fd_timer);
+        c_list_for_each_entry_safe(node, t_node, &client->event_cache.node_list, client_link) {
+                c_list_unlink(&node->client_link);
+                free(node);
         }
 
-        if (client->fd_epoll >= 0)
-                close(client->fd_epoll);
+        if (client->context) {
+                n_dhcp4_timer_unlink(&client->timer);
+                n_dhcp4_client_context_unref(client->context);
+        } else {
+                if (client->fd_timer >= 0) {
+                        epoll_ctl(client->fd_epoll, EPOLL_CTL_DEL, client->fd_timer, NULL);
+                        close(client->fd_timer);
+                }
+
+                if (client->fd_epoll >= 0)
+                        close(client->fd_epoll);
+
+                free(client->buf);
+        }
 
         n_dhcp4_client_config_free(client->config);
         free(client);
@@ -511,7 +779,7 @@ int n_dhcp4_client_raise(NDhcp4Client *client, NDhcp4CEventNode **nodep, unsigne
         NDhcp4CEventNode *node;
         int r;
 
-        r = n_dhcp4_c_event_node_new(&node);
+        r = n_dhcp4_c_event_node_new(&node, &client->event_cache);
         if (r)
                 return r;
 
@@ -566,7 +834,7 @@ void n_dhcp4_log_queue_fmt(NDhcp4LogQueue *log_queue,
                 return;
         }
 
-        r = n_dhcp4_c_event_node_new(&node);
+        r = n_dhcp4_c_event_node_new(&node, log_queue->event_cache);
         if (r < 0)
                 goto handle_nomem;
 
@@ -595,6 +863,28 @@ handle_nomem:
         c_list_link_tail(log_queue->event_list, &log_queue->nomem_node.client_link);
 }
 
+/**
+ * n_dhcp4_client_get_reap_list() - get list for freed probes
+ * @client:                     client to operate on
+ *
+ * Pending operations of a dispatch round might refer to any probe of @client,
+ * or of any other client of its context, so probes freed by the event
+ * callback are only destroyed once the round is done. This returns the list
+ * to park such probes on, or NULL if @client is not dispatched.
+ *
+ * Return: The list for freed probes, or NULL.
+ */
+CList *n_dhcp4_client_get_reap_list(NDhcp4Client *client) {
+        if (client->context) {
+                if (client->dispatching || client->context->dispatching)
+                        return &client->context->reap_list;
+        } else if (client->dispatching) {
+                return &client->reap_list;
+        }
+
+        return NULL;
+}
+
 /**
  * n_dhcp4_client_arm_timer() - update timer
  * @client:                     client to operate on
@@ -603,44 +893,25 @@ handle_nomem:
  * must be called whenever a timeout on @client might have changed.
  */
 void n_dhcp4_client_arm_timer(NDhcp4Client *client) {
-        uint64_t now, offset, timeout = 0;
-        int r;
+        uint64_t timeout = 0;
 
         if (client->current_probe)
                 n_dhcp4_client_probe_get_timeout(client->current_probe, &timeout);
 
-        if (timeout != client->scheduled_timeout) {
-                /*
-                 * Across our codebase, timeouts are specified as absolute
-                 * timestamps on CLOCK_BOOTTIME. Unfortunately, there are
-                 * systems with CLOCK_BOOTTIME support, but timerfd lacks it
-                 * (in particular RHEL). Therefore, our timerfd might be on
-                 * CLOCK_MONOTONIC.
-                 * To account for this, we always schedule a relative timeout.
-                 * We fetch the current time and then calculate the offset
-                 * which we then schedule as relative timeout on the timerfd.
-                 * This works regardless which clock the timerfd runs on.
-                 * Once we no longer support CLOCK_MONOTONIC as fallback, we
-                 * can simply switch to TFD_TIMER_ABSTIME here and specify
-                 * `timeout` directly as value.
-                 */
-                now = n_dhcp4_gettime(CLOCK_BOOTTIME);
-                if (now >= timeout)
-                        offset = 1; /* 0 would disarm the timerfd */
-                else
-                        offset = timeout - now;
-
-                r = timerfd_settime(client->fd_timer,
-                                    0,
-                                    &(struct itimerspec){
-                                        .it_value = {
-                                                .tv_sec = offset / UINT64_C(1000000000),
-                                                .tv_nsec = offset % UINT64_C(1000000000),
-                                        },
-                                    },
-                                    NULL);
-                c_assert(r >= 0);
+        if (client->context) {
+                if (timeout != client->scheduled_timeout) {
+                        if (timeout)
+                                n_dhcp4_timer_link(&client->timer, &client->context->timers, timeout);
+                        else
+                                n_dhcp4_timer_unlink(&client->timer);
+
+                        client->scheduled_timeout = timeout;
+                }
 
+                n_dhcp4_client_context_arm_timer(client->context);
+        } else if (timeout != client->scheduled_timeout) {
+                /* 0 would disarm the timerfd, but it is expected to fire */
+                n_dhcp4_timerfd_arm(client->fd_timer, timeout ? timeout : 1);
                 client->scheduled_timeout = timeout;
         }
 }
@@ -651,7 +922,8 @@ void n_dhcp4_client_arm_timer(NDhcp4Client *client) {
  * @fdp:                        output argument to store FD
  *
  * This retrieves the FD used by the client object given as @client. The FD is
- * always valid, and returned in @fdp.
+ * always valid, and returned in @fdp. If @client was created in a client
+ * context, this is the FD of the context.
  *
  * The caller is expected to poll this FD for readable events and call
  * n_dhcp4_client_dispatch() whenever the FD is readable.
@@ -660,77 +932,71 @@ _c_public_ void n_dhcp4_client_get_fd(NDhcp4Client *client, int *fdp) {
         *fdp = client->fd_epoll;
 }
 
+/*
+ * Forward the timer-event to the active probe. Timers should not fire if there
+ * is no probe running, but lets ignore them for now, so probe-internals are
+ * not leaked to this generic client dispatcher.
+ */
+static int n_dhcp4_client_dispatch_timeout(NDhcp4Client *client, uint64_t ns_now) {
+        if (!client->current_probe)
+                return 0;
+
+        return n_dhcp4_client_probe_dispatch_timer(client->current_probe, ns_now);
+}
+
 static int n_dhcp4_client_dispatch_timer(NDhcp4Client *client, struct epoll_event *event) {
-        uint64_t v, ns_now;
         int r;
 
-        if (event->events & (EPOLLHUP | EPOLLERR)) {
-                /*
-                 * There is no way to handle either gracefully. If we ignored
-                 * them, we would busy-loop, so lets rather forward the error
-                 * to the caller.
-                 */
-                return -ENOTRECOVERABLE;
-        }
+        r = n_dhcp4_timerfd_read(client->fd_timer, event);
+        if (r)
+                return (r == N_DHCP4_E_AGAIN) ? 0 : r;
 
-        if (event->events & EPOLLIN) {
-                r = read(client->fd_timer, &v, sizeof(v));
-                if (r < 0) {
-                        if (errno == EAGAIN) {
-                                /*
-                                 * There are no more pending events, so nothing
-                                 * to be done. Return to the caller.
-                                 */
-                                return 0;
-                        }
+        /*
+         * Read the current time *after* dispatching the timer, to make sure
+         * we do not miss wakeups.
+         */
+        return n_dhcp4_client_dispatch_timeout(client, n_dhcp4_gettime(CLOCK_BOOTTIME));
+}
 
-                        /*
-                         * Something failed. We use CLOCK_BOOTTIME/MONOTONIC,
-                         * so ECANCELED cannot happen. Hence, there is no error
-                         * that we could gracefully handle. Fail hard and let
-                         * the caller deal with it.
-                         */
-                        return -errno;
-                } else if (r != sizeof(v) || v == 0) {
-                        /*
-                         * Kernel guarantees 8-byte reads, and only to return
-                         * data if at least one timer triggered; fail hard if
-                         * it suddenly starts exposing unexpected behavior.
-                         */
-                        return -ENOTRECOVERABLE;
-                }
+static int n_dhcp4_client_dispatch_io(NDhcp4Client *client, struct epoll_event *event) {
+        NDhcp4CConnection *connection = c_container_of(event->data.ptr, NDhcp4CConnection, epoll_type);
+        NDhcp4ClientProbe *probe;
 
-                /*
-                 * Forward the timer-event to the active probe. Timers should
-                 * not fire if there is no probe running, but lets ignore them
-                 * for now, so probe-internals are not leaked to this generic
-                 * client dispatcher.
-                 */
-                if (client->current_probe) {
-                        /*
-                         * Read the current time *after* dispatching the timer,
-                         * to make sure we do not miss wakeups.
-                         */
-                        ns_now = n_dhcp4_gettime(CLOCK_BOOTTIME);
-
-                        r = n_dhcp4_client_probe_dispatch_timer(client->current_probe,
-                                                                ns_now);
-                        if (r)
-                                return r;
-                }
-        }
+        /* connections are only ever registered as part of a probe */
+        probe = c_container_of(connection, NDhcp4ClientProbe, connection);
 
-        return 0;
+        /* the event callback might have freed @probe earlier in this round */
+        if (c_list_is_linked(&probe->reap_link))
+                return 0;
+
+        return n_dhcp4_client_probe_dispatch_io(probe, event->events);
 }
 
-static int n_dhcp4_client_dispatch_io(NDhcp4Client *client, struct epoll_event *event) {
-        int r;
+/*
+ * Turn the result @r of dispatching an event of @client into the result for
+ * the caller. A lost link is reported as event on @client, rather than as
+ * error.
+ */
+static int n_dhcp4_client_dispatch_result(NDhcp4Client *client, int r) {
+        if (r == N_DHCP4_E_DOWN) {
+                /* continue normally */
+                if (client->config->event_fn) {
+                        NDhcp4ClientEvent event = { .event = N_DHCP4_CLIENT_EVENT_DOWN };
 
-        if (client->current_probe)
-                r = n_dhcp4_client_probe_dispatch_io(client->current_probe,
-                                                     event->events);
-        else
-                return -ENOTRECOVERABLE;
+                        client->config->event_fn(client, &event, client->config->event_userdata);
+                        r = 0;
+                } else {
+                        r = n_dhcp4_client_raise(client,
+                                                 NULL,
+                                                 N_DHCP4_CLIENT_EVENT_DOWN);
+                }
+        } else if (r >= _N_DHCP4_E_INTERNAL) {
+                n_dhcp4_log(&client->log_queue,
+                            LOG_ERR,
+                            "invalid internal error code %d after dispatch",
+                            r);
+                return N_DHCP4_E_INTERNAL;
+        }
 
         return r;
 }
@@ -751,13 +1017,20 @@ static int n_dhcp4_client_dispatch_io(NDhcp4Client *client, struct epoll_event *
  * If your event loop is level-triggered (it very likely is), you can
  * optionally ignore this return code and treat it as success.
  *
+ * If @client was created in a client context, this dispatches the entire
+ * context, see n_dhcp4_client_context_dispatch().
+ *
  * Return: 0 on success, negative error code on failure, N_DHCP4_E_PREEMPTED if
  *         there is more data to dispatch.
  */
 _c_public_ int n_dhcp4_client_dispatch(NDhcp4Client *client) {
+        _c_cleanup_(n_dhcp4_client_unrefp) NDhcp4Client *pin = NULL;
         struct epoll_event events[2];
         int n, i, r = 0;
 
+        if (client->context)
+                return n_dhcp4_client_context_dispatch(client->context);
+
         n = epoll_wait(client->fd_epoll, events, sizeof(events) / sizeof(*events), 0);
         if (n < 0) {
                 /* Linux never returns EINTR if `timeout == 0'. */
@@ -765,48 +1038,228 @@ _c_public_ int n_dhcp4_client_dispatch(NDhcp4Client *client) {
         }
 
         client->preempted = false;
+        client->dispatching = true;
 
-        for (i = 0; i < n; ++i) {
-                switch (events[i].data.u32) {
-                case N_DHCP4_CLIENT_EPOLL_TIMER:
-                        r = n_dhcp4_client_dispatch_timer(client, events + i);
-                        break;
-                case N_DHCP4_CLIENT_EPOLL_IO:
+        for (i = 0; i < n && !r; ++i) {
+                if (events[i].data.ptr)
                         r = n_dhcp4_client_dispatch_io(client, events + i);
-                        break;
-                default:
-                        c_assert(0);
-                        r = 0;
-                        break;
-                }
+                else
+                        r = n_dhcp4_client_dispatch_timer(client, events + i);
 
-                if (r) {
-                        if (r == N_DHCP4_E_DOWN) {
-                                r = n_dhcp4_client_raise(client,
-                                                         NULL,
-                                                         N_DHCP4_CLIENT_EVENT_DOWN);
-                                if (r)
-                                        return r;
-
-                                /* continue normally */
-                        } else if (r) {
-                                if (r >= _N_DHCP4_E_INTERNAL) {
-                                        n_dhcp4_log(&client->log_queue,
-                                                    LOG_ERR,
-                                                    "invalid internal error code %d after dispatch",
-                                                    r);
-                                        return N_DHCP4_E_INTERNAL;
-                                }
-                                return r;
-                        }
-                }
+                r = n_dhcp4_client_dispatch_result(client, r);
+        }
+
+        client->dispatching = false;
+
+        /* the freed probes might hold the last references to @client */
+        if (!c_list_is_empty(&client->reap_list)) {
+                pin = n_dhcp4_client_ref(client);
+                n_dhcp4_client_probe_reap(&client->reap_list);
         }
 
+        if (r)
+                return r;
+
         n_dhcp4_client_arm_timer(client);
 
         return client->preempted ? N_DHCP4_E_PREEMPTED : 0;
 }
 
+static int n_dhcp4_client_context_dispatch_timer(NDhcp4ClientContext *context,
+                                                 struct epoll_event *event) {
+        NDhcp4Client *client;
+        NDhcp4Timer *timer;
+        uint64_t ns_now;
+        int r;
+
+        r = n_dhcp4_timerfd_read(context->fd_timer, event);
+        if (r)
+                return (r == N_DHCP4_E_AGAIN) ? 0 : r;
+
+        /* the timerfd fired, so it is no longer armed */
+        context->scheduled_timeout = 0;
+
+        ns_now = n_dhcp4_gettime(CLOCK_BOOTTIME);
+
+        for (size_t i = 0; i < N_DHCP4_CLIENT_CONTEXT_N_DISPATCH; ++i) {
+                timer = n_dhcp4_timer_wheel_pop(&context->timers, ns_now);
+                if (!timer)
+                        return 0;
+
+                client = c_container_of(timer, NDhcp4Client, timer);
+                client->scheduled_timeout = 0;
+
+                r = n_dhcp4_client_dispatch_timeout(client, ns_now);
+                r = n_dhcp4_client_dispatch_result(client, r);
+                if (r)
+                        return r;
+
+                n_dhcp4_client_arm_timer(client);
+        }
+
+        return N_DHCP4_E_PREEMPTED;
+}
+
+static int n_dhcp4_client_context_dispatch_io(struct epoll_event *event, bool *preemptedp) {
+        NDhcp4CConnection *connection = c_container_of(event->data.ptr, NDhcp4CConnection, epoll_type);
+        NDhcp4Client *client;
+        int r;
+
+        /* connections are only ever registered as part of a probe */
+        client = c_container_of(connection, NDhcp4ClientProbe, connection)->client;
+
+        client->preempted = false;
+
+        r = n_dhcp4_client_dispatch_io(client, event);
+        r = n_dhcp4_client_dispatch_result(client, r);
+        if (r)
+                return r;
+
+        if (client->preempted)
+                *preemptedp = true;
+
+        n_dhcp4_client_arm_timer(client);
+        return 0;
+}
+
+static int n_dhcp4_client_context_dispatch_interface(NDhcp4ClientContext *context,
+                                                     NDhcp4CInterface *interface) {
+        NDhcp4CConnection *connection;
+        NDhcp4ClientProbe *probe;
+        NDhcp4Client *client;
+        int r;
+
+        for (size_t i = 0; i < N_DHCP4_CLIENT_CONTEXT_N_DISPATCH; ++i) {
+                _c_cleanup_(n_dhcp4_incoming_deinit) NDhcp4Incoming message = N_DHCP4_INCOMING_NULL(message);
+
+                connection = NULL;
+                r = n_dhcp4_c_interface_dispatch(interface,
+                                                 context->buf,
+                                                 N_DHCP4_CLIENT_BUF_SIZE,
+                                                 &message,
+                                                 &connection);
+                if (r == N_DHCP4_E_AGAIN)
+                        return 0;
+                else if (r == N_DHCP4_E_MALFORMED)
+                        continue;
+                else if (r)
+                        return r;
+
+                /* replies to no pending request are dropped, like the socket filter would */
+                if (!connection)
+                        continue;
+
+                probe = c_container_of(connection, NDhcp4ClientProbe, connection);
+                client = probe->client;
+
+                r = n_dhcp4_client_probe_dispatch_incoming(probe, &message);
+                r = n_dhcp4_client_dispatch_result(client, r);
+                if (r)
+                        return r;
+
+                n_dhcp4_client_arm_timer(client);
+        }
+
+        return N_DHCP4_E_PREEMPTED;
+}
+
+/**
+ * n_dhcp4_client_context_get_fd() - retrieve event FD
+ * @context:                    client context to operate on
+ * @fdp:                        output argument to store FD
+ *
+ * This retrieves the FD used by the client context given as @context. The FD
+ * is always valid, and returned in @fdp.
+ *
+ * The caller is expected to poll this FD for readable events and call
+ * n_dhcp4_client_context_dispatch() whenever the FD is readable.
+ */
+_c_public_ void n_dhcp4_client_context_get_fd(NDhcp4ClientContext *context, int *fdp) {
+        *fdp = context->fd_epoll;
+}
+
+/**
+ * n_dhcp4_client_context_dispatch() - dispatch client context
+ * @context:                    client context to operate on
+ *
+ * This dispatches pending operations on all clients of @context, like
+ * n_dhcp4_client_dispatch() does for a single client. Events are queued on
+ * the respective clients, or passed to their event callbacks.
+ *
+ * This function never blocks.
+ *
+ * Only a bounded number of sockets and timeouts is dispatched in a single
+ * call. If there is more to dispatch, this returns N_DHCP4_E_PREEMPTED, and
+ * the caller is expected to call into this function again.
+ *
+ * Return: 0 on success, negative error code on failure, N_DHCP4_E_PREEMPTED if
+ *         there is more data to dispatch.
+ */
+_c_public_ int n_dhcp4_client_context_dispatch(NDhcp4ClientContext *context) {
+        _c_cleanup_(n_dhcp4_client_context_unrefp) NDhcp4ClientContext *pin = NULL;
+        struct epoll_event events[N_DHCP4_CLIENT_CONTEXT_N_EPOLL];
+        NDhcp4CInterface *interface, *safe;
+        unsigned int *type;
+        bool preempted;
+        int n, i, r = 0;
+
+        n = epoll_wait(context->fd_epoll, events, sizeof(events) / sizeof(*events), 0);
+        if (n < 0) {
+                /* Linux never returns EINTR if `timeout == 0'. */
+                return -errno;
+        }
+
+        preempted = (n == N_DHCP4_CLIENT_CONTEXT_N_EPOLL);
+
+        /*
+         * Clients update their timeouts on the wheel while they are
+         * dispatched, but the timerfd is only re-armed once in the end.
+         */
+        context->dispatching = true;
+
+        for (i = 0; i < n && !r; ++i) {
+                type = events[i].data.ptr;
+
+                if (!type) {
+                        r = n_dhcp4_client_context_dispatch_timer(context, events + i);
+                } else if (*type == N_DHCP4_C_EPOLL_INTERFACE) {
+                        interface = c_container_of(type, NDhcp4CInterface, epoll_type);
+                        r = n_dhcp4_client_context_dispatch_interface(context, interface);
+                } else {
+                        r = n_dhcp4_client_context_dispatch_io(events + i, &preempted);
+                }
+
+                if (r == N_DHCP4_E_PREEMPTED) {
+                        preempted = true;
+                        r = 0;
+                }
+        }
+
+        context->dispatching = false;
+
+        /*
+         * Destroy the probes freed by event callbacks. Each keeps its client
+         * alive until now, and the last client might release the context, so
+         * it is pinned.
+         */
+        if (!c_list_is_empty(&context->reap_list)) {
+                pin = n_dhcp4_client_context_ref(context);
+                n_dhcp4_client_probe_reap(&context->reap_list);
+        }
+
+        n_dhcp4_client_context_arm_timer(context);
+
+        /* free the interfaces released while events might have referred to them */
+        c_list_for_each_entry_safe(interface, safe, &context->interface_list, context_link)
+                if (!interface->n_refs)
+                        n_dhcp4_c_interface_free(interface);
+
+        if (r)
+                return r;
+
+        return preempted ? N_DHCP4_E_PREEMPTED : 0;
+}
+
 /**
  * n_dhcp4_client_pop_event() - fetch pending event
  * @client:                     client to operate on
@@ -967,13 +1420,20 @@ _c_public_ int n_dhcp4_client_update_mtu(NDhcp4Client *client, uint16_t mtu) {
  * probes can be run in parallel (e.g., with different client-ids, or an INFORM
  * in parallel to a REQUEST, ...).
  *
+ * If @client has an event callback, it gets the CANCELLED event of a new
+ * probe before this returns. The callback may free the probe, in which case
+ * NULL is returned in @probep.
+ *
  * Return: 0 on success, negative error code on failure.
  */
 _c_public_ int n_dhcp4_client_probe(NDhcp4Client *client,
                                   NDhcp4ClientProbe **probep,
                                   NDhcp4ClientProbeConfig *config) {
         _c_cleanup_(n_dhcp4_client_probe_freep) NDhcp4ClientProbe *probe = NULL;
+        _c_cleanup_(n_dhcp4_client_unrefp) NDhcp4Client *pin = NULL;
+        CList *reap_list;
         uint64_t ns_now;
+        bool dispatching;
         int r;
 
         ns_now = n_dhcp4_gettime(CLOCK_BOOTTIME);
@@ -984,6 +1444,30 @@ _c_public_ int n_dhcp4_client_probe(NDhcp4Client *client,
 
         n_dhcp4_client_arm_timer(client);
 
+        if (probe != client->current_probe) {
+                /*
+                 * Another probe is running, so the new one is cancelled right
+                 * away. The callback might free it, so unless this is called
+                 * from within a dispatch round, it is treated like one.
+                 */
+                dispatching = client->dispatching;
+                client->dispatching = true;
+                reap_list = n_dhcp4_client_get_reap_list(client);
+                r = n_dhcp4_client_probe_emit(probe, N_DHCP4_CLIENT_EVENT_CANCELLED, NULL);
+                client->dispatching = dispatching;
+                if (r)
+                        return r;
+
+                if (c_list_is_linked(&probe->reap_link)) {
+                        probe = NULL;
+
+                        if (!n_dhcp4_client_get_reap_list(client)) {
+                                pin = n_dhcp4_client_ref(client);
+                                n_dhcp4_client_probe_reap(reap_list);
+                        }
+                }
+        }
+
         *probep = probe;
         probe = NULL;
         return 0;
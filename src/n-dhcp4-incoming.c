@@ -11,9 +11,15 @@
  * consistent view to the caller.
  *
  * Internally, for every incoming message we linearize its OPTIONs. This means,
- * we create a copy of the contents, and merge all duplicate options into a
- * single option entry. We then provide accessors to the caller to easily get
- * O(1) access to individual fields.
+ * we index all options in a single walk over the message, and merge all
+ * duplicate options into a single option entry in a copy trailing the
+ * message. We then provide accessors to the caller to easily get O(1) access
+ * to individual fields.
+ *
+ * The index is kept compact, since every lease keeps its message around: a
+ * bitmap tells which options are present, and a packed array holds one entry
+ * per present option, ordered by option code. The entry of an option is found
+ * by counting the present options with lower codes in the bitmap.
  */
 
 #include <assert.h>
@@ -30,137 +36,230 @@
 #include "n-dhcp4.h"
 #include "n-dhcp4-private.h"
 
-static void n_dhcp4_incoming_prefetch(NDhcp4Incoming *incoming, size_t *offset, uint8_t option, const uint8_t *raw, size_t n_raw) {
+/*
+ * Result of the first walk over the options of a message. This records which
+ * options are present, where options that occur just once are located, and
+ * how much space is needed to index and concatenate them.
+ */
+typedef struct NDhcp4IncomingScan {
+        uint64_t present[_N_DHCP4_OPTION_N / 64];
+        uint64_t multi[_N_DHCP4_OPTION_N / 64];
+        uint16_t offset[_N_DHCP4_OPTION_N];
+        uint16_t size[_N_DHCP4_OPTION_N];
+        size_t n_options;
+        size_t n_concatenated;
+        uint8_t overload;
+} NDhcp4IncomingScan;
+
+/*
+ * Sections of a message that can carry options, in the order their content is
+ * concatenated. FILE and SNAME are only used if the OVERLOAD option says so.
+ */
+static bool n_dhcp4_incoming_section(size_t n_message,
+                                     unsigned int i,
+                                     uint8_t overload,
+                                     size_t *posp,
+                                     size_t *endp) {
+        switch (i) {
+        case 0:
+                *posp = offsetof(NDhcp4Message, options);
+                *endp = n_message;
+                return true;
+        case 1:
+                if (!(overload & N_DHCP4_OVERLOAD_FILE))
+                        return false;
+
+                *posp = offsetof(NDhcp4Message, file);
+                *endp = *posp + sizeof(((NDhcp4Message *)NULL)->file);
+                return true;
+        case 2:
+                if (!(overload & N_DHCP4_OVERLOAD_SNAME))
+                        return false;
+
+                *posp = offsetof(NDhcp4Message, sname);
+                *endp = *posp + sizeof(((NDhcp4Message *)NULL)->sname);
+                return true;
+        default:
+                c_assert(0);
+                return false;
+        }
+}
+
+/*
+ * Fetch the next option of a section, skipping PAD. This stops at END and at
+ * the first option that does not fit into the section.
+ */
+static bool n_dhcp4_incoming_next(const uint8_t *m, size_t *posp, size_t end, uint8_t *optionp, uint8_t *lengthp) {
+        size_t pos = *posp;
         uint8_t o, l;
-        size_t pos;
 
-        for (pos = 0; pos < n_raw; ) {
-                o = raw[pos++];
-                if (o == N_DHCP4_OPTION_PAD)
-                        continue;
-                if (o == N_DHCP4_OPTION_END)
-                        return;
-
-                /* bail out if no remaining space for length field */
-                if (pos >= n_raw)
-                        return;
-
-                /* bail out if length exceeds the available space */
-                l = raw[pos++];
-                if (l > n_raw || pos > n_raw - l)
-                        return;
-
-                /* prefetch content if it matches @option */
-                if (o == option) {
-                        memcpy((uint8_t *)&incoming->message + *offset, raw + pos, l);
-                        *offset += l;
-                }
+        do {
+                if (pos >= end)
+                        return false;
 
-                pos += l;
-        }
+                o = m[pos++];
+        } while (o == N_DHCP4_OPTION_PAD);
+
+        if (o == N_DHCP4_OPTION_END)
+                return false;
+
+        /* bail out if no remaining space for length field */
+        if (pos >= end)
+                return false;
+
+        /* bail out if length exceeds the available space */
+        l = m[pos++];
+        if (l > end || pos > end - l)
+                return false;
+
+        *posp = pos;
+        *optionp = o;
+        *lengthp = l;
+        return true;
 }
 
-static void n_dhcp4_incoming_merge(NDhcp4Incoming *incoming, size_t *offset, uint8_t overload, uint8_t option) {
-        uint8_t *m = (uint8_t *)&incoming->message;
-        size_t pos;
+static void n_dhcp4_incoming_scan(NDhcp4IncomingScan *scan, const uint8_t *m, size_t n_m) {
+        bool has_overload = false;
+        uint64_t bit;
+        size_t i, pos, end;
+        uint8_t o, l;
 
         /*
-         * Prefetch all options matching @option from the 3 sections,
-         * concatenating their content. Remember the offset and size of the
-         * option in our message state.
+         * Index all OPTIONs of the incoming message in a single walk. This
+         * records the first instance of each option and sums up the length of
+         * all instances. Options that occur just once, which is the common
+         * case, are referenced in place. Only options that occur multiple
+         * times need to be concatenated, which requires another walk.
+         *
+         * OPTIONS is walked first, so the OVERLOAD option is known before it
+         * is decided whether FILE and SNAME need to be walked as well. So far,
+         * we require the OVERLOAD option to be present in the options-array
+         * (which is obvious and a given). However, if the option occurs
+         * outside of the options-array (i.e., SNAME or FILE), we silently
+         * ignore it. The specification does not allow multiple OVERLOAD
+         * options, anyway. Hence, this behavior only defines what we do when
+         * we see broken implementations, and we currently seem to support all
+         * styles we saw in the wild so far.
          */
 
-        pos = *offset;
+        memset(scan->present, 0, sizeof(scan->present));
+        memset(scan->multi, 0, sizeof(scan->multi));
+        scan->n_options = 0;
+        scan->n_concatenated = 0;
+        scan->overload = 0;
 
-        /* prefetch option from OPTIONS */
-        n_dhcp4_incoming_prefetch(incoming, offset, option,
-                                  m + offsetof(NDhcp4Message, options),
-                                  incoming->n_message - offsetof(NDhcp4Message, options));
+        for (i = 0; i < 3; ++i) {
+                if (!n_dhcp4_incoming_section(n_m, i, scan->overload, &pos, &end))
+                        continue;
 
-        /* prefetch option from FILE */
-        if (overload & N_DHCP4_OVERLOAD_FILE)
-                n_dhcp4_incoming_prefetch(incoming, offset, option,
-                                          m + offsetof(NDhcp4Message, file),
-                                          sizeof(incoming->message.file));
+                while (n_dhcp4_incoming_next(m, &pos, end, &o, &l)) {
+                        if (o == N_DHCP4_OPTION_OVERLOAD) {
+                                if (i > 0) {
+                                        pos += l;
+                                        continue;
+                                }
+
+                                if (!has_overload && l >= 1) {
+                                        scan->overload = m[pos];
+                                        has_overload = true;
+                                }
+                        }
+
+                        bit = UINT64_C(1) << (o % 64);
+
+                        if (!(scan->present[o / 64] & bit)) {
+                                scan->present[o / 64] |= bit;
+                                scan->offset[o] = pos;
+                                scan->size[o] = 0;
+                                ++scan->n_options;
+                        } else if (!(scan->multi[o / 64] & bit)) {
+                                scan->multi[o / 64] |= bit;
+                                scan->n_concatenated += scan->size[o];
+                        }
+
+                        if (scan->multi[o / 64] & bit)
+                                scan->n_concatenated += l;
+
+                        scan->size[o] += l;
+                        pos += l;
+                }
+        }
+}
 
-        /* prefetch option from SNAME */
-        if (overload & N_DHCP4_OVERLOAD_SNAME)
-                n_dhcp4_incoming_prefetch(incoming, offset, option,
-                                          m + offsetof(NDhcp4Message, sname),
-                                          sizeof(incoming->message.sname));
+/*
+ * Space needed to index the options of a scanned message, that is, the index
+ * entries followed by the concatenated options.
+ */
+static size_t n_dhcp4_incoming_index_size(NDhcp4IncomingScan *scan) {
+        return scan->n_options * sizeof(NDhcp4IncomingOption) + scan->n_concatenated;
+}
 
-        incoming->options[option].value = m + pos;
-        incoming->options[option].size = *offset - pos;
+static size_t n_dhcp4_incoming_align(size_t n) {
+        return (n + _Alignof(NDhcp4IncomingOption) - 1) & ~(_Alignof(NDhcp4IncomingOption) - 1);
 }
 
-static void n_dhcp4_incoming_linearize(NDhcp4Incoming *incoming) {
-        uint8_t *m, o, l, overload;
-        size_t i, pos, end, offset;
+static void n_dhcp4_incoming_index(NDhcp4Incoming *incoming, NDhcp4IncomingScan *scan, void *index) {
+        NDhcp4IncomingOption *option;
+        uint8_t *m, o, l;
+        size_t i, n, t, pos, end;
+        uint64_t word;
 
         /*
-         * Linearize all OPTIONs of the incoming message. We know that
-         * @incoming->message is preallocated to be big enough to hold the
-         * entire linearized message _trailing_ the original copy. All we have
-         * to do is walk the raw message in @incoming->message and for each
-         * option we find, copy it into the trailing space, concatenating all
-         * instances we find.
-         *
-         * Before we can copy the individual options, we must scan for the
-         * OVERLOAD option. This is required so our prefetcher knows which data
-         * arrays to scan for prefetching.
-         *
-         * So far, we require the OVERLOAD option to be present in the
-         * options-array (which is obvious and a given). However, if the option
-         * occurs multiple times outside of the options-array (i.e., SNAME or
-         * FILE), we silently ignore them. The specification does not allow
-         * multiple OVERLOAD options, anyway. Hence, this behavior only defines
-         * what we do when we see broken implementations, and we currently seem
-         * to support all styles we saw in the wild so far.
+         * Build the index of a scanned message in @index, which must provide
+         * n_dhcp4_incoming_index_size() bytes. Every option has an entry, and
+         * the entries are ordered by option code. The position of an entry is
+         * thus the number of options present with a lower code, which we get
+         * from the bitmap in O(1). Options that occur multiple times are then
+         * concatenated into the trailer following the entries.
          */
 
-        m = (uint8_t *)&incoming->message;
-        offset = incoming->n_message;
+        incoming->options = index;
+        incoming->trailer = (uint8_t *)(incoming->options + scan->n_options);
 
-        n_dhcp4_incoming_merge(incoming, &offset, 0, N_DHCP4_OPTION_OVERLOAD);
-        if (incoming->options[N_DHCP4_OPTION_OVERLOAD].size >= 1)
-                overload = *incoming->options[N_DHCP4_OPTION_OVERLOAD].value;
-        else
-                overload = 0;
+        n = 0;
+        t = 0;
 
-        for (i = 0; i < 3; ++i) {
-                if (i == 0) { /* walk OPTIONS */
-                        pos = offsetof(NDhcp4Message, options);
-                        end = incoming->n_message;
-                } else if (i == 1) { /* walk FILE */
-                        if (!(overload & N_DHCP4_OVERLOAD_FILE))
-                                continue;
+        for (i = 0; i < _N_DHCP4_OPTION_N / 64; ++i) {
+                incoming->present[i] = scan->present[i];
+                incoming->rank[i] = n;
 
-                        pos = offsetof(NDhcp4Message, file);
-                        end = pos + sizeof(incoming->message.file);
-                } else { /* walk SNAME */
-                        if (!(overload & N_DHCP4_OVERLOAD_SNAME))
-                                continue;
+                for (word = scan->present[i]; word; word &= word - 1) {
+                        o = i * 64 + __builtin_ctzll(word);
+                        option = &incoming->options[n++];
+
+                        option->code = o;
+                        option->size = scan->size[o];
 
-                        pos = offsetof(NDhcp4Message, sname);
-                        end = pos + sizeof(incoming->message.sname);
+                        if (scan->multi[i] & (word & -word)) {
+                                option->concatenated = true;
+                                option->offset = t;
+                                scan->offset[o] = t;
+                                t += scan->size[o];
+                        } else {
+                                option->concatenated = false;
+                                option->offset = scan->offset[o];
+                        }
                 }
+        }
 
-                while (pos < end) {
-                        o = m[pos++];
-                        if (o == N_DHCP4_OPTION_PAD)
-                                continue;
-                        if (o == N_DHCP4_OPTION_END)
-                                break;
-                        if (pos >= end)
-                                break;
+        if (!scan->n_concatenated)
+                return;
+
+        m = (uint8_t *)incoming->message;
 
-                        l = m[pos++];
-                        if (l > end || pos > end - l)
-                                break;
+        for (i = 0; i < 3; ++i) {
+                if (!n_dhcp4_incoming_section(incoming->n_message, i, scan->overload, &pos, &end))
+                        continue;
 
-                        if (!incoming->options[o].value)
-                                n_dhcp4_incoming_merge(incoming, &offset, overload, o);
+                while (n_dhcp4_incoming_next(m, &pos, end, &o, &l)) {
+                        if (!(scan->multi[o / 64] & (UINT64_C(1) << (o % 64))) ||
+                            (o == N_DHCP4_OPTION_OVERLOAD && i > 0)) {
+                                pos += l;
+                                continue;
+                        }
 
+                        memcpy(incoming->trailer + scan->offset[o], m + pos, l);
+                        scan->offset[o] += l;
                         pos += l;
                 }
         }
@@ -187,40 +286,144 @@ static void n_dhcp4_incoming_linearize(NDhcp4Incoming *incoming) {
  */
 int n_dhcp4_incoming_new(NDhcp4Incoming **incomingp, const void *raw, size_t n_raw) {
         _c_cleanup_(n_dhcp4_incoming_freep) NDhcp4Incoming *incoming = NULL;
+        NDhcp4IncomingScan scan;
+        uint32_t magic;
         size_t size;
 
         if (n_raw < sizeof(NDhcp4Message) || n_raw > UINT16_MAX)
                 return N_DHCP4_E_MALFORMED;
 
+        memcpy(&magic, (const uint8_t *)raw + offsetof(NDhcp4Message, magic), sizeof(magic));
+        if (magic != htobe32(N_DHCP4_MESSAGE_MAGIC))
+                return N_DHCP4_E_MALFORMED;
+
+        n_dhcp4_incoming_scan(&scan, raw, n_raw);
+
         /*
-         * Allocate enough space for book-keeping, a copy of @raw and trailing
-         * space for linearized options. The trailing space must be big enough
-         * to hold the entire options array unmodified (linearizing can only
-         * make it smaller). Hence, just allocate enough space to hold the raw
-         * message without the header.
+         * Allocate enough space for book-keeping, a copy of @raw and the
+         * index of its options. The scan tells exactly how big the index
+         * needs to be, which is usually a small fraction of the message.
          */
-        size = sizeof(*incoming) + n_raw - sizeof(NDhcp4Message);
-        size += n_raw - sizeof(NDhcp4Header);
+        size = n_dhcp4_incoming_align(sizeof(*incoming) + n_raw - sizeof(NDhcp4Message));
 
-        incoming = calloc(1, size);
+        incoming = calloc(1, size + n_dhcp4_incoming_index_size(&scan));
         if (!incoming)
                 return -ENOMEM;
 
         *incoming = (NDhcp4Incoming)N_DHCP4_INCOMING_NULL(*incoming);
+        incoming->message = &incoming->copy;
         incoming->n_message = n_raw;
-        memcpy(&incoming->message, raw, n_raw);
-
-        if (incoming->message.magic != htobe32(N_DHCP4_MESSAGE_MAGIC))
-                return N_DHCP4_E_MALFORMED;
+        memcpy(&incoming->copy, raw, n_raw);
 
-        /* linearize options */
-        n_dhcp4_incoming_linearize(incoming);
+        n_dhcp4_incoming_index(incoming, &scan, (uint8_t *)incoming + size);
 
         *incomingp = incoming;
         incoming = NULL;
         return 0;
 }
 
+/**
+ * n_dhcp4_incoming_init_borrowed() - Initialize message view over a buffer
+ * @incoming:           object to initialize
+ * @buf:                buffer holding the raw message blob
+ * @n_buf:              size of @buf
+ * @n_raw:              length of the raw message blob at the start of @buf
+ *
+ * This is like n_dhcp4_incoming_new(), but rather than copying the message,
+ * it parses it in place. @buf is borrowed and must stay valid and unmodified
+ * until @incoming is deinitialized. Use n_dhcp4_incoming_dup() to keep a
+ * message beyond that.
+ *
+ * The index of the options, as well as options that occur multiple times and
+ * thus must be concatenated, are placed in @buf trailing the message, if there
+ * is enough space. Otherwise, a separate buffer is allocated.
+ *
+ * On failure, @incoming is left deinitialized.
+ *
+ * Return: 0 on success, negative error code on failure, N_DHCP4_E_MALFORMED if
+ *         the message is not a valid DHCP4 message.
+ */
+int n_dhcp4_incoming_init_borrowed(NDhcp4Incoming *incoming, void *buf, size_t n_buf, size_t n_raw) {
+        NDhcp4IncomingScan scan;
+        size_t n_index, spare;
+        void *index;
+
+        *incoming = (NDhcp4Incoming)N_DHCP4_INCOMING_NULL(*incoming);
+
+        if (n_raw < sizeof(NDhcp4Message) || n_raw > UINT16_MAX || n_raw > n_buf)
+                return N_DHCP4_E_MALFORMED;
+        if (((NDhcp4Message *)buf)->magic != htobe32(N_DHCP4_MESSAGE_MAGIC))
+                return N_DHCP4_E_MALFORMED;
+
+        n_dhcp4_incoming_scan(&scan, buf, n_raw);
+
+        n_index = n_dhcp4_incoming_index_size(&scan);
+        spare = n_dhcp4_incoming_align((uintptr_t)buf + n_raw) - (uintptr_t)buf;
+
+        if (!n_index) {
+                index = buf;
+        } else if (spare <= n_buf && n_buf - spare >= n_index) {
+                index = (uint8_t *)buf + spare;
+        } else {
+                index = malloc(n_index);
+                if (!index)
+                        return -ENOMEM;
+
+                incoming->owns_index = true;
+        }
+
+        incoming->message = buf;
+        incoming->n_message = n_raw;
+        incoming->borrowed = true;
+
+        n_dhcp4_incoming_index(incoming, &scan, index);
+
+        return 0;
+}
+
+/**
+ * n_dhcp4_incoming_deinit() - Deinitialize message view
+ * @incoming:           object to operate on
+ *
+ * This releases all resources of a message view initialized via
+ * n_dhcp4_incoming_init_borrowed(), and leaves it deinitialized. The buffer
+ * the message was borrowed from is no longer referenced afterwards. This is a
+ * no-op if @incoming is already deinitialized.
+ */
+void n_dhcp4_incoming_deinit(NDhcp4Incoming *incoming) {
+        c_assert(!incoming->message || incoming->borrowed);
+
+        if (incoming->owns_index)
+                free(incoming->options);
+
+        *incoming = (NDhcp4Incoming)N_DHCP4_INCOMING_NULL(*incoming);
+}
+
+/**
+ * n_dhcp4_incoming_dup() - Copy message into a new object
+ * @dupp:               output argument for new object
+ * @incoming:           message to copy
+ *
+ * This creates a new message object owning a copy of the message of
+ * @incoming, including its user data. This is used to keep a message parsed
+ * in place beyond the lifetime of the buffer it was borrowed from.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int n_dhcp4_incoming_dup(NDhcp4Incoming **dupp, NDhcp4Incoming *incoming) {
+        NDhcp4Incoming *dup;
+        int r;
+
+        r = n_dhcp4_incoming_new(&dup, incoming->message, incoming->n_message);
+        if (r)
+                return r;
+
+        dup->userdata = incoming->userdata;
+
+        *dupp = dup;
+        return 0;
+}
+
 /**
  * n_dhcp4_incoming_free() - Deallocate message object
  * @incoming:           object to operate on, or NULL
@@ -234,6 +437,8 @@ NDhcp4Incoming *n_dhcp4_incoming_free(NDhcp4Incoming *incoming) {
         if (!incoming)
                 return NULL;
 
+        c_assert(!incoming->borrowed);
+
         free(incoming);
 
         return NULL;
@@ -249,7 +454,7 @@ NDhcp4Incoming *n_dhcp4_incoming_free(NDhcp4Incoming *incoming) {
  * Return: A pointer to the message header is returned.
  */
 NDhcp4Header *n_dhcp4_incoming_get_header(NDhcp4Incoming *incoming) {
-        return &incoming->message.header;
+        return &incoming->message->header;
 }
 
 /**
@@ -260,11 +465,10 @@ NDhcp4Header *n_dhcp4_incoming_get_header(NDhcp4Incoming *incoming) {
  * This hands out a pointer to the raw message blob to the caller. This will
  * point to the original message content, rather than the linearized version.
  *
- * Note that if the caller queried the contents of the message before, any
- * modifications done by the caller will not affect the original message. It
- * only affects the linearized content (which is a duplicate trailing the
- * original message). However, modifications to the message header *DO* also
- * appear in the original, since the message header is not duplicated.
+ * Note that options that occur just once are not duplicated, so modifications
+ * to their content, as well as modifications to the message header, *DO*
+ * appear in the original. Only options that occur multiple times are
+ * concatenated into a duplicate trailing the original message.
  *
  * In either case, it is better to never modify the message, if you intend to
  * forward it further.
@@ -273,7 +477,7 @@ NDhcp4Header *n_dhcp4_incoming_get_header(NDhcp4Incoming *incoming) {
  */
 size_t n_dhcp4_incoming_get_raw(NDhcp4Incoming *incoming, const void **rawp) {
         if (rawp)
-                *rawp = &incoming->message;
+                *rawp = incoming->message;
         return incoming->n_message;
 }
 
@@ -284,19 +488,18 @@ size_t n_dhcp4_incoming_get_raw(NDhcp4Incoming *incoming, const void **rawp) {
  * @datap:              output argument for the option-data, or NULL
  * @n_datap:            output argument for the length of the option, or NULL
  *
- * This returns a pointer to the requested option blob in the message. It
- * points to a linearized version of all respective option-fields of the same
- * type. Hence, the caller is not required to deal with multiple occurrences of
- * the same option.
+ * This returns a pointer to the requested option blob in the message. If the
+ * option occurs multiple times, it points to a linearized version of all
+ * respective option-fields of the same type. Hence, the caller is not required
+ * to deal with multiple occurrences of the same option.
  *
  * If an option was not present in the incoming message, N_DHCP4_E_UNSET is
  * returned. Note that this is different from an empty option! And empty option
  * will return a valid pointer and size 0.
  *
- * Note that the pointer to the option-blob does not point to the original
- * message, but a duplicated version. Modifications to the blob will not be
- * reflected in the original message, but they will be permanent regarding
- * further queries through this function.
+ * Note that the pointer to the option-blob points into the original message if
+ * the option occurs just once, and into a duplicated version otherwise. Hence,
+ * the blob must not be modified.
  *
  * Note that the original message alignment might no longer be reflected in the
  * returned blob. You must not alias the content of the blob, but always copy
@@ -308,13 +511,23 @@ size_t n_dhcp4_incoming_get_raw(NDhcp4Incoming *incoming, const void **rawp) {
  *         option was not found,
  */
 int n_dhcp4_incoming_query(NDhcp4Incoming *incoming, uint8_t option, uint8_t **datap, size_t *n_datap) {
-        if (!incoming->options[option].value)
+        uint64_t bit = UINT64_C(1) << (option % 64);
+        NDhcp4IncomingOption *entry;
+
+        if (!(incoming->present[option / 64] & bit))
                 return N_DHCP4_E_UNSET;
 
-        if (datap)
-                *datap = incoming->options[option].value;
+        entry = &incoming->options[incoming->rank[option / 64] +
+                                   __builtin_popcountll(incoming->present[option / 64] & (bit - 1))];
+
+        if (datap) {
+                if (entry->concatenated)
+                        *datap = incoming->trailer + entry->offset;
+                else
+                        *datap = (uint8_t *)incoming->message + entry->offset;
+        }
         if (n_datap)
-                *n_datap = incoming->options[option].size;
+                *n_datap = entry->size;
         return 0;
 }
 
@@ -17,6 +17,7 @@
 #include <string.h>
 #include "n-dhcp4.h"
 #include "n-dhcp4-private.h"
+#include "util/packet.h"
 
 /**
  * N_DHCP4_OUTGOING_MAX_PHDR - maximum protocol header size
@@ -31,6 +32,22 @@
  */
 #define N_DHCP4_OUTGOING_MAX_PHDR (N_DHCP4_NETWORK_IP_MAXIMUM_HEADER_SIZE + sizeof(struct udphdr))
 
+static void n_dhcp4_outgoing_init(NDhcp4Outgoing *outgoing, size_t max_size, uint8_t overload) {
+        c_assert(!(overload & ~(N_DHCP4_OVERLOAD_FILE | N_DHCP4_OVERLOAD_SNAME)));
+
+        outgoing->n_message = N_DHCP4_NETWORK_IP_MINIMUM_MAX_SIZE - N_DHCP4_OUTGOING_MAX_PHDR;
+        outgoing->i_message = offsetof(NDhcp4Message, options);
+        outgoing->max_size = outgoing->n_message;
+        outgoing->overload = overload;
+        outgoing->headers.valid = false;
+
+        if (max_size > N_DHCP4_NETWORK_IP_MINIMUM_MAX_SIZE)
+                outgoing->max_size = max_size - N_DHCP4_OUTGOING_MAX_PHDR;
+
+        outgoing->message->magic = htonl(N_DHCP4_MESSAGE_MAGIC);
+        outgoing->message->options[0] = N_DHCP4_OPTION_END;
+}
+
 /**
  * n_dhcp4_outgoing_new() - Allocate new outgoing message
  * @outgoingp:          output argument to return allocate object through
@@ -62,33 +79,43 @@ int n_dhcp4_outgoing_new(NDhcp4Outgoing **outgoingp, size_t max_size, uint8_t ov
                                                              sizeof(NDhcp4Message) + 1,
                       "Invalid minimum IP packet limit");
 
-        c_assert(!(overload & ~(N_DHCP4_OVERLOAD_FILE | N_DHCP4_OVERLOAD_SNAME)));
-
         outgoing = calloc(1, sizeof(*outgoing));
         if (!outgoing)
                 return -ENOMEM;
 
         *outgoing = (NDhcp4Outgoing)N_DHCP4_OUTGOING_NULL(*outgoing);
-        outgoing->n_message = N_DHCP4_NETWORK_IP_MINIMUM_MAX_SIZE - N_DHCP4_OUTGOING_MAX_PHDR;
-        outgoing->i_message = offsetof(NDhcp4Message, options);
-        outgoing->max_size = outgoing->n_message;
-        outgoing->overload = overload;
-
-        if (max_size > N_DHCP4_NETWORK_IP_MINIMUM_MAX_SIZE)
-                outgoing->max_size = max_size - N_DHCP4_OUTGOING_MAX_PHDR;
+        outgoing->n_buffer = N_DHCP4_NETWORK_IP_MINIMUM_MAX_SIZE - N_DHCP4_OUTGOING_MAX_PHDR;
 
-        outgoing->message = calloc(1, outgoing->n_message);
+        outgoing->message = calloc(1, outgoing->n_buffer);
         if (!outgoing->message)
                 return -ENOMEM;
 
-        outgoing->message->magic = htonl(N_DHCP4_MESSAGE_MAGIC);
-        outgoing->message->options[0] = N_DHCP4_OPTION_END;
+        n_dhcp4_outgoing_init(outgoing, max_size, overload);
 
         *outgoingp = outgoing;
         outgoing = NULL;
         return 0;
 }
 
+/**
+ * n_dhcp4_outgoing_reset() - Reset outgoing message for reuse
+ * @outgoing:           message to operate on
+ * @max_size:           maximum transmission size to use
+ * @overload:           select sections to overload
+ *
+ * This resets @outgoing to the state n_dhcp4_outgoing_new() returns it in,
+ * with the given parameters. The message buffer is kept, so once it has grown
+ * to the size of the messages being built, rebuilding a message does not
+ * allocate.
+ */
+void n_dhcp4_outgoing_reset(NDhcp4Outgoing *outgoing, size_t max_size, uint8_t overload) {
+        /* anything beyond @n_message is zeroed whenever it is taken into use */
+        memset(outgoing->message, 0, outgoing->n_message);
+        memset(&outgoing->userdata, 0, sizeof(outgoing->userdata));
+
+        n_dhcp4_outgoing_init(outgoing, max_size, overload);
+}
+
 /**
  * n_dhcp4_outgoing_free() - Deallocate outgoing message
  * @outgoing:           message to deallocate, or NULL
@@ -117,9 +144,27 @@ NDhcp4Outgoing *n_dhcp4_outgoing_free(NDhcp4Outgoing *outgoing) {
  * initialized to their default values. Hence, you only need to override the
  * fields where the default is not sufficient.
  *
+ * As the caller might modify the header, packet headers cached for this
+ * message are dropped.
+ *
  * Return: A pointer to the message header is returned.
  */
 NDhcp4Header *n_dhcp4_outgoing_get_header(NDhcp4Outgoing *outgoing) {
+        outgoing->headers.valid = false;
+        return &outgoing->message->header;
+}
+
+/**
+ * n_dhcp4_outgoing_peek_header() - Get read-only pointer to the message header
+ * @outgoing:           message to operate on
+ *
+ * This is like n_dhcp4_outgoing_get_header(), but the header cannot be
+ * modified through the returned pointer, so packet headers cached for this
+ * message are kept.
+ *
+ * Return: A pointer to the message header is returned.
+ */
+const NDhcp4Header *n_dhcp4_outgoing_peek_header(NDhcp4Outgoing *outgoing) {
         return &outgoing->message->header;
 }
 
@@ -148,6 +193,70 @@ size_t n_dhcp4_outgoing_get_raw(NDhcp4Outgoing *outgoing, const void **rawp) {
         return outgoing->i_message + 1;
 }
 
+/**
+ * n_dhcp4_outgoing_get_udp_headers() - Get packet headers for the message
+ * @outgoing:           message to operate on
+ * @src_paddr:          source protocol address, see ip(7)
+ * @dest_paddr:         destination protocol address, see ip(7)
+ * @ip_hdrp:            output argument for the IP header
+ * @udp_hdrp:           output argument for the UDP header
+ *
+ * This returns the IP and UDP headers to prepend to the message when sending
+ * it on a packet socket. The headers are cached with the message, and are
+ * valid until the next call.
+ *
+ * Retransmissions usually only change the `secs` and `xid` header fields. If
+ * the message was not modified otherwise since the headers were built for the
+ * same addresses, the UDP checksum is updated incrementally as described in
+ * RFC1624, rather than recomputed over the entire message. The IP header does
+ * not cover the message, so it is reused as is.
+ */
+void n_dhcp4_outgoing_get_udp_headers(NDhcp4Outgoing *outgoing,
+                                      const struct sockaddr_in *src_paddr,
+                                      const struct sockaddr_in *dest_paddr,
+                                      const struct iphdr **ip_hdrp,
+                                      const struct udphdr **udp_hdrp) {
+        NDhcp4Header *header = &outgoing->message->header;
+        const void *buf;
+        size_t n_buf;
+        uint16_t check;
+
+        n_buf = n_dhcp4_outgoing_get_raw(outgoing, &buf);
+
+        if (outgoing->headers.valid &&
+            outgoing->headers.ip.saddr == src_paddr->sin_addr.s_addr &&
+            outgoing->headers.ip.daddr == dest_paddr->sin_addr.s_addr &&
+            outgoing->headers.udp.source == src_paddr->sin_port &&
+            outgoing->headers.udp.dest == dest_paddr->sin_port &&
+            ntohs(outgoing->headers.udp.len) == sizeof(struct udphdr) + n_buf) {
+                check = packet_internet_checksum_update(outgoing->headers.udp.check,
+                                                        &outgoing->headers.xid,
+                                                        &header->xid,
+                                                        sizeof(header->xid));
+                check = packet_internet_checksum_update(check,
+                                                        &outgoing->headers.secs,
+                                                        &header->secs,
+                                                        sizeof(header->secs));
+
+                /* see packet_init_udp() */
+                outgoing->headers.udp.check = check ?: 0xffff;
+        } else {
+                packet_init_udp(&outgoing->headers.ip,
+                                &outgoing->headers.udp,
+                                buf,
+                                n_buf,
+                                src_paddr,
+                                dest_paddr);
+                outgoing->headers.valid = true;
+        }
+
+        outgoing->headers.xid = header->xid;
+        outgoing->headers.secs = header->secs;
+
+        *ip_hdrp = &outgoing->headers.ip;
+        *udp_hdrp = &outgoing->headers.udp;
+}
+
 static void n_dhcp4_outgoing_append_option(NDhcp4Outgoing *outgoing,
                                            uint8_t option,
                                            const void *data,
@@ -202,6 +311,8 @@ int n_dhcp4_outgoing_append(NDhcp4Outgoing *outgoing,
         c_assert(option != N_DHCP4_OPTION_END);
         c_assert(option != N_DHCP4_OPTION_OVERLOAD);
 
+        outgoing->headers.valid = false;
+
         /*
          * If the iterator is on the OPTIONs field, try appending the new blob.
          * We need 2 header-bytes plus @n_data bytes. Additionally, we always
@@ -223,12 +334,16 @@ int n_dhcp4_outgoing_append(NDhcp4Outgoing *outgoing,
                         n = outgoing->n_message + n_data + 128;
                         if (n > outgoing->max_size)
                                 n = outgoing->max_size;
-                        m = realloc(outgoing->message, n);
-                        if (!m)
-                                return -ENOMEM;
+                        if (n > outgoing->n_buffer) {
+                                m = realloc(outgoing->message, n);
+                                if (!m)
+                                        return -ENOMEM;
+
+                                outgoing->message = m;
+                                outgoing->n_buffer = n;
+                        }
 
-                        memset((void *)m + outgoing->i_message, 0, n - outgoing->i_message);
-                        outgoing->message = m;
+                        memset((void *)outgoing->message + outgoing->i_message, 0, n - outgoing->i_message);
                         outgoing->n_message = n;
                         n_dhcp4_outgoing_append_option(outgoing, option, data, n_data);
                         return 0;
@@ -343,7 +458,7 @@ int n_dhcp4_outgoing_append_requested_ip(NDhcp4Outgoing *message, struct in_addr
 }
 
 void n_dhcp4_outgoing_set_secs(NDhcp4Outgoing *message, uint16_t secs) {
-        NDhcp4Header *header = n_dhcp4_outgoing_get_header(message);
+        NDhcp4Header *header = &message->message->header;
 
         /*
          * Some DHCP servers will reject DISCOVER or REQUEST messages if 'secs'
@@ -355,13 +470,13 @@ void n_dhcp4_outgoing_set_secs(NDhcp4Outgoing *message, uint16_t secs) {
 }
 
 void n_dhcp4_outgoing_set_xid(NDhcp4Outgoing *message, uint32_t xid) {
-        NDhcp4Header *header = n_dhcp4_outgoing_get_header(message);
+        NDhcp4Header *header = &message->message->header;
 
         header->xid = xid;
 }
 
 void n_dhcp4_outgoing_get_xid(NDhcp4Outgoing *message, uint32_t *xidp) {
-        NDhcp4Header *header = n_dhcp4_outgoing_get_header(message);
+        NDhcp4Header *header = &message->message->header;
 
         *xidp = header->xid;
 }
@@ -7,25 +7,41 @@
 #include <endian.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <net/ethernet.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
 #include <time.h>
 #include <unistd.h>
 #include <syslog.h>
 #include "n-dhcp4.h"
 
 typedef struct NDhcp4CConnection NDhcp4CConnection;
+typedef struct NDhcp4EventCache NDhcp4EventCache;
 typedef struct NDhcp4CEventNode NDhcp4CEventNode;
+typedef struct NDhcp4CInterface NDhcp4CInterface;
 typedef struct NDhcp4ClientProbeOption NDhcp4ClientProbeOption;
 typedef struct NDhcp4Header NDhcp4Header;
 typedef struct NDhcp4Incoming NDhcp4Incoming;
+typedef struct NDhcp4IncomingOption NDhcp4IncomingOption;
 typedef struct NDhcp4Message NDhcp4Message;
 typedef struct NDhcp4Outgoing NDhcp4Outgoing;
 typedef struct NDhcp4SConnection NDhcp4SConnection;
 typedef struct NDhcp4SConnectionIp NDhcp4SConnectionIp;
 typedef struct NDhcp4SEventNode NDhcp4SEventNode;
+typedef struct NDhcp4SLeaseKey NDhcp4SLeaseKey;
+typedef struct NDhcp4SLeaseTable NDhcp4SLeaseTable;
+typedef struct NDhcp4SPoolReservation NDhcp4SPoolReservation;
+typedef struct NDhcp4SReply NDhcp4SReply;
+typedef struct NDhcp4SocketOffload NDhcp4SocketOffload;
+typedef struct NDhcp4Timer NDhcp4Timer;
+typedef struct NDhcp4TimerWheel NDhcp4TimerWheel;
 typedef struct NDhcp4LogQueue NDhcp4LogQueue;
 
+struct packet_ring;
+
 /* specs */
 
 #define N_DHCP4_NETWORK_IP_MAXIMUM_HEADER_SIZE (60) /* See RFC791 */
@@ -146,9 +162,13 @@ enum {
         N_DHCP4_C_CONNECTION_STATE_CLOSED,
 };
 
+/*
+ * Sockets of clients are registered with epoll by a pointer to the type field
+ * of the object they belong to. Timers are registered with NULL.
+ */
 enum {
-        N_DHCP4_CLIENT_EPOLL_TIMER,
-        N_DHCP4_CLIENT_EPOLL_IO,
+        N_DHCP4_C_EPOLL_CONNECTION,
+        N_DHCP4_C_EPOLL_INTERFACE,
 };
 
 enum {
@@ -172,11 +192,6 @@ enum {
         N_DHCP4_CLIENT_LEASE_STATE_ACKED,
 };
 
-enum {
-        N_DHCP4_SERVER_EPOLL_TIMER,
-        N_DHCP4_SERVER_EPOLL_IO,
-};
-
 enum {
         _N_DHCP4_C_MESSAGE_INVALID = 0,
         N_DHCP4_C_MESSAGE_DISCOVER,
@@ -192,12 +207,21 @@ enum {
 
 struct NDhcp4Outgoing {
         NDhcp4Message *message;
+        size_t n_buffer;
         size_t n_message;
         size_t i_message;
         size_t max_size;
 
         uint8_t overload : 2;
 
+        struct {
+                struct iphdr ip;
+                struct udphdr udp;
+                uint32_t xid;           /* header fields @udp covers */
+                uint16_t secs;
+                bool valid : 1;
+        } headers;                      /* headers of the last packet sent */
+
         struct {
                 uint8_t type;
                 uint8_t message_type;
@@ -214,11 +238,16 @@ struct NDhcp4Outgoing {
 #define N_DHCP4_OUTGOING_NULL(_x) {                                             \
         }
 
+struct NDhcp4IncomingOption {
+        uint8_t code;
+        bool concatenated : 1;          /* @offset is relative to the trailer */
+        uint16_t offset;
+        uint16_t size;
+};
+
 struct NDhcp4Incoming {
-        struct {
-                uint8_t *value;
-                size_t size;
-        } options[_N_DHCP4_OPTION_N];
+        uint64_t present[_N_DHCP4_OPTION_N / 64];       /* bitmap of options */
+        uint8_t rank[_N_DHCP4_OPTION_N / 64];           /* options in preceding words */
 
         struct {
                 uint8_t type;
@@ -226,9 +255,15 @@ struct NDhcp4Incoming {
                 uint64_t base_time;
         } userdata;
 
+        NDhcp4Message *message;         /* message, either @copy or borrowed */
         size_t n_message;
-        NDhcp4Message message;
-        /* @message must be the last member */
+        NDhcp4IncomingOption *options;  /* present options, ordered by code */
+        uint8_t *trailer;               /* space for concatenated options */
+        bool borrowed : 1;              /* @message is owned by the caller */
+        bool owns_index : 1;            /* @options was allocated separately */
+
+        NDhcp4Message copy;
+        /* @copy must be the last member */
 };
 
 #define N_DHCP4_INCOMING_NULL(_x) {                                             \
@@ -238,12 +273,16 @@ struct NDhcp4ClientConfig {
         int ifindex;
         unsigned int transport;
         bool request_broadcast;
+        bool checksum_offload;
+        bool rx_ring;
         uint8_t mac[32]; /* MAX_ADDR_LEN */
         size_t n_mac;
         uint8_t broadcast_mac[32]; /* MAX_ADDR_LEN */
         size_t n_broadcast_mac;
         uint8_t *client_id;
         size_t n_client_id;
+        NDhcp4ClientEventFn event_fn;
+        void *event_userdata;
 };
 
 #define N_DHCP4_CLIENT_CONFIG_NULL(_x) {                                        \
@@ -275,9 +314,26 @@ struct NDhcp4ClientProbeConfig {
                 .ms_start_delay = N_DHCP4_CLIENT_START_DELAY_RFC2131,           \
         }
 
+/*
+ * Event nodes are raised and freed for every transaction. Instead of returning
+ * them to the allocator, freed nodes are kept on a cache of the object that
+ * raised them, and reused by the next event, up to a limit of nodes.
+ */
+struct NDhcp4EventCache {
+        CList node_list;
+        size_t n_nodes;
+        size_t max_nodes;
+};
+
+#define N_DHCP4_EVENT_CACHE_NULL(_x, _max) {                                    \
+                .node_list = C_LIST_INIT((_x).node_list),                       \
+                .max_nodes = (_max),                                            \
+        }
+
 struct NDhcp4CEventNode {
         CList client_link;
         CList probe_link;
+        NDhcp4EventCache *cache;        /* cache to return to, or NULL */
         NDhcp4ClientEvent event;
         bool is_public : 1;
 };
@@ -289,6 +345,7 @@ struct NDhcp4CEventNode {
 
 struct NDhcp4LogQueue {
         CList *event_list;
+        NDhcp4EventCache *event_cache;
         NDhcp4CEventNode nomem_node;
         int log_level;
         bool is_client : 1;
@@ -301,6 +358,7 @@ struct NDhcp4LogQueue {
 
 #define N_DHCP4_LOG_QUEUE_NULL_CLIENT(client) {                                 \
                 .event_list = &((client).event_list),                           \
+                .event_cache = &((client).event_cache),                         \
                 .log_level = -1,                                                \
                 .is_client = true,                                              \
                 .nomem_node = {                                                 \
@@ -318,16 +376,67 @@ struct NDhcp4LogQueue {
                 },                                                              \
         }
 
+/*
+ * Timer wheels count time in ticks of 2^shift nanoseconds, with the shift
+ * chosen per wheel. Each level resolves BITS bits of a tick, and N_LEVELS
+ * levels cover all ticks of a 64-bit nanosecond clock for any shift of at
+ * least MIN_SHIFT.
+ */
+#define N_DHCP4_TIMER_MIN_SHIFT (16)
+#define N_DHCP4_TIMER_BITS (6)
+#define N_DHCP4_TIMER_N_SLOTS (1U << N_DHCP4_TIMER_BITS)
+#define N_DHCP4_TIMER_N_LEVELS ((64 - N_DHCP4_TIMER_MIN_SHIFT + N_DHCP4_TIMER_BITS - 1) / N_DHCP4_TIMER_BITS)
+
+struct NDhcp4Timer {
+        NDhcp4TimerWheel *wheel;
+        CList wheel_link;
+        uint64_t tick;                  /* tick to expire at */
+        uint8_t level;                  /* level of the wheel, or UINT8_MAX if expired */
+        uint8_t slot;                   /* slot within @level */
+};
+
+#define N_DHCP4_TIMER_NULL(_x) {                                                \
+                .wheel_link = C_LIST_INIT((_x).wheel_link),                     \
+        }
+
+struct NDhcp4TimerWheel {
+        unsigned int shift;             /* log2 of the tick length in nanoseconds */
+        uint64_t tick;                  /* current tick */
+        size_t n_timers;                /* number of linked timers */
+        CList pending;                  /* expired timers, not yet popped */
+        uint64_t bitmap[N_DHCP4_TIMER_N_LEVELS];
+        CList slots[N_DHCP4_TIMER_N_LEVELS][N_DHCP4_TIMER_N_SLOTS];
+};
+
+#define N_DHCP4_TIMER_WHEEL_NULL(_x) {                                          \
+                .pending = C_LIST_INIT((_x).pending),                           \
+        }
+
+struct NDhcp4SocketOffload {
+        bool enabled;                   /* packet socket offloads checksums */
+        uint8_t haddr[ETH_ALEN];        /* own hardware address, if enabled */
+};
+
+#define N_DHCP4_SOCKET_OFFLOAD_NULL(_x) {                                       \
+        }
+
 struct NDhcp4CConnection {
+        unsigned int epoll_type;        /* N_DHCP4_C_EPOLL_CONNECTION */
         NDhcp4ClientConfig *client_config;
         NDhcp4ClientProbeConfig *probe_config;
         NDhcp4LogQueue *log_queue;
 
         int fd_epoll;
+        NDhcp4ClientContext *context;   /* context to share packet sockets in, or NULL */
+        NDhcp4CInterface *interface;    /* shared packet socket, or NULL */
+        uint32_t interface_xid;         /* xid indexed on @interface */
+        bool interface_indexed : 1;
 
         unsigned int state;             /* current connection state */
         int fd_packet;                  /* packet socket */
         int fd_udp;                     /* udp socket */
+        NDhcp4SocketOffload offload;    /* packet socket offload */
+        struct packet_ring *ring;       /* packet socket receive ring, or NULL */
 
         NDhcp4Outgoing *request;        /* current request */
 
@@ -337,40 +446,122 @@ struct NDhcp4CConnection {
 };
 
 #define N_DHCP4_C_CONNECTION_NULL(_x) {                                         \
+                .epoll_type = N_DHCP4_C_EPOLL_CONNECTION,                       \
                 .fd_packet = -1,                                                \
                 .fd_udp = -1,                                                   \
         }
 
+/*
+ * Messages are received into the buffer of the client, and parsed in place.
+ * It fits the largest possible message, and the index of its options after
+ * it, so no separate index has to be allocated.
+ */
+#define N_DHCP4_CLIENT_BUF_SIZE (2 * UINT16_MAX)
+
+/* a client rarely has more than a few events queued */
+#define N_DHCP4_CLIENT_EVENT_CACHE_MAX (8)
+
 struct NDhcp4Client {
         unsigned long n_refs;
         NDhcp4ClientConfig *config;
         CList event_list;
+        NDhcp4EventCache event_cache;   /* freed event nodes */
 
         NDhcp4LogQueue log_queue;
 
+        /* borrowed from @context, if set */
+        NDhcp4ClientContext *context;
         int fd_epoll;
         int fd_timer;
+        NDhcp4Timer timer;              /* timeout on the wheel of @context */
 
         uint16_t mtu;
         NDhcp4ClientProbe *current_probe;
         uint64_t scheduled_timeout;
 
+        /* receive buffer, shared by all probes */
+        uint8_t *buf;
+
+        /* probes freed while dispatching, unless borrowed from @context */
+        CList reap_list;
+
         bool preempted : 1;
+        bool dispatching : 1;
 };
 
 #define N_DHCP4_CLIENT_NULL(_x) {                                               \
                 .n_refs = 1,                                                    \
                 .event_list = C_LIST_INIT((_x).event_list),                     \
+                .event_cache = N_DHCP4_EVENT_CACHE_NULL((_x).event_cache,       \
+                                                        N_DHCP4_CLIENT_EVENT_CACHE_MAX), \
                 .fd_epoll = -1,                                                 \
                 .fd_timer = -1,                                                 \
+                .timer = N_DHCP4_TIMER_NULL((_x).timer),                        \
+                .reap_list = C_LIST_INIT((_x).reap_list),                       \
                 .log_queue = N_DHCP4_LOG_QUEUE_NULL_CLIENT(_x),                 \
         }
 
+/* client timeouts are tracked in ticks of 2^20 nanoseconds, about a millisecond */
+#define N_DHCP4_CLIENT_CONTEXT_TIMER_SHIFT (20)
+#define N_DHCP4_CLIENT_CONTEXT_N_EPOLL (16)
+#define N_DHCP4_CLIENT_CONTEXT_N_DISPATCH (128)
+
+struct NDhcp4ClientContext {
+        unsigned long n_refs;
+        NDhcp4TimerWheel timers;        /* timeouts of all clients */
+        CList interface_list;           /* shared packet sockets */
+        CList reap_list;                /* probes freed while dispatching */
+
+        int fd_epoll;
+        int fd_timer;
+        uint64_t scheduled_timeout;
+
+        /* receive buffer, shared by all clients */
+        uint8_t *buf;
+
+        bool dispatching : 1;
+};
+
+#define N_DHCP4_CLIENT_CONTEXT_NULL(_x) {                                       \
+                .n_refs = 1,                                                    \
+                .timers = N_DHCP4_TIMER_WHEEL_NULL((_x).timers),                \
+                .interface_list = C_LIST_INIT((_x).interface_list),             \
+                .reap_list = C_LIST_INIT((_x).reap_list),                       \
+                .fd_epoll = -1,                                                 \
+                .fd_timer = -1,                                                 \
+        }
+
+#define N_DHCP4_C_INTERFACE_MIN_BUCKETS (8)
+
+struct NDhcp4CInterface {
+        unsigned int epoll_type;        /* N_DHCP4_C_EPOLL_INTERFACE */
+        NDhcp4ClientContext *context;
+        CList context_link;
+        unsigned long n_refs;           /* number of listening connections */
+
+        int ifindex;
+        unsigned int flags;             /* flags the socket was requested with */
+        int fd_packet;                  /* packet socket */
+        NDhcp4SocketOffload offload;    /* packet socket offload */
+        struct packet_ring *ring;       /* packet socket receive ring, or NULL */
+
+        NDhcp4CConnection **index;      /* open-addressing index by xid */
+        size_t n_buckets;               /* size of @index, power of two */
+        size_t n_connections;           /* number of indexed connections */
+};
+
+#define N_DHCP4_C_INTERFACE_NULL(_x) {                                          \
+                .epoll_type = N_DHCP4_C_EPOLL_INTERFACE,                        \
+                .context_link = C_LIST_INIT((_x).context_link),                 \
+                .fd_packet = -1,                                                \
+        }
+
 struct NDhcp4ClientProbe {
         NDhcp4ClientProbeConfig *config;
         NDhcp4Client *client;
         CList event_list;
         CList lease_list;
+        CList reap_link;                        /* freed while dispatching */
         void *userdata;
 
         unsigned int state;                     /* current probe state */
@@ -387,6 +578,7 @@ struct NDhcp4ClientProbe {
 #define N_DHCP4_CLIENT_PROBE_NULL(_x) {                                         \
                 .event_list = C_LIST_INIT((_x).event_list),                     \
                 .lease_list = C_LIST_INIT((_x).lease_list),                     \
+                .reap_link = C_LIST_INIT((_x).reap_link),                       \
                 .connection = N_DHCP4_C_CONNECTION_NULL((_x).connection),       \
         }
 
@@ -410,13 +602,22 @@ struct NDhcp4ClientLease {
 
 struct NDhcp4ServerConfig {
         int ifindex;
+        bool reuseport;
+        bool checksum_offload;
+        bool server_id_filter;
+        unsigned int n_steering;
+        uint32_t lease_lifetime;
+        NDhcp4ServerEventFn event_fn;
+        void *event_userdata;
 };
 
 #define N_DHCP4_SERVER_CONFIG_NULL(_x) {                                        \
+                .lease_lifetime = N_DHCP4_SERVER_LEASE_LIFETIME,                \
         }
 
 struct NDhcp4SEventNode {
         CList server_link;
+        NDhcp4EventCache *cache;        /* cache to return to, or NULL */
         NDhcp4ServerEvent event;
         bool is_public : 1;
 };
@@ -425,43 +626,177 @@ struct NDhcp4SEventNode {
                 .server_link = C_LIST_INIT((_x).server_link),                   \
         }
 
+/*
+ * The server receives requests in batches of up to N_BATCH datagrams per
+ * syscall. Each datagram gets a slot of SLOT bytes in the scratch buffer,
+ * which is large enough for unfragmented requests on jumbo-frame links.
+ * Larger datagrams are dropped as truncated.
+ */
+#define N_DHCP4_S_CONNECTION_N_BATCH (16)
+#define N_DHCP4_S_CONNECTION_SLOT (9216)
+#define N_DHCP4_S_CONNECTION_BUF_SIZE (N_DHCP4_S_CONNECTION_N_BATCH * N_DHCP4_S_CONNECTION_SLOT)
+
+/*
+ * Replies are queued during a dispatch round and flushed at its end, so one
+ * round of requests costs a single send syscall per socket.
+ */
+#define N_DHCP4_S_CONNECTION_N_REPLIES (128)
+
+/*
+ * Server addresses are indexed by address in an open-addressing hash table,
+ * as every REQUEST is checked against them.
+ */
+#define N_DHCP4_S_CONNECTION_MIN_IP_BUCKETS (16)
+
+struct NDhcp4SReply {
+        NDhcp4Outgoing *message;        /* reply message */
+        struct in_addr src;             /* server address */
+        struct in_addr dest;            /* client or relay address */
+        const uint8_t *haddr;           /* client hardware address, or NULL */
+        uint8_t halen;                  /* length of @haddr */
+};
+
 struct NDhcp4SConnection {
         int ifindex;                    /* interface index */
         int fd_packet;                  /* packet socket */
         int fd_udp;                     /* udp socket */
-        uint8_t buf[UINT16_MAX];        /* scratch recevie buffer */
-
-        /* XXX: support a set of server addresses */
-        NDhcp4SConnectionIp *ip;        /* server IP address, or NULL */
+        NDhcp4SocketOffload offload;    /* packet socket offload */
+        bool filter_server_id;          /* udp socket filters server identifiers */
+        bool own_buf;                   /* @buf is owned by the connection */
+
+        /* scratch receive buffer, split into one slot per datagram */
+        uint8_t *buf;
+
+        /* verified messages of the current batch, borrowed from @buf */
+        NDhcp4Incoming batch[N_DHCP4_S_CONNECTION_N_BATCH];
+        size_t i_batch;
+        size_t n_batch;
+
+        /* replies queued for sending, not yet flushed */
+        NDhcp4SReply replies[N_DHCP4_S_CONNECTION_N_REPLIES];
+        size_t n_replies;
+
+        /* sent replies, kept to build further replies in */
+        NDhcp4Outgoing *cache[N_DHCP4_S_CONNECTION_N_REPLIES];
+        size_t n_cache;
+
+        /* server addresses, in the order they were linked */
+        CList ip_list;
+        NDhcp4SConnectionIp **ip_index; /* open-addressing index by address */
+        size_t n_ip_buckets;            /* size of @ip_index, power of two */
+        size_t n_ips;                   /* number of entries in @ip_list */
+        uint64_t ip_serial;             /* bumped whenever @ip_list changes */
 };
 
 #define N_DHCP4_S_CONNECTION_NULL(_x) {                                         \
                 .fd_packet = -1,                                                \
                 .fd_udp = -1,                                                   \
+                .ip_list = C_LIST_INIT((_x).ip_list),                           \
         }
 
 struct NDhcp4SConnectionIp {
         NDhcp4SConnection *connection;
+        CList connection_link;
         struct in_addr ip;
 };
 
 #define N_DHCP4_S_CONNECTION_IP_NULL(_x) {                                      \
-}
+                .connection_link = C_LIST_INIT((_x).connection_link),           \
+        }
+
+/*
+ * Server leases are identified by the client identifier option, if the client
+ * sent one, or by its hardware address otherwise. Leases in quarantine no
+ * longer belong to a client, and are identified by their address instead. The
+ * key stores any form prefixed by its type, so they can never compare equal.
+ */
+#define N_DHCP4_S_LEASE_KEY_MAX (1 + 255)
+
+enum {
+        N_DHCP4_S_LEASE_KEY_CLIENT_ID,
+        N_DHCP4_S_LEASE_KEY_HWADDR,
+        N_DHCP4_S_LEASE_KEY_QUARANTINE,
+};
+
+struct NDhcp4SLeaseKey {
+        uint8_t n_key;                  /* length of @key, excluding the type */
+        uint8_t key[N_DHCP4_S_LEASE_KEY_MAX]; /* type, followed by the key */
+};
+
+#define N_DHCP4_S_LEASE_TABLE_MIN_BUCKETS (64)
+
+struct NDhcp4SLeaseTable {
+        uint8_t seed[16];               /* siphash seed */
+        NDhcp4ServerLease **by_key;     /* open-addressing index by key */
+        NDhcp4ServerLease **by_address; /* open-addressing index by address */
+        size_t n_buckets;               /* size of either index, power of two */
+        size_t n_leases;                /* number of leases in @by_key */
+        size_t n_addresses;             /* number of leases in @by_address */
+};
+
+#define N_DHCP4_S_LEASE_TABLE_NULL(_x) {                                        \
+        }
+
+/* lease expiry is tracked in ticks of 2^30 nanoseconds, a bit more than a second */
+#define N_DHCP4_SERVER_TIMER_SHIFT (30)
+#define N_DHCP4_SERVER_N_EPOLL (16)
+#define N_DHCP4_SERVER_N_DISPATCH (128)
+
+/* a dispatch round raises at most an event per dispatched request */
+#define N_DHCP4_SERVER_EVENT_CACHE_MAX N_DHCP4_SERVER_N_DISPATCH
 
 struct NDhcp4Server {
         unsigned long n_refs;
         CList event_list;
-        CList lease_list;
+        NDhcp4EventCache event_cache;   /* freed event nodes */
+        CList pool_list;
+        CList interface_list;
+        CList reap_list;                /* interfaces freed while dispatching */
+        NDhcp4SLeaseTable leases;
+        NDhcp4TimerWheel timers;        /* expiry of all linked leases */
 
         bool preempted : 1;
+        bool dispatching : 1;
 
-        NDhcp4SConnection connection;
+        int fd_epoll;
+        int fd_timer;
+        uint64_t scheduled_timeout;
+        unsigned int flags;             /* socket flags of new interfaces */
+        unsigned int n_steering;        /* reuseport steering of new interfaces */
+        uint32_t lease_lifetime;        /* lifetime of assigned addresses, in seconds */
+        NDhcp4ServerEventFn event_fn;   /* delivers events inline, or NULL */
+        void *event_userdata;
+
+        /* receive buffer shared by all interfaces, see n_dhcp4_s_connection_init() */
+        uint8_t *buf;
+
+        /* interface of the configuration, owned by the server */
+        NDhcp4ServerInterface *interface;
 };
 
 #define N_DHCP4_SERVER_NULL(_x) {                                               \
                 .n_refs = 1,                                                    \
                 .event_list = C_LIST_INIT((_x).event_list),                     \
-                .lease_list = C_LIST_INIT((_x).lease_list),                     \
+                .event_cache = N_DHCP4_EVENT_CACHE_NULL((_x).event_cache,       \
+                                                        N_DHCP4_SERVER_EVENT_CACHE_MAX), \
+                .pool_list = C_LIST_INIT((_x).pool_list),                       \
+                .interface_list = C_LIST_INIT((_x).interface_list),             \
+                .reap_list = C_LIST_INIT((_x).reap_list),                       \
+                .leases = N_DHCP4_S_LEASE_TABLE_NULL((_x).leases),              \
+                .timers = N_DHCP4_TIMER_WHEEL_NULL((_x).timers),                \
+                .fd_epoll = -1,                                                 \
+                .fd_timer = -1,                                                 \
+                .lease_lifetime = N_DHCP4_SERVER_LEASE_LIFETIME,                \
+        }
+
+struct NDhcp4ServerInterface {
+        NDhcp4Server *server;
+        CList server_link;
+        NDhcp4SConnection connection;
+};
+
+#define N_DHCP4_SERVER_INTERFACE_NULL(_x) {                                     \
+                .server_link = C_LIST_INIT((_x).server_link),                   \
                 .connection = N_DHCP4_S_CONNECTION_NULL((_x).connection),       \
         }
 
@@ -473,28 +808,96 @@ struct NDhcp4ServerIp {
                 .ip = N_DHCP4_S_CONNECTION_IP_NULL((_x).ip),                    \
         }
 
+/*
+ * Address pools track the state of every address of a subnet in bitmaps. The
+ * free addresses are additionally indexed by a hierarchy of summary bitmaps,
+ * where each bit tells whether the corresponding word of the level below has
+ * any bit set. Finding a free address thus takes one word per level, and the
+ * smallest supported subnet needs four levels.
+ */
+#define N_DHCP4_S_POOL_MIN_PREFIXLEN (8)
+#define N_DHCP4_S_POOL_MAX_LEVELS (4)
+
+struct NDhcp4SPoolReservation {
+        uint8_t halen;                  /* length of @haddr */
+        uint8_t haddr[16];              /* client hardware address */
+        struct in_addr address;         /* reserved address */
+};
+
+struct NDhcp4ServerPool {
+        NDhcp4Server *server;
+        CList server_link;
+
+        uint32_t base;                  /* subnet address, host order */
+        uint32_t n_addresses;           /* number of addresses in the subnet */
+        size_t n_words;                 /* number of words per bitmap */
+
+        uint64_t *in_range;             /* addresses covered by a range */
+        uint64_t *excluded;             /* addresses excluded from all ranges */
+        uint64_t *reserved;             /* addresses reserved for a client */
+        uint64_t *allocated;            /* addresses handed out dynamically */
+
+        /* free addresses, followed by the summary levels */
+        uint64_t *levels[N_DHCP4_S_POOL_MAX_LEVELS];
+        size_t n_levels;
+
+        /* reservations, sorted by hardware address */
+        NDhcp4SPoolReservation *reservations;
+        size_t n_reservations;
+
+        /* server address on the subnet, valid while @ip_serial of @ip_connection is current */
+        NDhcp4SConnection *ip_connection;
+        NDhcp4SConnectionIp *ip;
+        uint64_t ip_serial;
+};
+
+#define N_DHCP4_SERVER_POOL_NULL(_x) {                                          \
+                .server_link = C_LIST_INIT((_x).server_link),                   \
+        }
+
+/* default lifetime of assigned addresses, in seconds */
+#define N_DHCP4_SERVER_LEASE_LIFETIME (3600)
+
+/* time leases are kept after the latest request of their client, in seconds */
+#define N_DHCP4_SERVER_LEASE_HOLD (120)
+
+/* time declined addresses are withheld from all clients, in seconds */
+#define N_DHCP4_SERVER_LEASE_QUARANTINE (86400)
+
 struct NDhcp4ServerLease {
         unsigned long n_refs;
 
         NDhcp4Server *server;
-        CList server_link;
+        NDhcp4SConnection *connection;  /* interface of the latest request */
+        uint64_t hash;                  /* hash of @key in the lease table */
+        NDhcp4SLeaseKey key;            /* client the lease belongs to */
+        struct in_addr address;         /* assigned address, or INADDR_ANY */
+        uint64_t expiry;                /* time the lease is reclaimed at */
+        NDhcp4Timer timer;              /* expiry timer, while linked */
 
         NDhcp4Incoming *request;
-        NDhcp4Incoming *reply;
+        NDhcp4Outgoing *reply;          /* reply being built, or NULL */
 };
 
 #define N_DHCP4_SERVER_LEASE_NULL(_x) {                                         \
                 .n_refs = 1,                                                    \
-                .server_link = C_LIST_INIT((_x).server_link),                   \
+                .timer = N_DHCP4_TIMER_NULL((_x).timer),                        \
         }
 
 /* outgoing messages */
 
 int n_dhcp4_outgoing_new(NDhcp4Outgoing **outgoingp, size_t max_size, uint8_t overload);
 NDhcp4Outgoing *n_dhcp4_outgoing_free(NDhcp4Outgoing *outgoing);
+void n_dhcp4_outgoing_reset(NDhcp4Outgoing *outgoing, size_t max_size, uint8_t overload);
 
 NDhcp4Header *n_dhcp4_outgoing_get_header(NDhcp4Outgoing *outgoing);
+const NDhcp4Header *n_dhcp4_outgoing_peek_header(NDhcp4Outgoing *outgoing);
 size_t n_dhcp4_outgoing_get_raw(NDhcp4Outgoing *outgoing, const void **rawp);
+void n_dhcp4_outgoing_get_udp_headers(NDhcp4Outgoing *outgoing,
+                                      const struct sockaddr_in *src_paddr,
+                                      const struct sockaddr_in *dest_paddr,
+                                      const struct iphdr **ip_hdrp,
+                                      const struct udphdr **udp_hdrp);
 int n_dhcp4_outgoing_append(NDhcp4Outgoing *outgoing, uint8_t option, const void *data, uint8_t n_data);
 
 int n_dhcp4_outgoing_append_t1(NDhcp4Outgoing *message, uint32_t t1);
@@ -513,6 +916,9 @@ void n_dhcp4_outgoing_get_xid(NDhcp4Outgoing *message, uint32_t *xidp);
 
 int n_dhcp4_incoming_new(NDhcp4Incoming **incomingp, const void *raw, size_t n_raw);
 NDhcp4Incoming *n_dhcp4_incoming_free(NDhcp4Incoming *incoming);
+int n_dhcp4_incoming_init_borrowed(NDhcp4Incoming *incoming, void *buf, size_t n_buf, size_t n_raw);
+void n_dhcp4_incoming_deinit(NDhcp4Incoming *incoming);
+int n_dhcp4_incoming_dup(NDhcp4Incoming **dupp, NDhcp4Incoming *incoming);
 
 NDhcp4Header *n_dhcp4_incoming_get_header(NDhcp4Incoming *incoming);
 size_t n_dhcp4_incoming_get_raw(NDhcp4Incoming *incoming, const void **rawp);
@@ -531,15 +937,34 @@ void n_dhcp4_incoming_get_yiaddr(NDhcp4Incoming *message, struct in_addr *yiaddr
 
 /* sockets */
 
-int n_dhcp4_c_socket_packet_new(int *sockfdp, int ifindex);
+#define N_DHCP4_S_SOCKET_MAX_BATCH (64)
+#define N_DHCP4_S_SOCKET_MAX_FILTER_IDS (32)
+#define N_DHCP4_S_SOCKET_N_FILTER_OPTIONS (16)
+
+enum {
+        N_DHCP4_S_SOCKET_FLAG_REUSEPORT                 = (1U << 0),
+        N_DHCP4_SOCKET_FLAG_VNET_HDR                    = (1U << 1),
+        N_DHCP4_C_SOCKET_FLAG_RX_RING                   = (1U << 2),
+        N_DHCP4_S_SOCKET_FLAG_SERVER_ID                 = (1U << 3),
+};
+
+int n_dhcp4_c_socket_packet_new(int *sockfdp,
+                                int ifindex,
+                                unsigned int flags,
+                                NDhcp4SocketOffload *offloadp,
+                                struct packet_ring **ringp);
+int n_dhcp4_c_socket_packet_filter(int sockfd, const NDhcp4SocketOffload *offload, const NDhcp4Header *match);
 int n_dhcp4_c_socket_udp_new(int *sockfdp,
                              int ifindex,
                              const struct in_addr *client_addr,
                              const struct in_addr *server_addr);
-int n_dhcp4_s_socket_packet_new(int *sockfdp);
-int n_dhcp4_s_socket_udp_new(int *sockfdp, int ifindex);
+int n_dhcp4_s_socket_packet_new(int *sockfdp, int ifindex, unsigned int flags, NDhcp4SocketOffload *offloadp);
+int n_dhcp4_s_socket_udp_new(int *sockfdp, int ifindex, unsigned int flags);
+int n_dhcp4_s_socket_udp_filter(int sockfd, const struct in_addr *ids, size_t n_ids);
+int n_dhcp4_s_socket_udp_steer(int sockfd, unsigned int n_sockets);
 
 int n_dhcp4_c_socket_packet_send(int sockfd,
+                                 const NDhcp4SocketOffload *offload,
                                  int ifindex,
                                  const unsigned char *dest_haddr,
                                  unsigned char halen,
@@ -547,6 +972,7 @@ int n_dhcp4_c_socket_packet_send(int sockfd,
 int n_dhcp4_c_socket_udp_send(int sockfd, NDhcp4Outgoing *message);
 int n_dhcp4_c_socket_udp_broadcast(int sockfd, NDhcp4Outgoing *message);
 int n_dhcp4_s_socket_packet_send(int sockfd,
+                                 const NDhcp4SocketOffload *offload,
                                  int ifindex,
                                  const struct in_addr *src_inaddr,
                                  const unsigned char *dest_haddr,
@@ -560,20 +986,37 @@ int n_dhcp4_s_socket_udp_send(int sockfd,
 int n_dhcp4_s_socket_udp_broadcast(int sockfd,
                                    const struct in_addr *inaddr_src,
                                    NDhcp4Outgoing *message);
+int n_dhcp4_s_socket_packet_send_batch(int sockfd,
+                                       const NDhcp4SocketOffload *offload,
+                                       int ifindex,
+                                       NDhcp4SReply *replies,
+                                       size_t n_replies);
+int n_dhcp4_s_socket_udp_send_batch(int sockfd,
+                                    NDhcp4SReply *replies,
+                                    size_t n_replies);
 
 int n_dhcp4_c_socket_packet_recv(int sockfd,
+                                 const NDhcp4SocketOffload *offload,
+                                 struct packet_ring *ring,
                                  uint8_t *buf,
                                  size_t n_buf,
-                                 NDhcp4Incoming **messagep);
+                                 NDhcp4Incoming *message);
 int n_dhcp4_c_socket_udp_recv(int sockfd,
                               uint8_t *buf,
                               size_t n_buf,
-                              NDhcp4Incoming **messagep);
+                              NDhcp4Incoming *message);
 int n_dhcp4_s_socket_udp_recv(int sockfd,
                               uint8_t *buf,
                               size_t n_buf,
                               NDhcp4Incoming **messagep,
                               struct sockaddr_in *dest);
+int n_dhcp4_s_socket_udp_recv_batch(int sockfd,
+                                    uint8_t *buf,
+                                    size_t n_slot,
+                                    size_t n_batch,
+                                    NDhcp4Incoming *messages,
+                                    struct sockaddr_in *dests,
+                                    size_t *n_messagesp);
 
 /* client configs */
 
@@ -588,7 +1031,7 @@ uint32_t n_dhcp4_client_probe_config_get_random(NDhcp4ClientProbeConfig *config)
 
 /* client events */
 
-int n_dhcp4_c_event_node_new(NDhcp4CEventNode **nodep);
+int n_dhcp4_c_event_node_new(NDhcp4CEventNode **nodep, NDhcp4EventCache *cache);
 NDhcp4CEventNode *n_dhcp4_c_event_node_free(NDhcp4CEventNode *node);
 
 /* client connections */
@@ -597,6 +1040,7 @@ int n_dhcp4_c_connection_init(NDhcp4CConnection *connection,
                               NDhcp4ClientConfig *client_config,
                               NDhcp4ClientProbeConfig *probe_config,
                               NDhcp4LogQueue *log_queue,
+                              NDhcp4ClientContext *context,
                               int fd_epoll);
 void n_dhcp4_c_connection_deinit(NDhcp4CConnection *connection);
 
@@ -637,12 +1081,38 @@ int n_dhcp4_c_connection_start_request(NDhcp4CConnection *connection,
 int n_dhcp4_c_connection_dispatch_timer(NDhcp4CConnection *connection,
                                         uint64_t timestamp);
 int n_dhcp4_c_connection_dispatch_io(NDhcp4CConnection *connection,
+                                     uint8_t *buf,
+                                     size_t n_buf,
                                      NDhcp4Incoming **messagep);
+int n_dhcp4_c_connection_dispatch_incoming(NDhcp4CConnection *connection,
+                                           NDhcp4Incoming *message,
+                                           NDhcp4Incoming **messagep);
+
+/* client interfaces */
+
+NDhcp4CInterface *n_dhcp4_c_interface_free(NDhcp4CInterface *interface);
+
+int n_dhcp4_c_interface_acquire(NDhcp4CInterface **interfacep,
+                                NDhcp4ClientContext *context,
+                                int ifindex,
+                                unsigned int flags);
+void n_dhcp4_c_interface_release(NDhcp4CInterface *interface);
+
+int n_dhcp4_c_interface_link(NDhcp4CInterface *interface, NDhcp4CConnection *connection, uint32_t xid);
+void n_dhcp4_c_interface_unlink(NDhcp4CInterface *interface, NDhcp4CConnection *connection);
+NDhcp4CConnection *n_dhcp4_c_interface_find(NDhcp4CInterface *interface, const NDhcp4Header *header);
+
+int n_dhcp4_c_interface_dispatch(NDhcp4CInterface *interface,
+                                 uint8_t *buf,
+                                 size_t n_buf,
+                                 NDhcp4Incoming *message,
+                                 NDhcp4CConnection **connectionp);
 
 /* clients */
 
 int n_dhcp4_client_raise(NDhcp4Client *client, NDhcp4CEventNode **nodep, unsigned int event);
 void n_dhcp4_client_arm_timer(NDhcp4Client *client);
+CList *n_dhcp4_client_get_reap_list(NDhcp4Client *client);
 
 /* client probes */
 
@@ -651,10 +1121,12 @@ int n_dhcp4_client_probe_new(NDhcp4ClientProbe **probep,
                              NDhcp4Client *client,
                              uint64_t ns_now);
 
-int n_dhcp4_client_probe_raise(NDhcp4ClientProbe *probe, NDhcp4CEventNode **nodep, unsigned int event);
+void n_dhcp4_client_probe_reap(CList *reap_list);
+int n_dhcp4_client_probe_emit(NDhcp4ClientProbe *probe, unsigned int type, NDhcp4ClientLease *lease);
 void n_dhcp4_client_probe_get_timeout(NDhcp4ClientProbe *probe, uint64_t *timeoutp);
 int n_dhcp4_client_probe_dispatch_timer(NDhcp4ClientProbe *probe, uint64_t ns_now);
 int n_dhcp4_client_probe_dispatch_io(NDhcp4ClientProbe *probe, uint32_t events);
+int n_dhcp4_client_probe_dispatch_incoming(NDhcp4ClientProbe *probe, NDhcp4Incoming *message);
 int n_dhcp4_client_probe_transition_select(NDhcp4ClientProbe *probe, NDhcp4Incoming *offer, uint64_t ns_now);
 int n_dhcp4_client_probe_transition_accept(NDhcp4ClientProbe *probe, NDhcp4Incoming *ack);
 int n_dhcp4_client_probe_transition_decline(NDhcp4ClientProbe *probe, NDhcp4Incoming *offer, const char *error, uint64_t ns_now);
@@ -666,13 +1138,97 @@ int n_dhcp4_client_lease_new(NDhcp4ClientLease **leasep, NDhcp4Incoming *message
 void n_dhcp4_client_lease_link(NDhcp4ClientLease *lease, NDhcp4ClientProbe *probe);
 void n_dhcp4_client_lease_unlink(NDhcp4ClientLease *lease);
 
+/* servers */
+
+int n_dhcp4_s_event_node_new(NDhcp4SEventNode **nodep, NDhcp4EventCache *cache);
+NDhcp4SEventNode *n_dhcp4_s_event_node_free(NDhcp4SEventNode *node);
+
+int n_dhcp4_server_raise(NDhcp4Server *server, NDhcp4SEventNode **nodep, unsigned int event);
+
+/* server interfaces */
+
+void n_dhcp4_server_interface_unlink(NDhcp4ServerInterface *interface);
+
+/* server leases */
+
+int n_dhcp4_server_lease_new(NDhcp4ServerLease **leasep, NDhcp4Incoming *message);
+int n_dhcp4_server_lease_link(NDhcp4ServerLease *lease, NDhcp4Server *server);
+void n_dhcp4_server_lease_unlink(NDhcp4ServerLease *lease);
+void n_dhcp4_server_lease_detach(NDhcp4ServerLease *lease);
+void n_dhcp4_server_lease_hold(NDhcp4ServerLease *lease, uint64_t ns_now);
+void n_dhcp4_server_lease_quarantine(NDhcp4ServerLease *lease, uint64_t ns_now);
+void n_dhcp4_server_lease_release(NDhcp4ServerLease *lease);
+
+/* server pools */
+
+int n_dhcp4_server_pool_new(NDhcp4ServerPool **poolp, struct in_addr subnet, unsigned int prefixlen);
+void n_dhcp4_server_pool_link(NDhcp4ServerPool *pool, NDhcp4Server *server);
+void n_dhcp4_server_pool_unlink(NDhcp4ServerPool *pool);
+
+bool n_dhcp4_server_pool_includes(NDhcp4ServerPool *pool, struct in_addr address);
+int n_dhcp4_server_pool_find_reservation(NDhcp4ServerPool *pool,
+                                         const uint8_t *haddr,
+                                         uint8_t halen,
+                                         struct in_addr *addressp);
+int n_dhcp4_server_pool_allocate(NDhcp4ServerPool *pool, struct in_addr *addressp);
+int n_dhcp4_server_pool_claim(NDhcp4ServerPool *pool, struct in_addr address);
+void n_dhcp4_server_pool_release(NDhcp4ServerPool *pool, struct in_addr address);
+
+/* server lease tables */
+
+int n_dhcp4_s_lease_key_init(NDhcp4SLeaseKey *key, NDhcp4Incoming *message);
+
+void n_dhcp4_s_lease_table_init(NDhcp4SLeaseTable *table);
+void n_dhcp4_s_lease_table_deinit(NDhcp4SLeaseTable *table);
+
+int n_dhcp4_s_lease_table_link(NDhcp4SLeaseTable *table, NDhcp4ServerLease *lease);
+void n_dhcp4_s_lease_table_unlink(NDhcp4SLeaseTable *table, NDhcp4ServerLease *lease);
+int n_dhcp4_s_lease_table_set_address(NDhcp4SLeaseTable *table,
+                                      NDhcp4ServerLease *lease,
+                                      struct in_addr address);
+void n_dhcp4_s_lease_table_rekey(NDhcp4SLeaseTable *table,
+                                 NDhcp4ServerLease *lease,
+                                 const NDhcp4SLeaseKey *key);
+
+NDhcp4ServerLease *n_dhcp4_s_lease_table_find(NDhcp4SLeaseTable *table, const NDhcp4SLeaseKey *key);
+NDhcp4ServerLease *n_dhcp4_s_lease_table_find_address(NDhcp4SLeaseTable *table, struct in_addr address);
+
+/* timer wheels */
+
+void n_dhcp4_timer_wheel_init(NDhcp4TimerWheel *wheel, unsigned int shift, uint64_t now);
+void n_dhcp4_timer_wheel_deinit(NDhcp4TimerWheel *wheel);
+
+void n_dhcp4_timer_wheel_get_timeout(NDhcp4TimerWheel *wheel, uint64_t *timeoutp);
+NDhcp4Timer *n_dhcp4_timer_wheel_pop(NDhcp4TimerWheel *wheel, uint64_t now);
+
+void n_dhcp4_timer_link(NDhcp4Timer *timer, NDhcp4TimerWheel *wheel, uint64_t deadline);
+void n_dhcp4_timer_unlink(NDhcp4Timer *timer);
+
+int n_dhcp4_timerfd_new(int *fdp);
+void n_dhcp4_timerfd_arm(int fd_timer, uint64_t timeout);
+int n_dhcp4_timerfd_read(int fd_timer, struct epoll_event *event);
+
 /* server connections */
 
-int n_dhcp4_s_connection_init(NDhcp4SConnection *connection, int ifindex);
+int n_dhcp4_s_connection_init(NDhcp4SConnection *connection, int ifindex, unsigned int flags, uint8_t *buf);
 void n_dhcp4_s_connection_deinit(NDhcp4SConnection *connection);
 
 void n_dhcp4_s_connection_get_fd(NDhcp4SConnection *connection, int *fdp);
+int n_dhcp4_s_connection_steer(NDhcp4SConnection *connection, unsigned int n_workers);
 int n_dhcp4_s_connection_dispatch_io(NDhcp4SConnection *connection, NDhcp4Incoming **messagep);
+void n_dhcp4_s_connection_flush_batch(NDhcp4SConnection *connection);
+
+int n_dhcp4_s_connection_reply_new(NDhcp4SConnection *connection,
+                                   NDhcp4Outgoing **messagep,
+                                   NDhcp4Incoming *request,
+                                   uint8_t type,
+                                   const struct in_addr *server_address);
+void n_dhcp4_s_connection_reply_set_type(NDhcp4Outgoing *message, uint8_t type);
+void n_dhcp4_s_connection_reply_set_server_identifier(NDhcp4Outgoing *message, struct in_addr addr);
+int n_dhcp4_s_connection_reply_set_yiaddr(NDhcp4Outgoing *message,
+                                          uint32_t yiaddr,
+                                          uint32_t lifetime);
+void n_dhcp4_s_connection_recycle_reply(NDhcp4SConnection *connection, NDhcp4Outgoing *message);
 
 int n_dhcp4_s_connection_offer_new(NDhcp4SConnection *connection,
                                    NDhcp4Outgoing **replyp,
@@ -694,15 +1250,24 @@ int n_dhcp4_s_connection_nak_new(NDhcp4SConnection *connection,
 int n_dhcp4_s_connection_send_reply(NDhcp4SConnection *connection,
                                     const struct in_addr *server_addr,
                                     NDhcp4Outgoing *reply);
+int n_dhcp4_s_connection_queue_reply(NDhcp4SConnection *connection,
+                                     const struct in_addr *server_addr,
+                                     NDhcp4Outgoing *reply);
+int n_dhcp4_s_connection_flush_replies(NDhcp4SConnection *connection);
 
 /* server connection ips */
 
 void n_dhcp4_s_connection_ip_init(NDhcp4SConnectionIp *ip, struct in_addr addr);
 void n_dhcp4_s_connection_ip_deinit(NDhcp4SConnectionIp *ip);
 
-void n_dhcp4_s_connection_ip_link(NDhcp4SConnectionIp *ip, NDhcp4SConnection *connection);
+int n_dhcp4_s_connection_ip_link(NDhcp4SConnectionIp *ip, NDhcp4SConnection *connection);
 void n_dhcp4_s_connection_ip_unlink(NDhcp4SConnectionIp *ip);
 
+NDhcp4SConnectionIp *n_dhcp4_s_connection_find_ip(NDhcp4SConnection *connection, struct in_addr addr);
+NDhcp4SConnectionIp *n_dhcp4_s_connection_find_subnet_ip(NDhcp4SConnection *connection,
+                                                         uint32_t base,
+                                                         uint32_t n_addresses);
+
 /* inline helpers */
 
 static inline void n_dhcp4_outgoing_freep(NDhcp4Outgoing **outgoing) {
@@ -715,6 +1280,11 @@ static inline void n_dhcp4_incoming_freep(NDhcp4Incoming **incoming) {
                 n_dhcp4_incoming_free(*incoming);
 }
 
+static inline void n_dhcp4_c_interface_freep(NDhcp4CInterface **interface) {
+        if (*interface)
+                n_dhcp4_c_interface_free(*interface);
+}
+
 static inline uint64_t n_dhcp4_gettime(clockid_t clock) {
         struct timespec ts;
         int r;
@@ -725,6 +1295,28 @@ static inline uint64_t n_dhcp4_gettime(clockid_t clock) {
         return ts.tv_sec * 1000ULL * 1000ULL * 1000ULL + ts.tv_nsec;
 }
 
+/* nodes are kept on the cache by their link on the object that raised them */
+static inline CList *n_dhcp4_event_cache_pop(NDhcp4EventCache *cache) {
+        CList *link;
+
+        if (!cache || !cache->n_nodes)
+                return NULL;
+
+        link = cache->node_list.next;
+        c_list_unlink(link);
+        --cache->n_nodes;
+        return link;
+}
+
+static inline bool n_dhcp4_event_cache_push(NDhcp4EventCache *cache, CList *link) {
+        if (!cache || cache->n_nodes >= cache->max_nodes)
+                return false;
+
+        c_list_link_tail(&cache->node_list, link);
+        ++cache->n_nodes;
+        return true;
+}
+
 void n_dhcp4_log_queue_fmt(NDhcp4LogQueue *log_queue,
                            int level,
                            const char *fmt,
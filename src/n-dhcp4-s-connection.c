@@ -15,26 +15,107 @@
 #include "n-dhcp4-private.h"
 #include "util/packet.h"
 
-int n_dhcp4_s_connection_init(NDhcp4SConnection *connection, int ifindex) {
+/**
+ * n_dhcp4_s_connection_init() - initialize server connection
+ * @connection:         connection to operate on
+ * @ifindex:            interface index to serve
+ * @flags:              socket flags
+ * @buf:                receive buffer of N_DHCP4_S_CONNECTION_BUF_SIZE bytes, or NULL
+ *
+ * This opens the sockets of a server connection on the given interface. The
+ * connection receives into @buf, which is borrowed and must outlive it. The
+ * same buffer may be shared by several connections, as long as the caller
+ * does not interleave their dispatching: once a connection received a batch,
+ * n_dhcp4_s_connection_dispatch_io() must be called until the batch is
+ * exhausted before another connection sharing the buffer is dispatched. If
+ * @buf is NULL, the connection allocates a buffer of its own.
+ *
+ * On failure, the connection must still be deinitialized by the caller.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int n_dhcp4_s_connection_init(NDhcp4SConnection *connection, int ifindex, unsigned int flags, uint8_t *buf) {
         int r;
 
         *connection = (NDhcp4SConnection)N_DHCP4_S_CONNECTION_NULL(*connection);
 
-        r = n_dhcp4_s_socket_packet_new(&connection->fd_packet);
+        if (buf) {
+                connection->buf = buf;
+        } else {
+                connection->buf = malloc(N_DHCP4_S_CONNECTION_BUF_SIZE);
+                if (!connection->buf)
+                        return -ENOMEM;
+
+                connection->own_buf = true;
+        }
+
+        r = n_dhcp4_s_socket_packet_new(&connection->fd_packet, ifindex, flags, &connection->offload);
         if (r)
                 return r;
 
-        r = n_dhcp4_s_socket_udp_new(&connection->fd_udp, ifindex);
+        r = n_dhcp4_s_socket_udp_new(&connection->fd_udp, ifindex, flags);
         if (r)
                 return r;
 
         connection->ifindex = ifindex;
+        connection->filter_server_id = !!(flags & N_DHCP4_S_SOCKET_FLAG_SERVER_ID);
 
         return 0;
 }
 
+/**
+ * n_dhcp4_s_connection_flush_batch() - drop the rest of the current batch
+ * @connection:         connection to operate on
+ *
+ * This drops all messages of the current batch that were not dispatched yet,
+ * so the receive buffer of @connection is no longer in use.
+ */
+void n_dhcp4_s_connection_flush_batch(NDhcp4SConnection *connection) {
+        for (size_t i = connection->i_batch; i < connection->n_batch; ++i)
+                n_dhcp4_incoming_deinit(&connection->batch[i]);
+
+        connection->i_batch = 0;
+        connection->n_batch = 0;
+}
+
+/**
+ * n_dhcp4_s_connection_recycle_reply() - release a reply for reuse
+ * @connection:         connection to operate on
+ * @message:            reply to release, or NULL
+ *
+ * This takes ownership of @message, which must have been created on
+ * @connection, and keeps it for the next reply built on the connection. If
+ * enough replies are kept already, @message is freed.
+ */
+void n_dhcp4_s_connection_recycle_reply(NDhcp4SConnection *connection, NDhcp4Outgoing *message) {
+        if (!message)
+                return;
+
+        if (connection->n_cache < N_DHCP4_S_CONNECTION_N_REPLIES)
+                connection->cache[connection->n_cache++] = message;
+        else
+                n_dhcp4_outgoing_free(message);
+}
+
+static void n_dhcp4_s_connection_drop_replies(NDhcp4SConnection *connection) {
+        for (size_t i = 0; i < connection->n_replies; ++i) {
+                n_dhcp4_s_connection_recycle_reply(connection, connection->replies[i].message);
+                connection->replies[i].message = NULL;
+        }
+
+        connection->n_replies = 0;
+}
+
 void n_dhcp4_s_connection_deinit(NDhcp4SConnection *connection) {
-        c_assert(!connection->ip);
+        c_assert(c_list_is_empty(&connection->ip_list));
+
+        free(connection->ip_index);
+
+        n_dhcp4_s_connection_flush_batch(connection);
+        n_dhcp4_s_connection_drop_replies(connection);
+
+        for (size_t i = 0; i < connection->n_cache; ++i)
+                n_dhcp4_outgoing_free(connection->cache[i]);
 
         if (connection->fd_udp >= 0) {
                 close(connection->fd_udp);
@@ -44,6 +125,9 @@ void n_dhcp4_s_connection_deinit(NDhcp4SConnection *connection) {
                 close(connection->fd_packet);
         }
 
+        if (connection->own_buf)
+                free(connection->buf);
+
         *connection = (NDhcp4SConnection)N_DHCP4_S_CONNECTION_NULL(*connection);
 }
 
@@ -51,10 +135,12 @@ void n_dhcp4_s_connection_get_fd(NDhcp4SConnection *connection, int *fdp) {
         *fdp = connection->fd_udp;
 }
 
+int n_dhcp4_s_connection_steer(NDhcp4SConnection *connection, unsigned int n_workers) {
+        return n_dhcp4_s_socket_udp_steer(connection->fd_udp, n_workers);
+}
+
 static bool n_dhcp4_s_connection_owns_ip(NDhcp4SConnection *connection, struct in_addr addr) {
-        if (!connection->ip)
-                return false;
-        return (connection->ip->ip.s_addr == addr.s_addr);
+        return !!n_dhcp4_s_connection_find_ip(connection, addr);
 }
 
 static int n_dhcp4_s_connection_verify_incoming(NDhcp4SConnection *connection,
@@ -121,36 +207,78 @@ static int n_dhcp4_s_connection_verify_incoming(NDhcp4SConnection *connection,
         return 0;
 }
 
-int n_dhcp4_s_connection_dispatch_io(NDhcp4SConnection *connection, NDhcp4Incoming **messagep) {
-        _c_cleanup_(n_dhcp4_incoming_freep) NDhcp4Incoming *message = NULL;
-        struct sockaddr_in dest = {};
+static int n_dhcp4_s_connection_recv_batch(NDhcp4SConnection *connection) {
+        struct sockaddr_in dests[N_DHCP4_S_CONNECTION_N_BATCH] = {};
+        size_t n_messages = 0;
         int r;
 
-        r = n_dhcp4_s_socket_udp_recv(connection->fd_udp,
-                                          connection->buf,
-                                          sizeof(connection->buf),
-                                          &message,
-                                          &dest);
+        n_dhcp4_s_connection_flush_batch(connection);
+
+        r = n_dhcp4_s_socket_udp_recv_batch(connection->fd_udp,
+                                            connection->buf,
+                                            N_DHCP4_S_CONNECTION_SLOT,
+                                            N_DHCP4_S_CONNECTION_N_BATCH,
+                                            connection->batch,
+                                            dests,
+                                            &n_messages);
         if (r)
                 return r;
 
-        r = n_dhcp4_s_connection_verify_incoming(connection,
-                                                 message,
-                                                 dest.sin_addr.s_addr == INADDR_BROADCAST);
-        if (r) {
-                if (r == N_DHCP4_E_MALFORMED || r == N_DHCP4_E_UNEXPECTED) {
-                        *messagep = NULL;
-                        return 0;
+        connection->n_batch = n_messages;
+
+        /*
+         * Verify the whole batch upfront, while the messages are still parsed
+         * in place. Messages we do not handle, including requests directed at
+         * other servers, are dropped right away without ever being copied.
+         * Their slots are kept so every received datagram still accounts for
+         * one dispatch.
+         */
+        for (size_t i = 0; i < n_messages; ++i) {
+                if (!connection->batch[i].message)
+                        continue;
+
+                r = n_dhcp4_s_connection_verify_incoming(connection,
+                                                         &connection->batch[i],
+                                                         dests[i].sin_addr.s_addr == INADDR_BROADCAST);
+                if (r) {
+                        if (r == N_DHCP4_E_MALFORMED || r == N_DHCP4_E_UNEXPECTED) {
+                                n_dhcp4_incoming_deinit(&connection->batch[i]);
+                                continue;
+                        }
+
+                        n_dhcp4_s_connection_flush_batch(connection);
+                        return -ENOTRECOVERABLE;
                 }
 
-                return -ENOTRECOVERABLE;
+                if (connection->batch[i].userdata.type == N_DHCP4_C_MESSAGE_IGNORE)
+                        n_dhcp4_incoming_deinit(&connection->batch[i]);
         }
 
-        *messagep = message;
-        message = NULL;
         return 0;
 }
 
+int n_dhcp4_s_connection_dispatch_io(NDhcp4SConnection *connection, NDhcp4Incoming **messagep) {
+        NDhcp4Incoming *view;
+        int r;
+
+        if (connection->i_batch >= connection->n_batch) {
+                r = n_dhcp4_s_connection_recv_batch(connection);
+                if (r)
+                        return r;
+        }
+
+        view = &connection->batch[connection->i_batch++];
+        if (!view->message) {
+                *messagep = NULL;
+                return 0;
+        }
+
+        /* the caller may keep the message, so it must not borrow from @buf */
+        r = n_dhcp4_incoming_dup(messagep, view);
+        n_dhcp4_incoming_deinit(view);
+        return r;
+}
+
 /*
  * If the 'giaddr' field in a DHCP message from a client is non-zero,
  * the server sends any return messages to the 'DHCP server' port on the
@@ -165,51 +293,125 @@ int n_dhcp4_s_connection_dispatch_io(NDhcp4SConnection *connection, NDhcp4Incomi
  * all cases, when 'giaddr' is zero, the server broadcasts any DHCPNAK
  * messages to 0xffffffff.
  */
-int n_dhcp4_s_connection_send_reply(NDhcp4SConnection *connection,
-                                    const struct in_addr *server_addr,
-                                    NDhcp4Outgoing *message) {
+static void n_dhcp4_s_connection_reply_init(NDhcp4SReply *reply,
+                                            const struct in_addr *server_addr,
+                                            NDhcp4Outgoing *message) {
         NDhcp4Header *header = n_dhcp4_outgoing_get_header(message);
-        int r;
 
-        if (header->giaddr) {
-                const struct in_addr giaddr = { header->giaddr };
+        *reply = (NDhcp4SReply){
+                .message = message,
+                .src = *server_addr,
+        };
 
-                r = n_dhcp4_s_socket_udp_send(connection->fd_udp,
-                                              server_addr,
-                                              &giaddr,
-                                              message);
-                if (r)
-                        return r;
+        if (header->giaddr) {
+                reply->dest.s_addr = header->giaddr;
         } else if (header->ciaddr) {
-                const struct in_addr ciaddr = { header->ciaddr };
-
-                r = n_dhcp4_s_socket_udp_send(connection->fd_udp,
-                                              server_addr,
-                                              &ciaddr,
-                                              message);
-                if (r)
-                        return r;
+                reply->dest.s_addr = header->ciaddr;
         } else if (header->flags & htons(N_DHCP4_MESSAGE_FLAG_BROADCAST)) {
-                r = n_dhcp4_s_socket_udp_broadcast(connection->fd_udp,
-                                                   server_addr,
-                                                   message);
-                if (r)
-                        return r;
+                reply->dest.s_addr = INADDR_BROADCAST;
         } else {
-                r = n_dhcp4_s_socket_packet_send(connection->fd_packet,
-                                                 connection->ifindex,
-                                                 server_addr,
-                                                 header->chaddr,
-                                                 header->hlen,
-                                                 &(struct in_addr){header->yiaddr},
+                reply->dest.s_addr = header->yiaddr;
+                reply->haddr = header->chaddr;
+                reply->halen = header->hlen;
+        }
+}
+
+int n_dhcp4_s_connection_send_reply(NDhcp4SConnection *connection,
+                                    const struct in_addr *server_addr,
+                                    NDhcp4Outgoing *message) {
+        NDhcp4SReply reply;
+
+        n_dhcp4_s_connection_reply_init(&reply, server_addr, message);
+
+        if (reply.haddr)
+                return n_dhcp4_s_socket_packet_send(connection->fd_packet,
+                                                    &connection->offload,
+                                                    connection->ifindex,
+                                                    &reply.src,
+                                                    reply.haddr,
+                                                    reply.halen,
+                                                    &reply.dest,
+                                                    message);
+        else
+                return n_dhcp4_s_socket_udp_send(connection->fd_udp,
+                                                 &reply.src,
+                                                 &reply.dest,
                                                  message);
-                if (r)
+}
+
+/**
+ * n_dhcp4_s_connection_queue_reply() - queue a reply for sending
+ * @connection:         connection to operate on
+ * @server_addr:        server address to send from
+ * @message:            reply to queue
+ *
+ * Queue @message to be sent on the next call to
+ * n_dhcp4_s_connection_flush_replies(). On success, the connection takes
+ * ownership of @message. If the queue is full, it is flushed first.
+ *
+ * Return: 0 on success, or an error code of the implied flush on failure.
+ */
+int n_dhcp4_s_connection_queue_reply(NDhcp4SConnection *connection,
+                                     const struct in_addr *server_addr,
+                                     NDhcp4Outgoing *message) {
+        int r;
+
+        if (connection->n_replies >= N_DHCP4_S_CONNECTION_N_REPLIES) {
+                r = n_dhcp4_s_connection_flush_replies(connection);
+                if (r && r != N_DHCP4_E_DROPPED)
                         return r;
         }
 
+        n_dhcp4_s_connection_reply_init(&connection->replies[connection->n_replies++],
+                                        server_addr,
+                                        message);
         return 0;
 }
 
+/**
+ * n_dhcp4_s_connection_flush_replies() - send all queued replies
+ * @connection:         connection to operate on
+ *
+ * Send all replies queued via n_dhcp4_s_connection_queue_reply(). Replies are
+ * grouped by the socket they are sent on, and each group is passed to the
+ * kernel in one go. The queue is always empty afterwards, regardless of
+ * whether all replies could be sent.
+ *
+ * Return: 0 on success, N_DHCP4_E_DROPPED if any reply was dropped,
+ *         N_DHCP4_E_DOWN if the interface is down, or a negative error
+ *         code on failure.
+ */
+int n_dhcp4_s_connection_flush_replies(NDhcp4SConnection *connection) {
+        NDhcp4SReply udp[N_DHCP4_S_CONNECTION_N_REPLIES];
+        NDhcp4SReply packet[N_DHCP4_S_CONNECTION_N_REPLIES];
+        size_t n_udp = 0, n_packet = 0;
+        int r = 0, k;
+
+        for (size_t i = 0; i < connection->n_replies; ++i) {
+                if (connection->replies[i].haddr)
+                        packet[n_packet++] = connection->replies[i];
+                else
+                        udp[n_udp++] = connection->replies[i];
+        }
+
+        if (n_udp)
+                r = n_dhcp4_s_socket_udp_send_batch(connection->fd_udp, udp, n_udp);
+
+        if (n_packet && (!r || r == N_DHCP4_E_DROPPED)) {
+                k = n_dhcp4_s_socket_packet_send_batch(connection->fd_packet,
+                                                       &connection->offload,
+                                                       connection->ifindex,
+                                                       packet,
+                                                       n_packet);
+                if (k)
+                        r = k;
+        }
+
+        n_dhcp4_s_connection_drop_replies(connection);
+
+        return r;
+}
+
 static void n_dhcp4_s_connection_init_reply_header(NDhcp4SConnection *connection,
                                                    NDhcp4Header *request,
                                                    NDhcp4Header *reply) {
@@ -224,9 +426,17 @@ static void n_dhcp4_s_connection_init_reply_header(NDhcp4SConnection *connection
         memcpy(reply->chaddr, request->chaddr, request->hlen);
 }
 
-static int n_dhcp4_s_connection_outgoing_set_yiaddr(NDhcp4Outgoing *message,
-                                                     uint32_t yiaddr,
-                                                     uint32_t lifetime) {
+/**
+ * n_dhcp4_s_connection_reply_set_yiaddr() - assign address in a reply
+ * @message:            reply to operate on
+ * @yiaddr:             address to assign
+ * @lifetime:           lifetime of the assignment in seconds
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int n_dhcp4_s_connection_reply_set_yiaddr(NDhcp4Outgoing *message,
+                                          uint32_t yiaddr,
+                                          uint32_t lifetime) {
         uint32_t t1 = lifetime / 2;
         uint32_t t2 = ((uint64_t)lifetime * 7) / 8;
         struct in_addr addr = { .s_addr = yiaddr };
@@ -249,11 +459,27 @@ static int n_dhcp4_s_connection_outgoing_set_yiaddr(NDhcp4Outgoing *message,
         return 0;
 }
 
-static int n_dhcp4_s_connection_new_reply(NDhcp4SConnection *connection,
-                                          NDhcp4Outgoing **messagep,
-                                          NDhcp4Incoming *request,
-                                          uint8_t type,
-                                          const struct in_addr *server_address) {
+/**
+ * n_dhcp4_s_connection_reply_new() - build a new reply
+ * @connection:         connection to operate on
+ * @messagep:           output argument for the new reply
+ * @request:            request to reply to
+ * @type:               message type of the reply
+ * @server_address:     server address to send from
+ *
+ * This builds the common part of a reply to @request. The message type is
+ * always the first option, so it can be changed later on via
+ * n_dhcp4_s_connection_reply_set_type(). Replies are built in the buffers of
+ * replies sent or recycled earlier, if any, so in steady state this does not
+ * allocate.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int n_dhcp4_s_connection_reply_new(NDhcp4SConnection *connection,
+                                   NDhcp4Outgoing **messagep,
+                                   NDhcp4Incoming *request,
+                                   uint8_t type,
+                                   const struct in_addr *server_address) {
         _c_cleanup_(n_dhcp4_outgoing_freep) NDhcp4Outgoing *message = NULL;
         uint16_t max_message_size;
         uint8_t *client_identifier;
@@ -261,14 +487,23 @@ static int n_dhcp4_s_connection_new_reply(NDhcp4SConnection *connection,
         int r;
 
         r = n_dhcp4_incoming_query_max_message_size(request, &max_message_size);
-        if (r)
+        if (r == N_DHCP4_E_UNSET)
+                max_message_size = 0;
+        else if (r)
                 return r;
 
-        r = n_dhcp4_outgoing_new(&message,
-                                 max_message_size,
-                                 N_DHCP4_OVERLOAD_FILE | N_DHCP4_OVERLOAD_SNAME);
-        if (r)
-                return r;
+        if (connection->n_cache) {
+                message = connection->cache[--connection->n_cache];
+                n_dhcp4_outgoing_reset(message,
+                                       max_message_size,
+                                       N_DHCP4_OVERLOAD_FILE | N_DHCP4_OVERLOAD_SNAME);
+        } else {
+                r = n_dhcp4_outgoing_new(&message,
+                                         max_message_size,
+                                         N_DHCP4_OVERLOAD_FILE | N_DHCP4_OVERLOAD_SNAME);
+                if (r)
+                        return r;
+        }
 
         n_dhcp4_s_connection_init_reply_header(connection,
                                                n_dhcp4_incoming_get_header(request),
@@ -302,6 +537,35 @@ static int n_dhcp4_s_connection_new_reply(NDhcp4SConnection *connection,
         return 0;
 }
 
+/**
+ * n_dhcp4_s_connection_reply_set_server_identifier() - change server of a reply
+ * @message:            reply built by n_dhcp4_s_connection_reply_new()
+ * @addr:               new server identifier
+ *
+ * The server identifier always directly follows the message type, so it can
+ * be changed in place once the server address to reply from is known.
+ */
+void n_dhcp4_s_connection_reply_set_server_identifier(NDhcp4Outgoing *message, struct in_addr addr) {
+        c_assert(message->message->options[3] == N_DHCP4_OPTION_SERVER_IDENTIFIER);
+        c_assert(message->message->options[4] == sizeof(addr.s_addr));
+
+        memcpy(message->message->options + 5, &addr.s_addr, sizeof(addr.s_addr));
+        message->headers.valid = false;
+}
+
+/**
+ * n_dhcp4_s_connection_reply_set_type() - change message type of a reply
+ * @message:            reply built by n_dhcp4_s_connection_reply_new()
+ * @type:               new message type
+ */
+void n_dhcp4_s_connection_reply_set_type(NDhcp4Outgoing *message, uint8_t type) {
+        c_assert(message->message->options[0] == N_DHCP4_OPTION_MESSAGE_TYPE);
+        c_assert(message->message->options[1] == 1);
+
+        message->message->options[2] = type;
+        message->headers.valid = false;
+}
+
 int n_dhcp4_s_connection_offer_new(NDhcp4SConnection *connection,
                                    NDhcp4Outgoing **replyp,
                                    NDhcp4Incoming *request,
@@ -311,17 +575,17 @@ int n_dhcp4_s_connection_offer_new(NDhcp4SConnection *connection,
         _c_cleanup_(n_dhcp4_outgoing_freep) NDhcp4Outgoing *reply = NULL;
         int r;
 
-        r = n_dhcp4_s_connection_new_reply(connection,
-                                           &reply,
-                                           request,
-                                           N_DHCP4_MESSAGE_OFFER,
-                                           server_address);
+        r = n_dhcp4_s_connection_reply_new(connection,
+                                         &reply,
+                                         request,
+                                         N_DHCP4_MESSAGE_OFFER,
+                                         server_address);
         if (r)
                 return r;
 
-        r = n_dhcp4_s_connection_outgoing_set_yiaddr(reply,
-                                                     client_address->s_addr,
-                                                     lifetime);
+        r = n_dhcp4_s_connection_reply_set_yiaddr(reply,
+                                                  client_address->s_addr,
+                                                  lifetime);
         if (r)
                 return r;
 
@@ -339,17 +603,17 @@ int n_dhcp4_s_connection_ack_new(NDhcp4SConnection *connection,
         _c_cleanup_(n_dhcp4_outgoing_freep) NDhcp4Outgoing *reply = NULL;
         int r;
 
-        r = n_dhcp4_s_connection_new_reply(connection,
-                                           &reply,
-                                           request,
-                                           N_DHCP4_MESSAGE_ACK,
-                                           server_address);
+        r = n_dhcp4_s_connection_reply_new(connection,
+                                         &reply,
+                                         request,
+                                         N_DHCP4_MESSAGE_ACK,
+                                         server_address);
         if (r)
                 return r;
 
-        r = n_dhcp4_s_connection_outgoing_set_yiaddr(reply,
-                                                     client_address->s_addr,
-                                                     lifetime);
+        r = n_dhcp4_s_connection_reply_set_yiaddr(reply,
+                                                  client_address->s_addr,
+                                                  lifetime);
         if (r)
                 return r;
 
@@ -365,11 +629,11 @@ int n_dhcp4_s_connection_nak_new(NDhcp4SConnection *connection,
         _c_cleanup_(n_dhcp4_outgoing_freep) NDhcp4Outgoing *reply = NULL;
         int r;
 
-        r = n_dhcp4_s_connection_new_reply(connection,
-                                           &reply,
-                                           request,
-                                           N_DHCP4_MESSAGE_NAK,
-                                           server_address);
+        r = n_dhcp4_s_connection_reply_new(connection,
+                                         &reply,
+                                         request,
+                                         N_DHCP4_MESSAGE_NAK,
+                                         server_address);
         if (r)
                 return r;
 
@@ -387,6 +651,129 @@ int n_dhcp4_s_connection_nak_new(NDhcp4SConnection *connection,
         return 0;
 }
 
+/*
+ * Server addresses are configured by the user, not chosen by clients, so a
+ * multiplicative hash is good enough to spread them across the index, and
+ * much cheaper than SipHash on the lookup of every REQUEST.
+ */
+static size_t n_dhcp4_s_connection_ip_home(NDhcp4SConnection *connection, struct in_addr addr) {
+        uint64_t hash = (uint64_t)ntohl(addr.s_addr) * UINT64_C(0x9e3779b97f4a7c15);
+
+        return (hash >> 32) & (connection->n_ip_buckets - 1);
+}
+
+static void n_dhcp4_s_connection_ip_insert(NDhcp4SConnection *connection, NDhcp4SConnectionIp *ip) {
+        size_t i, mask = connection->n_ip_buckets - 1;
+
+        for (i = n_dhcp4_s_connection_ip_home(connection, ip->ip); connection->ip_index[i]; i = (i + 1) & mask)
+                ;
+
+        connection->ip_index[i] = ip;
+}
+
+static void n_dhcp4_s_connection_ip_remove(NDhcp4SConnection *connection, NDhcp4SConnectionIp *ip) {
+        NDhcp4SConnectionIp **index = connection->ip_index;
+        size_t i, j, home, mask = connection->n_ip_buckets - 1;
+
+        for (i = n_dhcp4_s_connection_ip_home(connection, ip->ip); index[i] != ip; i = (i + 1) & mask)
+                c_assert(index[i]);
+
+        /* backward-shift deletion, as in the lease table */
+        index[i] = NULL;
+        for (j = (i + 1) & mask; index[j]; j = (j + 1) & mask) {
+                home = n_dhcp4_s_connection_ip_home(connection, index[j]->ip);
+                if (((j - home) & mask) >= ((j - i) & mask)) {
+                        index[i] = index[j];
+                        index[j] = NULL;
+                        i = j;
+                }
+        }
+}
+
+static int n_dhcp4_s_connection_ip_resize(NDhcp4SConnection *connection, size_t n_buckets) {
+        NDhcp4SConnectionIp **index, *ip;
+
+        index = calloc(n_buckets, sizeof(*index));
+        if (!index)
+                return -ENOMEM;
+
+        free(connection->ip_index);
+        connection->ip_index = index;
+        connection->n_ip_buckets = n_buckets;
+
+        c_list_for_each_entry(ip, &connection->ip_list, connection_link)
+                n_dhcp4_s_connection_ip_insert(connection, ip);
+
+        return 0;
+}
+
+/*
+ * Install the current set of server addresses into the socket filter. If the
+ * set is too large for the filter, the filter passes on all REQUESTs, and the
+ * addresses are not needed.
+ */
+static int n_dhcp4_s_connection_filter(NDhcp4SConnection *connection) {
+        struct in_addr ids[N_DHCP4_S_SOCKET_MAX_FILTER_IDS];
+        NDhcp4SConnectionIp *ip;
+        size_t n_ids = 0;
+
+        if (!connection->filter_server_id)
+                return 0;
+
+        if (connection->n_ips <= N_DHCP4_S_SOCKET_MAX_FILTER_IDS)
+                c_list_for_each_entry(ip, &connection->ip_list, connection_link)
+                        ids[n_ids++] = ip->ip;
+
+        return n_dhcp4_s_socket_udp_filter(connection->fd_udp, ids, connection->n_ips);
+}
+
+/**
+ * n_dhcp4_s_connection_find_ip() - find server address
+ * @connection:         connection to operate on
+ * @addr:               address to look for
+ *
+ * Return: The server address linked into @connection that matches @addr, or
+ *         NULL if there is none.
+ */
+NDhcp4SConnectionIp *n_dhcp4_s_connection_find_ip(NDhcp4SConnection *connection, struct in_addr addr) {
+        NDhcp4SConnectionIp *ip;
+        size_t i, mask = connection->n_ip_buckets - 1;
+
+        if (!connection->n_ips)
+                return NULL;
+
+        for (i = n_dhcp4_s_connection_ip_home(connection, addr); (ip = connection->ip_index[i]); i = (i + 1) & mask)
+                if (ip->ip.s_addr == addr.s_addr)
+                        return ip;
+
+        return NULL;
+}
+
+/**
+ * n_dhcp4_s_connection_find_subnet_ip() - find server address on a subnet
+ * @connection:         connection to operate on
+ * @base:               subnet address, host order
+ * @n_addresses:        number of addresses in the subnet
+ *
+ * This scans all server addresses, so callers are expected to cache the
+ * result, and only look it up again once the ip_serial of @connection
+ * changed.
+ *
+ * Return: The server address linked first into @connection that is part of
+ *         the given subnet, or NULL if there is none.
+ */
+NDhcp4SConnectionIp *n_dhcp4_s_connection_find_subnet_ip(NDhcp4SConnection *connection,
+                                                         uint32_t base,
+                                                         uint32_t n_addresses) {
+        NDhcp4SConnectionIp *ip;
+
+        c_list_for_each_entry(ip, &connection->ip_list, connection_link)
+                if (ntohl(ip->ip.s_addr) - base < n_addresses)
+                        return ip;
+
+        return NULL;
+}
+
 void n_dhcp4_s_connection_ip_init(NDhcp4SConnectionIp *ip, struct in_addr addr) {
         *ip = (NDhcp4SConnectionIp)N_DHCP4_S_CONNECTION_IP_NULL(*ip);
         ip->ip = addr;
@@ -397,15 +784,68 @@ void n_dhcp4_s_connection_ip_deinit(NDhcp4SConnectionIp *ip) {
         *ip = (NDhcp4SConnectionIp)N_DHCP4_S_CONNECTION_IP_NULL(*ip);
 }
 
-void n_dhcp4_s_connection_ip_link(NDhcp4SConnectionIp *ip, NDhcp4SConnection *connection) {
-        c_assert(!connection->ip);
+/**
+ * n_dhcp4_s_connection_ip_link() - add server address to connection
+ * @ip:                 server address to link
+ * @connection:         connection to link into
+ *
+ * Return: 0 on success, -EADDRINUSE if the address is linked already,
+ *         negative error code on failure.
+ */
+int n_dhcp4_s_connection_ip_link(NDhcp4SConnectionIp *ip, NDhcp4SConnection *connection) {
+        int r;
+
         c_assert(!ip->connection);
 
-        connection->ip = ip;
+        if (n_dhcp4_s_connection_find_ip(connection, ip->ip))
+                return -EADDRINUSE;
+
+        /* keep the load factor of the index at or below 1/2 */
+        if ((connection->n_ips + 1) * 2 > connection->n_ip_buckets) {
+                r = n_dhcp4_s_connection_ip_resize(connection,
+                                                   connection->n_ip_buckets ?
+                                                   connection->n_ip_buckets * 2 :
+                                                   N_DHCP4_S_CONNECTION_MIN_IP_BUCKETS);
+                if (r)
+                        return r;
+        }
+
+        c_list_link_tail(&connection->ip_list, &ip->connection_link);
+        n_dhcp4_s_connection_ip_insert(connection, ip);
+        ++connection->n_ips;
         ip->connection = connection;
+
+        /* requests for the new address must pass the filter before it is used */
+        r = n_dhcp4_s_connection_filter(connection);
+        if (r) {
+                ip->connection = NULL;
+                --connection->n_ips;
+                n_dhcp4_s_connection_ip_remove(connection, ip);
+                c_list_unlink(&ip->connection_link);
+                return r;
+        }
+
+        ++connection->ip_serial;
+        return 0;
 }
 
 void n_dhcp4_s_connection_ip_unlink(NDhcp4SConnectionIp *ip) {
-        ip->connection->ip = NULL;
+        NDhcp4SConnection *connection;
+
+        if (!ip->connection)
+                return;
+
+        connection = ip->connection;
+
+        n_dhcp4_s_connection_ip_remove(connection, ip);
+        c_list_unlink(&ip->connection_link);
+        --connection->n_ips;
+        ++connection->ip_serial;
         ip->connection = NULL;
+
+        /*
+         * If the filter cannot be updated, requests for the old address keep
+         * passing it, and are ignored in userspace instead.
+         */
+        n_dhcp4_s_connection_filter(connection);
 }
@@ -0,0 +1,389 @@
+/*
+ * DHCP4 Server Lease Tables
+ *
+ * The lease table tracks all leases of a server. Leases are indexed by the
+ * client they belong to, and, once an address was assigned, by that address.
+ * Both indices are open-addressing hash tables with linear probing and
+ * backward-shift deletion, sharing a single power-of-two size. Since a lease
+ * can only be in the address index if it is in the key index as well, only
+ * insertions into the latter ever need to grow the table.
+ *
+ * Keys and addresses are chosen by the clients, so both are hashed with
+ * SipHash and a per-table random seed to keep the probe sequences out of
+ * their control.
+ */
+
+#include <assert.h>
+#include <c-siphash.h>
+#include <c-stdaux.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/auxv.h>
+#include "n-dhcp4.h"
+#include "n-dhcp4-private.h"
+
+/**
+ * n_dhcp4_s_lease_key_init() - initialize lease key from a request
+ * @key:                        key to initialize
+ * @message:                    request to take the key from
+ *
+ * This initializes @key to identify the client that sent @message. If the
+ * client identifier option is present, it is used verbatim. Otherwise, the
+ * hardware type and hardware address from the message header are used.
+ *
+ * Return: 0 on success, N_DHCP4_E_MALFORMED if the client cannot be
+ *         identified, negative error code on failure.
+ */
+int n_dhcp4_s_lease_key_init(NDhcp4SLeaseKey *key, NDhcp4Incoming *message) {
+        NDhcp4Header *header = n_dhcp4_incoming_get_header(message);
+        uint8_t *data;
+        size_t n_data;
+        int r;
+
+        r = n_dhcp4_incoming_query(message, N_DHCP4_OPTION_CLIENT_IDENTIFIER, &data, &n_data);
+        if (!r) {
+                /* RFC2132 requires at least a type and one byte of data */
+                if (n_data < 2 || n_data > sizeof(key->key) - 1)
+                        return N_DHCP4_E_MALFORMED;
+
+                key->key[0] = N_DHCP4_S_LEASE_KEY_CLIENT_ID;
+                key->n_key = n_data;
+                memcpy(key->key + 1, data, n_data);
+        } else if (r == N_DHCP4_E_UNSET) {
+                if (!header->hlen || header->hlen > sizeof(header->chaddr))
+                        return N_DHCP4_E_MALFORMED;
+
+                key->key[0] = N_DHCP4_S_LEASE_KEY_HWADDR;
+                key->key[1] = header->htype;
+                key->n_key = 1 + header->hlen;
+                memcpy(key->key + 2, header->chaddr, header->hlen);
+        } else {
+                return r;
+        }
+
+        return 0;
+}
+
+static bool n_dhcp4_s_lease_key_equal(const NDhcp4SLeaseKey *a, const NDhcp4SLeaseKey *b) {
+        return a->n_key == b->n_key && !memcmp(a->key, b->key, 1 + a->n_key);
+}
+
+static void n_dhcp4_s_lease_table_initialize_random_seed(NDhcp4SLeaseTable *table) {
+        uint8_t hash_seed[] = {
+                0x8a, 0x41, 0xe3, 0x0c, 0x5d, 0x27, 0x94, 0xb6,
+                0x1f, 0xc8, 0x73, 0x0e, 0xa9, 0x52, 0x3b, 0xd4,
+        };
+        const uint8_t *p;
+        uint64_t now;
+
+        /*
+         * Unlike the probe entropy, this seed protects the table from
+         * clients choosing keys that collide on purpose. It must not be
+         * predictable from the network, so we source it from AT_RANDOM and
+         * add the current time and the table address, as the client probes
+         * do. Everything is hashed through SipHash with a static salt, once
+         * for each half of the seed.
+         */
+        p = (const uint8_t *)getauxval(AT_RANDOM);
+        now = n_dhcp4_gettime(CLOCK_MONOTONIC);
+
+        for (uint64_t i = 0; i < sizeof(table->seed) / sizeof(uint64_t); ++i) {
+                CSipHash hash = C_SIPHASH_NULL;
+                uint64_t v;
+
+                c_siphash_init(&hash, hash_seed);
+                c_siphash_append(&hash, (const uint8_t *)&i, sizeof(i));
+                if (p)
+                        c_siphash_append(&hash, p, 16);
+                c_siphash_append(&hash, (const uint8_t *)&now, sizeof(now));
+                c_siphash_append(&hash, (const uint8_t *)&table, sizeof(table));
+                v = c_siphash_finalize(&hash);
+
+                memcpy(table->seed + i * sizeof(v), &v, sizeof(v));
+        }
+}
+
+/**
+ * n_dhcp4_s_lease_table_init() - initialize lease table
+ * @table:                      table to operate on
+ *
+ * This initializes a new, empty lease table. No memory is allocated until the
+ * first lease is linked.
+ */
+void n_dhcp4_s_lease_table_init(NDhcp4SLeaseTable *table) {
+        *table = (NDhcp4SLeaseTable)N_DHCP4_S_LEASE_TABLE_NULL(*table);
+        n_dhcp4_s_lease_table_initialize_random_seed(table);
+}
+
+/**
+ * n_dhcp4_s_lease_table_deinit() - deinitialize lease table
+ * @table:                      table to operate on
+ *
+ * This deinitializes a lease table and releases its indices. The table must
+ * be empty.
+ */
+void n_dhcp4_s_lease_table_deinit(NDhcp4SLeaseTable *table) {
+        c_assert(!table->n_leases);
+        c_assert(!table->n_addresses);
+
+        free(table->by_address);
+        free(table->by_key);
+        *table = (NDhcp4SLeaseTable)N_DHCP4_S_LEASE_TABLE_NULL(*table);
+}
+
+static uint64_t n_dhcp4_s_lease_table_hash_key(NDhcp4SLeaseTable *table, const NDhcp4SLeaseKey *key) {
+        return c_siphash_hash(table->seed, key->key, 1 + key->n_key);
+}
+
+static uint64_t n_dhcp4_s_lease_table_hash_address(NDhcp4SLeaseTable *table, struct in_addr address) {
+        return c_siphash_hash(table->seed, (const uint8_t *)&address.s_addr, sizeof(address.s_addr));
+}
+
+static size_t n_dhcp4_s_lease_table_home(NDhcp4SLeaseTable *table,
+                                         NDhcp4ServerLease **index,
+                                         NDhcp4ServerLease *lease) {
+        uint64_t hash;
+
+        if (index == table->by_key)
+                hash = lease->hash;
+        else
+                hash = n_dhcp4_s_lease_table_hash_address(table, lease->address);
+
+        return hash & (table->n_buckets - 1);
+}
+
+static void n_dhcp4_s_lease_table_insert(NDhcp4SLeaseTable *table,
+                                         NDhcp4ServerLease **index,
+                                         NDhcp4ServerLease *lease) {
+        size_t i, mask = table->n_buckets - 1;
+
+        for (i = n_dhcp4_s_lease_table_home(table, index, lease); index[i]; i = (i + 1) & mask)
+                ;
+
+        index[i] = lease;
+}
+
+static void n_dhcp4_s_lease_table_remove(NDhcp4SLeaseTable *table,
+                                         NDhcp4ServerLease **index,
+                                         NDhcp4ServerLease *lease) {
+        size_t i, j, home, mask = table->n_buckets - 1;
+
+        for (i = n_dhcp4_s_lease_table_home(table, index, lease); index[i] != lease; i = (i + 1) & mask)
+                c_assert(index[i]);
+
+        /*
+         * Rather than leaving a tombstone, shift back all following entries
+         * of the cluster that may be stored in the gap. An entry can move to
+         * the gap if the gap lies between its home bucket and its current
+         * bucket. This keeps lookups bounded by the cluster length, even
+         * after many removals.
+         */
+        index[i] = NULL;
+        for (j = (i + 1) & mask; index[j]; j = (j + 1) & mask) {
+                home = n_dhcp4_s_lease_table_home(table, index, index[j]);
+                if (((j - home) & mask) >= ((j - i) & mask)) {
+                        index[i] = index[j];
+                        index[j] = NULL;
+                        i = j;
+                }
+        }
+}
+
+static int n_dhcp4_s_lease_table_resize(NDhcp4SLeaseTable *table, size_t n_buckets) {
+        NDhcp4ServerLease **by_key, **by_address;
+        NDhcp4ServerLease **old_key = table->by_key, **old_address = table->by_address;
+        size_t n_old = table->n_buckets;
+
+        by_key = calloc(n_buckets, sizeof(*by_key));
+        if (!by_key)
+                return -ENOMEM;
+
+        by_address = calloc(n_buckets, sizeof(*by_address));
+        if (!by_address) {
+                free(by_key);
+                return -ENOMEM;
+        }
+
+        table->by_key = by_key;
+        table->by_address = by_address;
+        table->n_buckets = n_buckets;
+
+        for (size_t i = 0; i < n_old; ++i) {
+                if (old_key[i])
+                        n_dhcp4_s_lease_table_insert(table, table->by_key, old_key[i]);
+                if (old_address[i])
+                        n_dhcp4_s_lease_table_insert(table, table->by_address, old_address[i]);
+        }
+
+        free(old_address);
+        free(old_key);
+        return 0;
+}
+
+/**
+ * n_dhcp4_s_lease_table_link() - link lease into table
+ * @table:                      table to operate on
+ * @lease:                      lease to link
+ *
+ * This links @lease into @table, indexed by its key and, if set, by its
+ * address. No other lease with the same key may be linked into the table.
+ * The table does not take a reference to @lease, and the lease must not be
+ * modified while linked, other than through n_dhcp4_s_lease_table_set_address()
+ * and n_dhcp4_s_lease_table_rekey().
+ *
+ * Return: 0 on success, -EADDRINUSE if another lease already owns the address
+ *         of @lease, negative error code on failure.
+ */
+int n_dhcp4_s_lease_table_link(NDhcp4SLeaseTable *table, NDhcp4ServerLease *lease) {
+        int r;
+
+        c_assert(!n_dhcp4_s_lease_table_find(table, &lease->key));
+
+        if (lease->address.s_addr != INADDR_ANY &&
+            n_dhcp4_s_lease_table_find_address(table, lease->address))
+                return -EADDRINUSE;
+
+        /* keep the load factor of either index at or below 3/4 */
+        if ((table->n_leases + 1) * 4 > table->n_buckets * 3) {
+                r = n_dhcp4_s_lease_table_resize(table,
+                                                 table->n_buckets ?
+                                                 table->n_buckets * 2 :
+                                                 N_DHCP4_S_LEASE_TABLE_MIN_BUCKETS);
+                if (r)
+                        return r;
+        }
+
+        lease->hash = n_dhcp4_s_lease_table_hash_key(table, &lease->key);
+        n_dhcp4_s_lease_table_insert(table, table->by_key, lease);
+        ++table->n_leases;
+
+        if (lease->address.s_addr != INADDR_ANY) {
+                n_dhcp4_s_lease_table_insert(table, table->by_address, lease);
+                ++table->n_addresses;
+        }
+
+        return 0;
+}
+
+/**
+ * n_dhcp4_s_lease_table_unlink() - unlink lease from table
+ * @table:                      table to operate on
+ * @lease:                      lease to unlink
+ *
+ * This removes @lease, which must be linked into @table, from both indices.
+ */
+void n_dhcp4_s_lease_table_unlink(NDhcp4SLeaseTable *table, NDhcp4ServerLease *lease) {
+        if (lease->address.s_addr != INADDR_ANY) {
+                n_dhcp4_s_lease_table_remove(table, table->by_address, lease);
+                --table->n_addresses;
+        }
+
+        n_dhcp4_s_lease_table_remove(table, table->by_key, lease);
+        --table->n_leases;
+}
+
+/**
+ * n_dhcp4_s_lease_table_set_address() - change the address of a lease
+ * @table:                      table to operate on
+ * @lease:                      linked lease to operate on
+ * @address:                    new address, or INADDR_ANY
+ *
+ * This assigns @address to @lease and updates the address index. If @address
+ * is INADDR_ANY, the lease is removed from the address index.
+ *
+ * Return: 0 on success, -EADDRINUSE if another lease already owns @address.
+ */
+int n_dhcp4_s_lease_table_set_address(NDhcp4SLeaseTable *table,
+                                      NDhcp4ServerLease *lease,
+                                      struct in_addr address) {
+        NDhcp4ServerLease *owner;
+
+        if (address.s_addr == lease->address.s_addr)
+                return 0;
+
+        if (address.s_addr != INADDR_ANY) {
+                owner = n_dhcp4_s_lease_table_find_address(table, address);
+                if (owner)
+                        return -EADDRINUSE;
+        }
+
+        if (lease->address.s_addr != INADDR_ANY) {
+                n_dhcp4_s_lease_table_remove(table, table->by_address, lease);
+                --table->n_addresses;
+        }
+
+        lease->address = address;
+
+        if (lease->address.s_addr != INADDR_ANY) {
+                n_dhcp4_s_lease_table_insert(table, table->by_address, lease);
+                ++table->n_addresses;
+        }
+
+        return 0;
+}
+
+/**
+ * n_dhcp4_s_lease_table_rekey() - change the key of a lease
+ * @table:                      table to operate on
+ * @lease:                      linked lease to operate on
+ * @key:                        new key
+ *
+ * This moves @lease to @key in the key index. No other lease with @key may be
+ * linked into @table. The address index is not affected.
+ */
+void n_dhcp4_s_lease_table_rekey(NDhcp4SLeaseTable *table,
+                                 NDhcp4ServerLease *lease,
+                                 const NDhcp4SLeaseKey *key) {
+        c_assert(!n_dhcp4_s_lease_table_find(table, key));
+
+        n_dhcp4_s_lease_table_remove(table, table->by_key, lease);
+        lease->key = *key;
+        lease->hash = n_dhcp4_s_lease_table_hash_key(table, &lease->key);
+        n_dhcp4_s_lease_table_insert(table, table->by_key, lease);
+}
+
+/**
+ * n_dhcp4_s_lease_table_find() - find lease by key
+ * @table:                      table to operate on
+ * @key:                        key to look up
+ *
+ * Return: The lease linked with @key, or NULL if there is none.
+ */
+NDhcp4ServerLease *n_dhcp4_s_lease_table_find(NDhcp4SLeaseTable *table, const NDhcp4SLeaseKey *key) {
+        size_t i, mask = table->n_buckets - 1;
+        uint64_t hash;
+
+        if (!table->n_leases)
+                return NULL;
+
+        hash = n_dhcp4_s_lease_table_hash_key(table, key);
+
+        for (i = hash & mask; table->by_key[i]; i = (i + 1) & mask)
+                if (table->by_key[i]->hash == hash &&
+                    n_dhcp4_s_lease_key_equal(&table->by_key[i]->key, key))
+                        return table->by_key[i];
+
+        return NULL;
+}
+
+/**
+ * n_dhcp4_s_lease_table_find_address() - find lease by address
+ * @table:                      table to operate on
+ * @address:                    address to look up
+ *
+ * Return: The lease that was assigned @address, or NULL if there is none.
+ */
+NDhcp4ServerLease *n_dhcp4_s_lease_table_find_address(NDhcp4SLeaseTable *table, struct in_addr address) {
+        size_t i, mask = table->n_buckets - 1;
+
+        if (!table->n_addresses)
+                return NULL;
+
+        i = n_dhcp4_s_lease_table_hash_address(table, address) & mask;
+        for ( ; table->by_address[i]; i = (i + 1) & mask)
+                if (table->by_address[i]->address.s_addr == address.s_addr)
+                        return table->by_address[i];
+
+        return NULL;
+}
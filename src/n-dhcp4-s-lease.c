@@ -16,6 +16,7 @@
  */
 int n_dhcp4_server_lease_new(NDhcp4ServerLease **leasep, NDhcp4Incoming *message) {
         _c_cleanup_(n_dhcp4_server_lease_unrefp) NDhcp4ServerLease *lease = NULL;
+        int r;
 
         c_assert(leasep);
 
@@ -25,6 +26,10 @@ int n_dhcp4_server_lease_new(NDhcp4ServerLease **leasep, NDhcp4Incoming *message
 
         *lease = (NDhcp4ServerLease)N_DHCP4_SERVER_LEASE_NULL(*lease);
 
+        r = n_dhcp4_s_lease_key_init(&lease->key, message);
+        if (r)
+                return r;
+
         lease->request = message;
 
         *leasep = lease;
@@ -35,8 +40,7 @@ int n_dhcp4_server_lease_new(NDhcp4ServerLease **leasep, NDhcp4Incoming *message
 static void n_dhcp4_server_lease_free(NDhcp4ServerLease *lease) {
         c_assert(!lease->server);
 
-        c_list_unlink(&lease->server_link);
-
+        n_dhcp4_outgoing_free(lease->reply);
         n_dhcp4_incoming_free(lease->request);
         free(lease);
 }
@@ -60,9 +64,126 @@ _c_public_ NDhcp4ServerLease *n_dhcp4_server_lease_unref(NDhcp4ServerLease *leas
 }
 
 /**
- * n_dhcp4_server_lease_query() - XXX
+ * n_dhcp4_server_lease_link() - link lease into server
+ * @lease:                      the lease to operate on
+ * @server:                     the server to link the lease into
+ *
+ * Associate a lease with a server, making it visible to lookups by the client
+ * key and the assigned address. The server holds a reference to the lease
+ * while it is linked. The lease may not already be linked, and no other lease
+ * of the same client may be linked into @server.
+ *
+ * Return: 0 on success, negative error code on failure.
  */
-_c_public_ int n_dhcp4_server_lease_query(NDhcp4ServerLease *lease, uint8_t option, uint8_t **datap, size_t *n_datap) {
+int n_dhcp4_server_lease_link(NDhcp4ServerLease *lease, NDhcp4Server *server) {
+        int r;
+
+        c_assert(!lease->server);
+
+        r = n_dhcp4_s_lease_table_link(&server->leases, lease);
+        if (r)
+                return r;
+
+        lease->server = server;
+        n_dhcp4_server_lease_ref(lease);
+        return 0;
+}
+
+/**
+ * n_dhcp4_server_lease_detach() - detach lease from its interface
+ * @lease:                      the lease to operate on
+ *
+ * Dissassociate a lease from the interface its latest request was received
+ * on, discarding the reply being built on it. No reply can be sent for the
+ * lease until the client sends its next request.
+ */
+void n_dhcp4_server_lease_detach(NDhcp4ServerLease *lease) {
+        if (!lease->connection)
+                return;
+
+        n_dhcp4_s_connection_recycle_reply(lease->connection, lease->reply);
+        lease->reply = NULL;
+        lease->connection = NULL;
+}
+
+static void n_dhcp4_server_lease_schedule(NDhcp4ServerLease *lease, uint64_t expiry) {
+        lease->expiry = expiry;
+        n_dhcp4_timer_link(&lease->timer, &lease->server->timers, expiry);
+}
+
+/**
+ * n_dhcp4_server_lease_hold() - keep lease for the next request of its client
+ * @lease:                      the lease to operate on
+ * @ns_now:                     current time in nanoseconds
+ *
+ * Make sure a linked lease is not reclaimed before N_DHCP4_SERVER_LEASE_HOLD
+ * seconds have passed, so the client has time to follow up on a reply. This
+ * never shortens the time a lease is kept, in particular not the lifetime of
+ * an acknowledged address.
+ */
+void n_dhcp4_server_lease_hold(NDhcp4ServerLease *lease, uint64_t ns_now) {
+        uint64_t expiry = ns_now + N_DHCP4_SERVER_LEASE_HOLD * UINT64_C(1000000000);
+
+        if (!lease->server)
+                return;
+
+        if (!lease->timer.wheel || lease->expiry < expiry)
+                n_dhcp4_server_lease_schedule(lease, expiry);
+}
+
+/**
+ * n_dhcp4_server_lease_quarantine() - withhold address of a declined lease
+ * @lease:                      the lease to operate on
+ * @ns_now:                     current time in nanoseconds
+ *
+ * Take the address of a linked lease out of circulation for
+ * N_DHCP4_SERVER_LEASE_QUARANTINE seconds, after its client found it to be in
+ * use by someone else. The lease no longer belongs to its client, so the
+ * client starts over with a new lease on its next request. The address stays
+ * assigned to @lease, so it is offered to no one, until the lease expires and
+ * the address returns to its pool. A lease without an address is unlinked
+ * right away.
+ */
+void n_dhcp4_server_lease_quarantine(NDhcp4ServerLease *lease, uint64_t ns_now) {
+        NDhcp4SLeaseKey key = { .n_key = sizeof(lease->address.s_addr) };
+
+        if (!lease->server)
+                return;
+
+        if (lease->address.s_addr == INADDR_ANY) {
+                n_dhcp4_server_lease_unlink(lease);
+                return;
+        }
+
+        key.key[0] = N_DHCP4_S_LEASE_KEY_QUARANTINE;
+        memcpy(key.key + 1, &lease->address.s_addr, sizeof(lease->address.s_addr));
+
+        n_dhcp4_server_lease_detach(lease);
+        n_dhcp4_s_lease_table_rekey(&lease->server->leases, lease, &key);
+        n_dhcp4_server_lease_schedule(lease,
+                                      ns_now + N_DHCP4_SERVER_LEASE_QUARANTINE * UINT64_C(1000000000));
+}
+
+/**
+ * n_dhcp4_server_lease_unlink() - unlink lease from its server
+ * @lease:                      the lease to operate on
+ *
+ * Dissassociate a lease from a server if it is associated with one, and drop
+ * the reference the server held. Otherwise, this is a noop.
+ */
+void n_dhcp4_server_lease_unlink(NDhcp4ServerLease *lease) {
+        if (!lease->server)
+                return;
+
+        n_dhcp4_server_lease_detach(lease);
+        n_dhcp4_timer_unlink(&lease->timer);
+
+        n_dhcp4_s_lease_table_unlink(&lease->server->leases, lease);
+        lease->server = NULL;
+        n_dhcp4_server_lease_unref(lease);
+}
+
+static bool n_dhcp4_server_lease_is_internal(uint8_t option) {
         switch (option) {
         case N_DHCP4_OPTION_PAD:
         case N_DHCP4_OPTION_REQUESTED_IP_ADDRESS:
@@ -76,28 +197,355 @@ _c_public_ int n_dhcp4_server_lease_query(NDhcp4ServerLease *lease, uint8_t opti
         case N_DHCP4_OPTION_RENEWAL_T1_TIME:
         case N_DHCP4_OPTION_REBINDING_T2_TIME:
         case N_DHCP4_OPTION_END:
-                return N_DHCP4_E_INTERNAL;
+                return true;
+        default:
+                return false;
         }
+}
+
+/**
+ * n_dhcp4_server_lease_query() - XXX
+ */
+_c_public_ int n_dhcp4_server_lease_query(NDhcp4ServerLease *lease, uint8_t option, uint8_t **datap, size_t *n_datap) {
+        if (n_dhcp4_server_lease_is_internal(option))
+                return N_DHCP4_E_INTERNAL;
 
         return n_dhcp4_incoming_query(lease->request, option, datap, n_datap);
 }
 
+/*
+ * Pick the server address to reply from, which is also used as server
+ * identifier. Clients on the subnet of one of the pools get the server address
+ * on that subnet, if the interface of the client has one, so they can reach
+ * the server directly. All others get the first address of the interface. The
+ * address per pool is cached until the set of addresses of the interface
+ * changes, or a client on another interface uses the pool.
+ */
+static NDhcp4SConnectionIp *n_dhcp4_server_lease_select_ip(NDhcp4ServerLease *lease) {
+        NDhcp4SConnection *connection = lease->connection;
+        struct in_addr client = lease->address;
+        NDhcp4ServerPool *pool;
+
+        if (client.s_addr == INADDR_ANY)
+                client.s_addr = n_dhcp4_incoming_get_header(lease->request)->ciaddr;
+
+        c_list_for_each_entry(pool, &lease->server->pool_list, server_link) {
+                if (!n_dhcp4_server_pool_includes(pool, client))
+                        continue;
+
+                if (pool->ip_connection != connection || pool->ip_serial != connection->ip_serial) {
+                        pool->ip = n_dhcp4_s_connection_find_subnet_ip(connection, pool->base, pool->n_addresses);
+                        pool->ip_connection = connection;
+                        pool->ip_serial = connection->ip_serial;
+                }
+
+                if (pool->ip)
+                        return pool->ip;
+
+                break;
+        }
+
+        return c_list_first_entry(&connection->ip_list, NDhcp4SConnectionIp, connection_link);
+}
+
+static int n_dhcp4_server_lease_prepare(NDhcp4ServerLease *lease) {
+        NDhcp4SConnectionIp *ip;
+
+        if (lease->reply)
+                return 0;
+
+        if (!lease->server || !lease->connection)
+                return -ENOTRECOVERABLE;
+
+        ip = n_dhcp4_server_lease_select_ip(lease);
+        if (!ip)
+                return -ENOTRECOVERABLE;
+
+        /*
+         * The reply is built before it is known whether it turns into an
+         * OFFER or an ACK, or which address it assigns. The message type and
+         * server identifier are patched once the user decides.
+         */
+        return n_dhcp4_s_connection_reply_new(lease->connection,
+                                              &lease->reply,
+                                              lease->request,
+                                              N_DHCP4_MESSAGE_OFFER,
+                                              &ip->ip);
+}
+
+/*
+ * Drop the reply under construction, including all options appended to it so
+ * far, so the next attempt starts over from a clean one.
+ */
+static void n_dhcp4_server_lease_drop_reply(NDhcp4ServerLease *lease) {
+        n_dhcp4_s_connection_recycle_reply(lease->connection, lease->reply);
+        lease->reply = NULL;
+}
+
+static int n_dhcp4_server_lease_send(NDhcp4ServerLease *lease, uint8_t type) {
+        NDhcp4SConnection *connection = lease->connection;
+        NDhcp4SConnectionIp *ip;
+        int r;
+
+        ip = n_dhcp4_server_lease_select_ip(lease);
+        if (!ip) {
+                n_dhcp4_server_lease_drop_reply(lease);
+                return -ENOTRECOVERABLE;
+        }
+
+        n_dhcp4_s_connection_reply_set_type(lease->reply, type);
+        n_dhcp4_s_connection_reply_set_server_identifier(lease->reply, ip->ip);
+
+        r = n_dhcp4_s_connection_queue_reply(connection, &ip->ip, lease->reply);
+        if (r) {
+                n_dhcp4_server_lease_drop_reply(lease);
+                return r;
+        }
+
+        lease->reply = NULL;
+        return 0;
+}
+
+static int n_dhcp4_server_lease_set_address(NDhcp4ServerLease *lease,
+                                            NDhcp4ServerPool *pool,
+                                            struct in_addr address) {
+        int r;
+
+        r = n_dhcp4_s_lease_table_set_address(&lease->server->leases, lease, address);
+        if (r) {
+                if (pool)
+                        n_dhcp4_server_pool_release(pool, address);
+                return r;
+        }
+
+        return 0;
+}
+
+/*
+ * Pick the address to assign to the client. An address the lease holds
+ * already always wins, followed by a reservation for the client and then the
+ * address the client asks for, if it is free. Only if @allocate is set, any
+ * free address is picked as last resort.
+ */
+static int n_dhcp4_server_lease_assign(NDhcp4ServerLease *lease, bool allocate) {
+        NDhcp4Header *header = n_dhcp4_incoming_get_header(lease->request);
+        uint8_t halen = header->hlen < sizeof(header->chaddr) ? header->hlen : sizeof(header->chaddr);
+        NDhcp4ServerPool *pool;
+        struct in_addr requested = {}, address;
+        int r;
+
+        r = n_dhcp4_incoming_query_requested_ip(lease->request, &requested);
+        if (r == N_DHCP4_E_UNSET)
+                requested.s_addr = header->ciaddr;
+        else if (r)
+                return r;
+
+        if (lease->address.s_addr != INADDR_ANY) {
+                if (!allocate && requested.s_addr != INADDR_ANY && requested.s_addr != lease->address.s_addr)
+                        return -EADDRNOTAVAIL;
+                return 0;
+        }
+
+        c_list_for_each_entry(pool, &lease->server->pool_list, server_link) {
+                r = n_dhcp4_server_pool_find_reservation(pool,
+                                                         header->chaddr,
+                                                         halen,
+                                                         &address);
+                if (r == N_DHCP4_E_UNSET)
+                        continue;
+                else if (r)
+                        return r;
+
+                if (!allocate && requested.s_addr != INADDR_ANY && requested.s_addr != address.s_addr)
+                        return -EADDRNOTAVAIL;
+
+                return n_dhcp4_server_lease_set_address(lease, NULL, address);
+        }
+
+        if (requested.s_addr != INADDR_ANY) {
+                c_list_for_each_entry(pool, &lease->server->pool_list, server_link) {
+                        if (!n_dhcp4_server_pool_includes(pool, requested))
+                                continue;
+
+                        r = n_dhcp4_server_pool_claim(pool, requested);
+                        if (!r)
+                                return n_dhcp4_server_lease_set_address(lease, pool, requested);
+
+                        break;
+                }
+        }
+
+        if (allocate) {
+                c_list_for_each_entry(pool, &lease->server->pool_list, server_link) {
+                        r = n_dhcp4_server_pool_allocate(pool, &address);
+                        if (r == N_DHCP4_E_NO_SPACE)
+                                continue;
+                        else if (r)
+                                return r;
+
+                        return n_dhcp4_server_lease_set_address(lease, pool, address);
+                }
+        }
+
+        return -EADDRNOTAVAIL;
+}
+
+/**
+ * n_dhcp4_server_lease_release() - return assigned address to its pool
+ * @lease:                      the lease to operate on
+ *
+ * If an address is assigned to @lease, mark it as free again in the pool it
+ * was allocated from. The lease keeps the address, so this is only useful
+ * right before the lease is dropped.
+ */
+void n_dhcp4_server_lease_release(NDhcp4ServerLease *lease) {
+        NDhcp4ServerPool *pool;
+
+        if (!lease->server || lease->address.s_addr == INADDR_ANY)
+                return;
+
+        c_list_for_each_entry(pool, &lease->server->pool_list, server_link) {
+                if (n_dhcp4_server_pool_includes(pool, lease->address)) {
+                        n_dhcp4_server_pool_release(pool, lease->address);
+                        break;
+                }
+        }
+}
+
+/**
+ * n_dhcp4_server_lease_append() - append option to reply
+ * @lease:                      the lease to operate on
+ * @option:                     option code
+ * @data:                       option payload
+ * @n_data:                     length of @data in bytes
+ *
+ * Append an option to the reply that is sent by the next call to
+ * n_dhcp4_server_lease_offer() or n_dhcp4_server_lease_ack(). Options that
+ * are managed by the server itself cannot be appended. In particular, the
+ * lease time is set through n_dhcp4_server_config_set_lease_lifetime().
+ *
+ * The reply is built in a buffer owned by the interface of the client, which is
+ * reused once the reply was sent. Hence, in steady state neither this nor
+ * sending the reply allocates memory.
+ *
+ * Return: 0 on success, N_DHCP4_E_INTERNAL if @option is managed by the
+ *         server, -EMSGSIZE if the reply has no space left, negative error
+ *         code on failure.
+ */
 _c_public_ int n_dhcp4_server_lease_append(NDhcp4ServerLease *lease, uint8_t option, uint8_t *data, size_t n_data) {
-        /* XXX */
-        return -ENOTRECOVERABLE;
+        int r;
+
+        if (n_dhcp4_server_lease_is_internal(option))
+                return N_DHCP4_E_INTERNAL;
+        if (n_data > UINT8_MAX)
+                return -EINVAL;
+
+        r = n_dhcp4_server_lease_prepare(lease);
+        if (r)
+                return r;
+
+        r = n_dhcp4_outgoing_append(lease->reply, option, data, n_data);
+        if (r)
+                return (r == N_DHCP4_E_NO_SPACE) ? -EMSGSIZE : r;
+
+        return 0;
+}
+
+static int n_dhcp4_server_lease_reply(NDhcp4ServerLease *lease, uint8_t type) {
+        int r;
+
+        r = n_dhcp4_server_lease_prepare(lease);
+        if (r)
+                return r;
+
+        r = n_dhcp4_server_lease_assign(lease, type == N_DHCP4_MESSAGE_OFFER);
+        if (r)
+                return r;
+
+        /* the options of the assignment may only fit partially, so never retry on top of them */
+        r = n_dhcp4_s_connection_reply_set_yiaddr(lease->reply,
+                                                  lease->address.s_addr,
+                                                  lease->server->lease_lifetime);
+        if (r) {
+                n_dhcp4_server_lease_drop_reply(lease);
+                return (r == N_DHCP4_E_NO_SPACE) ? -EMSGSIZE : r;
+        }
+
+        r = n_dhcp4_server_lease_send(lease, type);
+        if (r)
+                return r;
+
+        /* the address is reclaimed once its lifetime passes without a renewal */
+        if (type == N_DHCP4_MESSAGE_ACK)
+                n_dhcp4_server_lease_schedule(lease,
+                                              n_dhcp4_gettime(CLOCK_BOOTTIME) +
+                                              lease->server->lease_lifetime * UINT64_C(1000000000));
+
+        return 0;
 }
 
+/**
+ * n_dhcp4_server_lease_offer() - offer address to client
+ * @lease:                      the lease to operate on
+ *
+ * Queue an OFFER for the client of @lease. If the lease has no address
+ * assigned yet, the reserved address of the client is offered, or otherwise
+ * the address the client asked for, if it is free, or otherwise the lowest
+ * free address of the first pool with space left. The reply is sent once the
+ * caller has processed all pending events.
+ *
+ * If the reply cannot be completed or queued, all options appended to it are
+ * dropped, so they must be appended again before the next attempt.
+ *
+ * Return: 0 on success, -EMSGSIZE if the reply has no space left for the
+ *         assignment, -EADDRNOTAVAIL if no address is available,
+ *         -ENOTRECOVERABLE if the lease is not linked into a server with an
+ *         address, negative error code on failure.
+ */
 _c_public_ int n_dhcp4_server_lease_offer(NDhcp4ServerLease *lease) {
-        /* XXX */
-        return -ENOTRECOVERABLE;
+        return n_dhcp4_server_lease_reply(lease, N_DHCP4_MESSAGE_OFFER);
 }
 
+/**
+ * n_dhcp4_server_lease_ack() - acknowledge address to client
+ * @lease:                      the lease to operate on
+ *
+ * Queue an ACK for the client of @lease. Unlike n_dhcp4_server_lease_offer(),
+ * this never picks an arbitrary address. It acknowledges the address the
+ * lease holds, the reserved address of the client, or the address the client
+ * asks for, if it is free. Like n_dhcp4_server_lease_offer(), this drops all
+ * appended options if the reply cannot be completed or queued.
+ *
+ * Return: 0 on success, -EMSGSIZE if the reply has no space left for the
+ *         assignment, -EADDRNOTAVAIL if the client asked for an address it
+ *         cannot have, -ENOTRECOVERABLE if the lease is not linked into a
+ *         server with an address, negative error code on failure.
+ */
 _c_public_ int n_dhcp4_server_lease_ack(NDhcp4ServerLease *lease) {
-        /* XXX */
-        return -ENOTRECOVERABLE;
+        return n_dhcp4_server_lease_reply(lease, N_DHCP4_MESSAGE_ACK);
 }
 
+/**
+ * n_dhcp4_server_lease_nack() - reject request of client
+ * @lease:                      the lease to operate on
+ *
+ * Queue a NAK for the client of @lease. Any options appended to the lease so
+ * far are discarded.
+ *
+ * Return: 0 on success, -ENOTRECOVERABLE if the lease is not linked into a
+ *         server with an address, negative error code on failure.
+ */
 _c_public_ int n_dhcp4_server_lease_nack(NDhcp4ServerLease *lease) {
-        /* XXX */
-        return -ENOTRECOVERABLE;
+        int r;
+
+        if (lease->reply) {
+                n_dhcp4_s_connection_recycle_reply(lease->connection, lease->reply);
+                lease->reply = NULL;
+        }
+
+        r = n_dhcp4_server_lease_prepare(lease);
+        if (r)
+                return r;
+
+        return n_dhcp4_server_lease_send(lease, N_DHCP4_MESSAGE_NAK);
 }
@@ -0,0 +1,460 @@
+/*
+ * DHCP4 Server Address Pools
+ *
+ * An address pool covers a single subnet and hands out addresses from the
+ * ranges added to it, skipping any exclusions and reservations. Every address
+ * of the subnet is tracked by one bit in each of the state bitmaps, and the
+ * free addresses are additionally indexed by a hierarchy of summary bitmaps.
+ * A bit in level n+1 is set if, and only if, the corresponding word in level
+ * n is non-zero. Hence, the first free address is found by following the
+ * lowest set bit from the single top-level word down to level 0, regardless
+ * of how full the pool is.
+ */
+
+#include <assert.h>
+#include <c-list.h>
+#include <c-stdaux.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "n-dhcp4.h"
+#include "n-dhcp4-private.h"
+
+/**
+ * n_dhcp4_server_pool_new() - allocate new address pool
+ * @poolp:                      output argument for new pool
+ * @subnet:                     subnet address
+ * @prefixlen:                  subnet prefix length
+ *
+ * This allocates a new, empty address pool for the given subnet. The network
+ * and broadcast addresses of the subnet are excluded right away, unless the
+ * subnet is too small to have them.
+ *
+ * Return: 0 on success, -EINVAL if @prefixlen is not supported,
+ *         N_DHCP4_E_INVALID_ADDRESS if @subnet has host bits set, negative
+ *         error code on failure.
+ */
+int n_dhcp4_server_pool_new(NDhcp4ServerPool **poolp, struct in_addr subnet, unsigned int prefixlen) {
+        _c_cleanup_(n_dhcp4_server_pool_freep) NDhcp4ServerPool *pool = NULL;
+        size_t n_levels, n_total, n_words;
+        uint64_t *words;
+
+        if (prefixlen < N_DHCP4_S_POOL_MIN_PREFIXLEN || prefixlen > 32)
+                return -EINVAL;
+
+        pool = malloc(sizeof(*pool));
+        if (!pool)
+                return -ENOMEM;
+
+        *pool = (NDhcp4ServerPool)N_DHCP4_SERVER_POOL_NULL(*pool);
+
+        pool->base = ntohl(subnet.s_addr);
+        pool->n_addresses = UINT32_C(1) << (32 - prefixlen);
+        pool->n_words = (pool->n_addresses + 63) / 64;
+
+        if (pool->base & (pool->n_addresses - 1))
+                return N_DHCP4_E_INVALID_ADDRESS;
+
+        /* four state bitmaps, plus the free bitmap and its summary levels */
+        n_total = 4 * pool->n_words;
+        n_levels = 0;
+        n_words = pool->n_words;
+        for (;;) {
+                c_assert(n_levels < N_DHCP4_S_POOL_MAX_LEVELS);
+                n_total += n_words;
+                ++n_levels;
+                if (n_words == 1)
+                        break;
+                n_words = (n_words + 63) / 64;
+        }
+
+        words = calloc(n_total, sizeof(*words));
+        if (!words)
+                return -ENOMEM;
+
+        pool->in_range = words;
+        pool->excluded = pool->in_range + pool->n_words;
+        pool->reserved = pool->excluded + pool->n_words;
+        pool->allocated = pool->reserved + pool->n_words;
+        pool->levels[0] = pool->allocated + pool->n_words;
+        pool->n_levels = n_levels;
+
+        n_words = pool->n_words;
+        for (size_t l = 1; l < n_levels; ++l) {
+                pool->levels[l] = pool->levels[l - 1] + n_words;
+                n_words = (n_words + 63) / 64;
+        }
+
+        if (prefixlen <= 30) {
+                pool->excluded[0] |= 1;
+                pool->excluded[pool->n_words - 1] |= UINT64_C(1) << ((pool->n_addresses - 1) % 64);
+        }
+
+        *poolp = pool;
+        pool = NULL;
+        return 0;
+}
+
+/**
+ * n_dhcp4_server_pool_free() - free address pool
+ * @pool:                       pool to free, or NULL
+ *
+ * This unlinks @pool from its server, if any, and frees it. Leases that were
+ * handed out from the pool are not affected. If @pool is NULL, this is a
+ * no-op.
+ *
+ * Return: NULL is returned.
+ */
+_c_public_ NDhcp4ServerPool *n_dhcp4_server_pool_free(NDhcp4ServerPool *pool) {
+        if (!pool)
+                return NULL;
+
+        n_dhcp4_server_pool_unlink(pool);
+
+        free(pool->reservations);
+        free(pool->in_range);
+        free(pool);
+
+        return NULL;
+}
+
+/**
+ * n_dhcp4_server_pool_link() - link pool into server
+ * @pool:                       the pool to operate on
+ * @server:                     the server to link the pool into
+ *
+ * Associate a pool with a server. The pool may not already be linked.
+ */
+void n_dhcp4_server_pool_link(NDhcp4ServerPool *pool, NDhcp4Server *server) {
+        c_assert(!pool->server);
+        c_assert(!c_list_is_linked(&pool->server_link));
+
+        pool->server = server;
+        c_list_link_tail(&server->pool_list, &pool->server_link);
+}
+
+/**
+ * n_dhcp4_server_pool_unlink() - unlink pool from its server
+ * @pool:                       the pool to operate on
+ *
+ * Dissassociate a pool from a server if it is associated with one. Otherwise,
+ * this is a noop.
+ */
+void n_dhcp4_server_pool_unlink(NDhcp4ServerPool *pool) {
+        pool->ip_connection = NULL;
+        pool->ip = NULL;
+        pool->server = NULL;
+        c_list_unlink(&pool->server_link);
+}
+
+static bool n_dhcp4_server_pool_test(const uint64_t *bitmap, uint32_t i) {
+        return bitmap[i / 64] & (UINT64_C(1) << (i % 64));
+}
+
+static void n_dhcp4_server_pool_update(NDhcp4ServerPool *pool, size_t w) {
+        uint64_t word, bit, old;
+
+        /*
+         * Recompute the free word at index @w and propagate a change of its
+         * emptiness up the summary levels. We can stop at the first level
+         * that does not change, as all levels above depend only on it.
+         */
+        word = pool->in_range[w] & ~pool->excluded[w] & ~pool->reserved[w] & ~pool->allocated[w];
+        pool->levels[0][w] = word;
+
+        for (size_t l = 1; l < pool->n_levels; ++l) {
+                bit = UINT64_C(1) << (w % 64);
+                w /= 64;
+
+                old = pool->levels[l][w];
+                word = word ? (old | bit) : (old & ~bit);
+                if (word == old)
+                        break;
+
+                pool->levels[l][w] = word;
+        }
+}
+
+static void n_dhcp4_server_pool_mark(NDhcp4ServerPool *pool, uint64_t *bitmap, uint32_t first, uint32_t last) {
+        uint64_t mask;
+
+        for (size_t w = first / 64; w <= last / 64; ++w) {
+                mask = UINT64_MAX;
+                if (w == first / 64)
+                        mask &= UINT64_MAX << (first % 64);
+                if (w == last / 64)
+                        mask &= UINT64_MAX >> (63 - last % 64);
+
+                bitmap[w] |= mask;
+                n_dhcp4_server_pool_update(pool, w);
+        }
+}
+
+static int n_dhcp4_server_pool_index(NDhcp4ServerPool *pool, struct in_addr address, uint32_t *indexp) {
+        uint32_t i = ntohl(address.s_addr) - pool->base;
+
+        if (i >= pool->n_addresses)
+                return N_DHCP4_E_INVALID_ADDRESS;
+
+        *indexp = i;
+        return 0;
+}
+
+/**
+ * n_dhcp4_server_pool_add_range() - add range of addresses to pool
+ * @pool:                       pool to operate on
+ * @first:                      first address of the range
+ * @last:                       last address of the range, inclusive
+ *
+ * This makes all addresses from @first to @last available for dynamic
+ * allocation, unless they are excluded or reserved. Ranges may overlap.
+ *
+ * Return: 0 on success, N_DHCP4_E_INVALID_ADDRESS if the range is empty or
+ *         not part of the subnet of @pool.
+ */
+_c_public_ int n_dhcp4_server_pool_add_range(NDhcp4ServerPool *pool, struct in_addr first, struct in_addr last) {
+        uint32_t i_first, i_last;
+        int r;
+
+        r = n_dhcp4_server_pool_index(pool, first, &i_first);
+        if (r)
+                return r;
+
+        r = n_dhcp4_server_pool_index(pool, last, &i_last);
+        if (r)
+                return r;
+
+        if (i_first > i_last)
+                return N_DHCP4_E_INVALID_ADDRESS;
+
+        n_dhcp4_server_pool_mark(pool, pool->in_range, i_first, i_last);
+        return 0;
+}
+
+/**
+ * n_dhcp4_server_pool_add_exclusion() - exclude range of addresses from pool
+ * @pool:                       pool to operate on
+ * @first:                      first address to exclude
+ * @last:                       last address to exclude, inclusive
+ *
+ * This excludes all addresses from @first to @last from dynamic allocation,
+ * regardless of the order ranges and exclusions are added in. Addresses that
+ * are currently handed out remain valid, but are not handed out again once
+ * released.
+ *
+ * Return: 0 on success, N_DHCP4_E_INVALID_ADDRESS if the range is empty or
+ *         not part of the subnet of @pool.
+ */
+_c_public_ int n_dhcp4_server_pool_add_exclusion(NDhcp4ServerPool *pool, struct in_addr first, struct in_addr last) {
+        uint32_t i_first, i_last;
+        int r;
+
+        r = n_dhcp4_server_pool_index(pool, first, &i_first);
+        if (r)
+                return r;
+
+        r = n_dhcp4_server_pool_index(pool, last, &i_last);
+        if (r)
+                return r;
+
+        if (i_first > i_last)
+                return N_DHCP4_E_INVALID_ADDRESS;
+
+        n_dhcp4_server_pool_mark(pool, pool->excluded, i_first, i_last);
+        return 0;
+}
+
+static int n_dhcp4_server_pool_compare(const NDhcp4SPoolReservation *reservation,
+                                       const uint8_t *haddr,
+                                       uint8_t halen) {
+        int r;
+
+        r = memcmp(reservation->haddr, haddr, reservation->halen < halen ? reservation->halen : halen);
+        if (r)
+                return r;
+
+        return (int)reservation->halen - (int)halen;
+}
+
+static size_t n_dhcp4_server_pool_search(NDhcp4ServerPool *pool, const uint8_t *haddr, uint8_t halen) {
+        size_t lo = 0, hi = pool->n_reservations, mid;
+
+        /* return the index of the first reservation not smaller than @haddr */
+        while (lo < hi) {
+                mid = lo + (hi - lo) / 2;
+                if (n_dhcp4_server_pool_compare(&pool->reservations[mid], haddr, halen) < 0)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+
+        return lo;
+}
+
+/**
+ * n_dhcp4_server_pool_add_reservation() - reserve address for a client
+ * @pool:                       pool to operate on
+ * @address:                    address to reserve
+ * @haddr:                      hardware address of the client
+ * @n_haddr:                    length of @haddr in bytes, from 1 up to 16
+ *
+ * This reserves @address for the client with hardware address @haddr. The
+ * address is never handed out to any other client, and the client is always
+ * offered this address. The address must be part of the subnet of @pool, but
+ * need not be part of any range.
+ *
+ * Return: 0 on success, -EINVAL if @n_haddr is invalid,
+ *         N_DHCP4_E_INVALID_ADDRESS if @address is not part of the subnet of
+ *         @pool, -EEXIST if either @address or @haddr is already reserved,
+ *         negative error code on failure.
+ */
+_c_public_ int n_dhcp4_server_pool_add_reservation(NDhcp4ServerPool *pool,
+                                                   struct in_addr address,
+                                                   const uint8_t *haddr,
+                                                   size_t n_haddr) {
+        NDhcp4SPoolReservation *reservations;
+        uint32_t i_address;
+        size_t i;
+        int r;
+
+        if (!n_haddr || n_haddr > sizeof(reservations->haddr))
+                return -EINVAL;
+
+        r = n_dhcp4_server_pool_index(pool, address, &i_address);
+        if (r)
+                return r;
+
+        if (n_dhcp4_server_pool_test(pool->reserved, i_address))
+                return -EEXIST;
+
+        i = n_dhcp4_server_pool_search(pool, haddr, n_haddr);
+        if (i < pool->n_reservations &&
+            !n_dhcp4_server_pool_compare(&pool->reservations[i], haddr, n_haddr))
+                return -EEXIST;
+
+        reservations = realloc(pool->reservations, (pool->n_reservations + 1) * sizeof(*reservations));
+        if (!reservations)
+                return -ENOMEM;
+
+        memmove(reservations + i + 1, reservations + i, (pool->n_reservations - i) * sizeof(*reservations));
+        reservations[i] = (NDhcp4SPoolReservation){
+                .halen = n_haddr,
+                .address = address,
+        };
+        memcpy(reservations[i].haddr, haddr, n_haddr);
+
+        pool->reservations = reservations;
+        ++pool->n_reservations;
+
+        n_dhcp4_server_pool_mark(pool, pool->reserved, i_address, i_address);
+        return 0;
+}
+
+/**
+ * n_dhcp4_server_pool_includes() - check whether address is in subnet
+ * @pool:                       pool to operate on
+ * @address:                    address to check
+ *
+ * Return: True if @address is part of the subnet of @pool, false otherwise.
+ */
+bool n_dhcp4_server_pool_includes(NDhcp4ServerPool *pool, struct in_addr address) {
+        return ntohl(address.s_addr) - pool->base < pool->n_addresses;
+}
+
+/**
+ * n_dhcp4_server_pool_find_reservation() - find reserved address of a client
+ * @pool:                       pool to operate on
+ * @haddr:                      hardware address of the client
+ * @halen:                      length of @haddr
+ * @addressp:                   output argument for the reserved address
+ *
+ * Return: 0 on success, N_DHCP4_E_UNSET if there is no reservation for the
+ *         client.
+ */
+int n_dhcp4_server_pool_find_reservation(NDhcp4ServerPool *pool,
+                                         const uint8_t *haddr,
+                                         uint8_t halen,
+                                         struct in_addr *addressp) {
+        size_t i;
+
+        i = n_dhcp4_server_pool_search(pool, haddr, halen);
+        if (i >= pool->n_reservations ||
+            n_dhcp4_server_pool_compare(&pool->reservations[i], haddr, halen))
+                return N_DHCP4_E_UNSET;
+
+        *addressp = pool->reservations[i].address;
+        return 0;
+}
+
+/**
+ * n_dhcp4_server_pool_allocate() - allocate free address
+ * @pool:                       pool to operate on
+ * @addressp:                   output argument for the allocated address
+ *
+ * This marks the lowest free address of @pool as allocated and returns it.
+ * It takes one word access per level of the summary hierarchy.
+ *
+ * Return: 0 on success, N_DHCP4_E_NO_SPACE if no address is free.
+ */
+int n_dhcp4_server_pool_allocate(NDhcp4ServerPool *pool, struct in_addr *addressp) {
+        size_t i = 0;
+
+        if (!pool->levels[pool->n_levels - 1][0])
+                return N_DHCP4_E_NO_SPACE;
+
+        for (size_t l = pool->n_levels; l-- > 0; )
+                i = i * 64 + __builtin_ctzll(pool->levels[l][i]);
+
+        pool->allocated[i / 64] |= UINT64_C(1) << (i % 64);
+        n_dhcp4_server_pool_update(pool, i / 64);
+
+        addressp->s_addr = htonl(pool->base + i);
+        return 0;
+}
+
+/**
+ * n_dhcp4_server_pool_claim() - allocate specific address
+ * @pool:                       pool to operate on
+ * @address:                    address to allocate
+ *
+ * This marks @address as allocated, if it is free. This is used to honor the
+ * address a client requests.
+ *
+ * Return: 0 on success, -EADDRINUSE if @address is already allocated,
+ *         -EADDRNOTAVAIL if @address is not available for allocation.
+ */
+int n_dhcp4_server_pool_claim(NDhcp4ServerPool *pool, struct in_addr address) {
+        uint32_t i;
+        int r;
+
+        r = n_dhcp4_server_pool_index(pool, address, &i);
+        if (r)
+                return -EADDRNOTAVAIL;
+
+        if (!n_dhcp4_server_pool_test(pool->levels[0], i))
+                return n_dhcp4_server_pool_test(pool->allocated, i) ? -EADDRINUSE : -EADDRNOTAVAIL;
+
+        pool->allocated[i / 64] |= UINT64_C(1) << (i % 64);
+        n_dhcp4_server_pool_update(pool, i / 64);
+        return 0;
+}
+
+/**
+ * n_dhcp4_server_pool_release() - release allocated address
+ * @pool:                       pool to operate on
+ * @address:                    address to release
+ *
+ * This returns @address to @pool. If the address was not allocated from the
+ * pool, this is a no-op.
+ */
+void n_dhcp4_server_pool_release(NDhcp4ServerPool *pool, struct in_addr address) {
+        uint32_t i;
+        int r;
+
+        r = n_dhcp4_server_pool_index(pool, address, &i);
+        if (r || !n_dhcp4_server_pool_test(pool->allocated, i))
+                return;
+
+        pool->allocated[i / 64] &= ~(UINT64_C(1) << (i % 64));
+        n_dhcp4_server_pool_update(pool, i / 64);
+}
@@ -12,7 +12,6 @@
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/time.h>
-#include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
 #include "n-dhcp4.h"
@@ -56,16 +55,152 @@ _c_public_ void n_dhcp4_server_config_set_ifindex(NDhcp4ServerConfig *config, in
 }
 
 /**
- * n_dhcp4_s_event_node_new() - XXX
+ * n_dhcp4_server_config_set_reuseport() - set reuseport property
+ * @config:                     configuration to operate on
+ * @reuseport:                  value to set
+ *
+ * This sets the reuseport property of the given configuration object.
+ *
+ * By default, only a single server can run on an interface. If this property
+ * is set, several servers can be created for the same interface, as long as
+ * all of them set this property. Every request is delivered to exactly one of
+ * the servers, so each can be dispatched on its own thread.
+ *
+ * On its own, this does not spread the load. The kernel picks the server by
+ * the source and destination address and port of a request, which are the
+ * same for all broadcasts of clients without an address, and for all requests
+ * forwarded by a relay agent. Those all end up on a single server. Use
+ * n_dhcp4_server_config_set_reuseport_steering() to distribute them.
  */
-int n_dhcp4_s_event_node_new(NDhcp4SEventNode **nodep) {
-        NDhcp4SEventNode *node;
+_c_public_ void n_dhcp4_server_config_set_reuseport(NDhcp4ServerConfig *config, bool reuseport) {
+        config->reuseport = reuseport;
+}
 
-        node = calloc(1, sizeof(*node));
-        if (!node)
-                return -ENOMEM;
+/**
+ * n_dhcp4_server_config_set_reuseport_steering() - set reuseport steering property
+ * @config:                     configuration to operate on
+ * @n_servers:                  number of servers in the reuseport group, or 0
+ *
+ * This sets the reuseport steering property of the given configuration
+ * object. It only has an effect if the reuseport property is set as well.
+ *
+ * By default, the kernel distributes requests across a reuseport group based
+ * on their source address and port. Hence, consecutive requests of a single
+ * client may be delivered to different servers. If @n_servers is non-zero,
+ * requests are instead distributed based on the client hardware address, so
+ * each client is always served by the same server. This allows servers to keep
+ * per-client state without sharing it.
+ *
+ * All servers of the group must be created with the same value, and @n_servers
+ * must match the number of servers. If a server is removed from the group, the
+ * assignment of clients to the remaining servers changes.
+ */
+_c_public_ void n_dhcp4_server_config_set_reuseport_steering(NDhcp4ServerConfig *config, unsigned int n_servers) {
+        config->n_steering = n_servers;
+}
+
+/**
+ * n_dhcp4_server_config_set_checksum_offload() - set checksum-offload property
+ * @config:                     configuration to operate on
+ * @checksum_offload:           value to set
+ *
+ * This sets the checksum-offload property of the given configuration object.
+ *
+ * By default, the server computes the UDP checksums of all replies it sends
+ * directly to the hardware address of a client. If this property is set, the
+ * server leaves them to the kernel instead, which passes them on to the
+ * network device if it supports checksum offload. This is only available on
+ * ethernet devices. If the kernel does not support it, the server silently
+ * falls back to computing the checksums itself.
+ */
+_c_public_ void n_dhcp4_server_config_set_checksum_offload(NDhcp4ServerConfig *config, bool checksum_offload) {
+        config->checksum_offload = checksum_offload;
+}
+
+/**
+ * n_dhcp4_server_config_set_server_id_filter() - set server-id-filter property
+ * @config:                     configuration to operate on
+ * @server_id_filter:           value to set
+ *
+ * This sets the server-id-filter property of the given configuration object.
+ *
+ * Clients broadcast the REQUEST selecting an offer, so every server on the
+ * link receives it, even though only the one named by its server identifier
+ * handles it. If this property is set, the server installs a kernel socket
+ * filter that drops REQUESTs carrying a server identifier other than the
+ * addresses of the interface they are received on, rather than receiving and
+ * parsing them only to ignore them. This is useful with several redundant
+ * servers on the same link. The filter only inspects the first options of a
+ * message, and passes on whatever it cannot decide on.
+ */
+_c_public_ void n_dhcp4_server_config_set_server_id_filter(NDhcp4ServerConfig *config, bool server_id_filter) {
+        config->server_id_filter = server_id_filter;
+}
+
+/**
+ * n_dhcp4_server_config_set_lease_lifetime() - set lease lifetime
+ * @config:                     configuration to operate on
+ * @lifetime:                   lifetime in seconds, or 0 for the default
+ *
+ * This sets the lifetime of the addresses assigned by the server. It is sent
+ * to the clients in every OFFER and ACK, along with the renewal and rebinding
+ * times derived from it, and an acknowledged address is reclaimed once it
+ * passed without a renewal. The default is one hour.
+ */
+_c_public_ void n_dhcp4_server_config_set_lease_lifetime(NDhcp4ServerConfig *config, uint32_t lifetime) {
+        config->lease_lifetime = lifetime ?: N_DHCP4_SERVER_LEASE_LIFETIME;
+}
+
+/**
+ * n_dhcp4_server_config_set_event_fn() - set event callback
+ * @config:                     configuration to operate on
+ * @fn:                         callback to set, or NULL
+ * @userdata:                   userdata to pass to @fn
+ *
+ * This sets the event callback of the given configuration object.
+ *
+ * By default, events are queued on the server and fetched with
+ * n_dhcp4_server_pop_event(). If a callback is set, each event is passed to
+ * it from within n_dhcp4_server_dispatch() as soon as it is raised, and is
+ * not queued. The event and the lease it carries are only valid for the
+ * duration of the callback, unless the callee acquires a reference to the
+ * lease. Replies to the lease may be queued from within the callback, they
+ * are sent once the dispatch round is done. The callback may free interfaces
+ * of the server, see n_dhcp4_server_interface_free(), but it must not
+ * dispatch or destroy the server.
+ */
+_c_public_ void n_dhcp4_server_config_set_event_fn(NDhcp4ServerConfig *config,
+                                                  NDhcp4ServerEventFn fn,
+                                                  void *userdata) {
+        config->event_fn = fn;
+        config->event_userdata = userdata;
+}
+
+/**
+ * n_dhcp4_s_event_node_new() - allocate new event
+ * @nodep:                      output argument for new event
+ * @cache:                      event cache to allocate from, or NULL
+ *
+ * This allocates a new event node, reusing one from @cache if possible. Once
+ * freed, the node is returned to @cache, unless it is full.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int n_dhcp4_s_event_node_new(NDhcp4SEventNode **nodep, NDhcp4EventCache *cache) {
+        NDhcp4SEventNode *node;
+        CList *link;
+
+        link = n_dhcp4_event_cache_pop(cache);
+        if (link) {
+                node = c_container_of(link, NDhcp4SEventNode, server_link);
+        } else {
+                node = malloc(sizeof(*node));
+                if (!node)
+                        return -ENOMEM;
+        }
 
         *node = (NDhcp4SEventNode)N_DHCP4_S_EVENT_NODE_NULL(*node);
+        node->cache = cache;
 
         *nodep = node;
         return 0;
@@ -78,8 +213,28 @@ NDhcp4SEventNode *n_dhcp4_s_event_node_free(NDhcp4SEventNode *node) {
         if (!node)
                 return NULL;
 
+        switch (node->event.event) {
+        case N_DHCP4_SERVER_EVENT_DISCOVER:
+                node->event.discover.lease = n_dhcp4_server_lease_unref(node->event.discover.lease);
+                break;
+        case N_DHCP4_SERVER_EVENT_REQUEST:
+        case N_DHCP4_SERVER_EVENT_RENEW:
+                node->event.request.lease = n_dhcp4_server_lease_unref(node->event.request.lease);
+                break;
+        case N_DHCP4_SERVER_EVENT_DECLINE:
+                node->event.decline.lease = n_dhcp4_server_lease_unref(node->event.decline.lease);
+                break;
+        case N_DHCP4_SERVER_EVENT_RELEASE:
+                node->event.release.lease = n_dhcp4_server_lease_unref(node->event.release.lease);
+                break;
+        default:
+                break;
+        }
+
         c_list_unlink(&node->server_link);
-        free(node);
+
+        if (!n_dhcp4_event_cache_push(node->cache, &node->server_link))
+                free(node);
 
         return NULL;
 }
@@ -99,7 +254,43 @@ _c_public_ int n_dhcp4_server_new(NDhcp4Server **serverp, NDhcp4ServerConfig *co
 
         *server = (NDhcp4Server)N_DHCP4_SERVER_NULL(*server);
 
-        r = n_dhcp4_s_connection_init(&server->connection, config->ifindex);
+        n_dhcp4_s_lease_table_init(&server->leases);
+
+        server->flags = (config->reuseport ? N_DHCP4_S_SOCKET_FLAG_REUSEPORT : 0) |
+                        (config->checksum_offload ? N_DHCP4_SOCKET_FLAG_VNET_HDR : 0) |
+                        (config->server_id_filter ? N_DHCP4_S_SOCKET_FLAG_SERVER_ID : 0);
+        server->n_steering = config->reuseport ? config->n_steering : 0;
+        server->lease_lifetime = config->lease_lifetime;
+        server->event_fn = config->event_fn;
+        server->event_userdata = config->event_userdata;
+
+        server->buf = malloc(N_DHCP4_S_CONNECTION_BUF_SIZE);
+        if (!server->buf)
+                return -ENOMEM;
+
+        server->fd_epoll = epoll_create1(EPOLL_CLOEXEC);
+        if (server->fd_epoll < 0)
+                return -errno;
+
+        n_dhcp4_timer_wheel_init(&server->timers,
+                                 N_DHCP4_SERVER_TIMER_SHIFT,
+                                 n_dhcp4_gettime(CLOCK_BOOTTIME));
+
+        r = n_dhcp4_timerfd_new(&server->fd_timer);
+        if (r)
+                return r;
+
+        /* interfaces are registered with their connection, the timer with NULL */
+        r = epoll_ctl(server->fd_epoll,
+                      EPOLL_CTL_ADD,
+                      server->fd_timer,
+                      &(struct epoll_event){
+                                .events = EPOLLIN,
+                      });
+        if (r < 0)
+                return -errno;
+
+        r = n_dhcp4_server_add_interface(server, &server->interface, config->ifindex);
         if (r)
                 return r;
 
@@ -109,11 +300,47 @@ _c_public_ int n_dhcp4_server_new(NDhcp4Server **serverp, NDhcp4ServerConfig *co
 }
 
 static void n_dhcp4_server_free(NDhcp4Server *server) {
+        NDhcp4ServerInterface *interface, *t_interface;
+        NDhcp4ServerPool *pool, *t_pool;
         NDhcp4SEventNode *node, *t_node;
+        NDhcp4ServerLease *lease;
 
         c_list_for_each_entry_safe(node, t_node, &server->event_list, server_link)
                 n_dhcp4_s_event_node_free(node);
 
+        c_list_for_each_entry_safe(node, t_node, &server->event_cache.node_list, server_link) {
+                c_list_unlink(&node->server_link);
+                free(node);
+        }
+
+        c_list_for_each_entry_safe(pool, t_pool, &server->pool_list, server_link)
+                n_dhcp4_server_pool_unlink(pool);
+
+        /*
+         * Unlinking a lease may shift later entries of its cluster back into
+         * the freed bucket, but never into a bucket after it, unless the
+         * cluster wraps around. Hence, walk the buckets backwards and drain
+         * each before moving on.
+         */
+        for (size_t i = server->leases.n_buckets; i-- > 0; )
+                while ((lease = server->leases.by_key[i]))
+                        n_dhcp4_server_lease_unlink(lease);
+
+        n_dhcp4_s_lease_table_deinit(&server->leases);
+        n_dhcp4_timer_wheel_deinit(&server->timers);
+
+        /* interfaces added by the caller may outlive the server, they are merely detached */
+        c_list_for_each_entry_safe(interface, t_interface, &server->interface_list, server_link)
+                n_dhcp4_server_interface_unlink(interface);
+        n_dhcp4_server_interface_free(server->interface);
+
+        if (server->fd_timer >= 0)
+                close(server->fd_timer);
+
+        if (server->fd_epoll >= 0)
+                close(server->fd_epoll);
+
+        free(server->buf);
         free(server);
 }
 
@@ -142,7 +369,7 @@ int n_dhcp4_server_raise(NDhcp4Server *server, NDhcp4SEventNode **nodep, unsigne
         NDhcp4SEventNode *node;
         int r;
 
-        r = n_dhcp4_s_event_node_new(&node);
+        r = n_dhcp4_s_event_node_new(&node, &server->event_cache);
         if (r)
                 return r;
 
@@ -155,37 +382,351 @@ int n_dhcp4_server_raise(NDhcp4Server *server, NDhcp4SEventNode **nodep, unsigne
 }
 
 /**
- * n_dhcp4_server_get_fd() - XXX
+ * n_dhcp4_server_get_fd() - retrieve event FD
+ * @server:                     server to operate on
+ * @fdp:                        output argument to store FD
+ *
+ * Retrieve the FD of @server, which covers the sockets of all its interfaces.
+ * The caller is expected to call n_dhcp4_server_dispatch() whenever the FD is
+ * readable.
  */
 _c_public_ void n_dhcp4_server_get_fd(NDhcp4Server *server, int *fdp) {
-        n_dhcp4_s_connection_get_fd(&server->connection, fdp);
+        *fdp = server->fd_epoll;
 }
 
-/**
- * n_dhcp4_server_dispatch() - XXX
+static void n_dhcp4_server_event_init(NDhcp4ServerEvent *event, unsigned int type, NDhcp4ServerLease *lease) {
+        *event = (NDhcp4ServerEvent){ .event = type };
+
+        switch (type) {
+        case N_DHCP4_SERVER_EVENT_DISCOVER:
+                event->discover.lease = lease;
+                break;
+        case N_DHCP4_SERVER_EVENT_REQUEST:
+        case N_DHCP4_SERVER_EVENT_RENEW:
+                event->request.lease = lease;
+                break;
+        case N_DHCP4_SERVER_EVENT_DECLINE:
+                event->decline.lease = lease;
+                break;
+        case N_DHCP4_SERVER_EVENT_RELEASE:
+                event->release.lease = lease;
+                break;
+        }
+}
+
+/*
+ * Pass an event to the callback of @server, or queue it if there is none. The
+ * caller pins @lease until the callback returns, a queued event holds its own
+ * reference.
  */
-_c_public_ int n_dhcp4_server_dispatch(NDhcp4Server *server) {
+static int n_dhcp4_server_emit(NDhcp4Server *server, unsigned int type, NDhcp4ServerLease *lease) {
+        NDhcp4SEventNode *node;
+        int r;
+
+        if (server->event_fn) {
+                NDhcp4ServerEvent event;
+
+                n_dhcp4_server_event_init(&event, type, lease);
+                server->event_fn(server, &event, server->event_userdata);
+                return 0;
+        }
+
+        r = n_dhcp4_server_raise(server, &node, type);
+        if (r)
+                return r;
+
+        n_dhcp4_server_event_init(&node->event, type, n_dhcp4_server_lease_ref(lease));
+        return 0;
+}
+
+static int n_dhcp4_server_dispatch_message(NDhcp4Server *server,
+                                           NDhcp4SConnection *connection,
+                                           NDhcp4Incoming **messagep) {
+        NDhcp4Incoming *message = *messagep;
+        _c_cleanup_(n_dhcp4_server_lease_unrefp) NDhcp4ServerLease *lease = NULL;
+        NDhcp4SLeaseKey key;
+        unsigned int event;
+        uint64_t ns_now;
+        uint8_t type;
+        int r;
+
+        r = n_dhcp4_incoming_query_message_type(message, &type);
+        if (r) {
+                if (r == N_DHCP4_E_UNSET || r == N_DHCP4_E_MALFORMED)
+                        return 0;
+                return r;
+        }
+
+        switch (type) {
+        case N_DHCP4_MESSAGE_DISCOVER:
+                event = N_DHCP4_SERVER_EVENT_DISCOVER;
+                break;
+        case N_DHCP4_MESSAGE_REQUEST:
+                if (n_dhcp4_incoming_get_header(message)->ciaddr)
+                        event = N_DHCP4_SERVER_EVENT_RENEW;
+                else
+                        event = N_DHCP4_SERVER_EVENT_REQUEST;
+                break;
+        case N_DHCP4_MESSAGE_DECLINE:
+                event = N_DHCP4_SERVER_EVENT_DECLINE;
+                break;
+        case N_DHCP4_MESSAGE_RELEASE:
+                event = N_DHCP4_SERVER_EVENT_RELEASE;
+                break;
+        default:
+                return 0;
+        }
+
+        r = n_dhcp4_s_lease_key_init(&key, message);
+        if (r) {
+                if (r == N_DHCP4_E_MALFORMED)
+                        return 0;
+                return r;
+        }
+
+        /*
+         * Look up the lease of the client. DISCOVER and REQUEST messages
+         * create a lease if the client has none, so the user can decide
+         * whether to offer, acknowledge or reject it. DECLINE and RELEASE
+         * messages refer to a lease we handed out, so they are dropped if
+         * there is none. The lease always carries the latest request.
+         */
+        lease = n_dhcp4_server_lease_ref(n_dhcp4_s_lease_table_find(&server->leases, &key));
+        if (lease) {
+                n_dhcp4_server_lease_detach(lease);
+                n_dhcp4_incoming_free(lease->request);
+                lease->request = message;
+                *messagep = NULL;
+        } else if (event == N_DHCP4_SERVER_EVENT_DECLINE || event == N_DHCP4_SERVER_EVENT_RELEASE) {
+                return 0;
+        } else {
+                r = n_dhcp4_server_lease_new(&lease, message);
+                if (r)
+                        return r;
+
+                *messagep = NULL;
+
+                r = n_dhcp4_server_lease_link(lease, server);
+                if (r)
+                        return r;
+        }
+
+        /* replies go out on the interface the latest request was received on */
+        lease->connection = connection;
+        ns_now = n_dhcp4_gettime(CLOCK_BOOTTIME);
+        n_dhcp4_server_lease_hold(lease, ns_now);
+
+        switch (event) {
+        case N_DHCP4_SERVER_EVENT_DECLINE:
+                /* the address is in use by someone else, keep it from everyone for a while */
+                n_dhcp4_server_lease_quarantine(lease, ns_now);
+                break;
+        case N_DHCP4_SERVER_EVENT_RELEASE:
+                n_dhcp4_server_lease_release(lease);
+                n_dhcp4_server_lease_unlink(lease);
+                break;
+        }
+
+        return n_dhcp4_server_emit(server, event, lease);
+}
+
+/*
+ * All interfaces receive into the buffer of the server, so a batch must be
+ * dispatched completely before another interface is dispatched. Hence, the
+ * budget of a dispatch round is only checked once a batch is exhausted, and a
+ * batch is dropped if it cannot be dispatched. An interface that went down is
+ * reported as event, rather than as error. The event callback may free the
+ * interface, which closes its sockets and drops the batch.
+ */
+static int n_dhcp4_server_dispatch_connection(NDhcp4Server *server,
+                                              NDhcp4SConnection *connection,
+                                              unsigned int *n_dispatchedp) {
+        NDhcp4ServerInterface *interface = c_container_of(connection, NDhcp4ServerInterface, connection);
         int r;
 
-        for (unsigned int i = 0; i < 128; ++i) {
+        do {
                 _c_cleanup_(n_dhcp4_incoming_freep) NDhcp4Incoming *message = NULL;
 
-                r = n_dhcp4_s_connection_dispatch_io(&server->connection, &message);
+                r = n_dhcp4_s_connection_dispatch_io(connection, &message);
                 if (r) {
                         if (r == N_DHCP4_E_AGAIN)
                                 return 0;
+
+                        n_dhcp4_s_connection_flush_batch(connection);
+
+                        if (r == N_DHCP4_E_DOWN)
+                                return n_dhcp4_server_emit(server, N_DHCP4_SERVER_EVENT_DOWN, NULL);
+
                         return r;
                 }
+
+                ++*n_dispatchedp;
+
+                if (!message)
+                        continue;
+
+                r = n_dhcp4_server_dispatch_message(server, connection, &message);
+                if (r) {
+                        n_dhcp4_s_connection_flush_batch(connection);
+                        return r;
+                }
+
+                if (!interface->server)
+                        return 0;
+        } while (*n_dispatchedp < N_DHCP4_SERVER_N_DISPATCH || connection->i_batch < connection->n_batch);
+
+        return N_DHCP4_E_PREEMPTED;
+}
+
+/*
+ * Reclaim the leases whose expiry passed: their addresses are returned to the
+ * pools, and the leases are dropped. Leases expire in batches of at most the
+ * dispatch budget, the timer is re-armed right away if more are pending.
+ */
+static int n_dhcp4_server_dispatch_timer(NDhcp4Server *server,
+                                         struct epoll_event *event,
+                                         unsigned int *n_dispatchedp) {
+        NDhcp4ServerLease *lease;
+        NDhcp4Timer *timer;
+        uint64_t ns_now;
+        int r;
+
+        r = n_dhcp4_timerfd_read(server->fd_timer, event);
+        if (r)
+                return (r == N_DHCP4_E_AGAIN) ? 0 : r;
+
+        /* the timerfd fired, so it is no longer armed */
+        server->scheduled_timeout = 0;
+
+        ns_now = n_dhcp4_gettime(CLOCK_BOOTTIME);
+
+        while (*n_dispatchedp < N_DHCP4_SERVER_N_DISPATCH) {
+                timer = n_dhcp4_timer_wheel_pop(&server->timers, ns_now);
+                if (!timer)
+                        return 0;
+
+                ++*n_dispatchedp;
+
+                lease = c_container_of(timer, NDhcp4ServerLease, timer);
+                n_dhcp4_server_lease_release(lease);
+                n_dhcp4_server_lease_unlink(lease);
         }
 
         return N_DHCP4_E_PREEMPTED;
 }
 
+/*
+ * A failing interface must not starve the others, so the remaining events of
+ * the round are still dispatched, and only the first error is returned
+ * afterwards.
+ */
+static int n_dhcp4_server_dispatch_io(NDhcp4Server *server) {
+        struct epoll_event events[N_DHCP4_SERVER_N_EPOLL];
+        NDhcp4ServerInterface *interface;
+        unsigned int n_dispatched = 0;
+        int n, r, k = 0;
+
+        n = epoll_wait(server->fd_epoll, events, sizeof(events) / sizeof(*events), 0);
+        if (n < 0) {
+                /* Linux never returns EINTR if `timeout == 0'. */
+                return -errno;
+        }
+
+        for (int i = 0; i < n; ++i) {
+                if (n_dispatched >= N_DHCP4_SERVER_N_DISPATCH)
+                        return k ?: N_DHCP4_E_PREEMPTED;
+
+                if (events[i].data.ptr) {
+                        interface = c_container_of(events[i].data.ptr, NDhcp4ServerInterface, connection);
+
+                        /* freed by the event callback earlier in this round */
+                        if (!interface->server)
+                                continue;
+
+                        r = n_dhcp4_server_dispatch_connection(server, &interface->connection, &n_dispatched);
+                } else
+                        r = n_dhcp4_server_dispatch_timer(server, events + i, &n_dispatched);
+                if (r == N_DHCP4_E_PREEMPTED)
+                        return k ?: r;
+                else if (r && !k)
+                        k = r;
+        }
+
+        if (k)
+                return k;
+
+        /* more interfaces may be ready than fit into a single wait */
+        return (n == sizeof(events) / sizeof(*events)) ? N_DHCP4_E_PREEMPTED : 0;
+}
+
+static int n_dhcp4_server_flush_replies(NDhcp4Server *server) {
+        NDhcp4ServerInterface *interface;
+        int r, k = 0;
+
+        c_list_for_each_entry(interface, &server->interface_list, server_link) {
+                r = n_dhcp4_s_connection_flush_replies(&interface->connection);
+                if (r && r != N_DHCP4_E_DROPPED && r != N_DHCP4_E_DOWN && !k)
+                        k = r;
+        }
+
+        return k;
+}
+
+/*
+ * Arm the timerfd to the next timeout of the timer wheel, if it changed.
+ */
+static void n_dhcp4_server_arm_timer(NDhcp4Server *server) {
+        uint64_t timeout;
+
+        n_dhcp4_timer_wheel_get_timeout(&server->timers, &timeout);
+
+        if (timeout != server->scheduled_timeout) {
+                n_dhcp4_timerfd_arm(server->fd_timer, timeout);
+                server->scheduled_timeout = timeout;
+        }
+}
+
+/**
+ * n_dhcp4_server_dispatch() - XXX
+ */
+_c_public_ int n_dhcp4_server_dispatch(NDhcp4Server *server) {
+        NDhcp4ServerInterface *interface;
+        int r, k;
+
+        server->dispatching = true;
+        r = n_dhcp4_server_dispatch_io(server);
+        server->dispatching = false;
+
+        /* interfaces freed by the event callback, see n_dhcp4_server_interface_free() */
+        while ((interface = c_list_first_entry(&server->reap_list, NDhcp4ServerInterface, server_link))) {
+                c_list_unlink(&interface->server_link);
+                free(interface);
+        }
+
+        n_dhcp4_server_arm_timer(server);
+
+        /*
+         * Replies produced while dispatching are queued on the interfaces
+         * and sent in one go. Replies dropped, or lost to a link that went
+         * down, are not fatal, the clients will retransmit.
+         */
+        k = n_dhcp4_server_flush_replies(server);
+        if (k && (!r || r == N_DHCP4_E_PREEMPTED))
+                r = k;
+
+        /* internal error codes never leave the library */
+        if (r >= _N_DHCP4_E_INTERNAL)
+                return N_DHCP4_E_INTERNAL;
+
+        return r;
+}
+
 /**
  * n_dhcp4_server_pop_event() - XXX
  */
 _c_public_ int n_dhcp4_server_pop_event(NDhcp4Server *server, NDhcp4ServerEvent **eventp) {
         NDhcp4SEventNode *node, *t_node;
+        int r;
 
         c_list_for_each_entry_safe(node, t_node, &server->event_list, server_link) {
                 if (node->is_public) {
@@ -198,31 +739,125 @@ _c_public_ int n_dhcp4_server_pop_event(NDhcp4Server *server, NDhcp4ServerEvent
                 return 0;
         }
 
+        /*
+         * All events are processed, so send the replies the user queued while
+         * handling them in one go, and account for the leases they extended.
+         */
+        n_dhcp4_server_arm_timer(server);
+
+        r = n_dhcp4_server_flush_replies(server);
+        if (r)
+                return r;
+
         *eventp = NULL;
         return 0;
 }
 
 /**
- * n_dhcp4_server_add_ip() - XXX
+ * n_dhcp4_server_add_ip() - add server address
+ * @server:                     server to operate on
+ * @ipp:                        output argument for new server address
+ * @addr:                       address to add
+ *
+ * This adds @addr to the set of addresses of the interface @server was
+ * configured with. See n_dhcp4_server_interface_add_ip() for details.
+ *
+ * Return: 0 on success, -EADDRINUSE if @addr was added already, negative
+ *         error code on failure.
  */
 _c_public_ int n_dhcp4_server_add_ip(NDhcp4Server *server, NDhcp4ServerIp **ipp, struct in_addr addr) {
-        _c_cleanup_(n_dhcp4_server_ip_freep) NDhcp4ServerIp *ip = NULL;
+        return n_dhcp4_server_interface_add_ip(server->interface, ipp, addr);
+}
 
-        /* XXX: support more than one address */
-        if (server->connection.ip)
-                return -EBUSY;
+/**
+ * n_dhcp4_server_add_interface() - add interface to server
+ * @server:                     server to operate on
+ * @interfacep:                 output argument for new interface
+ * @ifindex:                    interface index to serve
+ *
+ * This opens the sockets of @server on another interface, using the same
+ * socket properties as the interface the server was configured with. Requests
+ * received on any interface are dispatched through the FD of the server, and
+ * share its leases and pools. Replies are sent on the interface the latest
+ * request of a client was received on, so a client moving between interfaces
+ * keeps its lease. Addresses must be added to the interface before it can
+ * reply to clients.
+ *
+ * The interface is served until it is freed by the caller, and stays valid
+ * even if @server is destroyed before. Freeing it does not affect traffic on
+ * any other interface.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+_c_public_ int n_dhcp4_server_add_interface(NDhcp4Server *server, NDhcp4ServerInterface **interfacep, int ifindex) {
+        _c_cleanup_(n_dhcp4_server_interface_freep) NDhcp4ServerInterface *interface = NULL;
+        int r;
 
-        ip = malloc(sizeof(*ip));
-        if (!ip)
+        interface = malloc(sizeof(*interface));
+        if (!interface)
                 return -ENOMEM;
 
-        *ip = (NDhcp4ServerIp)N_DHCP4_SERVER_IP_NULL(*ip);
+        *interface = (NDhcp4ServerInterface)N_DHCP4_SERVER_INTERFACE_NULL(*interface);
 
-        n_dhcp4_s_connection_ip_init(&ip->ip, addr);
-        n_dhcp4_s_connection_ip_link(&ip->ip, &server->connection);
+        r = n_dhcp4_s_connection_init(&interface->connection, ifindex, server->flags, server->buf);
+        if (r)
+                return r;
 
-        *ipp = ip;
-        ip = NULL;
+        if (server->n_steering) {
+                r = n_dhcp4_s_connection_steer(&interface->connection, server->n_steering);
+                if (r)
+                        return r;
+        }
+
+        r = epoll_ctl(server->fd_epoll,
+                      EPOLL_CTL_ADD,
+                      interface->connection.fd_udp,
+                      &(struct epoll_event){
+                                .events = EPOLLIN,
+                                .data.ptr = &interface->connection,
+                      });
+        if (r < 0)
+                return -errno;
+
+        interface->server = server;
+        c_list_link_tail(&server->interface_list, &interface->server_link);
+
+        *interfacep = interface;
+        interface = NULL;
+        return 0;
+}
+
+/**
+ * n_dhcp4_server_add_pool() - add address pool to server
+ * @server:                     server to operate on
+ * @poolp:                      output argument for new pool
+ * @subnet:                     subnet address
+ * @prefixlen:                  subnet prefix length, at least 8
+ *
+ * This creates a new, empty address pool for the given subnet and adds it to
+ * @server. Addresses are handed out to clients only once ranges have been
+ * added to the pool. The pool stays valid until it is freed by the caller,
+ * even if @server is destroyed before.
+ *
+ * Return: 0 on success, -EINVAL if @prefixlen is not supported,
+ *         N_DHCP4_E_INVALID_ADDRESS if @subnet has host bits set, negative
+ *         error code on failure.
+ */
+_c_public_ int n_dhcp4_server_add_pool(NDhcp4Server *server,
+                                       NDhcp4ServerPool **poolp,
+                                       struct in_addr subnet,
+                                       unsigned int prefixlen) {
+        _c_cleanup_(n_dhcp4_server_pool_freep) NDhcp4ServerPool *pool = NULL;
+        int r;
+
+        r = n_dhcp4_server_pool_new(&pool, subnet, prefixlen);
+        if (r)
+                return r;
+
+        n_dhcp4_server_pool_link(pool, server);
+
+        *poolp = pool;
+        pool = NULL;
         return 0;
 }
 
@@ -239,3 +874,128 @@ _c_public_ NDhcp4ServerIp *n_dhcp4_server_ip_free(NDhcp4ServerIp *ip) {
         free(ip);
         return NULL;
 }
+
+/**
+ * n_dhcp4_server_interface_unlink() - unlink interface from its server
+ * @interface:                  the interface to operate on
+ *
+ * Dissassociate an interface from its server and close its sockets, if it is
+ * associated with one. Otherwise, this is a noop. Replies queued on the
+ * interface are still sent. Leases whose latest request was received on the
+ * interface stay in the server, but cannot be replied to until the client
+ * sends its next request on another interface. The addresses of the interface
+ * are merely detached.
+ */
+void n_dhcp4_server_interface_unlink(NDhcp4ServerInterface *interface) {
+        NDhcp4Server *server = interface->server;
+        NDhcp4SConnection *connection = &interface->connection;
+        NDhcp4SConnectionIp *ip, *t_ip;
+        NDhcp4ServerLease *lease;
+        NDhcp4ServerPool *pool;
+
+        if (!server)
+                return;
+
+        n_dhcp4_s_connection_flush_replies(connection);
+
+        for (size_t i = 0; i < server->leases.n_buckets; ++i) {
+                lease = server->leases.by_key[i];
+                if (lease && lease->connection == connection)
+                        n_dhcp4_server_lease_detach(lease);
+        }
+
+        c_list_for_each_entry(pool, &server->pool_list, server_link) {
+                if (pool->ip_connection == connection) {
+                        pool->ip_connection = NULL;
+                        pool->ip = NULL;
+                }
+        }
+
+        epoll_ctl(server->fd_epoll, EPOLL_CTL_DEL, connection->fd_udp, NULL);
+
+        /* the socket is about to be closed, so do not bother updating its filter */
+        connection->filter_server_id = false;
+        c_list_for_each_entry_safe(ip, t_ip, &connection->ip_list, connection_link)
+                n_dhcp4_s_connection_ip_unlink(ip);
+        n_dhcp4_s_connection_deinit(connection);
+
+        c_list_unlink(&interface->server_link);
+        interface->server = NULL;
+}
+
+/**
+ * n_dhcp4_server_interface_free() - remove interface from server
+ * @interface:                  interface to operate on, or NULL
+ *
+ * This stops serving @interface and frees it. See
+ * n_dhcp4_server_interface_unlink() for what happens to the state associated
+ * with the interface. If @interface is NULL, this is a noop.
+ *
+ * This may be called from within the event callback of the server. The
+ * interface stops being served right away, but its memory is only released
+ * once the dispatch round is done, as the pending events of the round might
+ * still refer to it.
+ *
+ * Return: NULL is returned.
+ */
+_c_public_ NDhcp4ServerInterface *n_dhcp4_server_interface_free(NDhcp4ServerInterface *interface) {
+        NDhcp4Server *server;
+
+        if (!interface)
+                return NULL;
+
+        server = interface->server;
+
+        n_dhcp4_server_interface_unlink(interface);
+        n_dhcp4_s_connection_deinit(&interface->connection);
+
+        if (server && server->dispatching) {
+                c_list_link_tail(&server->reap_list, &interface->server_link);
+                return NULL;
+        }
+
+        free(interface);
+        return NULL;
+}
+
+/**
+ * n_dhcp4_server_interface_add_ip() - add server address to interface
+ * @interface:                  interface to operate on
+ * @ipp:                        output argument for new server address
+ * @addr:                       address to add
+ *
+ * This adds @addr to the set of addresses of @interface. Requests received on
+ * the interface and selecting any of them are handled by the server. Replies
+ * to clients on the subnet of a pool are sent from the address of the
+ * interface on that subnet, if any, and from the address added first
+ * otherwise. The address stays part of the set until it is freed by the
+ * caller.
+ *
+ * Return: 0 on success, -EADDRINUSE if @addr was added already,
+ *         -ENOTRECOVERABLE if the server of @interface was destroyed,
+ *         negative error code on failure.
+ */
+_c_public_ int n_dhcp4_server_interface_add_ip(NDhcp4ServerInterface *interface,
+                                               NDhcp4ServerIp **ipp,
+                                               struct in_addr addr) {
+        _c_cleanup_(n_dhcp4_server_ip_freep) NDhcp4ServerIp *ip = NULL;
+        int r;
+
+        if (!interface->server)
+                return -ENOTRECOVERABLE;
+
+        ip = malloc(sizeof(*ip));
+        if (!ip)
+                return -ENOMEM;
+
+        *ip = (NDhcp4ServerIp)N_DHCP4_SERVER_IP_NULL(*ip);
+
+        n_dhcp4_s_connection_ip_init(&ip->ip, addr);
+        r = n_dhcp4_s_connection_ip_link(&ip->ip, &interface->connection);
+        if (r)
+                return r;
+
+        *ipp = ip;
+        ip = NULL;
+        return 0;
+}
@@ -9,8 +9,9 @@
 #include <linux/if.h>
 #include <linux/if_packet.h>
 #include <linux/netdevice.h>
-#include <linux/udp.h>
+#include <linux/virtio_net.h>
 #include <netinet/ip.h>
+#include <netinet/udp.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -20,22 +21,16 @@
 #include "util/packet.h"
 #include "util/socket.h"
 
-/**
- * n_dhcp4_c_socket_packet_new() - create a new DHCP4 client packet socket
- * @sockfdp:            return argument for the new socket
- * @ifindex:            interface index to bind to
- *
- * Create a new AF_PACKET/SOCK_DGRAM socket usable to listen to and send DHCP client
- * packets before an IP address has been configured.
- *
- * Only unfragmented DHCP packets from a server to a client destined for the given
- * ifindex is returned.
- *
- * Return: 0 on success, or a negative error code on failure.
+/*
+ * Packet sockets are AF_PACKET/SOCK_DGRAM sockets, unless checksum offload is
+ * enabled. The kernel only supports PACKET_VNET_HDR on SOCK_RAW sockets, so
+ * those carry the ethernet header. Socket filters load relative to the network
+ * header via SKF_NET_OFF in that case, so they work the same for both.
  */
-int n_dhcp4_c_socket_packet_new(int *sockfdp, int ifindex) {
-        _c_cleanup_(c_closep) int sockfd = -1;
-        struct sock_filter filter[] = {
+static int n_dhcp4_c_socket_packet_attach(int sockfd, bool vnet_hdr, const NDhcp4Header *match) {
+        const uint32_t net = vnet_hdr ? SKF_NET_OFF : 0;
+        const uint32_t hlen = vnet_hdr ? ETH_HLEN : 0;
+        struct sock_filter base[] = {
                 /*
                  * IP
                  *
@@ -46,19 +41,19 @@ int n_dhcp4_c_socket_packet_new(int *sockfdp, int ifindex) {
                  *
                  *  Leave X the size of the IP header, for future indirect reads.
                  */
-                BPF_STMT(BPF_LD + BPF_B + BPF_ABS, offsetof(struct iphdr, protocol)),                           /* A <- IP protocol */
+                BPF_STMT(BPF_LD + BPF_B + BPF_ABS, net + offsetof(struct iphdr, protocol)),                     /* A <- IP protocol */
                 BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, IPPROTO_UDP, 1, 0),                                         /* IP protocol == UDP ? */
                 BPF_STMT(BPF_RET + BPF_K, 0),                                                                   /* ignore */
 
-                BPF_STMT(BPF_LD + BPF_H + BPF_ABS, offsetof(struct iphdr, frag_off)),                           /* A <- Flags + Fragment offset */
+                BPF_STMT(BPF_LD + BPF_H + BPF_ABS, net + offsetof(struct iphdr, frag_off)),                     /* A <- Flags + Fragment offset */
                 BPF_STMT(BPF_ALU + BPF_AND + BPF_K, IP_MF | IP_OFFMASK),                                        /* A <- A & (IP_MF | IP_OFFMASK) */
                 BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, 0, 1, 0),                                                   /* fragmented packet ? */
                 BPF_STMT(BPF_RET + BPF_K, 0),                                                                   /* ignore */
 
-                BPF_STMT(BPF_LDX + BPF_B + BPF_MSH, 0),                                                         /* X <- IP header length */
+                BPF_STMT(BPF_LDX + BPF_B + BPF_MSH, net),                                                       /* X <- IP header length */
                 BPF_STMT(BPF_LD + BPF_W + BPF_LEN, 0),                                                          /* A <- packet length */
                 BPF_STMT(BPF_ALU + BPF_SUB + BPF_X, 0),                                                         /* A -= X */
-                BPF_JUMP(BPF_JMP + BPF_JGE + BPF_K, sizeof(struct udphdr) + sizeof(NDhcp4Message), 1, 0),       /* packet >= DHCPPacket ? */
+                BPF_JUMP(BPF_JMP + BPF_JGE + BPF_K, hlen + sizeof(struct udphdr) + sizeof(NDhcp4Message), 1, 0),/* packet >= DHCPPacket ? */
                 BPF_STMT(BPF_RET + BPF_K, 0),                                                                   /* ignore */
 
                 /*
@@ -69,7 +64,7 @@ int n_dhcp4_c_socket_packet_new(int *sockfdp, int ifindex) {
                  *
                  * Leave X the size of IP and UDP headers, for future indirect reads.
                  */
-                BPF_STMT(BPF_LD + BPF_H + BPF_IND, offsetof(struct udphdr, dest)),                              /* A <- UDP destination port */
+                BPF_STMT(BPF_LD + BPF_H + BPF_IND, net + offsetof(struct udphdr, dest)),                        /* A <- UDP destination port */
                 BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, N_DHCP4_NETWORK_CLIENT_PORT, 1, 0),                         /* UDP destination port == DHCP client port ? */
                 BPF_STMT(BPF_RET + BPF_K, 0),                                                                   /* ignore */
 
@@ -84,20 +79,115 @@ int n_dhcp4_c_socket_packet_new(int *sockfdp, int ifindex) {
                  *  - BOOTREPLY (from server to client)
                  *  - DHCP magic cookie
                  */
-                BPF_STMT(BPF_LD + BPF_B + BPF_IND, offsetof(NDhcp4Header, op)),                                 /* A <- DHCP op */
+                BPF_STMT(BPF_LD + BPF_B + BPF_IND, net + offsetof(NDhcp4Header, op)),                           /* A <- DHCP op */
                 BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, N_DHCP4_OP_BOOTREPLY, 1, 0),                                /* op == BOOTREPLY ? */
                 BPF_STMT(BPF_RET + BPF_K, 0),                                                                   /* ignore */
 
-                BPF_STMT(BPF_LD + BPF_W + BPF_IND, offsetof(NDhcp4Message, magic)),                             /* A <- DHCP magic cookie */
+                BPF_STMT(BPF_LD + BPF_W + BPF_IND, net + offsetof(NDhcp4Message, magic)),                       /* A <- DHCP magic cookie */
                 BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, N_DHCP4_MESSAGE_MAGIC, 1, 0),                               /* cookie == DHCP magic cookie ? */
                 BPF_STMT(BPF_RET + BPF_K, 0),                                                                   /* ignore */
-
-                BPF_STMT(BPF_RET + BPF_K, 65535),                                                               /* return all */
         };
+        struct sock_filter filter[sizeof(base) / sizeof(*base) + 3 * (2 + sizeof(match->chaddr) / 4) + 1];
         struct sock_fprog fprog = {
                 .filter = filter,
-                .len = sizeof(filter) / sizeof(filter[0]),
         };
+        size_t n = sizeof(base) / sizeof(*base), n_chaddr;
+        uint32_t mode, value;
+        int r;
+
+        memcpy(filter, base, sizeof(base));
+
+        if (match) {
+                /*
+                 * DHCP transaction
+                 *
+                 * Check
+                 *  - Transaction ID of @match
+                 *  - Hardware address of @match
+                 *
+                 * BPF loads in network byte order, so the fields of @match
+                 * are converted to compare the same bytes.
+                 */
+                n_chaddr = match->hlen;
+                if (n_chaddr > sizeof(match->chaddr))
+                        n_chaddr = sizeof(match->chaddr);
+
+                filter[n++] = (struct sock_filter)BPF_STMT(BPF_LD + BPF_W + BPF_IND, net + offsetof(NDhcp4Header, xid));
+                filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, be32toh(match->xid), 1, 0);
+                filter[n++] = (struct sock_filter)BPF_STMT(BPF_RET + BPF_K, 0);
+
+                filter[n++] = (struct sock_filter)BPF_STMT(BPF_LD + BPF_B + BPF_IND, net + offsetof(NDhcp4Header, hlen));
+                filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, match->hlen, 1, 0);
+                filter[n++] = (struct sock_filter)BPF_STMT(BPF_RET + BPF_K, 0);
+
+                for (size_t i = 0, n_load; i < n_chaddr; i += n_load) {
+                        if (n_chaddr - i >= sizeof(uint32_t)) {
+                                uint32_t word;
+
+                                memcpy(&word, match->chaddr + i, sizeof(word));
+                                mode = BPF_W;
+                                value = be32toh(word);
+                                n_load = sizeof(word);
+                        } else if (n_chaddr - i >= sizeof(uint16_t)) {
+                                uint16_t half;
+
+                                memcpy(&half, match->chaddr + i, sizeof(half));
+                                mode = BPF_H;
+                                value = be16toh(half);
+                                n_load = sizeof(half);
+                        } else {
+                                mode = BPF_B;
+                                value = match->chaddr[i];
+                                n_load = 1;
+                        }
+
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_LD + mode + BPF_IND, net + offsetof(NDhcp4Header, chaddr) + i);
+                        filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, value, 1, 0);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_RET + BPF_K, 0);
+                }
+        }
+
+        filter[n++] = (struct sock_filter)BPF_STMT(BPF_RET + BPF_K, 65535);                                     /* return all */
+
+        c_assert(n <= sizeof(filter) / sizeof(*filter));
+        fprog.len = n;
+
+        r = setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog));
+        if (r < 0)
+                return -errno;
+
+        return 0;
+}
+
+/**
+ * n_dhcp4_c_socket_packet_filter() - restrict client packet socket to a transaction
+ * @sockfd:             socket to operate on
+ * @offload:            offload state of the socket
+ * @match:              header of the pending request, or NULL
+ *
+ * This replaces the filter of a client packet socket created via
+ * n_dhcp4_c_socket_packet_new(). If @match is given, only replies with the
+ * same transaction ID and hardware address as @match are passed on, so
+ * replies to other clients on the same link are dropped in the kernel. If
+ * @match is NULL, all DHCP replies are passed on, like on a new socket.
+ *
+ * Packets already queued on the socket are not affected.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+int n_dhcp4_c_socket_packet_filter(int sockfd, const NDhcp4SocketOffload *offload, const NDhcp4Header *match) {
+        return n_dhcp4_c_socket_packet_attach(sockfd, offload && offload->enabled, match);
+}
+
+/*
+ * If @ringp is given, a receive ring is set up before the socket is bound.
+ */
+static int n_dhcp4_c_socket_packet_open(int *sockfdp,
+                                        int ifindex,
+                                        NDhcp4SocketOffload *offload,
+                                        struct packet_ring **ringp) {
+        _c_cleanup_(packet_ring_freep) struct packet_ring *ring = NULL;
+        _c_cleanup_(c_closep) int sockfd = -1;
         struct sockaddr_ll addr = {
                 .sll_family = AF_PACKET,
                 .sll_protocol = htons(ETH_P_IP),
@@ -105,28 +195,102 @@ int n_dhcp4_c_socket_packet_new(int *sockfdp, int ifindex) {
         };
         int r, on = 1;
 
-        sockfd = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        sockfd = socket(AF_PACKET, (offload ? SOCK_RAW : SOCK_DGRAM) | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
         if (sockfd < 0)
                 return -errno;
 
-        r = setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog));
-        if (r < 0)
-                return -errno;
+        if (offload) {
+                r = packet_enable_vnet_hdr(sockfd, ifindex, offload->haddr);
+                if (r)
+                        return r;
+        }
+
+        r = n_dhcp4_c_socket_packet_attach(sockfd, !!offload, NULL);
+        if (r)
+                return r;
 
         /* We need the flag that tells us if the checksum is correct. */
         r = setsockopt(sockfd, SOL_PACKET, PACKET_AUXDATA, &on, sizeof(on));
         if (r < 0)
                 return -errno;
 
+        if (ringp) {
+                r = packet_ring_new(&ring, sockfd);
+                if (r)
+                        return r;
+        }
+
         r = bind(sockfd, (struct sockaddr*)&addr, sizeof(addr));
         if (r < 0)
                 return -errno;
 
+        if (ringp) {
+                *ringp = ring;
+                ring = NULL;
+        }
+
         *sockfdp = sockfd;
         sockfd = -1;
         return 0;
 }
 
+/**
+ * n_dhcp4_c_socket_packet_new() - create a new DHCP4 client packet socket
+ * @sockfdp:            return argument for the new socket
+ * @ifindex:            interface index to bind to
+ * @flags:              N_DHCP4_SOCKET_FLAG_* flags
+ * @offloadp:           return argument for the offload state of the socket
+ * @ringp:              return argument for the receive ring of the socket
+ *
+ * Create a new AF_PACKET socket usable to listen to and send DHCP client
+ * packets before an IP address has been configured.
+ *
+ * Only unfragmented DHCP packets from a server to a client destined for the given
+ * ifindex is returned.
+ *
+ * If N_DHCP4_SOCKET_FLAG_VNET_HDR is passed, UDP checksums of sent packets are
+ * offloaded to the kernel, if the interface supports it, see
+ * packet_enable_vnet_hdr(). Otherwise, or if that fails, this silently falls
+ * back to a socket that computes checksums in software. The returned
+ * @offloadp must be passed to all operations on the socket.
+ *
+ * If N_DHCP4_C_SOCKET_FLAG_RX_RING is passed, packets are received through a
+ * memory-mapped ring, see packet_ring_new(), unless checksum offload was
+ * enabled, which the kernel does not support together with rings. If the ring
+ * cannot be set up, this silently falls back to a plain socket. The returned
+ * @ringp is NULL in that case, and must be passed to all receive operations
+ * on the socket otherwise. The caller owns the ring, and must free it when
+ * closing the socket.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+int n_dhcp4_c_socket_packet_new(int *sockfdp,
+                                int ifindex,
+                                unsigned int flags,
+                                NDhcp4SocketOffload *offloadp,
+                                struct packet_ring **ringp) {
+        int r;
+
+        *offloadp = (NDhcp4SocketOffload)N_DHCP4_SOCKET_OFFLOAD_NULL(*offloadp);
+        *ringp = NULL;
+
+        if (flags & N_DHCP4_SOCKET_FLAG_VNET_HDR) {
+                r = n_dhcp4_c_socket_packet_open(sockfdp, ifindex, offloadp, NULL);
+                if (!r) {
+                        offloadp->enabled = true;
+                        return 0;
+                }
+        }
+
+        if (flags & N_DHCP4_C_SOCKET_FLAG_RX_RING) {
+                r = n_dhcp4_c_socket_packet_open(sockfdp, ifindex, NULL, ringp);
+                if (!r)
+                        return 0;
+        }
+
+        return n_dhcp4_c_socket_packet_open(sockfdp, ifindex, NULL, NULL);
+}
+
 /**
  * n_dhcp4_c_socket_udp_new() - create a new DHCP4 client UDP socket
  * @sockfdp:            return argument for the new socket
@@ -228,50 +392,71 @@ int n_dhcp4_c_socket_udp_new(int *sockfdp,
         return 0;
 }
 
-/**
- * n_dhcp4_s_socket_packet_new() - create a new DHCP4 server packet socket
- * @sockfdp:            return argument for the new socket
- *
- * Create a new AF_PACKET/SOCK_DGRAM socket usable to send DHCP packets to clients
- * before they have an IP address configured, on the given interface.
- *
- * Return: 0 on success, or a negative error code on failure.
- */
-int n_dhcp4_s_socket_packet_new(int *sockfdp) {
+static int n_dhcp4_s_socket_packet_open(int *sockfdp, int ifindex, NDhcp4SocketOffload *offload) {
         _c_cleanup_(c_closep) int sockfd = -1;
+        int r;
 
-        sockfd = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        sockfd = socket(AF_PACKET, (offload ? SOCK_RAW : SOCK_DGRAM) | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
         if (sockfd < 0)
                 return -errno;
 
+        if (offload) {
+                r = packet_enable_vnet_hdr(sockfd, ifindex, offload->haddr);
+                if (r)
+                        return r;
+        }
+
         *sockfdp = sockfd;
         sockfd = -1;
         return 0;
 }
 
 /**
- * n_dhcp4_s_socket_udp_new() - create a new DHCP4 server UDP socket
+ * n_dhcp4_s_socket_packet_new() - create a new DHCP4 server packet socket
  * @sockfdp:            return argument for the new socket
- * @ifindex:            intercafe index to bind to
+ * @ifindex:            interface index to send on
+ * @flags:              N_DHCP4_SOCKET_FLAG_* flags
+ * @offloadp:           return argument for the offload state of the socket
  *
- * Create a new AF_INET/SOCK_DGRAM socket usable to listen to DHCP server packets,
- * on the given interface.
+ * Create a new AF_PACKET socket usable to send DHCP packets to clients before
+ * they have an IP address configured, on the given interface.
+ *
+ * N_DHCP4_SOCKET_FLAG_VNET_HDR is handled as with
+ * n_dhcp4_c_socket_packet_new().
  *
  * Return: 0 on success, or a negative error code on failure.
  */
-int n_dhcp4_s_socket_udp_new(int *sockfdp, int ifindex) {
-        _c_cleanup_(c_closep) int sockfd = -1;
-        struct sock_filter filter[] = {
-                /*
-                 * IP/UDP
-                 *
-                 * Set X to the size of IP and UDP headers, for future indirect reads.
-                 */
-                BPF_STMT(BPF_LDX + BPF_B + BPF_MSH, 0),                                                         /* X <- IP header length */
-                BPF_STMT(BPF_LD + BPF_W + BPF_K, sizeof(struct udphdr)),                                        /* A <- size of UDP header */
-                BPF_STMT(BPF_ALU + BPF_ADD + BPF_X, 0),                                                         /* A += X */
-                BPF_STMT(BPF_MISC + BPF_TAX, 0),                                                                /* X <- A */
+int n_dhcp4_s_socket_packet_new(int *sockfdp, int ifindex, unsigned int flags, NDhcp4SocketOffload *offloadp) {
+        int r;
+
+        *offloadp = (NDhcp4SocketOffload)N_DHCP4_SOCKET_OFFLOAD_NULL(*offloadp);
+
+        if (flags & N_DHCP4_SOCKET_FLAG_VNET_HDR) {
+                r = n_dhcp4_s_socket_packet_open(sockfdp, ifindex, offloadp);
+                if (!r) {
+                        offloadp->enabled = true;
+                        return 0;
+                }
+        }
+
+        return n_dhcp4_s_socket_packet_open(sockfdp, ifindex, NULL);
+}
 
+/*
+ * Socket filters of UDP sockets see the datagram starting at its UDP header,
+ * the IP header has already been stripped.
+ *
+ * If @server_id is set, the program further walks the options of REQUESTs,
+ * and drops those with a server identifier not in @ids, as they select
+ * another server. Classic BPF cannot loop, so the walk is unrolled for the
+ * first N_DHCP4_S_SOCKET_N_FILTER_OPTIONS options, and anything it cannot
+ * decide on is passed on, to be handled in userspace. This includes truncated,
+ * overloaded and malformed options.
+ * The filter is only an optimization; it never drops anything that
+ * n_dhcp4_s_connection_dispatch_io() would handle.
+ */
+static int n_dhcp4_s_socket_udp_attach(int sockfd, bool server_id, const struct in_addr *ids, size_t n_ids) {
+        const struct sock_filter base[] = {
                 /*
                  * DHCP
                  *
@@ -280,20 +465,157 @@ int n_dhcp4_s_socket_udp_new(int *sockfdp, int ifindex) {
                  *  - DHCP magic cookie
                  */
 
-                BPF_STMT(BPF_LD + BPF_B + BPF_IND, offsetof(NDhcp4Header, op)),                                 /* A <- DHCP op */
+                BPF_STMT(BPF_LD + BPF_B + BPF_ABS, sizeof(struct udphdr) + offsetof(NDhcp4Header, op)),         /* A <- DHCP op */
                 BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, N_DHCP4_OP_BOOTREQUEST, 1, 0),                              /* op == BOOTREQUEST ? */
                 BPF_STMT(BPF_RET + BPF_K, 0),                                                                   /* ignore */
 
-                BPF_STMT(BPF_LD + BPF_W + BPF_IND, offsetof(NDhcp4Message, magic)),                             /* A <- DHCP magic cookie */
+                BPF_STMT(BPF_LD + BPF_W + BPF_ABS, sizeof(struct udphdr) + offsetof(NDhcp4Message, magic)),     /* A <- DHCP magic cookie */
                 BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, N_DHCP4_MESSAGE_MAGIC, 1, 0),                               /* cookie == DHCP magic cookie ? */
                 BPF_STMT(BPF_RET + BPF_K, 0),                                                                   /* ignore */
-
-                BPF_STMT(BPF_RET + BPF_K, 65535),                                                               /* return all */
-        };
-        struct sock_fprog fprog = {
-                .filter = filter,
-                .len = sizeof(filter) / sizeof(filter[0]),
         };
+        _c_cleanup_(c_freep) struct sock_filter *filter = NULL;
+        struct sock_fprog fprog = {};
+        size_t n = sizeof(base) / sizeof(*base), n_filter = n + 1, i_start, i_advance, i_jump;
+        int r;
+
+        if (n_ids > N_DHCP4_S_SOCKET_MAX_FILTER_IDS)
+                server_id = false;
+
+        if (server_id)
+                n_filter += 4 + N_DHCP4_S_SOCKET_N_FILTER_OPTIONS * (51 + n_ids);
+
+        filter = malloc(n_filter * sizeof(*filter));
+        if (!filter)
+                return -ENOMEM;
+
+        memcpy(filter, base, sizeof(base));
+
+        if (server_id) {
+                /*
+                 * Options
+                 *
+                 * M[0] is set once a REQUEST message type was seen, M[1] once
+                 * a foreign server identifier was seen. X is the offset of the
+                 * current option.
+                 */
+                filter[n++] = (struct sock_filter)BPF_STMT(BPF_LD + BPF_IMM, 0);
+                filter[n++] = (struct sock_filter)BPF_STMT(BPF_ST, 0);
+                filter[n++] = (struct sock_filter)BPF_STMT(BPF_ST, 1);
+                filter[n++] = (struct sock_filter)BPF_STMT(BPF_LDX + BPF_W + BPF_IMM, sizeof(struct udphdr) + offsetof(NDhcp4Message, options));
+
+                for (size_t i = 0; i < N_DHCP4_S_SOCKET_N_FILTER_OPTIONS; ++i) {
+                        i_start = n;
+
+                        /* pass on truncated options, here and below before reading any of their bytes */
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_LD + BPF_W + BPF_LEN, 0);
+                        filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP + BPF_JGT + BPF_X, 0, 1, 0);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_RET + BPF_K, 65535);
+
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_LD + BPF_B + BPF_IND, 0);
+                        filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, N_DHCP4_OPTION_END, 0, 1);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_RET + BPF_K, 65535);
+                        filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, N_DHCP4_OPTION_OVERLOAD, 0, 1);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_RET + BPF_K, 65535);
+
+                        /* PAD is a single byte, skip it */
+                        filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, N_DHCP4_OPTION_PAD, 0, 4);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_MISC + BPF_TXA, 0);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_ALU + BPF_ADD + BPF_K, 1);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_MISC + BPF_TAX, 0);
+                        i_jump = n;
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_JMP + BPF_JA, 0);
+
+                        /* drop a REQUEST once a foreign server identifier was seen, pass on anything else */
+                        filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, N_DHCP4_OPTION_MESSAGE_TYPE, 0, 13);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_LD + BPF_W + BPF_LEN, 0);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_ALU + BPF_SUB + BPF_K, 2);
+                        filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP + BPF_JGT + BPF_X, 0, 1, 0);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_RET + BPF_K, 65535);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_LD + BPF_B + BPF_IND, 2);
+                        filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, N_DHCP4_MESSAGE_REQUEST, 1, 0);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_RET + BPF_K, 65535);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_LD + BPF_MEM, 1);
+                        filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, 0, 1, 0);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_RET + BPF_K, 0);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_LD + BPF_IMM, 1);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_ST, 0);
+                        filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP + BPF_JA, 14 + n_ids + !!n_ids, 0, 0);
+
+                        /* pass on own server identifiers, drop a REQUEST with a foreign one */
+                        filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, N_DHCP4_OPTION_SERVER_IDENTIFIER, 0, 13 + n_ids + !!n_ids);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_LD + BPF_W + BPF_LEN, 0);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_ALU + BPF_SUB + BPF_K, 5);
+                        filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP + BPF_JGT + BPF_X, 0, 1, 0);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_RET + BPF_K, 65535);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_LD + BPF_B + BPF_IND, 1);
+                        filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, sizeof(struct in_addr), 1, 0);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_RET + BPF_K, 65535);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_LD + BPF_W + BPF_IND, 2);
+                        for (size_t j = 0; j < n_ids; ++j) {
+                                if (j + 1 < n_ids)
+                                        filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, be32toh(ids[j].s_addr), n_ids - j - 1, 0);
+                                else
+                                        filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, be32toh(ids[j].s_addr), 0, 1);
+                        }
+                        if (n_ids)
+                                filter[n++] = (struct sock_filter)BPF_STMT(BPF_RET + BPF_K, 65535);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_LD + BPF_MEM, 0);
+                        filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, 0, 1, 0);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_RET + BPF_K, 0);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_LD + BPF_IMM, 1);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_ST, 1);
+
+                        /* advance to the next option */
+                        i_advance = n;
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_LD + BPF_W + BPF_LEN, 0);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_ALU + BPF_SUB + BPF_K, 1);
+                        filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP + BPF_JGT + BPF_X, 0, 1, 0);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_RET + BPF_K, 65535);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_LD + BPF_B + BPF_IND, 1);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_ALU + BPF_ADD + BPF_K, 2);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_ALU + BPF_ADD + BPF_X, 0);
+                        filter[n++] = (struct sock_filter)BPF_STMT(BPF_MISC + BPF_TAX, 0);
+
+                        filter[i_jump].k = n - i_jump - 1;
+                        c_assert(i_advance - i_start == 41 + n_ids + !!n_ids);
+                }
+        }
+
+        filter[n++] = (struct sock_filter)BPF_STMT(BPF_RET + BPF_K, 65535);                                     /* return all */
+
+        c_assert(n <= n_filter);
+        fprog.filter = filter;
+        fprog.len = n;
+
+        r = setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog));
+        if (r < 0)
+                return -errno;
+
+        return 0;
+}
+
+/**
+ * n_dhcp4_s_socket_udp_new() - create a new DHCP4 server UDP socket
+ * @sockfdp:            return argument for the new socket
+ * @ifindex:            intercafe index to bind to
+ * @flags:              N_DHCP4_S_SOCKET_FLAG_* flags
+ *
+ * Create a new AF_INET/SOCK_DGRAM socket usable to listen to DHCP server packets,
+ * on the given interface.
+ *
+ * Only one such socket can be bound to an interface, unless all of them pass
+ * N_DHCP4_S_SOCKET_FLAG_REUSEPORT. In that case the kernel distributes the
+ * incoming packets across the sockets, see SO_REUSEPORT in socket(7). This
+ * allows running several servers for the same interface on separate threads.
+ *
+ * If N_DHCP4_S_SOCKET_FLAG_SERVER_ID is passed, REQUESTs carrying a server
+ * identifier are dropped in the kernel until the set of own identifiers is
+ * provided via n_dhcp4_s_socket_udp_filter().
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+int n_dhcp4_s_socket_udp_new(int *sockfdp, int ifindex, unsigned int flags) {
+        _c_cleanup_(c_closep) int sockfd = -1;
         struct sockaddr_in addr = {
                 .sin_family = AF_INET,
                 .sin_addr = { INADDR_ANY },
@@ -305,9 +627,9 @@ int n_dhcp4_s_socket_udp_new(int *sockfdp, int ifindex) {
         if (sockfd < 0)
                 return -errno;
 
-        r = setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog));
-        if (r < 0)
-                return -errno;
+        r = n_dhcp4_s_socket_udp_attach(sockfd, flags & N_DHCP4_S_SOCKET_FLAG_SERVER_ID, NULL, 0);
+        if (r)
+                return r;
 
         r = socket_bind_if(sockfd, ifindex);
         if (r)
@@ -325,6 +647,12 @@ int n_dhcp4_s_socket_udp_new(int *sockfdp, int ifindex) {
         if (r < 0)
                 return -errno;
 
+        if (flags & N_DHCP4_S_SOCKET_FLAG_REUSEPORT) {
+                r = setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+                if (r < 0)
+                        return -errno;
+        }
+
         r = bind(sockfd, (struct sockaddr*)&addr, sizeof(addr));
         if (r < 0)
                 return -errno;
@@ -334,7 +662,93 @@ int n_dhcp4_s_socket_udp_new(int *sockfdp, int ifindex) {
         return 0;
 }
 
+/**
+ * n_dhcp4_s_socket_udp_filter() - drop REQUESTs selecting other servers
+ * @sockfd:             server UDP socket created with N_DHCP4_S_SOCKET_FLAG_SERVER_ID
+ * @ids:                own server identifiers
+ * @n_ids:              number of entries in @ids
+ *
+ * This replaces the filter of @sockfd, so REQUESTs with a server identifier
+ * not in @ids are dropped in the kernel. Those select an offer of another
+ * server and would be ignored anyway. This must be called whenever the set of
+ * server addresses changes.
+ *
+ * If @n_ids exceeds N_DHCP4_S_SOCKET_MAX_FILTER_IDS, the filter passes on all
+ * REQUESTs instead, leaving them to be ignored in userspace.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+int n_dhcp4_s_socket_udp_filter(int sockfd, const struct in_addr *ids, size_t n_ids) {
+        return n_dhcp4_s_socket_udp_attach(sockfd, true, ids, n_ids);
+}
+
+/**
+ * n_dhcp4_s_socket_udp_steer() - steer clients to fixed servers of a reuseport group
+ * @sockfd:             server UDP socket created with N_DHCP4_S_SOCKET_FLAG_REUSEPORT
+ * @n_sockets:          number of sockets in the reuseport group
+ *
+ * Attach a classic BPF program to the reuseport group of @sockfd, which picks
+ * the receiving socket based on a hash of the client hardware address, rather
+ * than the default hash of the UDP 4-tuple. All requests of a given client are
+ * thus delivered to the same socket, as long as the group is not modified.
+ *
+ * The program is shared by the whole group, so it is sufficient to attach it
+ * through any one socket of the group. The kernel indexes the group in the
+ * order its sockets were bound, and falls back to the default hash if the
+ * computed index does not refer to a socket. Requests too short to carry a
+ * hardware address also take that fallback.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+int n_dhcp4_s_socket_udp_steer(int sockfd, unsigned int n_sockets) {
+        /*
+         * The program sees the UDP payload, i.e., the DHCP header. Mix the
+         * four words of chaddr with a multiplicative hash and take it modulo
+         * the group size.
+         */
+        struct sock_filter filter[] = {
+                BPF_STMT(BPF_LD + BPF_W + BPF_LEN, 0),                                                          /* A <- packet length */
+                BPF_JUMP(BPF_JMP + BPF_JGE + BPF_K, sizeof(NDhcp4Header), 1, 0),                                /* packet >= DHCP header ? */
+                BPF_STMT(BPF_RET + BPF_K, n_sockets),                                                           /* fall back to default hash */
+
+                BPF_STMT(BPF_LD + BPF_W + BPF_ABS, offsetof(NDhcp4Header, chaddr) + 0),                         /* A <- chaddr[0..3] */
+                BPF_STMT(BPF_ALU + BPF_MUL + BPF_K, 0x9e3779b1),                                                /* A *= golden ratio */
+                BPF_STMT(BPF_MISC + BPF_TAX, 0),                                                                /* X <- A */
+                BPF_STMT(BPF_LD + BPF_W + BPF_ABS, offsetof(NDhcp4Header, chaddr) + 4),                         /* A <- chaddr[4..7] */
+                BPF_STMT(BPF_ALU + BPF_XOR + BPF_X, 0),                                                         /* A ^= X */
+                BPF_STMT(BPF_ALU + BPF_MUL + BPF_K, 0x9e3779b1),                                                /* A *= golden ratio */
+                BPF_STMT(BPF_MISC + BPF_TAX, 0),                                                                /* X <- A */
+                BPF_STMT(BPF_LD + BPF_W + BPF_ABS, offsetof(NDhcp4Header, chaddr) + 8),                         /* A <- chaddr[8..11] */
+                BPF_STMT(BPF_ALU + BPF_XOR + BPF_X, 0),                                                         /* A ^= X */
+                BPF_STMT(BPF_ALU + BPF_MUL + BPF_K, 0x9e3779b1),                                                /* A *= golden ratio */
+                BPF_STMT(BPF_MISC + BPF_TAX, 0),                                                                /* X <- A */
+                BPF_STMT(BPF_LD + BPF_W + BPF_ABS, offsetof(NDhcp4Header, chaddr) + 12),                        /* A <- chaddr[12..15] */
+                BPF_STMT(BPF_ALU + BPF_XOR + BPF_X, 0),                                                         /* A ^= X */
+                BPF_STMT(BPF_ALU + BPF_MUL + BPF_K, 0x9e3779b1),                                                /* A *= golden ratio */
+
+                BPF_STMT(BPF_MISC + BPF_TAX, 0),                                                                /* X <- A */
+                BPF_STMT(BPF_ALU + BPF_RSH + BPF_K, 16),                                                        /* A >>= 16 */
+                BPF_STMT(BPF_ALU + BPF_XOR + BPF_X, 0),                                                         /* A ^= X */
+                BPF_STMT(BPF_ALU + BPF_MOD + BPF_K, n_sockets),                                                 /* A %= number of sockets */
+                BPF_STMT(BPF_RET + BPF_A, 0),                                                                   /* return socket index */
+        };
+        struct sock_fprog fprog = {
+                .filter = filter,
+                .len = sizeof(filter) / sizeof(filter[0]),
+        };
+        int r;
+
+        c_assert(n_sockets > 0);
+
+        r = setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &fprog, sizeof(fprog));
+        if (r < 0)
+                return -errno;
+
+        return 0;
+}
+
 static int n_dhcp4_socket_packet_send(int sockfd,
+                                      const NDhcp4SocketOffload *offload,
                                       int ifindex,
                                       const struct sockaddr_in *src_paddr,
                                       const unsigned char *dest_haddr,
@@ -347,6 +761,11 @@ static int n_dhcp4_socket_packet_send(int sockfd,
                 .sll_ifindex = ifindex,
                 .sll_halen = halen,
         };
+        struct packet_vnet_hdr partial_vnet_hdr;
+        struct udphdr partial_udp_hdr;
+        struct iphdr partial_ip_hdr;
+        const struct udphdr *udp_hdr;
+        const struct iphdr *ip_hdr;
         const void *buf;
         size_t n_buf, len;
         int r;
@@ -357,7 +776,30 @@ static int n_dhcp4_socket_packet_send(int sockfd,
 
         n_buf = n_dhcp4_outgoing_get_raw(message, &buf);
 
-        r = packet_sendto_udp(sockfd, buf, n_buf, &len, src_paddr, &haddr, dest_paddr);
+        if (offload && offload->enabled) {
+                c_assert(halen == ETH_ALEN);
+
+                packet_init_udp_partial(&partial_vnet_hdr,
+                                        &partial_ip_hdr,
+                                        &partial_udp_hdr,
+                                        n_buf,
+                                        offload->haddr,
+                                        src_paddr,
+                                        dest_haddr,
+                                        dest_paddr);
+                r = packet_sendmsg_udp(sockfd,
+                                       &partial_vnet_hdr,
+                                       &partial_ip_hdr,
+                                       &partial_udp_hdr,
+                                       buf,
+                                       n_buf,
+                                       &len,
+                                       &haddr);
+        } else {
+                n_dhcp4_outgoing_get_udp_headers(message, src_paddr, dest_paddr, &ip_hdr, &udp_hdr);
+                r = packet_sendmsg_udp(sockfd, NULL, ip_hdr, udp_hdr, buf, n_buf, &len, &haddr);
+        }
+
         if (r < 0) {
                 if (r == -EAGAIN || r == -ENOBUFS)
                         return N_DHCP4_E_DROPPED;
@@ -376,6 +818,7 @@ static int n_dhcp4_socket_packet_send(int sockfd,
  * n_dhcp4_c_socket_packet_send() - XXX
  */
 int n_dhcp4_c_socket_packet_send(int sockfd,
+                                 const NDhcp4SocketOffload *offload,
                                  int ifindex,
                                  const unsigned char *dest_haddr,
                                  unsigned char halen,
@@ -392,6 +835,7 @@ int n_dhcp4_c_socket_packet_send(int sockfd,
         };
 
         return n_dhcp4_socket_packet_send(sockfd,
+                                          offload,
                                           ifindex,
                                           &src_paddr,
                                           dest_haddr,
@@ -463,6 +907,7 @@ int n_dhcp4_c_socket_udp_broadcast(int sockfd, NDhcp4Outgoing *message) {
  * n_dhcp4_s_socket_packet_send() - XXX
  */
 int n_dhcp4_s_socket_packet_send(int sockfd,
+                                 const NDhcp4SocketOffload *offload,
                                  int ifindex,
                                  const struct in_addr *src_inaddr,
                                  const unsigned char *dest_haddr,
@@ -481,6 +926,7 @@ int n_dhcp4_s_socket_packet_send(int sockfd,
         };
 
         return n_dhcp4_socket_packet_send(sockfd,
+                                          offload,
                                           ifindex,
                                           &src_paddr,
                                           dest_haddr,
@@ -550,15 +996,239 @@ int n_dhcp4_s_socket_udp_broadcast(int sockfd,
                                          message);
 }
 
+static int n_dhcp4_socket_sendmmsg(int sockfd,
+                                   struct mmsghdr *msgs,
+                                   size_t n_msgs,
+                                   bool *droppedp) {
+        size_t i = 0;
+        int n;
+
+        while (i < n_msgs) {
+                n = sendmmsg(sockfd, msgs + i, n_msgs - i, 0);
+                if (n < 0) {
+                        if (errno == EAGAIN || errno == ENOBUFS) {
+                                /* drop the failing datagram, but try the rest */
+                                *droppedp = true;
+                                ++i;
+                                continue;
+                        } else if (errno == ENETDOWN || errno == ENXIO) {
+                                return N_DHCP4_E_DOWN;
+                        } else {
+                                return -errno;
+                        }
+                }
+
+                for (size_t j = i; j < i + n; ++j) {
+                        size_t len = 0;
+
+                        for (size_t k = 0; k < msgs[j].msg_hdr.msg_iovlen; ++k)
+                                len += msgs[j].msg_hdr.msg_iov[k].iov_len;
+
+                        if (msgs[j].msg_len < len)
+                                *droppedp = true;
+                }
+
+                i += n;
+        }
+
+        return 0;
+}
+
+/**
+ * n_dhcp4_s_socket_packet_send_batch() - send a batch of replies on a packet socket
+ * @sockfd:             server packet socket
+ * @offload:            offload state of @sockfd, or NULL
+ * @ifindex:            interface index to send on
+ * @replies:            replies to send, all with a hardware address
+ * @n_replies:          number of replies
+ *
+ * Send all replies in @replies directly to the hardware address of each
+ * client, using as few sendmmsg(2) calls as possible. A reply that cannot be
+ * queued by the kernel is dropped, and the remaining ones are still sent.
+ *
+ * If checksum offload is enabled on @sockfd, the UDP checksums are left to
+ * the kernel, and the payloads are not read at all.
+ *
+ * Return: 0 on success, N_DHCP4_E_DROPPED if any reply was dropped,
+ *         N_DHCP4_E_DOWN if the interface is down, or a negative error
+ *         code on failure.
+ */
+int n_dhcp4_s_socket_packet_send_batch(int sockfd,
+                                       const NDhcp4SocketOffload *offload,
+                                       int ifindex,
+                                       NDhcp4SReply *replies,
+                                       size_t n_replies) {
+        struct packet_sockaddr_ll haddrs[N_DHCP4_S_SOCKET_MAX_BATCH];
+        struct packet_vnet_hdr vnet_hdrs[N_DHCP4_S_SOCKET_MAX_BATCH];
+        struct iphdr ip_hdrs[N_DHCP4_S_SOCKET_MAX_BATCH];
+        struct udphdr udp_hdrs[N_DHCP4_S_SOCKET_MAX_BATCH];
+        struct iovec iovs[N_DHCP4_S_SOCKET_MAX_BATCH][4];
+        struct mmsghdr msgs[N_DHCP4_S_SOCKET_MAX_BATCH];
+        bool vnet_hdr = offload && offload->enabled;
+        bool dropped = false;
+        size_t n;
+        int r;
+
+        for (size_t i_reply = 0; i_reply < n_replies; i_reply += n) {
+                n = n_replies - i_reply;
+                if (n > N_DHCP4_S_SOCKET_MAX_BATCH)
+                        n = N_DHCP4_S_SOCKET_MAX_BATCH;
+
+                for (size_t i = 0; i < n; ++i) {
+                        NDhcp4SReply *reply = &replies[i_reply + i];
+                        struct sockaddr_in src_paddr = {
+                                .sin_family = AF_INET,
+                                .sin_port = htons(N_DHCP4_NETWORK_SERVER_PORT),
+                                .sin_addr = reply->src,
+                        };
+                        struct sockaddr_in dest_paddr = {
+                                .sin_family = AF_INET,
+                                .sin_port = htons(N_DHCP4_NETWORK_CLIENT_PORT),
+                                .sin_addr = reply->dest,
+                        };
+                        const void *buf;
+                        size_t n_buf;
+
+                        c_assert(reply->haddr);
+                        c_assert(reply->halen <= sizeof(haddrs[i].sll_addr));
+
+                        haddrs[i] = (struct packet_sockaddr_ll){
+                                .sll_family = AF_PACKET,
+                                .sll_protocol = htons(ETH_P_IP),
+                                .sll_ifindex = ifindex,
+                                .sll_halen = reply->halen,
+                        };
+                        memcpy(haddrs[i].sll_addr, reply->haddr, reply->halen);
+
+                        n_buf = n_dhcp4_outgoing_get_raw(reply->message, &buf);
+                        if (vnet_hdr) {
+                                c_assert(reply->halen == ETH_ALEN);
+                                packet_init_udp_partial(&vnet_hdrs[i],
+                                                        &ip_hdrs[i],
+                                                        &udp_hdrs[i],
+                                                        n_buf,
+                                                        offload->haddr,
+                                                        &src_paddr,
+                                                        reply->haddr,
+                                                        &dest_paddr);
+                        } else {
+                                packet_init_udp(&ip_hdrs[i], &udp_hdrs[i], buf, n_buf, &src_paddr, &dest_paddr);
+                        }
+
+                        iovs[i][0] = (struct iovec){ .iov_base = &vnet_hdrs[i], .iov_len = sizeof(vnet_hdrs[i]) };
+                        iovs[i][1] = (struct iovec){ .iov_base = &ip_hdrs[i], .iov_len = sizeof(ip_hdrs[i]) };
+                        iovs[i][2] = (struct iovec){ .iov_base = &udp_hdrs[i], .iov_len = sizeof(udp_hdrs[i]) };
+                        iovs[i][3] = (struct iovec){ .iov_base = (void *)buf, .iov_len = n_buf };
+
+                        msgs[i] = (struct mmsghdr){
+                                .msg_hdr = {
+                                        .msg_name = (void*)&haddrs[i],
+                                        .msg_namelen = sizeof(haddrs[i]),
+                                        .msg_iov = vnet_hdr ? iovs[i] : iovs[i] + 1,
+                                        .msg_iovlen = vnet_hdr ? 4 : 3,
+                                },
+                        };
+                }
+
+                r = n_dhcp4_socket_sendmmsg(sockfd, msgs, n, &dropped);
+                if (r)
+                        return r;
+        }
+
+        return dropped ? N_DHCP4_E_DROPPED : 0;
+}
+
+/**
+ * n_dhcp4_s_socket_udp_send_batch() - send a batch of replies on a UDP socket
+ * @sockfd:             server UDP socket
+ * @replies:            replies to send
+ * @n_replies:          number of replies
+ *
+ * Send all replies in @replies from their respective server address to the
+ * client port, using as few sendmmsg(2) calls as possible. A reply that cannot
+ * be queued by the kernel is dropped, and the remaining ones are still sent.
+ *
+ * Return: 0 on success, N_DHCP4_E_DROPPED if any reply was dropped,
+ *         N_DHCP4_E_DOWN if the interface is down, or a negative error
+ *         code on failure.
+ */
+int n_dhcp4_s_socket_udp_send_batch(int sockfd,
+                                    NDhcp4SReply *replies,
+                                    size_t n_replies) {
+        union {
+               struct cmsghdr align; /* ensure correct stack alignment */
+               char buf[CMSG_SPACE(sizeof(struct in_pktinfo))];
+        } control[N_DHCP4_S_SOCKET_MAX_BATCH];
+        struct sockaddr_in dests[N_DHCP4_S_SOCKET_MAX_BATCH];
+        struct iovec iovs[N_DHCP4_S_SOCKET_MAX_BATCH];
+        struct mmsghdr msgs[N_DHCP4_S_SOCKET_MAX_BATCH];
+        bool dropped = false;
+        size_t n;
+        int r;
+
+        for (size_t i_reply = 0; i_reply < n_replies; i_reply += n) {
+                n = n_replies - i_reply;
+                if (n > N_DHCP4_S_SOCKET_MAX_BATCH)
+                        n = N_DHCP4_S_SOCKET_MAX_BATCH;
+
+                for (size_t i = 0; i < n; ++i) {
+                        NDhcp4SReply *reply = &replies[i_reply + i];
+                        struct in_pktinfo pktinfo = {
+                                .ipi_spec_dst = reply->src,
+                        };
+                        struct cmsghdr *cmsg;
+
+                        dests[i] = (struct sockaddr_in){
+                                .sin_family = AF_INET,
+                                .sin_port = htons(N_DHCP4_NETWORK_CLIENT_PORT),
+                                .sin_addr = reply->dest,
+                        };
+
+                        iovs[i] = (struct iovec){};
+                        iovs[i].iov_len = n_dhcp4_outgoing_get_raw(reply->message, (const void **)&iovs[i].iov_base);
+
+                        memset(&control[i], 0, sizeof(control[i]));
+                        msgs[i] = (struct mmsghdr){
+                                .msg_hdr = {
+                                        .msg_name = (void*)&dests[i],
+                                        .msg_namelen = sizeof(dests[i]),
+                                        .msg_iov = &iovs[i],
+                                        .msg_iovlen = 1,
+                                        .msg_control = &control[i].buf,
+                                        .msg_controllen = sizeof(control[i].buf),
+                                },
+                        };
+
+                        cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+                        cmsg->cmsg_level = IPPROTO_IP;
+                        cmsg->cmsg_type = IP_PKTINFO;
+                        cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+                        memcpy(CMSG_DATA(cmsg), &pktinfo, sizeof(pktinfo));
+                }
+
+                r = n_dhcp4_socket_sendmmsg(sockfd, msgs, n, &dropped);
+                if (r)
+                        return r;
+        }
+
+        return dropped ? N_DHCP4_E_DROPPED : 0;
+}
+
 int n_dhcp4_c_socket_packet_recv(int sockfd,
+                                 const NDhcp4SocketOffload *offload,
+                                 struct packet_ring *ring,
                                  uint8_t *buf,
                                  size_t n_buf,
-                                 NDhcp4Incoming **messagep) {
-        _c_cleanup_(n_dhcp4_incoming_freep) NDhcp4Incoming *message = NULL;
+                                 NDhcp4Incoming *message) {
         size_t len;
         int r;
 
-        r = packet_recv_udp(sockfd, buf, n_buf, &len);
+        *message = (NDhcp4Incoming)N_DHCP4_INCOMING_NULL(*message);
+
+        if (ring)
+                r = packet_ring_recv_udp(ring, buf, n_buf, &len, NULL);
+        else
+                r = packet_recvfrom_udp(sockfd, buf, n_buf, &len, NULL, offload && offload->enabled);
         if (r < 0) {
                 if (r == -ENETDOWN)
                         return N_DHCP4_E_DOWN;
@@ -570,21 +1240,14 @@ int n_dhcp4_c_socket_packet_recv(int sockfd,
                 return N_DHCP4_E_MALFORMED;
         }
 
-        r = n_dhcp4_incoming_new(&message, buf, len);
-        if (r)
-                return r;
-
-        *messagep = message;
-        message = NULL;
-        return 0;
+        return n_dhcp4_incoming_init_borrowed(message, buf, n_buf, len);
 }
 
 static int n_dhcp4_socket_udp_recv(int sockfd,
                                    uint8_t *buf,
                                    size_t n_buf,
-                                   NDhcp4Incoming **messagep,
+                                   size_t *n_rawp,
                                    struct in_pktinfo *pktinfo) {
-        _c_cleanup_(n_dhcp4_incoming_freep) NDhcp4Incoming *message = NULL;
         struct iovec iov = {
                 .iov_base = buf,
                 .iov_len = n_buf,
@@ -597,7 +1260,6 @@ static int n_dhcp4_socket_udp_recv(int sockfd,
                 .msg_controllen = sizeof(cmsgbuf),
         };
         ssize_t len;
-        int r;
 
         len = recvmsg(sockfd, &msg, MSG_TRUNC);
         if (len < 0) {
@@ -611,10 +1273,6 @@ static int n_dhcp4_socket_udp_recv(int sockfd,
                 return N_DHCP4_E_MALFORMED;
         }
 
-        r = n_dhcp4_incoming_new(&message, buf, len);
-        if (r)
-                return r;
-
         if (pktinfo) {
                 struct cmsghdr *cmsg;
 
@@ -627,16 +1285,24 @@ static int n_dhcp4_socket_udp_recv(int sockfd,
                 memcpy(pktinfo, (void*)CMSG_DATA(cmsg), sizeof(struct in_pktinfo));
         }
 
-        *messagep = message;
-        message = NULL;
+        *n_rawp = len;
         return 0;
 }
 
 int n_dhcp4_c_socket_udp_recv(int sockfd,
                               uint8_t *buf,
                               size_t n_buf,
-                              NDhcp4Incoming **messagep) {
-        return n_dhcp4_socket_udp_recv(sockfd, buf, n_buf, messagep, NULL);
+                              NDhcp4Incoming *message) {
+        size_t n_raw;
+        int r;
+
+        *message = (NDhcp4Incoming)N_DHCP4_INCOMING_NULL(*message);
+
+        r = n_dhcp4_socket_udp_recv(sockfd, buf, n_buf, &n_raw, NULL);
+        if (r)
+                return r;
+
+        return n_dhcp4_incoming_init_borrowed(message, buf, n_buf, n_raw);
 }
 
 int n_dhcp4_s_socket_udp_recv(int sockfd,
@@ -645,9 +1311,14 @@ int n_dhcp4_s_socket_udp_recv(int sockfd,
                               NDhcp4Incoming **messagep,
                               struct sockaddr_in *dest) {
         struct in_pktinfo pktinfo = {};
+        size_t n_raw;
         int r;
 
-        r = n_dhcp4_socket_udp_recv(sockfd, buf, n_buf, messagep, &pktinfo);
+        r = n_dhcp4_socket_udp_recv(sockfd, buf, n_buf, &n_raw, &pktinfo);
+        if (r)
+                return r;
+
+        r = n_dhcp4_incoming_new(messagep, buf, n_raw);
         if (r)
                 return r;
 
@@ -659,3 +1330,103 @@ int n_dhcp4_s_socket_udp_recv(int sockfd,
 
         return 0;
 }
+
+/**
+ * n_dhcp4_s_socket_udp_recv_batch() - receive a batch of DHCP4 server messages
+ * @sockfd:             socket to receive on
+ * @buf:                scratch buffer of @n_batch slots, each @n_slot bytes
+ * @n_slot:             size of each slot in @buf
+ * @n_batch:            maximum number of datagrams to receive, at most
+ *                      N_DHCP4_S_SOCKET_MAX_BATCH
+ * @messages:           array of @n_batch message views to initialize
+ * @dests:              array of @n_batch entries to store the destination
+ *                      addresses in, or NULL
+ * @n_messagesp:        return argument for the number of datagrams received
+ *
+ * Receive up to @n_batch datagrams with a single recvmmsg(2) call, together
+ * with their IP_PKTINFO control messages, and parse each of them in place.
+ * The entries of @messages borrow from @buf, so they must be deinitialized
+ * before @buf is reused. Datagrams that are empty, truncated or fail to parse
+ * are consumed but their entry in @messages is left deinitialized, that is,
+ * without message.
+ *
+ * Return: 0 on success, N_DHCP4_E_AGAIN if no datagram was queued,
+ *         N_DHCP4_E_DOWN if the interface is down, or a negative error
+ *         code on failure.
+ */
+int n_dhcp4_s_socket_udp_recv_batch(int sockfd,
+                                    uint8_t *buf,
+                                    size_t n_slot,
+                                    size_t n_batch,
+                                    NDhcp4Incoming *messages,
+                                    struct sockaddr_in *dests,
+                                    size_t *n_messagesp) {
+        union {
+               struct cmsghdr align; /* ensure correct stack alignment */
+               char buf[CMSG_SPACE(sizeof(struct in_pktinfo))];
+        } control[N_DHCP4_S_SOCKET_MAX_BATCH];
+        struct mmsghdr msgs[N_DHCP4_S_SOCKET_MAX_BATCH];
+        struct iovec iovs[N_DHCP4_S_SOCKET_MAX_BATCH];
+        int n, r;
+
+        c_assert(n_batch > 0 && n_batch <= N_DHCP4_S_SOCKET_MAX_BATCH);
+
+        for (size_t i = 0; i < n_batch; ++i) {
+                iovs[i] = (struct iovec){
+                        .iov_base = buf + i * n_slot,
+                        .iov_len = n_slot,
+                };
+                msgs[i] = (struct mmsghdr){
+                        .msg_hdr = {
+                                .msg_iov = &iovs[i],
+                                .msg_iovlen = 1,
+                                .msg_control = &control[i].buf,
+                                .msg_controllen = sizeof(control[i].buf),
+                        },
+                };
+        }
+
+        n = recvmmsg(sockfd, msgs, n_batch, MSG_TRUNC, NULL);
+        if (n < 0) {
+                if (errno == ENETDOWN)
+                        return N_DHCP4_E_DOWN;
+                else if (errno == EAGAIN)
+                        return N_DHCP4_E_AGAIN;
+                else
+                        return -errno;
+        }
+
+        for (size_t i = 0; i < (size_t)n; ++i) {
+                struct cmsghdr *cmsg;
+
+                messages[i] = (NDhcp4Incoming)N_DHCP4_INCOMING_NULL(messages[i]);
+
+                if (msgs[i].msg_len == 0 || msgs[i].msg_len > n_slot)
+                        continue;
+
+                r = n_dhcp4_incoming_init_borrowed(&messages[i], iovs[i].iov_base, n_slot, msgs[i].msg_len);
+                if (r) {
+                        if (r == N_DHCP4_E_MALFORMED)
+                                continue;
+
+                        while (i-- > 0)
+                                n_dhcp4_incoming_deinit(&messages[i]);
+                        return r;
+                }
+
+                if (dests) {
+                        cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+                        c_assert(cmsg);
+                        c_assert(cmsg->cmsg_level == IPPROTO_IP);
+                        c_assert(cmsg->cmsg_type == IP_PKTINFO);
+                        c_assert(cmsg->cmsg_len == CMSG_LEN(sizeof(struct in_pktinfo)));
+
+                        dests[i].sin_family = AF_INET;
+                        dests[i].sin_port = htons(N_DHCP4_NETWORK_SERVER_PORT);
+                        dests[i].sin_addr = ((struct in_pktinfo *)(void *)CMSG_DATA(cmsg))->ipi_addr;
+                }
+        }
+
+        *n_messagesp = n;
+        return 0;
+}
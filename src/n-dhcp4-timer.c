@@ -0,0 +1,357 @@
+/*
+ * DHCP4 Timer Wheels
+ *
+ * A timer wheel tracks a large number of deadlines, like the expiry of all
+ * leases of a server, or the timeouts of all clients of a client context.
+ * Deadlines are rounded up to ticks of 2^shift nanoseconds, with the shift
+ * chosen by the owner of the wheel, and ticks are split into groups of
+ * N_DHCP4_TIMER_BITS bits, one per level of the wheel. A timer is kept on the
+ * level of the highest group in which its tick differs from the current tick
+ * of the wheel, in the slot given by its own value of that group. Hence, all
+ * timers of a slot are due at the same tick on level 0, and on higher levels
+ * they all need to move to a lower level once the current tick reaches the
+ * start of their slot. Every timer moves at most once per level, so the cost
+ * of advancing the wheel is bounded by the number of timers that expire, plus
+ * a constant per level, rather than by the number of timers or the time that
+ * passed.
+ *
+ * A bitmap of non-empty slots per level allows finding the next tick at which
+ * anything happens on the wheel without scanning any slots, so the wheel can
+ * be driven by a single timer armed to that tick. The timerfd helpers used to
+ * drive wheels, and single timeouts, live here as well.
+ */
+
+#include <assert.h>
+#include <c-list.h>
+#include <c-stdaux.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include "n-dhcp4-private.h"
+
+#define N_DHCP4_TIMER_MASK ((UINT64_C(1) << N_DHCP4_TIMER_BITS) - 1)
+#define N_DHCP4_TIMER_LEVEL_PENDING (UINT8_MAX)
+
+/**
+ * n_dhcp4_timer_wheel_init() - initialize timer wheel
+ * @wheel:                      wheel to initialize
+ * @shift:                      log2 of the tick length in nanoseconds
+ * @now:                        current time in nanoseconds
+ *
+ * This initializes an empty timer wheel, starting at @now. Deadlines on the
+ * wheel are rounded up to multiples of 2^@shift nanoseconds, which must be at
+ * least 2^N_DHCP4_TIMER_MIN_SHIFT.
+ */
+void n_dhcp4_timer_wheel_init(NDhcp4TimerWheel *wheel, unsigned int shift, uint64_t now) {
+        c_assert(shift >= N_DHCP4_TIMER_MIN_SHIFT && shift < 64);
+
+        *wheel = (NDhcp4TimerWheel)N_DHCP4_TIMER_WHEEL_NULL(*wheel);
+        wheel->shift = shift;
+        wheel->tick = now >> shift;
+
+        for (size_t l = 0; l < N_DHCP4_TIMER_N_LEVELS; ++l)
+                for (size_t s = 0; s < N_DHCP4_TIMER_N_SLOTS; ++s)
+                        c_list_init(&wheel->slots[l][s]);
+}
+
+/**
+ * n_dhcp4_timer_wheel_deinit() - deinitialize timer wheel
+ * @wheel:                      wheel to deinitialize
+ *
+ * This deinitializes a timer wheel. All its timers must have been unlinked.
+ */
+void n_dhcp4_timer_wheel_deinit(NDhcp4TimerWheel *wheel) {
+        c_assert(!wheel->n_timers);
+        c_assert(c_list_is_empty(&wheel->pending));
+
+        *wheel = (NDhcp4TimerWheel)N_DHCP4_TIMER_WHEEL_NULL(*wheel);
+}
+
+static void n_dhcp4_timer_wheel_place(NDhcp4TimerWheel *wheel, NDhcp4Timer *timer) {
+        unsigned int level;
+        uint64_t slot;
+
+        if (timer->tick <= wheel->tick) {
+                timer->level = N_DHCP4_TIMER_LEVEL_PENDING;
+                c_list_link_tail(&wheel->pending, &timer->wheel_link);
+                return;
+        }
+
+        level = (63 - __builtin_clzll(timer->tick ^ wheel->tick)) / N_DHCP4_TIMER_BITS;
+        c_assert(level < N_DHCP4_TIMER_N_LEVELS);
+
+        slot = (timer->tick >> (level * N_DHCP4_TIMER_BITS)) & N_DHCP4_TIMER_MASK;
+
+        timer->level = level;
+        timer->slot = slot;
+        wheel->bitmap[level] |= UINT64_C(1) << slot;
+        c_list_link_tail(&wheel->slots[level][slot], &timer->wheel_link);
+}
+
+/**
+ * n_dhcp4_timer_link() - schedule timer on a wheel
+ * @timer:                      timer to operate on
+ * @wheel:                      wheel to schedule the timer on
+ * @deadline:                   time in nanoseconds to expire at
+ *
+ * This schedules @timer to expire once the time reaches @deadline. If the
+ * timer was scheduled before, it is rescheduled. A timer cannot be moved to
+ * another wheel without unlinking it first.
+ */
+void n_dhcp4_timer_link(NDhcp4Timer *timer, NDhcp4TimerWheel *wheel, uint64_t deadline) {
+        c_assert(!timer->wheel || timer->wheel == wheel);
+
+        n_dhcp4_timer_unlink(timer);
+
+        /* round up, so timers never expire early */
+        timer->tick = (deadline >> wheel->shift) +
+                      !!(deadline & ((UINT64_C(1) << wheel->shift) - 1));
+        timer->wheel = wheel;
+        ++wheel->n_timers;
+
+        n_dhcp4_timer_wheel_place(wheel, timer);
+}
+
+/**
+ * n_dhcp4_timer_unlink() - cancel timer
+ * @timer:                      timer to operate on
+ *
+ * This cancels @timer, if it is scheduled. Otherwise, this is a noop.
+ */
+void n_dhcp4_timer_unlink(NDhcp4Timer *timer) {
+        NDhcp4TimerWheel *wheel = timer->wheel;
+
+        if (!wheel)
+                return;
+
+        c_list_unlink(&timer->wheel_link);
+        if (timer->level != N_DHCP4_TIMER_LEVEL_PENDING &&
+            c_list_is_empty(&wheel->slots[timer->level][timer->slot]))
+                wheel->bitmap[timer->level] &= ~(UINT64_C(1) << timer->slot);
+
+        --wheel->n_timers;
+        timer->wheel = NULL;
+}
+
+/*
+ * Return the next tick at which any slot of the wheel needs to be processed,
+ * or UINT64_MAX if the wheel is empty. All set bits of a level are beyond the
+ * current slot of that level, so the lowest one is the next to process.
+ */
+static uint64_t n_dhcp4_timer_wheel_next(NDhcp4TimerWheel *wheel) {
+        uint64_t tick, next = UINT64_MAX;
+        unsigned int shift;
+
+        for (size_t l = 0; l < N_DHCP4_TIMER_N_LEVELS; ++l) {
+                if (!wheel->bitmap[l])
+                        continue;
+
+                shift = l * N_DHCP4_TIMER_BITS;
+                tick = (wheel->tick >> shift >> N_DHCP4_TIMER_BITS) << N_DHCP4_TIMER_BITS;
+                tick = (tick | __builtin_ctzll(wheel->bitmap[l])) << shift;
+                if (tick < next)
+                        next = tick;
+        }
+
+        return next;
+}
+
+static void n_dhcp4_timer_wheel_advance(NDhcp4TimerWheel *wheel, uint64_t tick) {
+        NDhcp4Timer *timer, *t_timer;
+        uint64_t next, slot;
+
+        while (wheel->tick < tick) {
+                next = n_dhcp4_timer_wheel_next(wheel);
+                if (next > tick) {
+                        wheel->tick = tick;
+                        break;
+                }
+
+                /*
+                 * Empty the slots the new tick falls into, top down, so timers
+                 * moving down more than one level are handled right away.
+                 * Timers due at the new tick end up on the pending list.
+                 */
+                wheel->tick = next;
+                for (size_t l = N_DHCP4_TIMER_N_LEVELS; l-- > 0; ) {
+                        slot = (next >> (l * N_DHCP4_TIMER_BITS)) & N_DHCP4_TIMER_MASK;
+                        if (!(wheel->bitmap[l] & (UINT64_C(1) << slot)))
+                                continue;
+
+                        wheel->bitmap[l] &= ~(UINT64_C(1) << slot);
+                        c_list_for_each_entry_safe(timer, t_timer, &wheel->slots[l][slot], wheel_link) {
+                                c_list_unlink(&timer->wheel_link);
+                                n_dhcp4_timer_wheel_place(wheel, timer);
+                        }
+                }
+        }
+}
+
+/**
+ * n_dhcp4_timer_wheel_get_timeout() - get next timeout of timer wheel
+ * @wheel:                      wheel to operate on
+ * @timeoutp:                   output argument for the timeout
+ *
+ * This returns the time in nanoseconds at which the wheel needs to be
+ * advanced next, or 0 if it is empty. This is never later than the deadline
+ * of the first timer to expire, but may be earlier.
+ */
+void n_dhcp4_timer_wheel_get_timeout(NDhcp4TimerWheel *wheel, uint64_t *timeoutp) {
+        uint64_t next;
+
+        if (!c_list_is_empty(&wheel->pending))
+                next = wheel->tick;
+        else
+                next = n_dhcp4_timer_wheel_next(wheel);
+
+        *timeoutp = (next == UINT64_MAX) ? 0 : next << wheel->shift;
+}
+
+/**
+ * n_dhcp4_timer_wheel_pop() - pop expired timer
+ * @wheel:                      wheel to operate on
+ * @now:                        current time in nanoseconds
+ *
+ * This advances @wheel to @now, and unlinks and returns the first timer whose
+ * deadline has passed, if any.
+ *
+ * Return: The expired timer, or NULL if there is none.
+ */
+NDhcp4Timer *n_dhcp4_timer_wheel_pop(NDhcp4TimerWheel *wheel, uint64_t now) {
+        NDhcp4Timer *timer;
+
+        if (c_list_is_empty(&wheel->pending))
+                n_dhcp4_timer_wheel_advance(wheel, now >> wheel->shift);
+
+        timer = c_list_first_entry(&wheel->pending, NDhcp4Timer, wheel_link);
+        if (timer)
+                n_dhcp4_timer_unlink(timer);
+
+        return timer;
+}
+
+/**
+ * n_dhcp4_timerfd_new() - create timerfd
+ * @fdp:                        output argument for the new timerfd
+ *
+ * This creates a non-blocking timerfd on CLOCK_BOOTTIME, or on
+ * CLOCK_MONOTONIC if the kernel does not support the former for timerfds. Use
+ * n_dhcp4_timerfd_arm() to schedule it.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int n_dhcp4_timerfd_new(int *fdp) {
+        int fd;
+
+        fd = timerfd_create(CLOCK_BOOTTIME, TFD_CLOEXEC | TFD_NONBLOCK);
+        if (fd < 0 && errno == EINVAL)
+                fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+        if (fd < 0)
+                return -errno;
+
+        *fdp = fd;
+        return 0;
+}
+
+/**
+ * n_dhcp4_timerfd_arm() - schedule timerfd
+ * @fd_timer:                   timerfd to operate on
+ * @timeout:                    absolute CLOCK_BOOTTIME timestamp, or 0
+ *
+ * This schedules @fd_timer to fire at @timeout, or disarms it if @timeout is
+ * 0. A timeout in the past fires right away.
+ */
+void n_dhcp4_timerfd_arm(int fd_timer, uint64_t timeout) {
+        uint64_t now, offset;
+        int r;
+
+        /*
+         * Across our codebase, timeouts are specified as absolute timestamps
+         * on CLOCK_BOOTTIME. Unfortunately, there are systems with
+         * CLOCK_BOOTTIME support, but timerfd lacks it (in particular RHEL).
+         * Therefore, our timerfd might be on CLOCK_MONOTONIC.
+         * To account for this, we always schedule a relative timeout. We
+         * fetch the current time and then calculate the offset which we then
+         * schedule as relative timeout on the timerfd. This works regardless
+         * which clock the timerfd runs on.
+         * Once we no longer support CLOCK_MONOTONIC as fallback, we can simply
+         * switch to TFD_TIMER_ABSTIME here and specify `timeout` directly as
+         * value.
+         */
+        now = n_dhcp4_gettime(CLOCK_BOOTTIME);
+        if (!timeout)
+                offset = 0; /* disarm */
+        else if (now >= timeout)
+                offset = 1; /* 0 would disarm the timerfd */
+        else
+                offset = timeout - now;
+
+        r = timerfd_settime(fd_timer,
+                            0,
+                            &(struct itimerspec){
+                                .it_value = {
+                                        .tv_sec = offset / UINT64_C(1000000000),
+                                        .tv_nsec = offset % UINT64_C(1000000000),
+                                },
+                            },
+                            NULL);
+        c_assert(r >= 0);
+}
+
+/**
+ * n_dhcp4_timerfd_read() - consume timerfd expiration
+ * @fd_timer:                   timerfd to operate on
+ * @event:                      epoll event signalled for @fd_timer
+ *
+ * This consumes the expiration of @fd_timer, as signalled by @event.
+ *
+ * Return: 0 if the timerfd fired, N_DHCP4_E_AGAIN if it did not, negative
+ *         error code on failure.
+ */
+int n_dhcp4_timerfd_read(int fd_timer, struct epoll_event *event) {
+        uint64_t v;
+        int r;
+
+        if (event->events & (EPOLLHUP | EPOLLERR)) {
+                /*
+                 * There is no way to handle either gracefully. If we ignored
+                 * them, we would busy-loop, so lets rather forward the error
+                 * to the caller.
+                 */
+                return -ENOTRECOVERABLE;
+        }
+
+        if (!(event->events & EPOLLIN))
+                return N_DHCP4_E_AGAIN;
+
+        r = read(fd_timer, &v, sizeof(v));
+        if (r < 0) {
+                if (errno == EAGAIN) {
+                        /*
+                         * There are no more pending events, so nothing to be
+                         * done. Return to the caller.
+                         */
+                        return N_DHCP4_E_AGAIN;
+                }
+
+                /*
+                 * Something failed. We use CLOCK_BOOTTIME/MONOTONIC, so
+                 * ECANCELED cannot happen. Hence, there is no error that we
+                 * could gracefully handle. Fail hard and let the caller deal
+                 * with it.
+                 */
+                return -errno;
+        } else if (r != sizeof(v) || v == 0) {
+                /*
+                 * Kernel guarantees 8-byte reads, and only to return data if
+                 * at least one timer triggered; fail hard if it suddenly
+                 * starts exposing unexpected behavior.
+                 */
+                return -ENOTRECOVERABLE;
+        }
+
+        return 0;
+}
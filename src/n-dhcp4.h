@@ -19,6 +19,7 @@ extern "C" {
 
 typedef struct NDhcp4Client NDhcp4Client;
 typedef struct NDhcp4ClientConfig NDhcp4ClientConfig;
+typedef struct NDhcp4ClientContext NDhcp4ClientContext;
 typedef struct NDhcp4ClientEvent NDhcp4ClientEvent;
 typedef struct NDhcp4ClientLease NDhcp4ClientLease;
 typedef struct NDhcp4ClientProbe NDhcp4ClientProbe;
@@ -26,8 +27,10 @@ typedef struct NDhcp4ClientProbeConfig NDhcp4ClientProbeConfig;
 typedef struct NDhcp4Server NDhcp4Server;
 typedef struct NDhcp4ServerConfig NDhcp4ServerConfig;
 typedef struct NDhcp4ServerEvent NDhcp4ServerEvent;
+typedef struct NDhcp4ServerInterface NDhcp4ServerInterface;
 typedef struct NDhcp4ServerIp NDhcp4ServerIp;
 typedef struct NDhcp4ServerLease NDhcp4ServerLease;
+typedef struct NDhcp4ServerPool NDhcp4ServerPool;
 
 #define N_DHCP4_CLIENT_START_DELAY_RFC2131 (UINT64_C(9000))
 
@@ -109,6 +112,9 @@ struct NDhcp4ServerEvent {
         };
 };
 
+typedef void (*NDhcp4ClientEventFn)(NDhcp4Client *client, NDhcp4ClientEvent *event, void *userdata);
+typedef void (*NDhcp4ServerEventFn)(NDhcp4Server *server, NDhcp4ServerEvent *event, void *userdata);
+
 /* client configs */
 
 int n_dhcp4_client_config_new(NDhcp4ClientConfig **configp);
@@ -117,9 +123,12 @@ NDhcp4ClientConfig *n_dhcp4_client_config_free(NDhcp4ClientConfig *config);
 void n_dhcp4_client_config_set_ifindex(NDhcp4ClientConfig *config, int ifindex);
 void n_dhcp4_client_config_set_transport(NDhcp4ClientConfig *config, unsigned int transport);
 void n_dhcp4_client_config_set_request_broadcast(NDhcp4ClientConfig *config, bool request_broadcast);
+void n_dhcp4_client_config_set_checksum_offload(NDhcp4ClientConfig *config, bool checksum_offload);
+void n_dhcp4_client_config_set_rx_ring(NDhcp4ClientConfig *config, bool rx_ring);
 void n_dhcp4_client_config_set_mac(NDhcp4ClientConfig *config, const uint8_t *mac, size_t n_mac);
 void n_dhcp4_client_config_set_broadcast_mac(NDhcp4ClientConfig *config, const uint8_t *mac, size_t n_mac);
 int n_dhcp4_client_config_set_client_id(NDhcp4ClientConfig *config, const uint8_t *id, size_t n_id);
+void n_dhcp4_client_config_set_event_fn(NDhcp4ClientConfig *config, NDhcp4ClientEventFn fn, void *userdata);
 
 /* client-probe configs */
 
@@ -136,9 +145,21 @@ int n_dhcp4_client_probe_config_append_option(NDhcp4ClientProbeConfig *config,
                                               const void *data,
                                               uint8_t n_data);
 
+/* client contexts */
+
+int n_dhcp4_client_context_new(NDhcp4ClientContext **contextp);
+NDhcp4ClientContext *n_dhcp4_client_context_ref(NDhcp4ClientContext *context);
+NDhcp4ClientContext *n_dhcp4_client_context_unref(NDhcp4ClientContext *context);
+
+void n_dhcp4_client_context_get_fd(NDhcp4ClientContext *context, int *fdp);
+int n_dhcp4_client_context_dispatch(NDhcp4ClientContext *context);
+
 /* clients */
 
 int n_dhcp4_client_new(NDhcp4Client **clientp, NDhcp4ClientConfig *config);
+int n_dhcp4_client_new_in_context(NDhcp4Client **clientp,
+                                  NDhcp4ClientConfig *config,
+                                  NDhcp4ClientContext *context);
 NDhcp4Client *n_dhcp4_client_ref(NDhcp4Client *client);
 NDhcp4Client *n_dhcp4_client_unref(NDhcp4Client *client);
 
@@ -184,6 +205,12 @@ int n_dhcp4_server_config_new(NDhcp4ServerConfig **configp);
 NDhcp4ServerConfig *n_dhcp4_server_config_free(NDhcp4ServerConfig *config);
 
 void n_dhcp4_server_config_set_ifindex(NDhcp4ServerConfig *config, int ifindex);
+void n_dhcp4_server_config_set_reuseport(NDhcp4ServerConfig *config, bool reuseport);
+void n_dhcp4_server_config_set_reuseport_steering(NDhcp4ServerConfig *config, unsigned int n_servers);
+void n_dhcp4_server_config_set_checksum_offload(NDhcp4ServerConfig *config, bool checksum_offload);
+void n_dhcp4_server_config_set_server_id_filter(NDhcp4ServerConfig *config, bool server_id_filter);
+void n_dhcp4_server_config_set_lease_lifetime(NDhcp4ServerConfig *config, uint32_t lifetime);
+void n_dhcp4_server_config_set_event_fn(NDhcp4ServerConfig *config, NDhcp4ServerEventFn fn, void *userdata);
 
 /* servers */
 
@@ -196,11 +223,33 @@ int n_dhcp4_server_dispatch(NDhcp4Server *server);
 int n_dhcp4_server_pop_event(NDhcp4Server *server, NDhcp4ServerEvent **eventp);
 
 int n_dhcp4_server_add_ip(NDhcp4Server *server, NDhcp4ServerIp **ipp, struct in_addr ip);
+int n_dhcp4_server_add_interface(NDhcp4Server *server, NDhcp4ServerInterface **interfacep, int ifindex);
+int n_dhcp4_server_add_pool(NDhcp4Server *server,
+                            NDhcp4ServerPool **poolp,
+                            struct in_addr subnet,
+                            unsigned int prefixlen);
+
+/* server interfaces */
+
+NDhcp4ServerInterface *n_dhcp4_server_interface_free(NDhcp4ServerInterface *interface);
+
+int n_dhcp4_server_interface_add_ip(NDhcp4ServerInterface *interface, NDhcp4ServerIp **ipp, struct in_addr ip);
 
 /* server ip addresses */
 
 NDhcp4ServerIp *n_dhcp4_server_ip_free(NDhcp4ServerIp *ip);
 
+/* server address pools */
+
+NDhcp4ServerPool *n_dhcp4_server_pool_free(NDhcp4ServerPool *pool);
+
+int n_dhcp4_server_pool_add_range(NDhcp4ServerPool *pool, struct in_addr first, struct in_addr last);
+int n_dhcp4_server_pool_add_exclusion(NDhcp4ServerPool *pool, struct in_addr first, struct in_addr last);
+int n_dhcp4_server_pool_add_reservation(NDhcp4ServerPool *pool,
+                                        struct in_addr address,
+                                        const uint8_t *haddr,
+                                        size_t n_haddr);
+
 /* server leases */
 
 NDhcp4ServerLease *n_dhcp4_server_lease_ref(NDhcp4ServerLease *lease);
@@ -233,6 +282,15 @@ static inline void n_dhcp4_client_probe_config_freev(NDhcp4ClientProbeConfig *p)
         n_dhcp4_client_probe_config_free(p);
 }
 
+static inline void n_dhcp4_client_context_unrefp(NDhcp4ClientContext **p) {
+        if (*p)
+                n_dhcp4_client_context_unref(*p);
+}
+
+static inline void n_dhcp4_client_context_unrefv(NDhcp4ClientContext *p) {
+        n_dhcp4_client_context_unref(p);
+}
+
 static inline void n_dhcp4_client_unrefp(NDhcp4Client **p) {
         if (*p)
                 n_dhcp4_client_unref(*p);
@@ -278,6 +336,15 @@ static inline void n_dhcp4_server_unrefv(NDhcp4Server *p) {
         n_dhcp4_server_unref(p);
 }
 
+static inline void n_dhcp4_server_interface_freep(NDhcp4ServerInterface **p) {
+        if (*p)
+                n_dhcp4_server_interface_free(*p);
+}
+
+static inline void n_dhcp4_server_interface_freev(NDhcp4ServerInterface *p) {
+        n_dhcp4_server_interface_free(p);
+}
+
 static inline void n_dhcp4_server_ip_freep(NDhcp4ServerIp **p) {
         if (*p)
                 n_dhcp4_server_ip_free(*p);
@@ -287,6 +354,15 @@ static inline void n_dhcp4_server_ip_freev(NDhcp4ServerIp *p) {
         n_dhcp4_server_ip_free(p);
 }
 
+static inline void n_dhcp4_server_pool_freep(NDhcp4ServerPool **p) {
+        if (*p)
+                n_dhcp4_server_pool_free(*p);
+}
+
+static inline void n_dhcp4_server_pool_freev(NDhcp4ServerPool *p) {
+        n_dhcp4_server_pool_free(p);
+}
+
 static inline void n_dhcp4_server_lease_unrefp(NDhcp4ServerLease **p) {
         if (*p)
                 n_dhcp4_server_lease_unref(*p);
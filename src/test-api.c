@@ -46,14 +46,17 @@ static void test_api_constants(void) {
 
 static void test_api_types(void) {
         assert(sizeof(NDhcp4ClientConfig*) > 0);
+        assert(sizeof(NDhcp4ClientContext*) > 0);
         assert(sizeof(NDhcp4ClientProbeConfig*) > 0);
         assert(sizeof(NDhcp4Client*) > 0);
         assert(sizeof(NDhcp4ClientEvent) > 0);
+        assert(sizeof(NDhcp4ClientEventFn) > 0);
         assert(sizeof(NDhcp4ClientProbe*) > 0);
         assert(sizeof(NDhcp4ClientLease*) > 0);
         assert(sizeof(NDhcp4Server*) > 0);
         assert(sizeof(NDhcp4ServerConfig*) > 0);
         assert(sizeof(NDhcp4ServerEvent) > 0);
+        assert(sizeof(NDhcp4ServerEventFn) > 0);
         assert(sizeof(NDhcp4ServerIp*) > 0);
         assert(sizeof(NDhcp4ServerLease*) > 0);
 }
@@ -67,9 +70,12 @@ static void test_api_functions(void) {
                 (void *)n_dhcp4_client_config_set_ifindex,
                 (void *)n_dhcp4_client_config_set_transport,
                 (void *)n_dhcp4_client_config_set_request_broadcast,
+                (void *)n_dhcp4_client_config_set_checksum_offload,
+                (void *)n_dhcp4_client_config_set_rx_ring,
                 (void *)n_dhcp4_client_config_set_mac,
                 (void *)n_dhcp4_client_config_set_broadcast_mac,
                 (void *)n_dhcp4_client_config_set_client_id,
+                (void *)n_dhcp4_client_config_set_event_fn,
 
                 (void *)n_dhcp4_client_probe_config_new,
                 (void *)n_dhcp4_client_probe_config_free,
@@ -82,7 +88,16 @@ static void test_api_functions(void) {
                 (void *)n_dhcp4_client_probe_config_request_option,
                 (void *)n_dhcp4_client_probe_config_append_option,
 
+                (void *)n_dhcp4_client_context_new,
+                (void *)n_dhcp4_client_context_ref,
+                (void *)n_dhcp4_client_context_unref,
+                (void *)n_dhcp4_client_context_unrefp,
+                (void *)n_dhcp4_client_context_unrefv,
+                (void *)n_dhcp4_client_context_get_fd,
+                (void *)n_dhcp4_client_context_dispatch,
+
                 (void *)n_dhcp4_client_new,
+                (void *)n_dhcp4_client_new_in_context,
                 (void *)n_dhcp4_client_ref,
                 (void *)n_dhcp4_client_unref,
                 (void *)n_dhcp4_client_unrefp,
@@ -118,6 +133,12 @@ static void test_api_functions(void) {
                 (void *)n_dhcp4_server_config_freep,
                 (void *)n_dhcp4_server_config_freev,
                 (void *)n_dhcp4_server_config_set_ifindex,
+                (void *)n_dhcp4_server_config_set_reuseport,
+                (void *)n_dhcp4_server_config_set_reuseport_steering,
+                (void *)n_dhcp4_server_config_set_checksum_offload,
+                (void *)n_dhcp4_server_config_set_server_id_filter,
+                (void *)n_dhcp4_server_config_set_lease_lifetime,
+                (void *)n_dhcp4_server_config_set_event_fn,
 
                 (void *)n_dhcp4_server_new,
                 (void *)n_dhcp4_server_ref,
@@ -128,11 +149,25 @@ static void test_api_functions(void) {
                 (void *)n_dhcp4_server_dispatch,
                 (void *)n_dhcp4_server_pop_event,
                 (void *)n_dhcp4_server_add_ip,
+                (void *)n_dhcp4_server_add_interface,
+                (void *)n_dhcp4_server_add_pool,
+
+                (void *)n_dhcp4_server_interface_free,
+                (void *)n_dhcp4_server_interface_freep,
+                (void *)n_dhcp4_server_interface_freev,
+                (void *)n_dhcp4_server_interface_add_ip,
 
                 (void *)n_dhcp4_server_ip_free,
                 (void *)n_dhcp4_server_ip_freep,
                 (void *)n_dhcp4_server_ip_freev,
 
+                (void *)n_dhcp4_server_pool_free,
+                (void *)n_dhcp4_server_pool_freep,
+                (void *)n_dhcp4_server_pool_freev,
+                (void *)n_dhcp4_server_pool_add_range,
+                (void *)n_dhcp4_server_pool_add_exclusion,
+                (void *)n_dhcp4_server_pool_add_reservation,
+
                 (void *)n_dhcp4_server_lease_ref,
                 (void *)n_dhcp4_server_lease_unref,
                 (void *)n_dhcp4_server_lease_unrefp,
@@ -20,14 +20,14 @@
 #include "util/netns.h"
 #include "util/packet.h"
 
-static void test_poll_client(int efd, unsigned int u32) {
+static void test_poll_client(int efd, void *ptr) {
         struct epoll_event event = {};
         int r;
 
         r = epoll_wait(efd, &event, 1, -1);
         c_assert(r == 1);
         c_assert(event.events == EPOLLIN);
-        c_assert(event.data.u32 == u32);
+        c_assert(event.data.ptr == ptr);
 }
 
 static void test_poll_server(int fd) {
@@ -39,13 +39,13 @@ static void test_poll_server(int fd) {
         c_assert(pfd.revents == POLLIN);
 }
 
-static void test_s_connection_init(int netns, NDhcp4SConnection *connection, int ifindex) {
+static void test_s_connection_init(int netns, NDhcp4SConnection *connection, int ifindex, unsigned int flags) {
         int r, oldns;
 
         netns_get(&oldns);
         netns_set(netns);
 
-        r = n_dhcp4_s_connection_init(connection, ifindex);
+        r = n_dhcp4_s_connection_init(connection, ifindex, flags, NULL);
         c_assert(!r);
 
         netns_set(oldns);
@@ -102,12 +102,13 @@ static void test_server_receive(NDhcp4SConnection *connection, uint8_t expected_
 
 static void test_client_receive(NDhcp4CConnection *connection, uint8_t expected_type, NDhcp4Incoming **messagep) {
         _c_cleanup_(n_dhcp4_incoming_freep) NDhcp4Incoming *message = NULL;
+        uint8_t buf[UINT16_MAX];
         uint8_t received_type;
         int r;
 
-        test_poll_client(connection->fd_epoll, N_DHCP4_CLIENT_EPOLL_IO);
+        test_poll_client(connection->fd_epoll, &connection->epoll_type);
 
-        r = n_dhcp4_c_connection_dispatch_io(connection, &message);
+        r = n_dhcp4_c_connection_dispatch_io(connection, buf, sizeof(buf), &message);
         c_assert(!r);
         c_assert(message);
 
@@ -324,9 +325,10 @@ static void test_connection(void) {
                 _c_cleanup_(n_dhcp4_incoming_freep) NDhcp4Incoming *ack = NULL;
                 NDhcp4LogQueue log_queue = N_DHCP4_LOG_QUEUE_NULL_DEFUNCT();
 
-                test_s_connection_init(ns_server, &connection_server, link_server.ifindex);
+                test_s_connection_init(ns_server, &connection_server, link_server.ifindex, 0);
                 n_dhcp4_s_connection_ip_init(&connection_server_ip, addr_server);
-                n_dhcp4_s_connection_ip_link(&connection_server_ip, &connection_server);
+                r = n_dhcp4_s_connection_ip_link(&connection_server_ip, &connection_server);
+                c_assert(!r);
 
                 r = n_dhcp4_client_config_new(&client_config);
                 c_assert(!r);
@@ -353,6 +355,7 @@ static void test_connection(void) {
                                               client_config,
                                               probe_config,
                                               &log_queue,
+                                              NULL,
                                               efd_client);
                 c_assert(!r);
                 test_c_connection_listen(ns_client, &connection_client);
@@ -381,10 +384,205 @@ static void test_connection(void) {
         link_del_ip4(&link_server, &addr_server, 8);
 }
 
+/*
+ * Send a request like a renewing client would, from the client port to the
+ * server port, so all requests share the same addresses and ports.
+ */
+static void test_workers_send(int sk, uint32_t xid, uint8_t client) {
+        _c_cleanup_(n_dhcp4_outgoing_freep) NDhcp4Outgoing *outgoing = NULL;
+        NDhcp4Header *header;
+        uint8_t type = N_DHCP4_MESSAGE_DISCOVER;
+        uint16_t mms = htons(N_DHCP4_NETWORK_IP_MINIMUM_MAX_SIZE);
+        const void *buf;
+        size_t n_buf;
+        ssize_t len;
+        int r;
+
+        r = n_dhcp4_outgoing_new(&outgoing, 0, 0);
+        c_assert(!r);
+
+        header = n_dhcp4_outgoing_get_header(outgoing);
+        header->op = N_DHCP4_OP_BOOTREQUEST;
+        header->xid = xid;
+        header->ciaddr = htonl(10 << 24 | 2);
+        header->hlen = ETH_ALEN;
+        header->chaddr[ETH_ALEN - 1] = client;
+
+        r = n_dhcp4_outgoing_append(outgoing, N_DHCP4_OPTION_MESSAGE_TYPE, &type, sizeof(type));
+        c_assert(!r);
+        r = n_dhcp4_outgoing_append(outgoing, N_DHCP4_OPTION_MAXIMUM_MESSAGE_SIZE, &mms, sizeof(mms));
+        c_assert(!r);
+
+        n_buf = n_dhcp4_outgoing_get_raw(outgoing, &buf);
+        len = send(sk, buf, n_buf, 0);
+        c_assert(len == (ssize_t)n_buf);
+}
+
+static void test_workers(bool steer) {
+        const struct in_addr addr_server = (struct in_addr){ htonl(10 << 24 | 1) };
+        const struct in_addr addr_client = (struct in_addr){ htonl(10 << 24 | 2) };
+        _c_cleanup_(netns_closep) int ns_server = -1, ns_client = -1;
+        _c_cleanup_(link_deinit) Link link_server = LINK_NULL(link_server);
+        _c_cleanup_(link_deinit) Link link_client = LINK_NULL(link_client);
+        _c_cleanup_(c_closep) int sk_client = -1;
+        NDhcp4SConnection connections[4];
+        NDhcp4SConnectionIp ips[4];
+        const size_t n_workers = sizeof(connections) / sizeof(*connections);
+        unsigned int n_requests[4] = {}, n_served[64 + 1] = {}, n_answered[64 + 1] = {};
+        const uint32_t n_xids = 64, n_clients = 8;
+        ssize_t workers[8] = { -1, -1, -1, -1, -1, -1, -1, -1 };
+        uint8_t buf[UINT16_MAX];
+        size_t n_busy = 0, n;
+        int r, oldns;
+
+        /* setup */
+
+        netns_new(&ns_server);
+        netns_new(&ns_client);
+
+        link_new_veth(&link_server, &link_client, ns_server, ns_client);
+        link_add_ip4(&link_server, &addr_server, 8);
+        link_add_ip4(&link_client, &addr_client, 8);
+
+        for (size_t i = 0; i < n_workers; ++i) {
+                connections[i] = (NDhcp4SConnection)N_DHCP4_S_CONNECTION_NULL(connections[i]);
+                test_s_connection_init(ns_server,
+                                       &connections[i],
+                                       link_server.ifindex,
+                                       N_DHCP4_S_SOCKET_FLAG_REUSEPORT);
+                n_dhcp4_s_connection_ip_init(&ips[i], addr_server);
+                r = n_dhcp4_s_connection_ip_link(&ips[i], &connections[i]);
+                c_assert(!r);
+
+                if (steer) {
+                        r = n_dhcp4_s_connection_steer(&connections[i], n_workers);
+                        c_assert(!r);
+                }
+        }
+
+        netns_get(&oldns);
+        netns_set(ns_client);
+        r = n_dhcp4_c_socket_udp_new(&sk_client, link_client.ifindex, &addr_client, &addr_server);
+        c_assert(!r);
+        netns_set(oldns);
+
+        /*
+         * Send one request per xid, spread over a few clients, and let each
+         * worker answer what it got.
+         */
+
+        for (uint32_t xid = 1; xid <= n_xids; ++xid)
+                test_workers_send(sk_client, xid, xid % n_clients);
+
+        for (n = 0; n < n_xids; ) {
+                struct pollfd pfds[4];
+
+                for (size_t i = 0; i < n_workers; ++i)
+                        pfds[i] = (struct pollfd){ .fd = connections[i].fd_udp, .events = POLLIN };
+
+                r = poll(pfds, n_workers, -1);
+                c_assert(r > 0);
+
+                for (size_t i = 0; i < n_workers; ++i) {
+                        if (!(pfds[i].revents & POLLIN))
+                                continue;
+
+                        for (;;) {
+                                _c_cleanup_(n_dhcp4_incoming_freep) NDhcp4Incoming *request = NULL;
+                                NDhcp4Outgoing *reply = NULL;
+                                uint32_t xid;
+
+                                r = n_dhcp4_s_connection_dispatch_io(&connections[i], &request);
+                                if (r == N_DHCP4_E_AGAIN)
+                                        break;
+                                c_assert(!r);
+                                c_assert(request);
+
+                                n_dhcp4_incoming_get_xid(request, &xid);
+                                c_assert(xid >= 1 && xid <= n_xids);
+                                ++n_served[xid];
+                                ++n_requests[i];
+                                ++n;
+
+                                /* with steering, a client always hits the same worker */
+                                if (steer) {
+                                        if (workers[xid % n_clients] < 0)
+                                                workers[xid % n_clients] = i;
+                                        c_assert(workers[xid % n_clients] == (ssize_t)i);
+                                }
+
+                                r = n_dhcp4_s_connection_offer_new(&connections[i],
+                                                                   &reply,
+                                                                   request,
+                                                                   &addr_server,
+                                                                   &addr_client,
+                                                                   60);
+                                c_assert(!r);
+
+                                r = n_dhcp4_s_connection_queue_reply(&connections[i], &addr_server, reply);
+                                c_assert(!r);
+                        }
+
+                        r = n_dhcp4_s_connection_flush_replies(&connections[i]);
+                        c_assert(!r);
+                }
+        }
+
+        for (n = 0; n < n_xids; ++n) {
+                _c_cleanup_(n_dhcp4_incoming_deinit) NDhcp4Incoming reply = N_DHCP4_INCOMING_NULL(reply);
+                uint32_t xid;
+
+                r = poll(&(struct pollfd){ .fd = sk_client, .events = POLLIN }, 1, -1);
+                c_assert(r == 1);
+
+                r = n_dhcp4_c_socket_udp_recv(sk_client, buf, sizeof(buf), &reply);
+                c_assert(!r);
+                c_assert(reply.message);
+
+                n_dhcp4_incoming_get_xid(&reply, &xid);
+                c_assert(xid >= 1 && xid <= n_xids);
+                ++n_answered[xid];
+        }
+
+        /* every request must have been served and answered exactly once */
+
+        for (uint32_t xid = 1; xid <= n_xids; ++xid) {
+                c_assert(n_served[xid] == 1);
+                c_assert(n_answered[xid] == 1);
+        }
+
+        r = n_dhcp4_c_socket_udp_recv(sk_client, buf, sizeof(buf), &(NDhcp4Incoming){});
+        c_assert(r == N_DHCP4_E_AGAIN);
+
+        /*
+         * Without steering, the kernel picks the worker by addresses and
+         * ports, which are the same for all requests. Only steering by the
+         * client hardware address spreads them.
+         */
+
+        for (size_t i = 0; i < n_workers; ++i)
+                if (n_requests[i])
+                        ++n_busy;
+        c_assert(steer ? n_busy > 1 : n_busy == 1);
+
+        /* teardown */
+
+        for (size_t i = 0; i < n_workers; ++i) {
+                n_dhcp4_s_connection_ip_unlink(&ips[i]);
+                n_dhcp4_s_connection_ip_deinit(&ips[i]);
+                n_dhcp4_s_connection_deinit(&connections[i]);
+        }
+
+        link_del_ip4(&link_client, &addr_client, 8);
+        link_del_ip4(&link_server, &addr_server, 8);
+}
+
 int main(int argc, char **argv) {
         test_setup();
 
         test_connection();
+        test_workers(false);
+        test_workers(true);
 
         return 0;
 }
@@ -0,0 +1,179 @@
+/*
+ * Tests for DHCP4 Server Lease Tables
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <c-stdaux.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "n-dhcp4-private.h"
+
+#define TEST_N_LEASES (4096)
+
+static void test_request_new(NDhcp4Incoming **incomingp,
+                             uint32_t id,
+                             const uint8_t *client_id,
+                             size_t n_client_id) {
+        _c_cleanup_(n_dhcp4_outgoing_freep) NDhcp4Outgoing *outgoing = NULL;
+        uint8_t type = N_DHCP4_MESSAGE_DISCOVER;
+        NDhcp4Header *header;
+        const void *raw;
+        size_t n_raw;
+        int r;
+
+        r = n_dhcp4_outgoing_new(&outgoing, 0, 0);
+        c_assert(!r);
+
+        header = n_dhcp4_outgoing_get_header(outgoing);
+        header->op = N_DHCP4_OP_BOOTREQUEST;
+        header->htype = 1;
+        header->hlen = 6;
+        memcpy(header->chaddr + 2, &id, sizeof(id));
+
+        r = n_dhcp4_outgoing_append(outgoing, N_DHCP4_OPTION_MESSAGE_TYPE, &type, sizeof(type));
+        c_assert(!r);
+
+        if (client_id) {
+                r = n_dhcp4_outgoing_append(outgoing, N_DHCP4_OPTION_CLIENT_IDENTIFIER, client_id, n_client_id);
+                c_assert(!r);
+        }
+
+        n_raw = n_dhcp4_outgoing_get_raw(outgoing, &raw);
+        r = n_dhcp4_incoming_new(incomingp, raw, n_raw);
+        c_assert(!r);
+}
+
+static void test_lease_new(NDhcp4ServerLease **leasep, uint32_t id) {
+        NDhcp4Incoming *incoming;
+        int r;
+
+        test_request_new(&incoming, id, NULL, 0);
+        r = n_dhcp4_server_lease_new(leasep, incoming);
+        c_assert(!r);
+}
+
+static void test_key(void) {
+        _c_cleanup_(n_dhcp4_incoming_freep) NDhcp4Incoming *by_hwaddr = NULL;
+        _c_cleanup_(n_dhcp4_incoming_freep) NDhcp4Incoming *by_id = NULL;
+        NDhcp4SLeaseKey key_hwaddr, key_id;
+        uint8_t client_id[7] = { 1 };
+        int r;
+
+        /*
+         * A client identifier consisting of the hardware type and address
+         * must not be confused with the hardware address itself.
+         */
+
+        test_request_new(&by_hwaddr, 1, NULL, 0);
+        memcpy(client_id + 1, n_dhcp4_incoming_get_header(by_hwaddr)->chaddr, 6);
+        test_request_new(&by_id, 1, client_id, sizeof(client_id));
+
+        r = n_dhcp4_s_lease_key_init(&key_hwaddr, by_hwaddr);
+        c_assert(!r);
+        r = n_dhcp4_s_lease_key_init(&key_id, by_id);
+        c_assert(!r);
+
+        c_assert(key_hwaddr.n_key == key_id.n_key);
+        c_assert(!memcmp(key_hwaddr.key + 1, key_id.key + 1, key_id.n_key));
+        c_assert(key_hwaddr.key[0] != key_id.key[0]);
+
+        /* a client without identifier or hardware address is rejected */
+
+        n_dhcp4_incoming_get_header(by_hwaddr)->hlen = 0;
+        r = n_dhcp4_s_lease_key_init(&key_hwaddr, by_hwaddr);
+        c_assert(r == N_DHCP4_E_MALFORMED);
+}
+
+static void test_table(void) {
+        NDhcp4SLeaseTable table;
+        NDhcp4ServerLease *leases[TEST_N_LEASES];
+        struct in_addr address;
+        int r;
+
+        n_dhcp4_s_lease_table_init(&table);
+
+        /* link enough leases to grow the table several times */
+
+        for (uint32_t i = 0; i < TEST_N_LEASES; ++i) {
+                test_lease_new(&leases[i], i);
+                leases[i]->address.s_addr = (i % 2) ? htonl((10 << 24) | i) : INADDR_ANY;
+
+                r = n_dhcp4_s_lease_table_link(&table, leases[i]);
+                c_assert(!r);
+        }
+
+        c_assert(table.n_leases == TEST_N_LEASES);
+        c_assert(table.n_addresses == TEST_N_LEASES / 2);
+
+        for (uint32_t i = 0; i < TEST_N_LEASES; ++i) {
+                c_assert(n_dhcp4_s_lease_table_find(&table, &leases[i]->key) == leases[i]);
+
+                address.s_addr = htonl((10 << 24) | i);
+                c_assert(n_dhcp4_s_lease_table_find_address(&table, address) ==
+                         ((i % 2) ? leases[i] : NULL));
+        }
+
+        /* addresses can be assigned, moved and dropped, but never shared */
+
+        for (uint32_t i = 0; i < TEST_N_LEASES; i += 2) {
+                address.s_addr = htonl((10 << 24) | (i + 1));
+                r = n_dhcp4_s_lease_table_set_address(&table, leases[i], address);
+                c_assert(r == -EADDRINUSE);
+
+                address.s_addr = htonl((11 << 24) | i);
+                r = n_dhcp4_s_lease_table_set_address(&table, leases[i], address);
+                c_assert(!r);
+        }
+
+        for (uint32_t i = 1; i < TEST_N_LEASES; i += 2) {
+                r = n_dhcp4_s_lease_table_set_address(&table, leases[i], (struct in_addr){ INADDR_ANY });
+                c_assert(!r);
+        }
+
+        c_assert(table.n_addresses == TEST_N_LEASES / 2);
+
+        for (uint32_t i = 0; i < TEST_N_LEASES; ++i) {
+                address.s_addr = htonl((10 << 24) | i);
+                c_assert(!n_dhcp4_s_lease_table_find_address(&table, address));
+
+                address.s_addr = htonl((11 << 24) | i);
+                c_assert(n_dhcp4_s_lease_table_find_address(&table, address) ==
+                         ((i % 2) ? NULL : leases[i]));
+        }
+
+        /* unlink every third lease and verify the remaining ones are found */
+
+        for (uint32_t i = 0; i < TEST_N_LEASES; i += 3)
+                n_dhcp4_s_lease_table_unlink(&table, leases[i]);
+
+        for (uint32_t i = 0; i < TEST_N_LEASES; ++i) {
+                address.s_addr = htonl((11 << 24) | i);
+
+                if (i % 3) {
+                        c_assert(n_dhcp4_s_lease_table_find(&table, &leases[i]->key) == leases[i]);
+                        c_assert(n_dhcp4_s_lease_table_find_address(&table, address) ==
+                                 ((i % 2) ? NULL : leases[i]));
+                } else {
+                        c_assert(!n_dhcp4_s_lease_table_find(&table, &leases[i]->key));
+                        c_assert(!n_dhcp4_s_lease_table_find_address(&table, address));
+                }
+        }
+
+        /* cleanup */
+
+        for (uint32_t i = 0; i < TEST_N_LEASES; ++i) {
+                if (i % 3)
+                        n_dhcp4_s_lease_table_unlink(&table, leases[i]);
+                n_dhcp4_server_lease_unref(leases[i]);
+        }
+
+        n_dhcp4_s_lease_table_deinit(&table);
+}
+
+int main(int argc, char **argv) {
+        test_key();
+        test_table();
+        return 0;
+}
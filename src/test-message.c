@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "n-dhcp4-private.h"
+#include "util/packet.h"
 
 static void test_outgoing(void) {
         NDhcp4Outgoing *outgoing;
@@ -27,6 +28,57 @@ static void test_outgoing(void) {
         c_assert(!outgoing);
 }
 
+static void test_outgoing_headers(void) {
+        _c_cleanup_(n_dhcp4_outgoing_freep) NDhcp4Outgoing *outgoing = NULL;
+        const struct sockaddr_in src = {
+                .sin_family = AF_INET,
+                .sin_port = htons(N_DHCP4_NETWORK_CLIENT_PORT),
+        };
+        const struct sockaddr_in dst = {
+                .sin_family = AF_INET,
+                .sin_port = htons(N_DHCP4_NETWORK_SERVER_PORT),
+                .sin_addr = { INADDR_BROADCAST },
+        };
+        const struct udphdr *udp_hdr;
+        const struct iphdr *ip_hdr;
+        struct udphdr udp_expected;
+        struct iphdr ip_expected;
+        const void *buf;
+        size_t n_buf;
+        int r;
+
+        r = n_dhcp4_outgoing_new(&outgoing, 0, 0);
+        c_assert(!r);
+        r = n_dhcp4_outgoing_append(outgoing, N_DHCP4_OPTION_MESSAGE_TYPE, (uint8_t []){ N_DHCP4_MESSAGE_DISCOVER }, 1);
+        c_assert(!r);
+
+        /*
+         * Resend the message with changing secs and xid, as well as other
+         * changes in between, and verify the cached headers always match
+         * headers built from scratch.
+         */
+        for (unsigned int i = 0; i < 1024; ++i) {
+                if (i % 7 == 3)
+                        n_dhcp4_outgoing_get_header(outgoing)->ciaddr = i;
+                if (i % 13 == 5) {
+                        r = n_dhcp4_outgoing_append(outgoing, N_DHCP4_OPTION_PAD + 224, NULL, 0);
+                        c_assert(!r || r == N_DHCP4_E_NO_SPACE);
+                }
+
+                n_dhcp4_outgoing_set_secs(outgoing, 1 + i * 37);
+                if (i % 3)
+                        n_dhcp4_outgoing_set_xid(outgoing, i * 0x9e3779b9);
+
+                n_dhcp4_outgoing_get_udp_headers(outgoing, &src, &dst, &ip_hdr, &udp_hdr);
+
+                n_buf = n_dhcp4_outgoing_get_raw(outgoing, &buf);
+                packet_init_udp(&ip_expected, &udp_expected, buf, n_buf, &src, &dst);
+
+                c_assert(!memcmp(ip_hdr, &ip_expected, sizeof(ip_expected)));
+                c_assert(!memcmp(udp_hdr, &udp_expected, sizeof(udp_expected)));
+        }
+}
+
 static void test_incoming(void) {
         NDhcp4Incoming *incoming;
         struct {
@@ -150,10 +202,177 @@ static void test_incoming(void) {
         c_assert(l == 2);
         c_assert(v[0] == 0xef && v[1] == 0xcf);
         incoming = n_dhcp4_incoming_free(incoming);
+
+        /* verify concatenation order across sections and single instances */
+
+        m.options[2] = N_DHCP4_OVERLOAD_SNAME;
+        m.options[6] = 3;
+        m.options[7] = 2;
+        m.options[8] = 0xaa;
+        m.options[9] = 0xbb;
+        m.options[10] = 1;
+        m.options[11] = 0;
+        m.options[12] = 1;
+        m.options[13] = 1;
+        m.options[14] = 0xdf;
+        m.options[15] = N_DHCP4_OPTION_END;
+        m.file[0] = 1;
+        m.file[1] = 1;
+        m.file[2] = 0x00;
+
+        r = n_dhcp4_incoming_new(&incoming, &m, sizeof(m));
+        c_assert(!r);
+        r = n_dhcp4_incoming_query(incoming, 1, &v, &l);
+        c_assert(r == 0);
+        c_assert(l == 3);
+        c_assert(v[0] == 0xef && v[1] == 0xdf && v[2] == 0xcf);
+        r = n_dhcp4_incoming_query(incoming, 2, NULL, NULL);
+        c_assert(r == N_DHCP4_E_UNSET);
+        r = n_dhcp4_incoming_query(incoming, 3, &v, &l);
+        c_assert(r == 0);
+        c_assert(l == 2);
+        c_assert(v[0] == 0xaa && v[1] == 0xbb);
+        incoming = n_dhcp4_incoming_free(incoming);
+}
+
+static void test_index(void) {
+        NDhcp4Incoming *incoming;
+        struct {
+                NDhcp4Header header;
+                uint8_t sname[64];
+                uint8_t file[128];
+                uint32_t magic;
+                uint8_t options[1024];
+        } m;
+        size_t pos = 0;
+        uint8_t *v;
+        size_t l;
+        int r;
+
+        memset(&m, 0, sizeof(m));
+        m.magic = htobe32(N_DHCP4_MESSAGE_MAGIC);
+
+        /*
+         * Add options on both sides of every word of the option bitmap, in
+         * descending order, and with every other option split in two. Each
+         * option carries its code as data, once per instance.
+         */
+        for (unsigned int i = 0; i < 2; ++i) {
+                for (unsigned int o = 254; o > 0; --o) {
+                        if (o % 64 != 0 && o % 64 != 63 && o % 64 != 1)
+                                continue;
+                        if (i && o % 2)
+                                continue;
+
+                        m.options[pos++] = o;
+                        m.options[pos++] = 1;
+                        m.options[pos++] = o;
+                }
+        }
+        m.options[pos++] = N_DHCP4_OPTION_END;
+
+        r = n_dhcp4_incoming_new(&incoming, &m, sizeof(m));
+        c_assert(!r);
+
+        /* verify every option is found, with all its instances */
+
+        for (unsigned int o = 0; o < _N_DHCP4_OPTION_N; ++o) {
+                r = n_dhcp4_incoming_query(incoming, o, &v, &l);
+                if (o == 0 || o == 255 || (o % 64 != 0 && o % 64 != 63 && o % 64 != 1)) {
+                        c_assert(r == N_DHCP4_E_UNSET);
+                        continue;
+                }
+
+                c_assert(!r);
+                c_assert(l == (o % 2 ? 1 : 2));
+                c_assert(v[0] == o && v[l - 1] == o);
+        }
+
+        /* verify the index is ordered by option code */
+
+        for (unsigned int i = 1; i < 10; ++i)
+                c_assert(incoming->options[i - 1].code < incoming->options[i].code);
+
+        incoming = n_dhcp4_incoming_free(incoming);
+}
+
+static void test_borrowed(void) {
+        NDhcp4Incoming view, *incoming;
+        struct {
+                NDhcp4Header header;
+                uint8_t sname[64];
+                uint8_t file[128];
+                uint32_t magic;
+                uint8_t options[64];
+                uint8_t trailer[512];
+        } m;
+        size_t n_raw = sizeof(m) - sizeof(m.trailer);
+        uint8_t *v;
+        size_t l;
+        int r;
+
+        memset(&m, 0, sizeof(m));
+        m.magic = htobe32(N_DHCP4_MESSAGE_MAGIC);
+        m.options[0] = 1;
+        m.options[1] = 1;
+        m.options[2] = 0xef;
+        m.options[3] = 2;
+        m.options[4] = 1;
+        m.options[5] = 0xaa;
+        m.options[6] = 1;
+        m.options[7] = 1;
+        m.options[8] = 0xcf;
+        m.options[9] = N_DHCP4_OPTION_END;
+
+        /* verify that the message must fit the buffer and carry the magic */
+
+        r = n_dhcp4_incoming_init_borrowed(&view, &m, n_raw - 1, n_raw);
+        c_assert(r == N_DHCP4_E_MALFORMED);
+        c_assert(!view.message);
+
+        /* verify single options are parsed in place, split ones in the buffer */
+
+        r = n_dhcp4_incoming_init_borrowed(&view, &m, sizeof(m), n_raw);
+        c_assert(!r);
+        c_assert(!view.owns_index);
+        r = n_dhcp4_incoming_query(&view, 2, &v, &l);
+        c_assert(!r);
+        c_assert(l == 1 && v == &m.options[5]);
+        r = n_dhcp4_incoming_query(&view, 1, &v, &l);
+        c_assert(!r);
+        c_assert(l == 2 && v[0] == 0xef && v[1] == 0xcf);
+        c_assert(v >= m.trailer && v < m.trailer + sizeof(m.trailer));
+
+        /* verify copies survive the buffer */
+
+        view.userdata.type = N_DHCP4_C_MESSAGE_DISCOVER;
+        r = n_dhcp4_incoming_dup(&incoming, &view);
+        c_assert(!r);
+        n_dhcp4_incoming_deinit(&view);
+        c_assert(!view.message);
+
+        r = n_dhcp4_incoming_query(incoming, 1, &v, &l);
+        c_assert(!r);
+        c_assert(l == 2 && v[0] == 0xef && v[1] == 0xcf);
+        c_assert(incoming->userdata.type == N_DHCP4_C_MESSAGE_DISCOVER);
+        incoming = n_dhcp4_incoming_free(incoming);
+
+        /* verify split options are concatenated elsewhere without space */
+
+        r = n_dhcp4_incoming_init_borrowed(&view, &m, n_raw, n_raw);
+        c_assert(!r);
+        c_assert(view.owns_index);
+        r = n_dhcp4_incoming_query(&view, 1, &v, &l);
+        c_assert(!r);
+        c_assert(l == 2 && v[0] == 0xef && v[1] == 0xcf);
+        n_dhcp4_incoming_deinit(&view);
 }
 
 int main(int argc, char **argv) {
         test_outgoing();
+        test_outgoing_headers();
         test_incoming();
+        test_index();
+        test_borrowed();
         return 0;
 }
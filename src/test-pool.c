@@ -0,0 +1,209 @@
+/*
+ * Tests for DHCP4 Server Address Pools
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <c-stdaux.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "n-dhcp4-private.h"
+
+static struct in_addr test_addr(uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+        return (struct in_addr){ htonl(a << 24 | b << 16 | c << 8 | d) };
+}
+
+static void test_allocate(NDhcp4ServerPool *pool, struct in_addr expected) {
+        struct in_addr address;
+        int r;
+
+        r = n_dhcp4_server_pool_allocate(pool, &address);
+        c_assert(!r);
+        c_assert(address.s_addr == expected.s_addr);
+}
+
+static void test_new(void) {
+        NDhcp4ServerPool *pool = NULL;
+        int r;
+
+        r = n_dhcp4_server_pool_new(&pool, test_addr(10, 0, 0, 0), 7);
+        c_assert(r == -EINVAL);
+        r = n_dhcp4_server_pool_new(&pool, test_addr(10, 0, 0, 0), 33);
+        c_assert(r == -EINVAL);
+        r = n_dhcp4_server_pool_new(&pool, test_addr(10, 0, 0, 1), 24);
+        c_assert(r == N_DHCP4_E_INVALID_ADDRESS);
+        c_assert(!pool);
+
+        for (unsigned int i = N_DHCP4_S_POOL_MIN_PREFIXLEN; i <= 32; ++i) {
+                r = n_dhcp4_server_pool_new(&pool, test_addr(10, 0, 0, 0), i);
+                c_assert(!r);
+                c_assert(pool->n_levels <= N_DHCP4_S_POOL_MAX_LEVELS);
+                pool = n_dhcp4_server_pool_free(pool);
+        }
+}
+
+static void test_ranges(void) {
+        _c_cleanup_(n_dhcp4_server_pool_freep) NDhcp4ServerPool *pool = NULL;
+        struct in_addr address;
+        int r;
+
+        r = n_dhcp4_server_pool_new(&pool, test_addr(10, 0, 0, 0), 24);
+        c_assert(!r);
+
+        /* an empty pool has nothing to hand out */
+
+        r = n_dhcp4_server_pool_allocate(pool, &address);
+        c_assert(r == N_DHCP4_E_NO_SPACE);
+
+        /* ranges must be part of the subnet */
+
+        r = n_dhcp4_server_pool_add_range(pool, test_addr(10, 0, 0, 10), test_addr(10, 0, 1, 10));
+        c_assert(r == N_DHCP4_E_INVALID_ADDRESS);
+        r = n_dhcp4_server_pool_add_range(pool, test_addr(10, 0, 0, 20), test_addr(10, 0, 0, 10));
+        c_assert(r == N_DHCP4_E_INVALID_ADDRESS);
+
+        /* exclusions apply regardless of the order they are added in */
+
+        r = n_dhcp4_server_pool_add_exclusion(pool, test_addr(10, 0, 0, 15), test_addr(10, 0, 0, 16));
+        c_assert(!r);
+        r = n_dhcp4_server_pool_add_range(pool, test_addr(10, 0, 0, 10), test_addr(10, 0, 0, 20));
+        c_assert(!r);
+        r = n_dhcp4_server_pool_add_exclusion(pool, test_addr(10, 0, 0, 20), test_addr(10, 0, 0, 20));
+        c_assert(!r);
+
+        test_allocate(pool, test_addr(10, 0, 0, 10));
+        test_allocate(pool, test_addr(10, 0, 0, 11));
+        test_allocate(pool, test_addr(10, 0, 0, 12));
+        test_allocate(pool, test_addr(10, 0, 0, 13));
+        test_allocate(pool, test_addr(10, 0, 0, 14));
+        test_allocate(pool, test_addr(10, 0, 0, 17));
+
+        /* requested addresses can be claimed if they are free */
+
+        r = n_dhcp4_server_pool_claim(pool, test_addr(10, 0, 0, 19));
+        c_assert(!r);
+        r = n_dhcp4_server_pool_claim(pool, test_addr(10, 0, 0, 19));
+        c_assert(r == -EADDRINUSE);
+        r = n_dhcp4_server_pool_claim(pool, test_addr(10, 0, 0, 15));
+        c_assert(r == -EADDRNOTAVAIL);
+        r = n_dhcp4_server_pool_claim(pool, test_addr(10, 0, 0, 30));
+        c_assert(r == -EADDRNOTAVAIL);
+        r = n_dhcp4_server_pool_claim(pool, test_addr(10, 0, 1, 19));
+        c_assert(r == -EADDRNOTAVAIL);
+
+        test_allocate(pool, test_addr(10, 0, 0, 18));
+
+        r = n_dhcp4_server_pool_allocate(pool, &address);
+        c_assert(r == N_DHCP4_E_NO_SPACE);
+
+        /* released addresses are handed out again */
+
+        n_dhcp4_server_pool_release(pool, test_addr(10, 0, 0, 12));
+        n_dhcp4_server_pool_release(pool, test_addr(10, 0, 0, 12));
+        n_dhcp4_server_pool_release(pool, test_addr(10, 0, 0, 15));
+        test_allocate(pool, test_addr(10, 0, 0, 12));
+
+        r = n_dhcp4_server_pool_allocate(pool, &address);
+        c_assert(r == N_DHCP4_E_NO_SPACE);
+
+        /* the network and broadcast addresses are never handed out */
+
+        r = n_dhcp4_server_pool_add_range(pool, test_addr(10, 0, 0, 0), test_addr(10, 0, 0, 255));
+        c_assert(!r);
+        r = n_dhcp4_server_pool_claim(pool, test_addr(10, 0, 0, 0));
+        c_assert(r == -EADDRNOTAVAIL);
+        r = n_dhcp4_server_pool_claim(pool, test_addr(10, 0, 0, 255));
+        c_assert(r == -EADDRNOTAVAIL);
+        test_allocate(pool, test_addr(10, 0, 0, 1));
+}
+
+static void test_reservations(void) {
+        _c_cleanup_(n_dhcp4_server_pool_freep) NDhcp4ServerPool *pool = NULL;
+        uint8_t mac[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x00 };
+        struct in_addr address;
+        int r;
+
+        r = n_dhcp4_server_pool_new(&pool, test_addr(10, 0, 0, 0), 24);
+        c_assert(!r);
+
+        r = n_dhcp4_server_pool_add_range(pool, test_addr(10, 0, 0, 1), test_addr(10, 0, 0, 2));
+        c_assert(!r);
+
+        /* reservations may be inside or outside of any range */
+
+        for (uint8_t i = 0; i < 4; ++i) {
+                mac[5] = 3 - i;
+                r = n_dhcp4_server_pool_add_reservation(pool, test_addr(10, 0, 0, 3 - i), mac, sizeof(mac));
+                c_assert(!r);
+        }
+
+        r = n_dhcp4_server_pool_add_reservation(pool, test_addr(10, 0, 0, 3), mac, 0);
+        c_assert(r == -EINVAL);
+        r = n_dhcp4_server_pool_add_reservation(pool, test_addr(10, 0, 1, 3), mac, sizeof(mac));
+        c_assert(r == N_DHCP4_E_INVALID_ADDRESS);
+        r = n_dhcp4_server_pool_add_reservation(pool, test_addr(10, 0, 0, 4), mac, sizeof(mac));
+        c_assert(r == -EEXIST);
+        mac[5] = 4;
+        r = n_dhcp4_server_pool_add_reservation(pool, test_addr(10, 0, 0, 3), mac, sizeof(mac));
+        c_assert(r == -EEXIST);
+
+        for (uint8_t i = 0; i < 4; ++i) {
+                mac[5] = i;
+                r = n_dhcp4_server_pool_find_reservation(pool, mac, sizeof(mac), &address);
+                c_assert(!r);
+                c_assert(address.s_addr == test_addr(10, 0, 0, i).s_addr);
+        }
+
+        mac[5] = 4;
+        r = n_dhcp4_server_pool_find_reservation(pool, mac, sizeof(mac), &address);
+        c_assert(r == N_DHCP4_E_UNSET);
+        r = n_dhcp4_server_pool_find_reservation(pool, mac, sizeof(mac) - 1, &address);
+        c_assert(r == N_DHCP4_E_UNSET);
+
+        /* reserved addresses are never handed out dynamically */
+
+        r = n_dhcp4_server_pool_allocate(pool, &address);
+        c_assert(r == N_DHCP4_E_NO_SPACE);
+        r = n_dhcp4_server_pool_claim(pool, test_addr(10, 0, 0, 1));
+        c_assert(r == -EADDRNOTAVAIL);
+}
+
+static void test_large(void) {
+        _c_cleanup_(n_dhcp4_server_pool_freep) NDhcp4ServerPool *pool = NULL;
+        uint32_t n = (1 << 16) - 2;
+        struct in_addr address;
+        int r;
+
+        /* fill a /16 completely and verify the addresses come out in order */
+
+        r = n_dhcp4_server_pool_new(&pool, test_addr(172, 16, 0, 0), 16);
+        c_assert(!r);
+        r = n_dhcp4_server_pool_add_range(pool, test_addr(172, 16, 0, 0), test_addr(172, 16, 255, 255));
+        c_assert(!r);
+
+        for (uint32_t i = 0; i < n; ++i)
+                test_allocate(pool, test_addr(172, 16, (i + 1) >> 8, (i + 1) & 0xff));
+
+        r = n_dhcp4_server_pool_allocate(pool, &address);
+        c_assert(r == N_DHCP4_E_NO_SPACE);
+
+        /* release scattered addresses and get them back in ascending order */
+
+        for (uint32_t i = 997; i <= n; i += 997)
+                n_dhcp4_server_pool_release(pool, test_addr(172, 16, i >> 8, i & 0xff));
+
+        for (uint32_t i = 997; i <= n; i += 997)
+                test_allocate(pool, test_addr(172, 16, i >> 8, i & 0xff));
+
+        r = n_dhcp4_server_pool_allocate(pool, &address);
+        c_assert(r == N_DHCP4_E_NO_SPACE);
+}
+
+int main(int argc, char **argv) {
+        test_new();
+        test_ranges();
+        test_reservations();
+        test_large();
+        return 0;
+}
@@ -0,0 +1,1899 @@
+/*
+ * Tests for DHCP4 Servers
+ *
+ * This runs a server against client connections and clients over veth pairs.
+ * The heap allocator is wrapped to count allocations, so the tests can verify
+ * that events and replies are built without allocating once the server is
+ * warmed up, and that clients receive without allocating for anything but the
+ * replies they keep.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <c-stdaux.h>
+#include <errno.h>
+#include <net/if_arp.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include "n-dhcp4-private.h"
+#include "test.h"
+#include "util/link.h"
+#include "util/netns.h"
+
+#define TEST_N_ROUNDS (16)
+#define TEST_N_CLIENTS (8)
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void __libc_free(void *p);
+
+static size_t test_n_allocations;
+
+void *malloc(size_t size) {
+        ++test_n_allocations;
+        return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+        ++test_n_allocations;
+        return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+        ++test_n_allocations;
+        return __libc_realloc(p, size);
+}
+
+void free(void *p) {
+        __libc_free(p);
+}
+
+static void test_server_new(int netns, NDhcp4Server **serverp, int ifindex) {
+        _c_cleanup_(n_dhcp4_server_config_freep) NDhcp4ServerConfig *config = NULL;
+        int r, oldns;
+
+        r = n_dhcp4_server_config_new(&config);
+        c_assert(!r);
+
+        n_dhcp4_server_config_set_ifindex(config, ifindex);
+
+        netns_get(&oldns);
+        netns_set(netns);
+
+        r = n_dhcp4_server_new(serverp, config);
+        c_assert(!r);
+
+        netns_set(oldns);
+}
+
+static void test_client_new(int netns,
+                            NDhcp4CConnection *connection,
+                            NDhcp4ClientConfig **configp,
+                            NDhcp4ClientProbeConfig **probe_configp,
+                            NDhcp4LogQueue *log_queue,
+                            int efd,
+                            Link *link,
+                            const char *client_id) {
+        int r, oldns;
+
+        r = n_dhcp4_client_config_new(configp);
+        c_assert(!r);
+
+        n_dhcp4_client_config_set_ifindex(*configp, link->ifindex);
+        n_dhcp4_client_config_set_transport(*configp, N_DHCP4_TRANSPORT_ETHERNET);
+        n_dhcp4_client_config_set_mac(*configp, link->mac.ether_addr_octet, ETH_ALEN);
+        n_dhcp4_client_config_set_broadcast_mac(*configp,
+                                                (const uint8_t[]){
+                                                        0xff, 0xff, 0xff,
+                                                        0xff, 0xff, 0xff,
+                                                },
+                                                ETH_ALEN);
+        r = n_dhcp4_client_config_set_client_id(*configp, (void *)client_id, strlen(client_id));
+        c_assert(!r);
+
+        r = n_dhcp4_client_probe_config_new(probe_configp);
+        c_assert(!r);
+
+        r = n_dhcp4_c_connection_init(connection, *configp, *probe_configp, log_queue, NULL, efd);
+        c_assert(!r);
+
+        netns_get(&oldns);
+        netns_set(netns);
+
+        r = n_dhcp4_c_connection_listen(connection);
+        c_assert(!r);
+
+        netns_set(oldns);
+}
+
+/*
+ * Fill the reply of @lease up to the last byte, so the options of the
+ * assignment no longer fit.
+ */
+static void test_fill_reply(NDhcp4ServerLease *lease) {
+        uint8_t filler[UINT8_MAX] = {};
+        size_t n_filler = sizeof(filler);
+        int r;
+
+        while (n_filler) {
+                r = n_dhcp4_server_lease_append(lease, 224, filler, n_filler);
+                if (r == -EMSGSIZE)
+                        --n_filler;
+                else
+                        c_assert(!r);
+        }
+}
+
+static void test_discover(NDhcp4Server *server,
+                          NDhcp4CConnection *client,
+                          NDhcp4CConnection *bystander,
+                          bool warm,
+                          bool overflow) {
+        _c_cleanup_(n_dhcp4_outgoing_freep) NDhcp4Outgoing *request = NULL;
+        _c_cleanup_(n_dhcp4_incoming_freep) NDhcp4Incoming *offer = NULL;
+        struct in_addr router = (struct in_addr){ htonl(10 << 24 | 1) };
+        struct in_addr yiaddr, server_id;
+        NDhcp4Incoming *ignored = NULL;
+        NDhcp4ServerEvent *event;
+        struct pollfd pfd = { .events = POLLIN };
+        uint8_t buf[UINT16_MAX];
+        uint8_t *data;
+        size_t n_data;
+        uint8_t type;
+        int r;
+
+        r = n_dhcp4_c_connection_discover_new(client, &request);
+        c_assert(!r);
+
+        r = n_dhcp4_c_connection_start_request(client, request, 0);
+        c_assert(!r);
+        request = NULL;
+
+        n_dhcp4_server_get_fd(server, &pfd.fd);
+        r = poll(&pfd, 1, -1);
+        c_assert(r == 1);
+
+        /*
+         * Once warmed up, the event is raised on a node recycled from the
+         * previous round, and only the copy of the request kept on the lease
+         * is allocated.
+         */
+
+        test_n_allocations = 0;
+
+        r = n_dhcp4_server_dispatch(server);
+        c_assert(!r || r == N_DHCP4_E_PREEMPTED);
+
+        r = n_dhcp4_server_pop_event(server, &event);
+        c_assert(!r);
+        c_assert(event);
+        c_assert(event->event == N_DHCP4_SERVER_EVENT_DISCOVER);
+
+        c_assert(!warm || test_n_allocations == 1);
+
+        /* the lease is held for the next request, with the timer armed to reclaim it */
+        c_assert(event->discover.lease->timer.wheel == &server->timers);
+        c_assert(server->scheduled_timeout);
+
+        /*
+         * If the assignment does not fit into the reply, the reply is dropped
+         * with everything appended to it, so the next attempt starts over.
+         */
+
+        if (overflow) {
+                test_fill_reply(event->discover.lease);
+
+                r = n_dhcp4_server_lease_offer(event->discover.lease);
+                c_assert(r == -EMSGSIZE);
+        }
+
+        /* building and sending the offer must not allocate once warmed up */
+
+        test_n_allocations = 0;
+
+        r = n_dhcp4_server_lease_append(event->discover.lease,
+                                        N_DHCP4_OPTION_ROUTER,
+                                        (uint8_t *)&router.s_addr,
+                                        sizeof(router.s_addr));
+        c_assert(!r);
+
+        r = n_dhcp4_server_lease_offer(event->discover.lease);
+        c_assert(!r);
+
+        r = n_dhcp4_server_pop_event(server, &event);
+        c_assert(!r);
+        c_assert(!event);
+
+        c_assert(!warm || !test_n_allocations);
+
+        /*
+         * The client receives the offer with the first address of the pool.
+         * It is parsed in place, and only copied out of the receive buffer
+         * once it was accepted.
+         */
+
+        pfd.fd = client->fd_epoll;
+        r = poll(&pfd, 1, -1);
+        c_assert(r == 1);
+
+        test_n_allocations = 0;
+
+        r = n_dhcp4_c_connection_dispatch_io(client, buf, sizeof(buf), &offer);
+        c_assert(!r);
+        c_assert(offer);
+
+        c_assert(test_n_allocations == 1);
+
+        /* a client on the same link drops the offer without allocating */
+
+        pfd.fd = bystander->fd_epoll;
+        r = poll(&pfd, 1, -1);
+        c_assert(r == 1);
+
+        test_n_allocations = 0;
+
+        r = n_dhcp4_c_connection_dispatch_io(bystander, buf, sizeof(buf), &ignored);
+        c_assert(r == N_DHCP4_E_UNEXPECTED);
+        c_assert(!ignored);
+
+        c_assert(!test_n_allocations);
+
+        r = n_dhcp4_incoming_query_message_type(offer, &type);
+        c_assert(!r);
+        c_assert(type == N_DHCP4_MESSAGE_OFFER);
+
+        n_dhcp4_incoming_get_yiaddr(offer, &yiaddr);
+        c_assert(yiaddr.s_addr == htonl(10 << 24 | 100));
+
+        /* the server identifies itself with its address on the subnet of the pool */
+
+        r = n_dhcp4_incoming_query_server_identifier(offer, &server_id);
+        c_assert(!r);
+        c_assert(server_id.s_addr == router.s_addr);
+
+        r = n_dhcp4_incoming_query(offer, N_DHCP4_OPTION_ROUTER, &data, &n_data);
+        c_assert(!r);
+        c_assert(n_data == sizeof(router.s_addr));
+        c_assert(!memcmp(data, &router.s_addr, n_data));
+
+        /* options of a failed attempt never leak into the reply */
+
+        r = n_dhcp4_incoming_query(offer, 224, &data, &n_data);
+        c_assert(r == N_DHCP4_E_UNSET);
+
+        r = n_dhcp4_incoming_query(offer, N_DHCP4_OPTION_IP_ADDRESS_LEASE_TIME, &data, &n_data);
+        c_assert(!r);
+        c_assert(n_data == sizeof(uint32_t));
+}
+
+static void test_offer(void) {
+        const struct in_addr addr_server = (struct in_addr){ htonl(10 << 24 | 1) };
+        _c_cleanup_(netns_closep) int ns_server = -1, ns_client = -1;
+        _c_cleanup_(link_deinit) Link link_server = LINK_NULL(link_server);
+        _c_cleanup_(link_deinit) Link link_client = LINK_NULL(link_client);
+        _c_cleanup_(c_closep) int efd_client = -1, efd_bystander = -1;
+        _c_cleanup_(n_dhcp4_client_config_freep) NDhcp4ClientConfig *client_config = NULL;
+        _c_cleanup_(n_dhcp4_client_probe_config_freep) NDhcp4ClientProbeConfig *probe_config = NULL;
+        _c_cleanup_(n_dhcp4_client_config_freep) NDhcp4ClientConfig *bystander_config = NULL;
+        _c_cleanup_(n_dhcp4_client_probe_config_freep) NDhcp4ClientProbeConfig *bystander_probe_config = NULL;
+        _c_cleanup_(n_dhcp4_server_unrefp) NDhcp4Server *server = NULL;
+        _c_cleanup_(n_dhcp4_server_ip_freep) NDhcp4ServerIp *ip = NULL;
+        _c_cleanup_(n_dhcp4_server_ip_freep) NDhcp4ServerIp *ip_other = NULL;
+        NDhcp4ServerIp *ip_duplicate = NULL;
+        _c_cleanup_(n_dhcp4_server_pool_freep) NDhcp4ServerPool *pool = NULL;
+        NDhcp4CConnection client = N_DHCP4_C_CONNECTION_NULL(client);
+        NDhcp4CConnection bystander = N_DHCP4_C_CONNECTION_NULL(bystander);
+        NDhcp4LogQueue log_queue = N_DHCP4_LOG_QUEUE_NULL_DEFUNCT();
+        int r;
+
+        /* setup */
+
+        netns_new(&ns_server);
+        netns_new(&ns_client);
+
+        link_new_veth(&link_server, &link_client, ns_server, ns_client);
+        link_add_ip4(&link_server, &addr_server, 8);
+
+        efd_client = epoll_create1(EPOLL_CLOEXEC);
+        c_assert(efd_client >= 0);
+        efd_bystander = epoll_create1(EPOLL_CLOEXEC);
+        c_assert(efd_bystander >= 0);
+
+        test_server_new(ns_server, &server, link_server.ifindex);
+
+        /* the first address is not on the subnet of the pool */
+
+        r = n_dhcp4_server_add_ip(server, &ip_other, (struct in_addr){ htonl(192 << 24 | 168 << 16 | 1) });
+        c_assert(!r);
+        r = n_dhcp4_server_add_ip(server, &ip, addr_server);
+        c_assert(!r);
+        r = n_dhcp4_server_add_ip(server, &ip_duplicate, addr_server);
+        c_assert(r == -EADDRINUSE);
+
+        r = n_dhcp4_server_add_pool(server, &pool, (struct in_addr){ htonl(10 << 24) }, 8);
+        c_assert(!r);
+        r = n_dhcp4_server_pool_add_range(pool,
+                                          (struct in_addr){ htonl(10 << 24 | 100) },
+                                          (struct in_addr){ htonl(10 << 24 | 200) });
+        c_assert(!r);
+
+        test_client_new(ns_client,
+                        &client,
+                        &client_config,
+                        &probe_config,
+                        &log_queue,
+                        efd_client,
+                        &link_client,
+                        "client-id");
+
+        /* the bystander listens on the same link, without a pending request */
+
+        test_client_new(ns_client,
+                        &bystander,
+                        &bystander_config,
+                        &bystander_probe_config,
+                        &log_queue,
+                        efd_bystander,
+                        &link_client,
+                        "client-id");
+
+        /* the first round may allocate the reply buffer, later ones must not */
+
+        for (unsigned int i = 0; i < TEST_N_ROUNDS; ++i)
+                test_discover(server, &client, &bystander, i > 0, false);
+
+        /* a failed offer can be retried */
+
+        test_discover(server, &client, &bystander, false, true);
+
+        /* teardown */
+
+        n_dhcp4_c_connection_deinit(&bystander);
+        n_dhcp4_c_connection_deinit(&client);
+        link_del_ip4(&link_server, &addr_server, 8);
+}
+
+static void test_interface_discover(NDhcp4Server *server,
+                                    NDhcp4CConnection *client,
+                                    struct in_addr server_id,
+                                    struct in_addr address,
+                                    NDhcp4Incoming **offerp) {
+        _c_cleanup_(n_dhcp4_outgoing_freep) NDhcp4Outgoing *request = NULL;
+        _c_cleanup_(n_dhcp4_incoming_freep) NDhcp4Incoming *offer = NULL;
+        struct in_addr yiaddr, id;
+        NDhcp4ServerEvent *event;
+        struct pollfd pfd = { .events = POLLIN };
+        uint8_t buf[UINT16_MAX];
+        int r;
+
+        r = n_dhcp4_c_connection_discover_new(client, &request);
+        c_assert(!r);
+
+        r = n_dhcp4_c_connection_start_request(client, request, 0);
+        c_assert(!r);
+        request = NULL;
+
+        n_dhcp4_server_get_fd(server, &pfd.fd);
+        r = poll(&pfd, 1, -1);
+        c_assert(r == 1);
+
+        r = n_dhcp4_server_dispatch(server);
+        c_assert(!r);
+
+        r = n_dhcp4_server_pop_event(server, &event);
+        c_assert(!r);
+        c_assert(event);
+        c_assert(event->event == N_DHCP4_SERVER_EVENT_DISCOVER);
+
+        r = n_dhcp4_server_lease_offer(event->discover.lease);
+        c_assert(!r);
+
+        r = n_dhcp4_server_pop_event(server, &event);
+        c_assert(!r);
+        c_assert(!event);
+
+        pfd.fd = client->fd_epoll;
+        r = poll(&pfd, 1, -1);
+        c_assert(r == 1);
+
+        r = n_dhcp4_c_connection_dispatch_io(client, buf, sizeof(buf), &offer);
+        c_assert(!r);
+        c_assert(offer);
+
+        n_dhcp4_incoming_get_yiaddr(offer, &yiaddr);
+        c_assert(yiaddr.s_addr == address.s_addr);
+
+        r = n_dhcp4_incoming_query_server_identifier(offer, &id);
+        c_assert(!r);
+        c_assert(id.s_addr == server_id.s_addr);
+
+        if (offerp) {
+                *offerp = offer;
+                offer = NULL;
+        }
+}
+
+static void test_interfaces(void) {
+        const struct in_addr addr_server = (struct in_addr){ htonl(10 << 24 | 1) };
+        const struct in_addr addr_server2 = (struct in_addr){ htonl(11 << 24 | 1) };
+        _c_cleanup_(netns_closep) int ns_server = -1, ns_server2 = -1, ns_client = -1, ns_client2 = -1;
+        _c_cleanup_(link_deinit) Link link_server = LINK_NULL(link_server);
+        _c_cleanup_(link_deinit) Link link_server2 = LINK_NULL(link_server2);
+        _c_cleanup_(link_deinit) Link link_client = LINK_NULL(link_client);
+        _c_cleanup_(link_deinit) Link link_client2 = LINK_NULL(link_client2);
+        _c_cleanup_(c_closep) int efd_client = -1, efd_client2 = -1;
+        _c_cleanup_(n_dhcp4_client_config_freep) NDhcp4ClientConfig *client_config = NULL;
+        _c_cleanup_(n_dhcp4_client_probe_config_freep) NDhcp4ClientProbeConfig *probe_config = NULL;
+        _c_cleanup_(n_dhcp4_client_config_freep) NDhcp4ClientConfig *client2_config = NULL;
+        _c_cleanup_(n_dhcp4_client_probe_config_freep) NDhcp4ClientProbeConfig *client2_probe_config = NULL;
+        _c_cleanup_(n_dhcp4_server_unrefp) NDhcp4Server *server = NULL;
+        _c_cleanup_(n_dhcp4_server_interface_freep) NDhcp4ServerInterface *interface = NULL;
+        _c_cleanup_(n_dhcp4_server_ip_freep) NDhcp4ServerIp *ip = NULL;
+        _c_cleanup_(n_dhcp4_server_ip_freep) NDhcp4ServerIp *ip2 = NULL;
+        _c_cleanup_(n_dhcp4_server_pool_freep) NDhcp4ServerPool *pool = NULL;
+        _c_cleanup_(n_dhcp4_server_pool_freep) NDhcp4ServerPool *pool2 = NULL;
+        NDhcp4CConnection client = N_DHCP4_C_CONNECTION_NULL(client);
+        NDhcp4CConnection client2 = N_DHCP4_C_CONNECTION_NULL(client2);
+        NDhcp4LogQueue log_queue = N_DHCP4_LOG_QUEUE_NULL_DEFUNCT();
+        struct pollfd pfd = { .events = POLLIN };
+        int r, oldns;
+
+        /*
+         * The second link lives in namespaces of its own, so the names of the
+         * veth pairs do not clash. The server does not care which namespace
+         * the sockets of its interfaces were opened in.
+         */
+
+        netns_new(&ns_server);
+        netns_new(&ns_server2);
+        netns_new(&ns_client);
+        netns_new(&ns_client2);
+
+        link_new_veth(&link_server, &link_client, ns_server, ns_client);
+        link_new_veth(&link_server2, &link_client2, ns_server2, ns_client2);
+        link_add_ip4(&link_server, &addr_server, 8);
+        link_add_ip4(&link_server2, &addr_server2, 8);
+
+        efd_client = epoll_create1(EPOLL_CLOEXEC);
+        c_assert(efd_client >= 0);
+        efd_client2 = epoll_create1(EPOLL_CLOEXEC);
+        c_assert(efd_client2 >= 0);
+
+        test_server_new(ns_server, &server, link_server.ifindex);
+
+        netns_get(&oldns);
+        netns_set(ns_server2);
+
+        r = n_dhcp4_server_add_interface(server, &interface, link_server2.ifindex);
+        c_assert(!r);
+
+        netns_set(oldns);
+
+        r = n_dhcp4_server_add_ip(server, &ip, addr_server);
+        c_assert(!r);
+        r = n_dhcp4_server_interface_add_ip(interface, &ip2, addr_server2);
+        c_assert(!r);
+
+        /* both interfaces share the pools of the server */
+
+        r = n_dhcp4_server_add_pool(server, &pool, (struct in_addr){ htonl(10 << 24) }, 8);
+        c_assert(!r);
+        r = n_dhcp4_server_pool_add_range(pool,
+                                          (struct in_addr){ htonl(10 << 24 | 100) },
+                                          (struct in_addr){ htonl(10 << 24 | 200) });
+        c_assert(!r);
+        r = n_dhcp4_server_add_pool(server, &pool2, (struct in_addr){ htonl(11 << 24) }, 8);
+        c_assert(!r);
+        r = n_dhcp4_server_pool_add_range(pool2,
+                                          (struct in_addr){ htonl(11 << 24 | 100) },
+                                          (struct in_addr){ htonl(11 << 24 | 200) });
+        c_assert(!r);
+
+        test_client_new(ns_client,
+                        &client,
+                        &client_config,
+                        &probe_config,
+                        &log_queue,
+                        efd_client,
+                        &link_client,
+                        "client-id");
+        test_client_new(ns_client2,
+                        &client2,
+                        &client2_config,
+                        &client2_probe_config,
+                        &log_queue,
+                        efd_client2,
+                        &link_client2,
+                        "client-id-2");
+
+        /*
+         * Both clients are served through the single FD of the server, each
+         * by the address of the interface it is connected to. The first pool
+         * with space left serves the second client, as its interface has no
+         * address on the subnet of the pool.
+         */
+
+        test_interface_discover(server, &client, addr_server, (struct in_addr){ htonl(10 << 24 | 100) }, NULL);
+        test_interface_discover(server, &client2, addr_server2, (struct in_addr){ htonl(10 << 24 | 101) }, NULL);
+
+        /* once removed, the interface is no longer served, but the other one is */
+
+        interface = n_dhcp4_server_interface_free(interface);
+
+        {
+                _c_cleanup_(n_dhcp4_outgoing_freep) NDhcp4Outgoing *request = NULL;
+
+                r = n_dhcp4_c_connection_discover_new(&client2, &request);
+                c_assert(!r);
+
+                r = n_dhcp4_c_connection_start_request(&client2, request, 0);
+                c_assert(!r);
+                request = NULL;
+        }
+
+        n_dhcp4_server_get_fd(server, &pfd.fd);
+        r = poll(&pfd, 1, 100);
+        c_assert(r == 0);
+
+        test_interface_discover(server, &client, addr_server, (struct in_addr){ htonl(10 << 24 | 100) }, NULL);
+
+        /* teardown */
+
+        n_dhcp4_c_connection_deinit(&client2);
+        n_dhcp4_c_connection_deinit(&client);
+        link_del_ip4(&link_server2, &addr_server2, 8);
+        link_del_ip4(&link_server, &addr_server, 8);
+}
+
+/*
+ * A declined address is withheld from all clients for the quarantine period,
+ * including the client that declined it, and returns to its pool afterwards.
+ */
+static void test_decline(void) {
+        const struct in_addr addr_server = (struct in_addr){ htonl(10 << 24 | 1) };
+        const struct in_addr addr_declined = (struct in_addr){ htonl(10 << 24 | 100) };
+        _c_cleanup_(netns_closep) int ns_server = -1, ns_client = -1;
+        _c_cleanup_(link_deinit) Link link_server = LINK_NULL(link_server);
+        _c_cleanup_(link_deinit) Link link_client = LINK_NULL(link_client);
+        _c_cleanup_(c_closep) int efd_client = -1, efd_client2 = -1;
+        _c_cleanup_(n_dhcp4_client_config_freep) NDhcp4ClientConfig *client_config = NULL;
+        _c_cleanup_(n_dhcp4_client_probe_config_freep) NDhcp4ClientProbeConfig *probe_config = NULL;
+        _c_cleanup_(n_dhcp4_client_config_freep) NDhcp4ClientConfig *client2_config = NULL;
+        _c_cleanup_(n_dhcp4_client_probe_config_freep) NDhcp4ClientProbeConfig *client2_probe_config = NULL;
+        _c_cleanup_(n_dhcp4_server_unrefp) NDhcp4Server *server = NULL;
+        _c_cleanup_(n_dhcp4_server_ip_freep) NDhcp4ServerIp *ip = NULL;
+        _c_cleanup_(n_dhcp4_server_pool_freep) NDhcp4ServerPool *pool = NULL;
+        _c_cleanup_(n_dhcp4_outgoing_freep) NDhcp4Outgoing *request = NULL;
+        _c_cleanup_(n_dhcp4_incoming_freep) NDhcp4Incoming *offer = NULL;
+        NDhcp4CConnection client = N_DHCP4_C_CONNECTION_NULL(client);
+        NDhcp4CConnection client2 = N_DHCP4_C_CONNECTION_NULL(client2);
+        NDhcp4LogQueue log_queue = N_DHCP4_LOG_QUEUE_NULL_DEFUNCT();
+        struct pollfd pfd = { .events = POLLIN };
+        NDhcp4ServerEvent *event;
+        NDhcp4ServerLease *lease;
+        uint64_t ns_now;
+        int r;
+
+        /* setup */
+
+        netns_new(&ns_server);
+        netns_new(&ns_client);
+
+        link_new_veth(&link_server, &link_client, ns_server, ns_client);
+        link_add_ip4(&link_server, &addr_server, 8);
+
+        efd_client = epoll_create1(EPOLL_CLOEXEC);
+        c_assert(efd_client >= 0);
+        efd_client2 = epoll_create1(EPOLL_CLOEXEC);
+        c_assert(efd_client2 >= 0);
+
+        test_server_new(ns_server, &server, link_server.ifindex);
+
+        r = n_dhcp4_server_add_ip(server, &ip, addr_server);
+        c_assert(!r);
+        r = n_dhcp4_server_add_pool(server, &pool, (struct in_addr){ htonl(10 << 24) }, 8);
+        c_assert(!r);
+        r = n_dhcp4_server_pool_add_range(pool,
+                                          (struct in_addr){ htonl(10 << 24 | 100) },
+                                          (struct in_addr){ htonl(10 << 24 | 200) });
+        c_assert(!r);
+
+        test_client_new(ns_client,
+                        &client,
+                        &client_config,
+                        &probe_config,
+                        &log_queue,
+                        efd_client,
+                        &link_client,
+                        "client-id");
+
+        /* the client declines the first address it is offered */
+
+        test_interface_discover(server, &client, addr_server, addr_declined, &offer);
+
+        r = n_dhcp4_c_connection_decline_new(&client, &request, offer, "address in use");
+        c_assert(!r);
+
+        r = n_dhcp4_c_connection_start_request(&client, request, 0);
+        c_assert(!r);
+        request = NULL;
+
+        n_dhcp4_server_get_fd(server, &pfd.fd);
+        r = poll(&pfd, 1, -1);
+        c_assert(r == 1);
+
+        r = n_dhcp4_server_dispatch(server);
+        c_assert(!r);
+
+        r = n_dhcp4_server_pop_event(server, &event);
+        c_assert(!r);
+        c_assert(event);
+        c_assert(event->event == N_DHCP4_SERVER_EVENT_DECLINE);
+
+        /* the lease keeps the address, but no longer belongs to the client */
+
+        ns_now = n_dhcp4_gettime(CLOCK_BOOTTIME);
+        lease = event->decline.lease;
+        c_assert(lease->server == server);
+        c_assert(lease->address.s_addr == addr_declined.s_addr);
+        c_assert(lease->key.key[0] == N_DHCP4_S_LEASE_KEY_QUARANTINE);
+        c_assert(lease->timer.wheel == &server->timers);
+        c_assert(lease->expiry > ns_now + N_DHCP4_SERVER_LEASE_HOLD * UINT64_C(1000000000));
+
+        r = n_dhcp4_server_lease_offer(lease);
+        c_assert(r == -ENOTRECOVERABLE);
+
+        r = n_dhcp4_server_pop_event(server, &event);
+        c_assert(!r);
+        c_assert(!event);
+
+        /* while in quarantine, the client starts over with another address */
+
+        test_interface_discover(server, &client, addr_server, (struct in_addr){ htonl(10 << 24 | 101) }, NULL);
+
+        /*
+         * Cut the quarantine short, rather than waiting for it. The timer of
+         * the server is re-armed once all events were popped.
+         */
+
+        lease = n_dhcp4_s_lease_table_find_address(&server->leases, addr_declined);
+        c_assert(lease);
+        n_dhcp4_timer_link(&lease->timer, &server->timers, n_dhcp4_gettime(CLOCK_BOOTTIME));
+
+        r = n_dhcp4_server_pop_event(server, &event);
+        c_assert(!r);
+        c_assert(!event);
+
+        r = poll(&pfd, 1, -1);
+        c_assert(r == 1);
+
+        r = n_dhcp4_server_dispatch(server);
+        c_assert(!r);
+
+        c_assert(!n_dhcp4_s_lease_table_find_address(&server->leases, addr_declined));
+
+        /* afterwards, the address is offered again */
+
+        test_client_new(ns_client,
+                        &client2,
+                        &client2_config,
+                        &client2_probe_config,
+                        &log_queue,
+                        efd_client2,
+                        &link_client,
+                        "client-id-2");
+
+        test_interface_discover(server, &client2, addr_server, addr_declined, NULL);
+
+        /* teardown */
+
+        n_dhcp4_c_connection_deinit(&client2);
+        n_dhcp4_c_connection_deinit(&client);
+        link_del_ip4(&link_server, &addr_server, 8);
+}
+
+/*
+ * The lease lifetime of the configuration is sent in OFFERs and ACKs, and an
+ * acknowledged address expires once it passed.
+ */
+static void test_lifetime(void) {
+        const struct in_addr addr_server = (struct in_addr){ htonl(10 << 24 | 1) };
+        const struct in_addr addr_client = (struct in_addr){ htonl(10 << 24 | 100) };
+        const uint32_t lifetime = 600;
+        _c_cleanup_(netns_closep) int ns_server = -1, ns_client = -1;
+        _c_cleanup_(link_deinit) Link link_server = LINK_NULL(link_server);
+        _c_cleanup_(link_deinit) Link link_client = LINK_NULL(link_client);
+        _c_cleanup_(c_closep) int efd_client = -1;
+        _c_cleanup_(n_dhcp4_client_config_freep) NDhcp4ClientConfig *client_config = NULL;
+        _c_cleanup_(n_dhcp4_client_probe_config_freep) NDhcp4ClientProbeConfig *probe_config = NULL;
+        _c_cleanup_(n_dhcp4_server_config_freep) NDhcp4ServerConfig *server_config = NULL;
+        _c_cleanup_(n_dhcp4_server_unrefp) NDhcp4Server *server = NULL;
+        _c_cleanup_(n_dhcp4_server_ip_freep) NDhcp4ServerIp *ip = NULL;
+        _c_cleanup_(n_dhcp4_server_pool_freep) NDhcp4ServerPool *pool = NULL;
+        _c_cleanup_(n_dhcp4_outgoing_freep) NDhcp4Outgoing *request = NULL;
+        _c_cleanup_(n_dhcp4_incoming_freep) NDhcp4Incoming *offer = NULL;
+        _c_cleanup_(n_dhcp4_incoming_freep) NDhcp4Incoming *ack = NULL;
+        NDhcp4CConnection client = N_DHCP4_C_CONNECTION_NULL(client);
+        NDhcp4LogQueue log_queue = N_DHCP4_LOG_QUEUE_NULL_DEFUNCT();
+        struct pollfd pfd = { .events = POLLIN };
+        NDhcp4ServerEvent *event;
+        NDhcp4ServerLease *lease;
+        uint8_t buf[UINT16_MAX];
+        uint64_t ns_before, ns_after;
+        uint32_t value;
+        int r, oldns;
+
+        /* setup */
+
+        netns_new(&ns_server);
+        netns_new(&ns_client);
+
+        link_new_veth(&link_server, &link_client, ns_server, ns_client);
+        link_add_ip4(&link_server, &addr_server, 8);
+
+        efd_client = epoll_create1(EPOLL_CLOEXEC);
+        c_assert(efd_client >= 0);
+
+        r = n_dhcp4_server_config_new(&server_config);
+        c_assert(!r);
+
+        n_dhcp4_server_config_set_ifindex(server_config, link_server.ifindex);
+        n_dhcp4_server_config_set_lease_lifetime(server_config, lifetime);
+
+        netns_get(&oldns);
+        netns_set(ns_server);
+
+        r = n_dhcp4_server_new(&server, server_config);
+        c_assert(!r);
+
+        netns_set(oldns);
+
+        r = n_dhcp4_server_add_ip(server, &ip, addr_server);
+        c_assert(!r);
+        r = n_dhcp4_server_add_pool(server, &pool, (struct in_addr){ htonl(10 << 24) }, 8);
+        c_assert(!r);
+        r = n_dhcp4_server_pool_add_range(pool, addr_client, addr_client);
+        c_assert(!r);
+
+        test_client_new(ns_client,
+                        &client,
+                        &client_config,
+                        &probe_config,
+                        &log_queue,
+                        efd_client,
+                        &link_client,
+                        "client-id");
+
+        /* the OFFER carries the configured lifetime */
+
+        test_interface_discover(server, &client, addr_server, addr_client, &offer);
+
+        r = n_dhcp4_incoming_query_lifetime(offer, &value);
+        c_assert(!r);
+        c_assert(value == lifetime);
+
+        /* so does the ACK, and the lease expires along with it */
+
+        r = n_dhcp4_c_connection_select_new(&client, &request, offer);
+        c_assert(!r);
+
+        r = n_dhcp4_c_connection_start_request(&client, request, 0);
+        c_assert(!r);
+        request = NULL;
+
+        n_dhcp4_server_get_fd(server, &pfd.fd);
+        r = poll(&pfd, 1, -1);
+        c_assert(r == 1);
+
+        r = n_dhcp4_server_dispatch(server);
+        c_assert(!r);
+
+        r = n_dhcp4_server_pop_event(server, &event);
+        c_assert(!r);
+        c_assert(event);
+        c_assert(event->event == N_DHCP4_SERVER_EVENT_REQUEST);
+
+        lease = event->request.lease;
+
+        ns_before = n_dhcp4_gettime(CLOCK_BOOTTIME);
+        r = n_dhcp4_server_lease_ack(lease);
+        c_assert(!r);
+        ns_after = n_dhcp4_gettime(CLOCK_BOOTTIME);
+
+        c_assert(lease->timer.wheel == &server->timers);
+        c_assert(lease->expiry >= ns_before + lifetime * UINT64_C(1000000000));
+        c_assert(lease->expiry <= ns_after + lifetime * UINT64_C(1000000000));
+
+        r = n_dhcp4_server_pop_event(server, &event);
+        c_assert(!r);
+        c_assert(!event);
+
+        pfd.fd = client.fd_epoll;
+        r = poll(&pfd, 1, -1);
+        c_assert(r == 1);
+
+        r = n_dhcp4_c_connection_dispatch_io(&client, buf, sizeof(buf), &ack);
+        c_assert(!r);
+        c_assert(ack);
+
+        r = n_dhcp4_incoming_query_lifetime(ack, &value);
+        c_assert(!r);
+        c_assert(value == lifetime);
+
+        /* teardown */
+
+        n_dhcp4_c_connection_deinit(&client);
+        link_del_ip4(&link_server, &addr_server, 8);
+}
+
+/*
+ * Run full clients in a shared client context against the server, until each
+ * of them got an offer. All clients are dispatched through the single FD of
+ * the context, and their timeouts share its timer.
+ */
+static void test_context(void) {
+        const struct in_addr addr_server = (struct in_addr){ htonl(10 << 24 | 1) };
+        _c_cleanup_(netns_closep) int ns_server = -1, ns_client = -1;
+        _c_cleanup_(link_deinit) Link link_server = LINK_NULL(link_server);
+        _c_cleanup_(link_deinit) Link link_client = LINK_NULL(link_client);
+        _c_cleanup_(n_dhcp4_client_probe_config_freep) NDhcp4ClientProbeConfig *probe_config = NULL;
+        _c_cleanup_(n_dhcp4_client_context_unrefp) NDhcp4ClientContext *context = NULL;
+        _c_cleanup_(n_dhcp4_server_unrefp) NDhcp4Server *server = NULL;
+        _c_cleanup_(n_dhcp4_server_ip_freep) NDhcp4ServerIp *ip = NULL;
+        _c_cleanup_(n_dhcp4_server_pool_freep) NDhcp4ServerPool *pool = NULL;
+        NDhcp4ClientProbe *probes[TEST_N_CLIENTS] = {};
+        NDhcp4Client *clients[TEST_N_CLIENTS] = {};
+        struct in_addr yiaddrs[TEST_N_CLIENTS] = {};
+        struct pollfd pfds[2] = {
+                { .events = POLLIN },
+                { .events = POLLIN },
+        };
+        NDhcp4ClientEvent *client_event;
+        NDhcp4ServerEvent *server_event;
+        size_t n_offers = 0;
+        int r, fd, oldns;
+
+        /* setup */
+
+        netns_new(&ns_server);
+        netns_new(&ns_client);
+
+        link_new_veth(&link_server, &link_client, ns_server, ns_client);
+        link_add_ip4(&link_server, &addr_server, 8);
+
+        test_server_new(ns_server, &server, link_server.ifindex);
+
+        r = n_dhcp4_server_add_ip(server, &ip, addr_server);
+        c_assert(!r);
+        r = n_dhcp4_server_add_pool(server, &pool, (struct in_addr){ htonl(10 << 24) }, 8);
+        c_assert(!r);
+        r = n_dhcp4_server_pool_add_range(pool,
+                                          (struct in_addr){ htonl(10 << 24 | 100) },
+                                          (struct in_addr){ htonl(10 << 24 | 200) });
+        c_assert(!r);
+
+        r = n_dhcp4_client_context_new(&context);
+        c_assert(!r);
+
+        r = n_dhcp4_client_probe_config_new(&probe_config);
+        c_assert(!r);
+
+        n_dhcp4_client_probe_config_set_start_delay(probe_config, 10);
+
+        netns_get(&oldns);
+        netns_set(ns_client);
+
+        for (size_t i = 0; i < TEST_N_CLIENTS; ++i) {
+                _c_cleanup_(n_dhcp4_client_config_freep) NDhcp4ClientConfig *config = NULL;
+                char client_id[] = "client-id-0";
+
+                client_id[sizeof(client_id) - 2] += i;
+
+                r = n_dhcp4_client_config_new(&config);
+                c_assert(!r);
+
+                n_dhcp4_client_config_set_ifindex(config, link_client.ifindex);
+                n_dhcp4_client_config_set_transport(config, N_DHCP4_TRANSPORT_ETHERNET);
+                n_dhcp4_client_config_set_mac(config, link_client.mac.ether_addr_octet, ETH_ALEN);
+                n_dhcp4_client_config_set_broadcast_mac(config,
+                                                        (const uint8_t[]){
+                                                                0xff, 0xff, 0xff,
+                                                                0xff, 0xff, 0xff,
+                                                        },
+                                                        ETH_ALEN);
+                r = n_dhcp4_client_config_set_client_id(config, (void *)client_id, strlen(client_id));
+                c_assert(!r);
+
+                r = n_dhcp4_client_new_in_context(&clients[i], config, context);
+                c_assert(!r);
+
+                n_dhcp4_client_get_fd(clients[i], &fd);
+                c_assert(fd == context->fd_epoll);
+                c_assert(clients[i]->fd_timer < 0);
+
+                r = n_dhcp4_client_probe(clients[i], &probes[i], probe_config);
+                c_assert(!r);
+
+                /* the deferred start is scheduled on the wheel of the context */
+                c_assert(clients[i]->timer.wheel == &context->timers);
+        }
+
+        c_assert(context->scheduled_timeout);
+
+        n_dhcp4_client_context_get_fd(context, &pfds[0].fd);
+        n_dhcp4_server_get_fd(server, &pfds[1].fd);
+
+        while (n_offers < TEST_N_CLIENTS) {
+                r = poll(pfds, 2, -1);
+                c_assert(r > 0);
+
+                if (pfds[0].revents & POLLIN) {
+                        r = n_dhcp4_client_context_dispatch(context);
+                        c_assert(!r || r == N_DHCP4_E_PREEMPTED);
+                }
+
+                if (pfds[1].revents & POLLIN) {
+                        r = n_dhcp4_server_dispatch(server);
+                        c_assert(!r || r == N_DHCP4_E_PREEMPTED);
+                }
+
+                for (;;) {
+                        r = n_dhcp4_server_pop_event(server, &server_event);
+                        c_assert(!r);
+                        if (!server_event)
+                                break;
+
+                        if (server_event->event == N_DHCP4_SERVER_EVENT_DISCOVER) {
+                                r = n_dhcp4_server_lease_offer(server_event->discover.lease);
+                                c_assert(!r);
+                        }
+                }
+
+                for (size_t i = 0; i < TEST_N_CLIENTS; ++i) {
+                        for (;;) {
+                                r = n_dhcp4_client_pop_event(clients[i], &client_event);
+                                c_assert(!r);
+                                if (!client_event)
+                                        break;
+
+                                /* retransmissions may yield more than one offer */
+                                if (client_event->event != N_DHCP4_CLIENT_EVENT_OFFER || yiaddrs[i].s_addr)
+                                        continue;
+
+                                n_dhcp4_client_lease_get_yiaddr(client_event->offer.lease, &yiaddrs[i]);
+                                c_assert(yiaddrs[i].s_addr);
+                                ++n_offers;
+                        }
+                }
+        }
+
+        netns_set(oldns);
+
+        /* every client got an address of its own */
+
+        for (size_t i = 0; i < TEST_N_CLIENTS; ++i)
+                for (size_t j = 0; j < i; ++j)
+                        c_assert(yiaddrs[i].s_addr != yiaddrs[j].s_addr);
+
+        /* all of them received on a single packet socket of the context */
+
+        c_assert(c_list_length(&context->interface_list) == 1);
+        for (size_t i = 0; i < TEST_N_CLIENTS; ++i) {
+                c_assert(probes[i]->connection.interface);
+                c_assert(probes[i]->connection.interface->n_refs == TEST_N_CLIENTS);
+                c_assert(probes[i]->connection.fd_packet < 0);
+        }
+
+        /* teardown */
+
+        for (size_t i = 0; i < TEST_N_CLIENTS; ++i) {
+                n_dhcp4_client_probe_free(probes[i]);
+                n_dhcp4_client_unref(clients[i]);
+        }
+
+        c_assert(c_list_is_empty(&context->interface_list));
+
+        link_del_ip4(&link_server, &addr_server, 8);
+}
+
+static void test_server_event_fn(NDhcp4Server *server, NDhcp4ServerEvent *event, void *userdata) {
+        size_t *n_discoversp = userdata;
+        int r;
+
+        c_assert(event->event == N_DHCP4_SERVER_EVENT_DISCOVER);
+
+        r = n_dhcp4_server_lease_offer(event->discover.lease);
+        c_assert(!r);
+
+        ++*n_discoversp;
+}
+
+static void test_client_event_fn(NDhcp4Client *client, NDhcp4ClientEvent *event, void *userdata) {
+        struct in_addr *yiaddrp = userdata;
+
+        if (event->event == N_DHCP4_CLIENT_EVENT_OFFER)
+                n_dhcp4_client_lease_get_yiaddr(event->offer.lease, yiaddrp);
+}
+
+/*
+ * Run a client against a server, both with event callbacks. Events are never
+ * queued, so there is nothing to pop on either side.
+ */
+static void test_callback(void) {
+        const struct in_addr addr_server = (struct in_addr){ htonl(10 << 24 | 1) };
+        _c_cleanup_(netns_closep) int ns_server = -1, ns_client = -1;
+        _c_cleanup_(link_deinit) Link link_server = LINK_NULL(link_server);
+        _c_cleanup_(link_deinit) Link link_client = LINK_NULL(link_client);
+        _c_cleanup_(n_dhcp4_server_config_freep) NDhcp4ServerConfig *server_config = NULL;
+        _c_cleanup_(n_dhcp4_client_config_freep) NDhcp4ClientConfig *client_config = NULL;
+        _c_cleanup_(n_dhcp4_client_probe_config_freep) NDhcp4ClientProbeConfig *probe_config = NULL;
+        _c_cleanup_(n_dhcp4_client_probe_freep) NDhcp4ClientProbe *probe = NULL;
+        _c_cleanup_(n_dhcp4_client_unrefp) NDhcp4Client *client = NULL;
+        _c_cleanup_(n_dhcp4_server_unrefp) NDhcp4Server *server = NULL;
+        _c_cleanup_(n_dhcp4_server_ip_freep) NDhcp4ServerIp *ip = NULL;
+        _c_cleanup_(n_dhcp4_server_pool_freep) NDhcp4ServerPool *pool = NULL;
+        struct pollfd pfds[2] = {
+                { .events = POLLIN },
+                { .events = POLLIN },
+        };
+        NDhcp4ClientEvent *client_event;
+        NDhcp4ServerEvent *server_event;
+        struct in_addr yiaddr = {};
+        size_t n_discovers = 0;
+        int r, oldns;
+
+        /* setup */
+
+        netns_new(&ns_server);
+        netns_new(&ns_client);
+
+        link_new_veth(&link_server, &link_client, ns_server, ns_client);
+        link_add_ip4(&link_server, &addr_server, 8);
+
+        r = n_dhcp4_server_config_new(&server_config);
+        c_assert(!r);
+
+        n_dhcp4_server_config_set_ifindex(server_config, link_server.ifindex);
+        n_dhcp4_server_config_set_event_fn(server_config, test_server_event_fn, &n_discovers);
+
+        netns_get(&oldns);
+        netns_set(ns_server);
+
+        r = n_dhcp4_server_new(&server, server_config);
+        c_assert(!r);
+
+        netns_set(oldns);
+
+        r = n_dhcp4_server_add_ip(server, &ip, addr_server);
+        c_assert(!r);
+        r = n_dhcp4_server_add_pool(server, &pool, (struct in_addr){ htonl(10 << 24) }, 8);
+        c_assert(!r);
+        r = n_dhcp4_server_pool_add_range(pool,
+                                          (struct in_addr){ htonl(10 << 24 | 100) },
+                                          (struct in_addr){ htonl(10 << 24 | 200) });
+        c_assert(!r);
+
+        r = n_dhcp4_client_config_new(&client_config);
+        c_assert(!r);
+
+        n_dhcp4_client_config_set_ifindex(client_config, link_client.ifindex);
+        n_dhcp4_client_config_set_transport(client_config, N_DHCP4_TRANSPORT_ETHERNET);
+        n_dhcp4_client_config_set_mac(client_config, link_client.mac.ether_addr_octet, ETH_ALEN);
+        n_dhcp4_client_config_set_broadcast_mac(client_config,
+                                                (const uint8_t[]){
+                                                        0xff, 0xff, 0xff,
+                                                        0xff, 0xff, 0xff,
+                                                },
+                                                ETH_ALEN);
+        r = n_dhcp4_client_config_set_client_id(client_config, (void *)"client-id", strlen("client-id"));
+        c_assert(!r);
+        n_dhcp4_client_config_set_event_fn(client_config, test_client_event_fn, &yiaddr);
+
+        r = n_dhcp4_client_probe_config_new(&probe_config);
+        c_assert(!r);
+
+        n_dhcp4_client_probe_config_set_start_delay(probe_config, 10);
+
+        netns_get(&oldns);
+        netns_set(ns_client);
+
+        r = n_dhcp4_client_new(&client, client_config);
+        c_assert(!r);
+
+        r = n_dhcp4_client_probe(client, &probe, probe_config);
+        c_assert(!r);
+
+        n_dhcp4_client_get_fd(client, &pfds[0].fd);
+        n_dhcp4_server_get_fd(server, &pfds[1].fd);
+
+        while (!yiaddr.s_addr) {
+                r = poll(pfds, 2, -1);
+                c_assert(r > 0);
+
+                if (pfds[0].revents & POLLIN) {
+                        r = n_dhcp4_client_dispatch(client);
+                        c_assert(!r || r == N_DHCP4_E_PREEMPTED);
+                }
+
+                if (pfds[1].revents & POLLIN) {
+                        r = n_dhcp4_server_dispatch(server);
+                        c_assert(!r || r == N_DHCP4_E_PREEMPTED);
+                }
+
+                r = n_dhcp4_client_pop_event(client, &client_event);
+                c_assert(!r);
+                c_assert(!client_event);
+
+                r = n_dhcp4_server_pop_event(server, &server_event);
+                c_assert(!r);
+                c_assert(!server_event);
+        }
+
+        netns_set(oldns);
+
+        /* the offer was sent from within the callback of the server */
+
+        c_assert(n_discovers >= 1);
+        c_assert(yiaddr.s_addr == htonl(10 << 24 | 100));
+
+        /* teardown */
+
+        link_del_ip4(&link_server, &addr_server, 8);
+}
+
+static void test_demux_send(int sk, Link *link, uint32_t xid, const uint8_t *mac) {
+        _c_cleanup_(n_dhcp4_outgoing_freep) NDhcp4Outgoing *reply = NULL;
+        struct in_addr addr_server = (struct in_addr){ htonl(10 << 24 | 1) };
+        struct in_addr addr_client = (struct in_addr){ htonl(10 << 24 | 100) };
+        uint8_t type = N_DHCP4_MESSAGE_OFFER;
+        NDhcp4Header *header;
+        int r;
+
+        r = n_dhcp4_outgoing_new(&reply, 0, 0);
+        c_assert(!r);
+
+        header = n_dhcp4_outgoing_get_header(reply);
+        header->op = N_DHCP4_OP_BOOTREPLY;
+        header->xid = xid;
+        header->hlen = ETH_ALEN;
+        memcpy(header->chaddr, mac, ETH_ALEN);
+        n_dhcp4_outgoing_set_yiaddr(reply, addr_client);
+
+        r = n_dhcp4_outgoing_append(reply, N_DHCP4_OPTION_MESSAGE_TYPE, &type, sizeof(type));
+        c_assert(!r);
+        r = n_dhcp4_outgoing_append_server_identifier(reply, addr_server);
+        c_assert(!r);
+        r = n_dhcp4_outgoing_append_lifetime(reply, N_DHCP4_SERVER_LEASE_LIFETIME);
+        c_assert(!r);
+
+        r = n_dhcp4_s_socket_packet_send(sk,
+                                         NULL,
+                                         link->ifindex,
+                                         &addr_server,
+                                         (const unsigned char[]){
+                                                0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+                                         },
+                                         ETH_ALEN,
+                                         &addr_client,
+                                         reply);
+        c_assert(!r);
+}
+
+/*
+ * Dispatch the context once the reply sent last is queued on the shared packet
+ * socket of @interface, and return the number of offers each client got.
+ */
+static void test_demux_dispatch(NDhcp4ClientContext *context,
+                                NDhcp4CInterface *interface,
+                                NDhcp4Client **clients,
+                                size_t n_clients,
+                                size_t *n_offers) {
+        struct pollfd pfd = { .fd = interface->fd_packet, .events = POLLIN };
+        NDhcp4ClientEvent *event;
+        int r;
+
+        r = poll(&pfd, 1, -1);
+        c_assert(r == 1);
+
+        r = n_dhcp4_client_context_dispatch(context);
+        c_assert(!r);
+
+        for (size_t i = 0; i < n_clients; ++i) {
+                n_offers[i] = 0;
+
+                for (;;) {
+                        r = n_dhcp4_client_pop_event(clients[i], &event);
+                        c_assert(!r);
+                        if (!event)
+                                break;
+
+                        if (event->event == N_DHCP4_CLIENT_EVENT_OFFER)
+                                ++n_offers[i];
+                }
+        }
+}
+
+/*
+ * Replies received on the shared packet socket of a client context are handed
+ * to the probe with the transaction id and hardware address of the reply, and
+ * to no other. The replies are crafted on a raw packet socket on the server
+ * side of the link, so their transaction ids and hardware addresses can be
+ * picked freely.
+ */
+static void test_demux(void) {
+        static const uint8_t macs[2][ETH_ALEN] = {
+                { 0x02, 0x00, 0x00, 0x00, 0x00, 0x0a },
+                { 0x02, 0x00, 0x00, 0x00, 0x00, 0x0b },
+        };
+        _c_cleanup_(netns_closep) int ns_server = -1, ns_client = -1;
+        _c_cleanup_(link_deinit) Link link_server = LINK_NULL(link_server);
+        _c_cleanup_(link_deinit) Link link_client = LINK_NULL(link_client);
+        _c_cleanup_(n_dhcp4_client_probe_config_freep) NDhcp4ClientProbeConfig *probe_config = NULL;
+        _c_cleanup_(n_dhcp4_client_context_unrefp) NDhcp4ClientContext *context = NULL;
+        _c_cleanup_(c_closep) int sk_server = -1;
+        NDhcp4ClientProbe *probes[2] = {};
+        NDhcp4Client *clients[2] = {};
+        NDhcp4SocketOffload offload;
+        NDhcp4CInterface *interface;
+        struct pollfd pfd = { .events = POLLIN };
+        size_t n_offers[2];
+        uint32_t xid, xid_stale;
+        int r, oldns;
+
+        /* setup */
+
+        netns_new(&ns_server);
+        netns_new(&ns_client);
+
+        link_new_veth(&link_server, &link_client, ns_server, ns_client);
+
+        netns_get(&oldns);
+        netns_set(ns_server);
+        r = n_dhcp4_s_socket_packet_new(&sk_server, link_server.ifindex, 0, &offload);
+        c_assert(!r);
+        netns_set(oldns);
+
+        r = n_dhcp4_client_context_new(&context);
+        c_assert(!r);
+
+        r = n_dhcp4_client_probe_config_new(&probe_config);
+        c_assert(!r);
+
+        n_dhcp4_client_probe_config_set_start_delay(probe_config, 10);
+
+        netns_get(&oldns);
+        netns_set(ns_client);
+
+        /* two clients on the same interface, told apart by their hardware addresses */
+
+        for (size_t i = 0; i < 2; ++i) {
+                _c_cleanup_(n_dhcp4_client_config_freep) NDhcp4ClientConfig *config = NULL;
+                char client_id[] = "client-id-0";
+
+                client_id[sizeof(client_id) - 2] += i;
+
+                r = n_dhcp4_client_config_new(&config);
+                c_assert(!r);
+
+                n_dhcp4_client_config_set_ifindex(config, link_client.ifindex);
+                n_dhcp4_client_config_set_transport(config, N_DHCP4_TRANSPORT_ETHERNET);
+                n_dhcp4_client_config_set_mac(config, macs[i], ETH_ALEN);
+                n_dhcp4_client_config_set_broadcast_mac(config,
+                                                        (const uint8_t[]){
+                                                                0xff, 0xff, 0xff,
+                                                                0xff, 0xff, 0xff,
+                                                        },
+                                                        ETH_ALEN);
+                r = n_dhcp4_client_config_set_client_id(config, (void *)client_id, strlen(client_id));
+                c_assert(!r);
+
+                r = n_dhcp4_client_new_in_context(&clients[i], config, context);
+                c_assert(!r);
+
+                r = n_dhcp4_client_probe(clients[i], &probes[i], probe_config);
+                c_assert(!r);
+        }
+
+        /* wait for both to send their DISCOVER, which indexes them by its xid */
+
+        n_dhcp4_client_context_get_fd(context, &pfd.fd);
+
+        while (!probes[0]->connection.interface_indexed || !probes[1]->connection.interface_indexed) {
+                r = poll(&pfd, 1, -1);
+                c_assert(r == 1);
+
+                r = n_dhcp4_client_context_dispatch(context);
+                c_assert(!r || r == N_DHCP4_E_PREEMPTED);
+        }
+
+        netns_set(oldns);
+
+        interface = probes[0]->connection.interface;
+        c_assert(interface == probes[1]->connection.interface);
+        c_assert(interface->n_connections == 2);
+
+        /* each reply reaches the probe it is addressed to */
+
+        for (size_t i = 0; i < 2; ++i) {
+                test_demux_send(sk_server, &link_server, probes[i]->connection.interface_xid, macs[i]);
+                test_demux_dispatch(context, interface, clients, 2, n_offers);
+                c_assert(n_offers[i] == 1 && n_offers[!i] == 0);
+        }
+
+        /* with colliding xids, the hardware address decides */
+
+        xid = probes[0]->connection.interface_xid;
+        n_dhcp4_outgoing_set_xid(probes[1]->connection.request, xid);
+        r = n_dhcp4_c_interface_link(interface, &probes[1]->connection, xid);
+        c_assert(!r);
+
+        for (size_t i = 0; i < 2; ++i) {
+                test_demux_send(sk_server, &link_server, xid, macs[i]);
+                test_demux_dispatch(context, interface, clients, 2, n_offers);
+                c_assert(n_offers[i] == 1 && n_offers[!i] == 0);
+        }
+
+        /* once a probe moved on to another xid, replies to the old one are dropped */
+
+        xid_stale = probes[0]->connection.interface_xid;
+        xid = xid_stale + 1;
+        n_dhcp4_outgoing_set_xid(probes[0]->connection.request, xid);
+        r = n_dhcp4_c_interface_link(interface, &probes[0]->connection, xid);
+        c_assert(!r);
+        c_assert(interface->n_connections == 2);
+
+        test_demux_send(sk_server, &link_server, xid_stale, macs[0]);
+        test_demux_dispatch(context, interface, clients, 2, n_offers);
+        c_assert(n_offers[0] == 0 && n_offers[1] == 0);
+
+        test_demux_send(sk_server, &link_server, xid, macs[0]);
+        test_demux_dispatch(context, interface, clients, 2, n_offers);
+        c_assert(n_offers[0] == 1 && n_offers[1] == 0);
+
+        /* replies to a freed probe are dropped, while the other keeps the socket */
+
+        probes[0] = n_dhcp4_client_probe_free(probes[0]);
+        c_assert(interface->n_refs == 1);
+        c_assert(interface->n_connections == 1);
+
+        test_demux_send(sk_server, &link_server, xid, macs[0]);
+        test_demux_dispatch(context, interface, clients, 2, n_offers);
+        c_assert(n_offers[0] == 0 && n_offers[1] == 0);
+
+        /* teardown */
+
+        probes[1] = n_dhcp4_client_probe_free(probes[1]);
+        c_assert(c_list_is_empty(&context->interface_list));
+
+        for (size_t i = 0; i < 2; ++i)
+                n_dhcp4_client_unref(clients[i]);
+}
+
+typedef struct TestServerFree {
+        NDhcp4ServerInterface *interface;
+        size_t n_discovers;
+        bool freed_own;
+} TestServerFree;
+
+static void test_server_free_fn(NDhcp4Server *server, NDhcp4ServerEvent *event, void *userdata) {
+        TestServerFree *state = userdata;
+
+        c_assert(event->event == N_DHCP4_SERVER_EVENT_DISCOVER);
+
+        if (state->interface) {
+                state->freed_own = (event->discover.lease->connection == &state->interface->connection);
+                state->interface = n_dhcp4_server_interface_free(state->interface);
+        }
+
+        ++state->n_discovers;
+}
+
+typedef struct TestClientFree {
+        NDhcp4Client *client;
+        NDhcp4ClientProbe *probe;
+        size_t n_offers;
+} TestClientFree;
+
+static void test_client_free_fn(NDhcp4Client *client, NDhcp4ClientEvent *event, void *userdata) {
+        TestClientFree *state = userdata;
+
+        c_assert(event->event == N_DHCP4_CLIENT_EVENT_OFFER);
+
+        state->probe = n_dhcp4_client_probe_free(state->probe);
+        state->client = n_dhcp4_client_unref(state->client);
+        ++state->n_offers;
+}
+
+/*
+ * Wait until @n events are pending on the epoll context @fd_epoll, so a single
+ * dispatch sees all of them. The context is level-triggered, so nothing is
+ * consumed.
+ */
+static void test_wait_events(int fd_epoll, int n) {
+        struct epoll_event events[2];
+        int r;
+
+        c_assert(n <= (int)(sizeof(events) / sizeof(*events)));
+
+        do {
+                r = epoll_wait(fd_epoll, events, n, -1);
+                c_assert(r > 0);
+        } while (r < n);
+}
+
+/*
+ * Event callbacks may destroy the objects that events of the ongoing dispatch
+ * refer to: the server callback removes an interface while both interfaces
+ * are pending, and the client callback destroys its probe, and the client
+ * along with it, while both the timer and the socket of the probe are pending.
+ * The destroyed objects must not be dispatched any further.
+ */
+static void test_callback_free(void) {
+        const struct in_addr addr_server = (struct in_addr){ htonl(10 << 24 | 1) };
+        const struct in_addr addr_server2 = (struct in_addr){ htonl(11 << 24 | 1) };
+        _c_cleanup_(netns_closep) int ns_server = -1, ns_server2 = -1, ns_client = -1, ns_client2 = -1;
+        _c_cleanup_(link_deinit) Link link_server = LINK_NULL(link_server);
+        _c_cleanup_(link_deinit) Link link_server2 = LINK_NULL(link_server2);
+        _c_cleanup_(link_deinit) Link link_client = LINK_NULL(link_client);
+        _c_cleanup_(link_deinit) Link link_client2 = LINK_NULL(link_client2);
+        _c_cleanup_(c_closep) int efd_client = -1, efd_client2 = -1, sk_server = -1;
+        _c_cleanup_(n_dhcp4_client_config_freep) NDhcp4ClientConfig *client_config = NULL;
+        _c_cleanup_(n_dhcp4_client_probe_config_freep) NDhcp4ClientProbeConfig *probe_config = NULL;
+        _c_cleanup_(n_dhcp4_client_config_freep) NDhcp4ClientConfig *client2_config = NULL;
+        _c_cleanup_(n_dhcp4_client_probe_config_freep) NDhcp4ClientProbeConfig *client2_probe_config = NULL;
+        _c_cleanup_(n_dhcp4_server_config_freep) NDhcp4ServerConfig *server_config = NULL;
+        _c_cleanup_(n_dhcp4_server_unrefp) NDhcp4Server *server = NULL;
+        _c_cleanup_(n_dhcp4_server_ip_freep) NDhcp4ServerIp *ip = NULL;
+        _c_cleanup_(n_dhcp4_server_pool_freep) NDhcp4ServerPool *pool = NULL;
+        NDhcp4CConnection client = N_DHCP4_C_CONNECTION_NULL(client);
+        NDhcp4CConnection client2 = N_DHCP4_C_CONNECTION_NULL(client2);
+        NDhcp4LogQueue log_queue = N_DHCP4_LOG_QUEUE_NULL_DEFUNCT();
+        TestServerFree server_state = {};
+        TestClientFree client_state = {};
+        NDhcp4SocketOffload offload;
+        struct pollfd pfd = { .events = POLLIN };
+        uint32_t xid;
+        int r, oldns;
+
+        /* setup */
+
+        netns_new(&ns_server);
+        netns_new(&ns_server2);
+        netns_new(&ns_client);
+        netns_new(&ns_client2);
+
+        link_new_veth(&link_server, &link_client, ns_server, ns_client);
+        link_new_veth(&link_server2, &link_client2, ns_server2, ns_client2);
+        link_add_ip4(&link_server, &addr_server, 8);
+        link_add_ip4(&link_server2, &addr_server2, 8);
+
+        efd_client = epoll_create1(EPOLL_CLOEXEC);
+        c_assert(efd_client >= 0);
+        efd_client2 = epoll_create1(EPOLL_CLOEXEC);
+        c_assert(efd_client2 >= 0);
+
+        r = n_dhcp4_server_config_new(&server_config);
+        c_assert(!r);
+
+        n_dhcp4_server_config_set_ifindex(server_config, link_server.ifindex);
+        n_dhcp4_server_config_set_event_fn(server_config, test_server_free_fn, &server_state);
+
+        netns_get(&oldns);
+        netns_set(ns_server);
+
+        r = n_dhcp4_server_new(&server, server_config);
+        c_assert(!r);
+
+        netns_set(ns_server2);
+
+        r = n_dhcp4_server_add_interface(server, &server_state.interface, link_server2.ifindex);
+        c_assert(!r);
+
+        netns_set(oldns);
+
+        r = n_dhcp4_server_add_ip(server, &ip, addr_server);
+        c_assert(!r);
+        r = n_dhcp4_server_add_pool(server, &pool, (struct in_addr){ htonl(10 << 24) }, 8);
+        c_assert(!r);
+        r = n_dhcp4_server_pool_add_range(pool,
+                                          (struct in_addr){ htonl(10 << 24 | 100) },
+                                          (struct in_addr){ htonl(10 << 24 | 200) });
+        c_assert(!r);
+
+        test_client_new(ns_client,
+                        &client,
+                        &client_config,
+                        &probe_config,
+                        &log_queue,
+                        efd_client,
+                        &link_client,
+                        "client-id");
+        test_client_new(ns_client2,
+                        &client2,
+                        &client2_config,
+                        &client2_probe_config,
+                        &log_queue,
+                        efd_client2,
+                        &link_client2,
+                        "client-id-2");
+
+        /*
+         * The first DISCOVER removes the second interface, whichever it arrived
+         * on. The DISCOVER pending on the second interface is only seen if it
+         * was the one that removed it.
+         */
+
+        {
+                _c_cleanup_(n_dhcp4_outgoing_freep) NDhcp4Outgoing *request = NULL;
+                _c_cleanup_(n_dhcp4_outgoing_freep) NDhcp4Outgoing *request2 = NULL;
+
+                r = n_dhcp4_c_connection_discover_new(&client, &request);
+                c_assert(!r);
+                r = n_dhcp4_c_connection_start_request(&client, request, 0);
+                c_assert(!r);
+                request = NULL;
+
+                r = n_dhcp4_c_connection_discover_new(&client2, &request2);
+                c_assert(!r);
+                r = n_dhcp4_c_connection_start_request(&client2, request2, 0);
+                c_assert(!r);
+                request2 = NULL;
+        }
+
+        test_wait_events(server->fd_epoll, 2);
+
+        r = n_dhcp4_server_dispatch(server);
+        c_assert(!r);
+        c_assert(server_state.n_discovers == (server_state.freed_own ? 2 : 1));
+        c_assert(!server_state.interface);
+
+        /* the OFFER destroys the probe, and drops the last reference to the client */
+
+        netns_get(&oldns);
+        netns_set(ns_server);
+        r = n_dhcp4_s_socket_packet_new(&sk_server, link_server.ifindex, 0, &offload);
+        c_assert(!r);
+        netns_set(oldns);
+
+        n_dhcp4_client_config_set_event_fn(client_config, test_client_free_fn, &client_state);
+        n_dhcp4_client_probe_config_set_start_delay(probe_config, 10);
+
+        netns_get(&oldns);
+        netns_set(ns_client);
+
+        r = n_dhcp4_client_new(&client_state.client, client_config);
+        c_assert(!r);
+
+        r = n_dhcp4_client_probe(client_state.client, &client_state.probe, probe_config);
+        c_assert(!r);
+
+        n_dhcp4_client_get_fd(client_state.client, &pfd.fd);
+
+        while (client_state.probe->state != N_DHCP4_CLIENT_PROBE_STATE_SELECTING) {
+                r = poll(&pfd, 1, -1);
+                c_assert(r == 1);
+
+                r = n_dhcp4_client_dispatch(client_state.client);
+                c_assert(!r || r == N_DHCP4_E_PREEMPTED);
+        }
+
+        netns_set(oldns);
+
+        n_dhcp4_outgoing_get_xid(client_state.probe->connection.request, &xid);
+        test_demux_send(sk_server, &link_server, xid, link_client.mac.ether_addr_octet);
+
+        n_dhcp4_timerfd_arm(client_state.client->fd_timer, 1);
+        test_wait_events(pfd.fd, 2);
+
+        r = n_dhcp4_client_dispatch(client_state.client);
+        c_assert(!r || r == N_DHCP4_E_PREEMPTED);
+        c_assert(client_state.n_offers == 1);
+        c_assert(!client_state.probe);
+        c_assert(!client_state.client);
+
+        /* teardown */
+
+        n_dhcp4_c_connection_deinit(&client2);
+        n_dhcp4_c_connection_deinit(&client);
+        link_del_ip4(&link_server2, &addr_server2, 8);
+        link_del_ip4(&link_server, &addr_server, 8);
+}
+
+static void test_client_count_fn(NDhcp4Client *client, NDhcp4ClientEvent *event, void *userdata) {
+        size_t *n_offersp = userdata;
+
+        c_assert(event->event == N_DHCP4_CLIENT_EVENT_OFFER);
+
+        ++*n_offersp;
+}
+
+/*
+ * With event callbacks, events are built on the stack of their raise sites and
+ * passed on right away. Neither side ever queues an event or allocates a node
+ * for it, so a dispatch only allocates what the message it handles takes.
+ */
+static void test_callback_allocations(void) {
+        const struct in_addr addr_server = (struct in_addr){ htonl(10 << 24 | 1) };
+        _c_cleanup_(netns_closep) int ns_server = -1, ns_client = -1;
+        _c_cleanup_(link_deinit) Link link_server = LINK_NULL(link_server);
+        _c_cleanup_(link_deinit) Link link_client = LINK_NULL(link_client);
+        _c_cleanup_(c_closep) int efd_client = -1, sk_server = -1;
+        _c_cleanup_(n_dhcp4_client_config_freep) NDhcp4ClientConfig *client_config = NULL;
+        _c_cleanup_(n_dhcp4_client_probe_config_freep) NDhcp4ClientProbeConfig *probe_config = NULL;
+        _c_cleanup_(n_dhcp4_server_config_freep) NDhcp4ServerConfig *server_config = NULL;
+        _c_cleanup_(n_dhcp4_client_probe_freep) NDhcp4ClientProbe *probe = NULL;
+        _c_cleanup_(n_dhcp4_client_unrefp) NDhcp4Client *client = NULL;
+        _c_cleanup_(n_dhcp4_server_unrefp) NDhcp4Server *server = NULL;
+        _c_cleanup_(n_dhcp4_server_ip_freep) NDhcp4ServerIp *ip = NULL;
+        _c_cleanup_(n_dhcp4_server_pool_freep) NDhcp4ServerPool *pool = NULL;
+        NDhcp4CConnection connection = N_DHCP4_C_CONNECTION_NULL(connection);
+        NDhcp4LogQueue log_queue = N_DHCP4_LOG_QUEUE_NULL_DEFUNCT();
+        NDhcp4SocketOffload offload;
+        struct pollfd pfd = { .events = POLLIN };
+        uint8_t buf[UINT16_MAX];
+        size_t n_discovers = 0, n_offers = 0;
+        uint32_t xid;
+        int r, oldns;
+
+        /* setup */
+
+        netns_new(&ns_server);
+        netns_new(&ns_client);
+
+        link_new_veth(&link_server, &link_client, ns_server, ns_client);
+        link_add_ip4(&link_server, &addr_server, 8);
+
+        efd_client = epoll_create1(EPOLL_CLOEXEC);
+        c_assert(efd_client >= 0);
+
+        r = n_dhcp4_server_config_new(&server_config);
+        c_assert(!r);
+
+        n_dhcp4_server_config_set_ifindex(server_config, link_server.ifindex);
+        n_dhcp4_server_config_set_event_fn(server_config, test_server_event_fn, &n_discovers);
+
+        netns_get(&oldns);
+        netns_set(ns_server);
+
+        r = n_dhcp4_server_new(&server, server_config);
+        c_assert(!r);
+
+        netns_set(oldns);
+
+        r = n_dhcp4_server_add_ip(server, &ip, addr_server);
+        c_assert(!r);
+        r = n_dhcp4_server_add_pool(server, &pool, (struct in_addr){ htonl(10 << 24) }, 8);
+        c_assert(!r);
+        r = n_dhcp4_server_pool_add_range(pool,
+                                          (struct in_addr){ htonl(10 << 24 | 100) },
+                                          (struct in_addr){ htonl(10 << 24 | 200) });
+        c_assert(!r);
+
+        test_client_new(ns_client,
+                        &connection,
+                        &client_config,
+                        &probe_config,
+                        &log_queue,
+                        efd_client,
+                        &link_client,
+                        "client-id");
+
+        /*
+         * Once warmed up, a DISCOVER only allocates the copy of the request
+         * kept on the lease, even though the callback sends an offer.
+         */
+
+        for (unsigned int i = 0; i < TEST_N_ROUNDS; ++i) {
+                _c_cleanup_(n_dhcp4_outgoing_freep) NDhcp4Outgoing *request = NULL;
+                _c_cleanup_(n_dhcp4_incoming_freep) NDhcp4Incoming *offer = NULL;
+
+                r = n_dhcp4_c_connection_discover_new(&connection, &request);
+                c_assert(!r);
+                r = n_dhcp4_c_connection_start_request(&connection, request, 0);
+                c_assert(!r);
+                request = NULL;
+
+                n_dhcp4_server_get_fd(server, &pfd.fd);
+                r = poll(&pfd, 1, -1);
+                c_assert(r == 1);
+
+                test_n_allocations = 0;
+
+                r = n_dhcp4_server_dispatch(server);
+                c_assert(!r);
+                c_assert(n_discovers == i + 1);
+
+                c_assert(!i || test_n_allocations == 1);
+                c_assert(c_list_is_empty(&server->event_list));
+                c_assert(c_list_is_empty(&server->event_cache.node_list));
+
+                pfd.fd = connection.fd_epoll;
+                r = poll(&pfd, 1, -1);
+                c_assert(r == 1);
+
+                r = n_dhcp4_c_connection_dispatch_io(&connection, buf, sizeof(buf), &offer);
+                c_assert(!r);
+                c_assert(offer);
+        }
+
+        /*
+         * Every offer a selecting probe gets is passed on as a lease of its
+         * own. That takes the copy of the offer and the lease, and nothing
+         * else.
+         */
+
+        netns_get(&oldns);
+        netns_set(ns_server);
+        r = n_dhcp4_s_socket_packet_new(&sk_server, link_server.ifindex, 0, &offload);
+        c_assert(!r);
+        netns_set(oldns);
+
+        n_dhcp4_client_config_set_event_fn(client_config, test_client_count_fn, &n_offers);
+        n_dhcp4_client_probe_config_set_start_delay(probe_config, 10);
+
+        netns_get(&oldns);
+        netns_set(ns_client);
+
+        r = n_dhcp4_client_new(&client, client_config);
+        c_assert(!r);
+
+        r = n_dhcp4_client_probe(client, &probe, probe_config);
+        c_assert(!r);
+
+        n_dhcp4_client_get_fd(client, &pfd.fd);
+
+        while (probe->state != N_DHCP4_CLIENT_PROBE_STATE_SELECTING) {
+                r = poll(&pfd, 1, -1);
+                c_assert(r == 1);
+
+                r = n_dhcp4_client_dispatch(client);
+                c_assert(!r || r == N_DHCP4_E_PREEMPTED);
+        }
+
+        netns_set(oldns);
+
+        n_dhcp4_outgoing_get_xid(probe->connection.request, &xid);
+
+        for (unsigned int i = 0; i < TEST_N_ROUNDS; ++i) {
+                test_demux_send(sk_server, &link_server, xid, link_client.mac.ether_addr_octet);
+
+                r = poll(&pfd, 1, -1);
+                c_assert(r == 1);
+
+                test_n_allocations = 0;
+
+                r = n_dhcp4_client_dispatch(client);
+                c_assert(!r || r == N_DHCP4_E_PREEMPTED);
+                c_assert(n_offers == i + 1);
+
+                c_assert(test_n_allocations == 2);
+                c_assert(c_list_is_empty(&client->event_list));
+                c_assert(c_list_is_empty(&client->event_cache.node_list));
+        }
+
+        /* teardown */
+
+        n_dhcp4_c_connection_deinit(&connection);
+        link_del_ip4(&link_server, &addr_server, 8);
+}
+
+typedef struct TestClientCancel {
+        NDhcp4ClientProbe *probe;
+        size_t n_cancelled;
+        bool free;
+} TestClientCancel;
+
+static void test_client_cancel_fn(NDhcp4Client *client, NDhcp4ClientEvent *event, void *userdata) {
+        TestClientCancel *state = userdata;
+
+        c_assert(event->event == N_DHCP4_CLIENT_EVENT_CANCELLED);
+
+        state->probe = event->cancelled.probe;
+        if (state->free)
+                state->probe = n_dhcp4_client_probe_free(state->probe);
+
+        ++state->n_cancelled;
+}
+
+/*
+ * A probe created while another one is running is cancelled right away. With
+ * an event callback, the event is passed on before the probe is even returned,
+ * rather than waiting for a dispatch that might never come. The callback may
+ * free the probe, which is then not returned at all.
+ */
+static void test_callback_cancel(void) {
+        _c_cleanup_(netns_closep) int ns_server = -1, ns_client = -1;
+        _c_cleanup_(link_deinit) Link link_server = LINK_NULL(link_server);
+        _c_cleanup_(link_deinit) Link link_client = LINK_NULL(link_client);
+        _c_cleanup_(c_closep) int efd_client = -1;
+        _c_cleanup_(n_dhcp4_client_config_freep) NDhcp4ClientConfig *client_config = NULL;
+        _c_cleanup_(n_dhcp4_client_probe_config_freep) NDhcp4ClientProbeConfig *probe_config = NULL;
+        _c_cleanup_(n_dhcp4_client_probe_freep) NDhcp4ClientProbe *probe = NULL;
+        _c_cleanup_(n_dhcp4_client_probe_freep) NDhcp4ClientProbe *cancelled = NULL;
+        _c_cleanup_(n_dhcp4_client_unrefp) NDhcp4Client *client = NULL;
+        NDhcp4CConnection connection = N_DHCP4_C_CONNECTION_NULL(connection);
+        NDhcp4LogQueue log_queue = N_DHCP4_LOG_QUEUE_NULL_DEFUNCT();
+        TestClientCancel state = {};
+        NDhcp4ClientProbe *freed;
+        NDhcp4ClientEvent *event;
+        int r, oldns;
+
+        /* setup */
+
+        netns_new(&ns_server);
+        netns_new(&ns_client);
+
+        link_new_veth(&link_server, &link_client, ns_server, ns_client);
+
+        efd_client = epoll_create1(EPOLL_CLOEXEC);
+        c_assert(efd_client >= 0);
+
+        test_client_new(ns_client,
+                        &connection,
+                        &client_config,
+                        &probe_config,
+                        &log_queue,
+                        efd_client,
+                        &link_client,
+                        "client-id");
+        n_dhcp4_c_connection_deinit(&connection);
+
+        n_dhcp4_client_config_set_event_fn(client_config, test_client_cancel_fn, &state);
+
+        netns_get(&oldns);
+        netns_set(ns_client);
+
+        r = n_dhcp4_client_new(&client, client_config);
+        c_assert(!r);
+
+        r = n_dhcp4_client_probe(client, &probe, probe_config);
+        c_assert(!r);
+        c_assert(!state.n_cancelled);
+
+        /* the second probe is cancelled before it is returned */
+
+        r = n_dhcp4_client_probe(client, &cancelled, probe_config);
+        c_assert(!r);
+        c_assert(state.n_cancelled == 1);
+        c_assert(state.probe == cancelled);
+        c_assert(client->current_probe == probe);
+
+        /* the third one is freed by the callback */
+
+        state.free = true;
+
+        r = n_dhcp4_client_probe(client, &freed, probe_config);
+        c_assert(!r);
+        c_assert(state.n_cancelled == 2);
+        c_assert(!freed);
+        c_assert(client->current_probe == probe);
+        c_assert(c_list_is_empty(&client->reap_list));
+
+        netns_set(oldns);
+
+        /* nothing was queued */
+
+        r = n_dhcp4_client_pop_event(client, &event);
+        c_assert(!r);
+        c_assert(!event);
+}
+
+int main(int argc, char **argv) {
+        test_setup();
+
+        test_offer();
+        test_interfaces();
+        test_decline();
+        test_lifetime();
+        test_context();
+        test_demux();
+        test_callback_free();
+        test_callback();
+        test_callback_allocations();
+        test_callback_cancel();
+
+        return 0;
+}
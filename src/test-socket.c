@@ -9,6 +9,8 @@
 #include <errno.h>
 #include <poll.h>
 #include <linux/if_packet.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,18 +27,31 @@ static void test_poll(int sk) {
         c_assert(r == 1);
 }
 
-static void test_client_packet_socket_new(Link *link, int *skp) {
+static void test_client_packet_socket_new_flags(Link *link,
+                                                int *skp,
+                                                unsigned int flags,
+                                                NDhcp4SocketOffload *offloadp,
+                                                struct packet_ring **ringp) {
         int r, oldns;
 
         netns_get(&oldns);
         netns_set(link->netns);
 
-        r = n_dhcp4_c_socket_packet_new(skp, link->ifindex);
+        r = n_dhcp4_c_socket_packet_new(skp, link->ifindex, flags, offloadp, ringp);
         c_assert(r >= 0);
 
         netns_set(oldns);
 }
 
+static void test_client_packet_socket_new(Link *link, int *skp) {
+        NDhcp4SocketOffload offload;
+        struct packet_ring *ring;
+
+        test_client_packet_socket_new_flags(link, skp, 0, &offload, &ring);
+        c_assert(!offload.enabled);
+        c_assert(!ring);
+}
+
 static void test_client_udp_socket_new(Link *link,
                                        int *skp,
                                        const struct in_addr *addr_client,
@@ -52,25 +67,35 @@ static void test_client_udp_socket_new(Link *link,
         netns_set(oldns);
 }
 
-static void test_server_packet_socket_new(Link *link, int *skp) {
+static void test_server_packet_socket_new_flags(Link *link,
+                                                int *skp,
+                                                unsigned int flags,
+                                                NDhcp4SocketOffload *offloadp) {
         int r, oldns;
 
         netns_get(&oldns);
         netns_set(link->netns);
 
-        r = n_dhcp4_s_socket_packet_new(skp);
+        r = n_dhcp4_s_socket_packet_new(skp, link->ifindex, flags, offloadp);
         c_assert(r >= 0);
 
         netns_set(oldns);
 }
 
+static void test_server_packet_socket_new(Link *link, int *skp) {
+        NDhcp4SocketOffload offload;
+
+        test_server_packet_socket_new_flags(link, skp, 0, &offload);
+        c_assert(!offload.enabled);
+}
+
 static void test_server_udp_socket_new(Link *link, int *skp) {
         int r, oldns;
 
         netns_get(&oldns);
         netns_set(link->netns);
 
-        r = n_dhcp4_s_socket_udp_new(skp, link->ifindex);
+        r = n_dhcp4_s_socket_udp_new(skp, link->ifindex, 0);
         c_assert(r >= 0);
 
         netns_set(oldns);
@@ -92,6 +117,7 @@ static void test_client_server_packet(Link *link_server, Link *link_client) {
         n_dhcp4_outgoing_get_header(outgoing)->op = N_DHCP4_OP_BOOTREQUEST;
 
         r = n_dhcp4_c_socket_packet_send(sk_client,
+                                         NULL,
                                          link_client->ifindex,
                                          (const unsigned char[]){0xff, 0xff, 0xff, 0xff, 0xff, 0xff},
                                          ETH_ALEN,
@@ -150,9 +176,174 @@ static void test_client_server_udp(Link *link_server, Link *link_client) {
         link_del_ip4(link_server, &addr_server, 8);
 }
 
+static void test_filter_send(int sk, uint8_t type, const struct in_addr *server_id, bool id_first) {
+        _c_cleanup_(n_dhcp4_outgoing_freep) NDhcp4Outgoing *outgoing = NULL;
+        int r;
+
+        r = n_dhcp4_outgoing_new(&outgoing, 0, 0);
+        c_assert(!r);
+        n_dhcp4_outgoing_get_header(outgoing)->op = N_DHCP4_OP_BOOTREQUEST;
+
+        if (server_id && id_first) {
+                r = n_dhcp4_outgoing_append_server_identifier(outgoing, *server_id);
+                c_assert(!r);
+        }
+
+        r = n_dhcp4_outgoing_append(outgoing, N_DHCP4_OPTION_MESSAGE_TYPE, &type, sizeof(type));
+        c_assert(!r);
+
+        if (server_id && !id_first) {
+                r = n_dhcp4_outgoing_append_server_identifier(outgoing, *server_id);
+                c_assert(!r);
+        }
+
+        r = n_dhcp4_c_socket_udp_send(sk, outgoing);
+        c_assert(!r);
+}
+
+static void test_client_server_filter(Link *link_server, Link *link_client) {
+        _c_cleanup_(c_closep) int sk_server = -1, sk_client = -1;
+        struct in_addr addr_server = (struct in_addr){ htonl(10 << 24 | 1) };
+        struct in_addr addr_client = (struct in_addr){ htonl(10 << 24 | 2) };
+        struct in_addr addr_other = (struct in_addr){ htonl(10 << 24 | 3) };
+        struct sockaddr_in dest = {
+                .sin_family = AF_INET,
+                .sin_addr = addr_server,
+                .sin_port = htons(N_DHCP4_NETWORK_SERVER_PORT),
+        };
+        struct in_addr server_id;
+        uint8_t buf[UINT16_MAX];
+        uint8_t type;
+        int r, oldns;
+
+        /* setup */
+
+        link_add_ip4(link_server, &addr_server, 8);
+        link_add_ip4(link_client, &addr_client, 8);
+
+        netns_get(&oldns);
+        netns_set(link_server->netns);
+        r = n_dhcp4_s_socket_udp_new(&sk_server, link_server->ifindex, N_DHCP4_S_SOCKET_FLAG_SERVER_ID);
+        c_assert(r >= 0);
+        netns_set(oldns);
+
+        r = n_dhcp4_s_socket_udp_filter(sk_server, &addr_server, 1);
+        c_assert(!r);
+
+        /*
+         * Send from an ephemeral port, like relay agents or tools might do,
+         * rather than the DHCP client port.
+         */
+        netns_get(&oldns);
+        netns_set(link_client->netns);
+        sk_client = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        c_assert(sk_client >= 0);
+        r = connect(sk_client, (struct sockaddr *)&dest, sizeof(dest));
+        c_assert(!r);
+        netns_set(oldns);
+
+        /*
+         * Only REQUESTs selecting another server are dropped, regardless of
+         * the order of their options. Other messages with a foreign server
+         * identifier, and REQUESTs without one, are passed on.
+         */
+        test_filter_send(sk_client, N_DHCP4_MESSAGE_REQUEST, &addr_other, false);
+        test_filter_send(sk_client, N_DHCP4_MESSAGE_DECLINE, &addr_other, false);
+        test_filter_send(sk_client, N_DHCP4_MESSAGE_REQUEST, &addr_other, true);
+        test_filter_send(sk_client, N_DHCP4_MESSAGE_REQUEST, &addr_server, false);
+        test_filter_send(sk_client, N_DHCP4_MESSAGE_REQUEST, NULL, false);
+
+        for (unsigned int i = 0; i < 3; ++i) {
+                _c_cleanup_(n_dhcp4_incoming_freep) NDhcp4Incoming *incoming = NULL;
+
+                test_poll(sk_server);
+
+                r = n_dhcp4_s_socket_udp_recv(sk_server, buf, sizeof(buf), &incoming, &dest);
+                c_assert(!r);
+                c_assert(incoming);
+
+                r = n_dhcp4_incoming_query_message_type(incoming, &type);
+                c_assert(!r);
+                r = n_dhcp4_incoming_query_server_identifier(incoming, &server_id);
+
+                switch (i) {
+                case 0:
+                        c_assert(type == N_DHCP4_MESSAGE_DECLINE);
+                        c_assert(!r && server_id.s_addr == addr_other.s_addr);
+                        break;
+                case 1:
+                        c_assert(type == N_DHCP4_MESSAGE_REQUEST);
+                        c_assert(!r && server_id.s_addr == addr_server.s_addr);
+                        break;
+                case 2:
+                        c_assert(type == N_DHCP4_MESSAGE_REQUEST);
+                        c_assert(r == N_DHCP4_E_UNSET);
+                        break;
+                }
+        }
+
+        /* without any own address, all REQUESTs selecting a server are dropped */
+
+        r = n_dhcp4_s_socket_udp_filter(sk_server, NULL, 0);
+        c_assert(!r);
+
+        test_filter_send(sk_client, N_DHCP4_MESSAGE_REQUEST, &addr_server, false);
+        test_filter_send(sk_client, N_DHCP4_MESSAGE_REQUEST, NULL, false);
+
+        {
+                _c_cleanup_(n_dhcp4_incoming_freep) NDhcp4Incoming *incoming = NULL;
+
+                test_poll(sk_server);
+
+                r = n_dhcp4_s_socket_udp_recv(sk_server, buf, sizeof(buf), &incoming, &dest);
+                c_assert(!r);
+                c_assert(incoming);
+
+                r = n_dhcp4_incoming_query_server_identifier(incoming, &server_id);
+                c_assert(r == N_DHCP4_E_UNSET);
+        }
+
+        {
+                _c_cleanup_(n_dhcp4_incoming_freep) NDhcp4Incoming *incoming = NULL;
+
+                r = n_dhcp4_s_socket_udp_recv(sk_server, buf, sizeof(buf), &incoming, &dest);
+                c_assert(r == N_DHCP4_E_AGAIN);
+        }
+
+        /*
+         * Options cut off at the end of the datagram, right after their code
+         * or in the middle of their value, are passed on for userspace to
+         * deal with, rather than aborting the filter.
+         */
+        for (size_t i = 1; i <= 2 + sizeof(struct in_addr); ++i) {
+                uint8_t message[offsetof(NDhcp4Message, options) + 2 + sizeof(struct in_addr)] = {};
+                NDhcp4Message *m = (NDhcp4Message *)message;
+                ssize_t len;
+
+                m->header.op = N_DHCP4_OP_BOOTREQUEST;
+                m->magic = htonl(N_DHCP4_MESSAGE_MAGIC);
+                m->options[0] = N_DHCP4_OPTION_ROUTER;
+                m->options[1] = sizeof(struct in_addr);
+
+                len = send(sk_client, message, offsetof(NDhcp4Message, options) + i, 0);
+                c_assert(len == (ssize_t)(offsetof(NDhcp4Message, options) + i));
+
+                test_poll(sk_server);
+
+                len = recv(sk_server, buf, sizeof(buf), 0);
+                c_assert(len == (ssize_t)(offsetof(NDhcp4Message, options) + i));
+        }
+
+        /* teardown */
+
+        link_del_ip4(link_client, &addr_client, 8);
+        link_del_ip4(link_server, &addr_server, 8);
+}
+
 static void test_server_client_packet(Link *link_server, Link *link_client) {
         _c_cleanup_(n_dhcp4_outgoing_freep) NDhcp4Outgoing *outgoing = NULL;
-        _c_cleanup_(n_dhcp4_incoming_freep) NDhcp4Incoming *incoming1 = NULL, *incoming2 = NULL;
+        _c_cleanup_(n_dhcp4_incoming_deinit) NDhcp4Incoming incoming1 = N_DHCP4_INCOMING_NULL(incoming1);
+        _c_cleanup_(n_dhcp4_incoming_deinit) NDhcp4Incoming incoming2 = N_DHCP4_INCOMING_NULL(incoming2);
         _c_cleanup_(c_closep) int sk_server = -1, sk_client = -1;
         struct in_addr addr_client = (struct in_addr){ htonl(10 << 24 | 2) };
         struct in_addr addr_server = (struct in_addr){ htonl(10 << 24 | 1) };
@@ -173,6 +364,7 @@ static void test_server_client_packet(Link *link_server, Link *link_client) {
         n_dhcp4_outgoing_get_header(outgoing)->op = N_DHCP4_OP_BOOTREPLY;
 
         r = n_dhcp4_s_socket_packet_send(sk_server,
+                                         NULL,
                                          link_server->ifindex,
                                          &addr_server,
                                          link_client->mac.ether_addr_octet,
@@ -181,6 +373,7 @@ static void test_server_client_packet(Link *link_server, Link *link_client) {
                                          outgoing);
         c_assert(!r);
         r = n_dhcp4_s_socket_packet_send(sk_server,
+                                         NULL,
                                          link_server->ifindex,
                                          &addr_server,
                                          (const unsigned char[]){
@@ -193,15 +386,87 @@ static void test_server_client_packet(Link *link_server, Link *link_client) {
 
         test_poll(sk_client);
 
-        r = n_dhcp4_c_socket_packet_recv(sk_client, buf, sizeof(buf), &incoming1);
+        r = n_dhcp4_c_socket_packet_recv(sk_client, NULL, NULL, buf, sizeof(buf), &incoming1);
+        c_assert(!r);
+        c_assert(incoming1.message);
+
+        test_poll(sk_client);
+
+        r = n_dhcp4_c_socket_packet_recv(sk_client, NULL, NULL, buf, sizeof(buf), &incoming2);
+        c_assert(!r);
+        c_assert(incoming2.message);
+
+        /* teardown */
+
+        link_del_ip4(link_server, &addr_server, 8);
+}
+
+static void test_server_client_filter(Link *link_server, Link *link_client) {
+        _c_cleanup_(n_dhcp4_outgoing_freep) NDhcp4Outgoing *outgoing = NULL;
+        _c_cleanup_(n_dhcp4_incoming_deinit) NDhcp4Incoming incoming = N_DHCP4_INCOMING_NULL(incoming);
+        _c_cleanup_(c_closep) int sk_server = -1, sk_client = -1;
+        struct in_addr addr_client = (struct in_addr){ htonl(10 << 24 | 2) };
+        struct in_addr addr_server = (struct in_addr){ htonl(10 << 24 | 1) };
+        NDhcp4SocketOffload offload = {};
+        NDhcp4Header match = {}, *header;
+        uint8_t buf[UINT16_MAX];
+        uint32_t xid;
+        int r;
+
+        /* setup */
+
+        link_add_ip4(link_server, &addr_server, 8);
+
+        test_server_packet_socket_new(link_server, &sk_server);
+        test_client_packet_socket_new(link_client, &sk_client);
+
+        match.xid = htobe32(0x12345678);
+        match.hlen = ETH_ALEN;
+        memcpy(match.chaddr, link_client->mac.ether_addr_octet, ETH_ALEN);
+
+        r = n_dhcp4_c_socket_packet_filter(sk_client, &offload, &match);
+        c_assert(!r);
+
+        r = n_dhcp4_outgoing_new(&outgoing, 0, 0);
         c_assert(!r);
-        c_assert(incoming1);
+        header = n_dhcp4_outgoing_get_header(outgoing);
+        header->op = N_DHCP4_OP_BOOTREPLY;
+        header->hlen = ETH_ALEN;
+
+        /*
+         * Send a reply for another transaction, a reply for another client
+         * with the same transaction, and the matching reply last. Only the
+         * latter must be queued on the client.
+         */
+        for (unsigned int i = 0; i < 3; ++i) {
+                header->xid = (i == 0) ? htobe32(0x87654321) : match.xid;
+                memcpy(header->chaddr, match.chaddr, sizeof(header->chaddr));
+                if (i == 1)
+                        header->chaddr[ETH_ALEN - 1] ^= 0xff;
+
+                r = n_dhcp4_s_socket_packet_send(sk_server,
+                                                 NULL,
+                                                 link_server->ifindex,
+                                                 &addr_server,
+                                                 link_client->mac.ether_addr_octet,
+                                                 ETH_ALEN,
+                                                 &addr_client,
+                                                 outgoing);
+                c_assert(!r);
+        }
 
         test_poll(sk_client);
 
-        r = n_dhcp4_c_socket_packet_recv(sk_client, buf, sizeof(buf), &incoming2);
+        r = n_dhcp4_c_socket_packet_recv(sk_client, NULL, NULL, buf, sizeof(buf), &incoming);
         c_assert(!r);
-        c_assert(incoming2);
+        c_assert(incoming.message);
+
+        n_dhcp4_incoming_get_xid(&incoming, &xid);
+        c_assert(xid == match.xid);
+        c_assert(!memcmp(incoming.message->header.chaddr, match.chaddr, sizeof(match.chaddr)));
+
+        r = n_dhcp4_c_socket_packet_recv(sk_client, NULL, NULL, buf, sizeof(buf), &incoming);
+        c_assert(r == N_DHCP4_E_AGAIN);
 
         /* teardown */
 
@@ -210,7 +475,7 @@ static void test_server_client_packet(Link *link_server, Link *link_client) {
 
 static void test_server_client_udp(Link *link_server, Link *link_client) {
         _c_cleanup_(n_dhcp4_outgoing_freep) NDhcp4Outgoing *outgoing = NULL;
-        _c_cleanup_(n_dhcp4_incoming_freep) NDhcp4Incoming *incoming = NULL;
+        _c_cleanup_(n_dhcp4_incoming_deinit) NDhcp4Incoming incoming = N_DHCP4_INCOMING_NULL(incoming);
         _c_cleanup_(c_closep) int sk_server = -1, sk_client = -1;
         struct in_addr addr_client = (struct in_addr){ htonl(10 << 24 | 2) };
         struct in_addr addr_server = (struct in_addr){ htonl(10 << 24 | 1) };
@@ -241,7 +506,90 @@ static void test_server_client_udp(Link *link_server, Link *link_client) {
 
         r = n_dhcp4_c_socket_udp_recv(sk_client, buf, sizeof(buf), &incoming);
         c_assert(!r);
-        c_assert(incoming);
+        c_assert(incoming.message);
+
+        /* teardown */
+
+        link_del_ip4(link_client, &addr_client, 8);
+        link_del_ip4(link_server, &addr_server, 8);
+}
+
+static void test_server_client_batch(Link *link_server, Link *link_client) {
+        _c_cleanup_(n_dhcp4_outgoing_freep) NDhcp4Outgoing *outgoing = NULL;
+        struct in_addr addr_client = (struct in_addr){ htonl(10 << 24 | 2) };
+        struct in_addr addr_server = (struct in_addr){ htonl(10 << 24 | 1) };
+        NDhcp4SReply replies[3];
+        const size_t n_replies = sizeof(replies) / sizeof(*replies);
+        uint8_t buf[UINT16_MAX];
+        int r;
+
+        /* setup */
+
+        link_add_ip4(link_server, &addr_server, 8);
+        link_add_ip4(link_client, &addr_client, 8);
+
+        r = n_dhcp4_outgoing_new(&outgoing, 0, 0);
+        c_assert(!r);
+        n_dhcp4_outgoing_get_header(outgoing)->op = N_DHCP4_OP_BOOTREPLY;
+
+        for (size_t i = 0; i < n_replies; ++i) {
+                replies[i] = (NDhcp4SReply){
+                        .message = outgoing,
+                        .src = addr_server,
+                        .dest = addr_client,
+                };
+        }
+
+        /* test batched UDP replies */
+        {
+                _c_cleanup_(c_closep) int sk_server = -1, sk_client = -1;
+
+                test_server_udp_socket_new(link_server, &sk_server);
+                test_client_udp_socket_new(link_client, &sk_client, &addr_client, &addr_server);
+
+                r = n_dhcp4_s_socket_udp_send_batch(sk_server, replies, n_replies);
+                c_assert(!r);
+
+                for (size_t i = 0; i < n_replies; ++i) {
+                        _c_cleanup_(n_dhcp4_incoming_deinit) NDhcp4Incoming incoming = N_DHCP4_INCOMING_NULL(incoming);
+
+                        test_poll(sk_client);
+
+                        r = n_dhcp4_c_socket_udp_recv(sk_client, buf, sizeof(buf), &incoming);
+                        c_assert(!r);
+                        c_assert(incoming.message);
+                }
+        }
+
+        /* test batched packet replies */
+        {
+                _c_cleanup_(c_closep) int sk_server = -1, sk_client = -1;
+
+                test_server_packet_socket_new(link_server, &sk_server);
+                test_client_packet_socket_new(link_client, &sk_client);
+
+                for (size_t i = 0; i < n_replies; ++i) {
+                        replies[i].haddr = link_client->mac.ether_addr_octet;
+                        replies[i].halen = ETH_ALEN;
+                }
+
+                r = n_dhcp4_s_socket_packet_send_batch(sk_server,
+                                                       NULL,
+                                                       link_server->ifindex,
+                                                       replies,
+                                                       n_replies);
+                c_assert(!r);
+
+                for (size_t i = 0; i < n_replies; ++i) {
+                        _c_cleanup_(n_dhcp4_incoming_deinit) NDhcp4Incoming incoming = N_DHCP4_INCOMING_NULL(incoming);
+
+                        test_poll(sk_client);
+
+                        r = n_dhcp4_c_socket_packet_recv(sk_client, NULL, NULL, buf, sizeof(buf), &incoming);
+                        c_assert(!r);
+                        c_assert(incoming.message);
+                }
+        }
 
         /* teardown */
 
@@ -249,6 +597,233 @@ static void test_server_client_udp(Link *link_server, Link *link_client) {
         link_del_ip4(link_server, &addr_server, 8);
 }
 
+static void test_capture_socket_new(Link *link, int *skp) {
+        struct sockaddr_ll addr = {
+                .sll_family = AF_PACKET,
+                .sll_protocol = htons(ETH_P_IP),
+                .sll_ifindex = link->ifindex,
+        };
+        int r, oldns, on = 1;
+
+        netns_get(&oldns);
+        netns_set(link->netns);
+
+        *skp = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        c_assert(*skp >= 0);
+
+        r = setsockopt(*skp, SOL_PACKET, PACKET_AUXDATA, &on, sizeof(on));
+        c_assert(r >= 0);
+
+        r = bind(*skp, (struct sockaddr *)&addr, sizeof(addr));
+        c_assert(r >= 0);
+
+        netns_set(oldns);
+}
+
+static void test_capture_verify(int sk, const struct in_addr *addr_server, const struct in_addr *addr_client) {
+        uint8_t buf[UINT16_MAX], cmsgbuf[CMSG_SPACE(sizeof(struct tpacket_auxdata))];
+        struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+        struct msghdr msg = {
+                .msg_iov = &iov,
+                .msg_iovlen = 1,
+                .msg_control = cmsgbuf,
+                .msg_controllen = sizeof(cmsgbuf),
+        };
+        struct tpacket_auxdata *aux;
+        struct udphdr *udp_hdr;
+        struct iphdr *ip_hdr;
+        struct cmsghdr *cmsg;
+        size_t n_payload;
+        ssize_t len;
+
+        test_poll(sk);
+
+        len = recvmsg(sk, &msg, 0);
+        c_assert(len >= (ssize_t)(sizeof(*ip_hdr) + sizeof(*udp_hdr)));
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        c_assert(cmsg && cmsg->cmsg_type == PACKET_AUXDATA);
+        aux = (void *)CMSG_DATA(cmsg);
+
+        ip_hdr = (void *)buf;
+        udp_hdr = (void *)(buf + ip_hdr->ihl * 4);
+        n_payload = ntohs(udp_hdr->len) - sizeof(*udp_hdr);
+
+        c_assert(ip_hdr->protocol == IPPROTO_UDP);
+        c_assert(!packet_internet_checksum((void *)ip_hdr, ip_hdr->ihl * 4));
+        c_assert(udp_hdr->dest == htons(N_DHCP4_NETWORK_CLIENT_PORT));
+
+        if (aux->tp_status & TP_STATUS_CSUMNOTREADY) {
+                /*
+                 * The checksum was not completed on the way, so complete it
+                 * as a device would, starting at the UDP header.
+                 */
+                c_assert(packet_internet_checksum((void *)udp_hdr, ntohs(udp_hdr->len)) ==
+                         packet_internet_checksum_udp(addr_server,
+                                                      addr_client,
+                                                      N_DHCP4_NETWORK_SERVER_PORT,
+                                                      N_DHCP4_NETWORK_CLIENT_PORT,
+                                                      (void *)(udp_hdr + 1),
+                                                      n_payload,
+                                                      0));
+        } else {
+                c_assert(!packet_internet_checksum_udp(addr_server,
+                                                       addr_client,
+                                                       N_DHCP4_NETWORK_SERVER_PORT,
+                                                       N_DHCP4_NETWORK_CLIENT_PORT,
+                                                       (void *)(udp_hdr + 1),
+                                                       n_payload,
+                                                       udp_hdr->check));
+        }
+}
+
+static void test_server_client_offload(Link *link_server, Link *link_client) {
+        _c_cleanup_(n_dhcp4_outgoing_freep) NDhcp4Outgoing *outgoing = NULL;
+        _c_cleanup_(c_closep) int sk_server = -1, sk_client = -1, sk_capture = -1;
+        struct in_addr addr_client = (struct in_addr){ htonl(10 << 24 | 2) };
+        struct in_addr addr_server = (struct in_addr){ htonl(10 << 24 | 1) };
+        NDhcp4SocketOffload offload_server, offload_client;
+        struct packet_ring *ring;
+        NDhcp4SReply replies[2];
+        const size_t n_replies = sizeof(replies) / sizeof(*replies);
+        uint8_t buf[UINT16_MAX];
+        int r;
+
+        /* setup */
+
+        link_add_ip4(link_server, &addr_server, 8);
+
+        /* veth links are ethernet, so offload must be available */
+
+        test_server_packet_socket_new_flags(link_server, &sk_server, N_DHCP4_SOCKET_FLAG_VNET_HDR, &offload_server);
+        c_assert(offload_server.enabled);
+        c_assert(!memcmp(offload_server.haddr, link_server->mac.ether_addr_octet, ETH_ALEN));
+        test_client_packet_socket_new_flags(link_client, &sk_client, N_DHCP4_SOCKET_FLAG_VNET_HDR, &offload_client, &ring);
+        c_assert(offload_client.enabled);
+        c_assert(!ring);
+        test_capture_socket_new(link_client, &sk_capture);
+
+        r = n_dhcp4_outgoing_new(&outgoing, 0, 0);
+        c_assert(!r);
+        n_dhcp4_outgoing_get_header(outgoing)->op = N_DHCP4_OP_BOOTREPLY;
+
+        for (size_t i = 0; i < n_replies; ++i) {
+                replies[i] = (NDhcp4SReply){
+                        .message = outgoing,
+                        .src = addr_server,
+                        .dest = addr_client,
+                        .haddr = link_client->mac.ether_addr_octet,
+                        .halen = ETH_ALEN,
+                };
+        }
+
+        /* test single and batched replies with offloaded checksums */
+
+        r = n_dhcp4_s_socket_packet_send(sk_server,
+                                         &offload_server,
+                                         link_server->ifindex,
+                                         &addr_server,
+                                         link_client->mac.ether_addr_octet,
+                                         ETH_ALEN,
+                                         &addr_client,
+                                         outgoing);
+        c_assert(!r);
+
+        r = n_dhcp4_s_socket_packet_send_batch(sk_server,
+                                               &offload_server,
+                                               link_server->ifindex,
+                                               replies,
+                                               n_replies);
+        c_assert(!r);
+
+        for (size_t i = 0; i < 1 + n_replies; ++i) {
+                _c_cleanup_(n_dhcp4_incoming_deinit) NDhcp4Incoming incoming = N_DHCP4_INCOMING_NULL(incoming);
+
+                test_poll(sk_client);
+
+                r = n_dhcp4_c_socket_packet_recv(sk_client, &offload_client, NULL, buf, sizeof(buf), &incoming);
+                c_assert(!r);
+                c_assert(incoming.message);
+
+                test_capture_verify(sk_capture, &addr_server, &addr_client);
+        }
+
+        /* teardown */
+
+        link_del_ip4(link_server, &addr_server, 8);
+}
+
+static void test_server_client_ring(Link *link_server, Link *link_client) {
+        _c_cleanup_(n_dhcp4_outgoing_freep) NDhcp4Outgoing *outgoing = NULL;
+        _c_cleanup_(n_dhcp4_incoming_deinit) NDhcp4Incoming incoming = N_DHCP4_INCOMING_NULL(incoming);
+        _c_cleanup_(packet_ring_freep) struct packet_ring *ring = NULL;
+        _c_cleanup_(c_closep) int sk_server = -1, sk_client = -1;
+        struct in_addr addr_client = (struct in_addr){ htonl(10 << 24 | 2) };
+        struct in_addr addr_server = (struct in_addr){ htonl(10 << 24 | 1) };
+        NDhcp4SocketOffload offload;
+        NDhcp4SReply replies[N_DHCP4_S_SOCKET_MAX_BATCH];
+        const size_t n_replies = sizeof(replies) / sizeof(*replies);
+        uint8_t buf[UINT16_MAX];
+        size_t n_received = 0;
+        int r;
+
+        /* setup */
+
+        link_add_ip4(link_server, &addr_server, 8);
+
+        test_server_packet_socket_new(link_server, &sk_server);
+        test_client_packet_socket_new_flags(link_client, &sk_client, N_DHCP4_C_SOCKET_FLAG_RX_RING, &offload, &ring);
+        c_assert(!offload.enabled);
+        c_assert(ring);
+
+        r = n_dhcp4_outgoing_new(&outgoing, 0, 0);
+        c_assert(!r);
+        n_dhcp4_outgoing_get_header(outgoing)->op = N_DHCP4_OP_BOOTREPLY;
+
+        for (size_t i = 0; i < n_replies; ++i) {
+                replies[i] = (NDhcp4SReply){
+                        .message = outgoing,
+                        .src = addr_server,
+                        .dest = addr_client,
+                        .haddr = link_client->mac.ether_addr_octet,
+                        .halen = ETH_ALEN,
+                };
+        }
+
+        /* a batch of replies is read from the ring, block by block */
+
+        r = n_dhcp4_s_socket_packet_send_batch(sk_server,
+                                               NULL,
+                                               link_server->ifindex,
+                                               replies,
+                                               n_replies);
+        c_assert(!r);
+
+        while (n_received < n_replies) {
+                test_poll(sk_client);
+
+                r = n_dhcp4_c_socket_packet_recv(sk_client, &offload, ring, buf, sizeof(buf), &incoming);
+                if (r == N_DHCP4_E_AGAIN)
+                        continue;
+
+                c_assert(!r);
+                c_assert(incoming.message);
+                c_assert(incoming.message->header.op == N_DHCP4_OP_BOOTREPLY);
+                n_dhcp4_incoming_deinit(&incoming);
+                ++n_received;
+        }
+
+        /* the ring is empty once all frames were consumed */
+
+        r = n_dhcp4_c_socket_packet_recv(sk_client, &offload, ring, buf, sizeof(buf), &incoming);
+        c_assert(r == N_DHCP4_E_AGAIN);
+        c_assert(!incoming.message);
+
+        /* teardown */
+
+        link_del_ip4(link_server, &addr_server, 8);
+}
+
 static void test_sockets(void) {
         _c_cleanup_(netns_closep) int ns_server = -1, ns_client = -1;
         _c_cleanup_(link_deinit) Link link_server = LINK_NULL(link_server);
@@ -264,8 +839,13 @@ static void test_sockets(void) {
 
         test_client_server_packet(&link_server, &link_client);
         test_client_server_udp(&link_server, &link_client);
+        test_client_server_filter(&link_server, &link_client);
         test_server_client_packet(&link_server, &link_client);
+        test_server_client_filter(&link_server, &link_client);
         test_server_client_udp(&link_server, &link_client);
+        test_server_client_batch(&link_server, &link_client);
+        test_server_client_offload(&link_server, &link_client);
+        test_server_client_ring(&link_server, &link_client);
 }
 
 static void test_multiple_servers(void) {
@@ -292,15 +872,32 @@ static void test_multiple_servers(void) {
                  * run them on separate interfaces, though.
                  */
 
-                r = n_dhcp4_s_socket_udp_new(&sk1, link_server.ifindex);
+                r = n_dhcp4_s_socket_udp_new(&sk1, link_server.ifindex, 0);
                 c_assert(r >= 0);
 
-                r = n_dhcp4_s_socket_udp_new(&sk2, link_server.ifindex);
+                r = n_dhcp4_s_socket_udp_new(&sk2, link_server.ifindex, 0);
                 c_assert(r == -EADDRINUSE);
 
-                r = n_dhcp4_s_socket_udp_new(&sk2, link_client.ifindex);
+                r = n_dhcp4_s_socket_udp_new(&sk2, link_client.ifindex, 0);
                 c_assert(r >= 0);
         }
+        {
+                _c_cleanup_(c_closep) int sk1 = -1, sk2 = -1, sk3 = -1;
+
+                /*
+                 * With SO_REUSEPORT, several servers can share an interface,
+                 * but only if all of them opt in.
+                 */
+
+                r = n_dhcp4_s_socket_udp_new(&sk1, link_server.ifindex, N_DHCP4_S_SOCKET_FLAG_REUSEPORT);
+                c_assert(r >= 0);
+
+                r = n_dhcp4_s_socket_udp_new(&sk2, link_server.ifindex, N_DHCP4_S_SOCKET_FLAG_REUSEPORT);
+                c_assert(r >= 0);
+
+                r = n_dhcp4_s_socket_udp_new(&sk3, link_server.ifindex, 0);
+                c_assert(r == -EADDRINUSE);
+        }
         netns_set(oldns);
 }
 
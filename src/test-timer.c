@@ -0,0 +1,137 @@
+/*
+ * Tests for DHCP4 Timer Wheels
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <c-stdaux.h>
+#include <stdlib.h>
+#include <string.h>
+#include "n-dhcp4-private.h"
+
+#define TEST_N_TIMERS (4096)
+#define TEST_N_STEPS (2048)
+#define TEST_SHIFT (30)
+
+static uint64_t test_ns(uint64_t tick) {
+        return tick << TEST_SHIFT;
+}
+
+static void test_basic(void) {
+        NDhcp4TimerWheel wheel;
+        NDhcp4Timer a = N_DHCP4_TIMER_NULL(a), b = N_DHCP4_TIMER_NULL(b);
+        uint64_t timeout;
+
+        n_dhcp4_timer_wheel_init(&wheel, TEST_SHIFT, test_ns(1000));
+
+        n_dhcp4_timer_wheel_get_timeout(&wheel, &timeout);
+        c_assert(!timeout);
+        c_assert(!n_dhcp4_timer_wheel_pop(&wheel, test_ns(100000)));
+
+        /* deadlines are rounded up to the next tick */
+
+        n_dhcp4_timer_link(&a, &wheel, test_ns(100010) + 1);
+        n_dhcp4_timer_wheel_get_timeout(&wheel, &timeout);
+        c_assert(timeout && timeout <= test_ns(100011));
+        c_assert(!n_dhcp4_timer_wheel_pop(&wheel, test_ns(100011) - 1));
+        c_assert(n_dhcp4_timer_wheel_pop(&wheel, test_ns(100011)) == &a);
+        c_assert(!a.wheel);
+        c_assert(!n_dhcp4_timer_wheel_pop(&wheel, test_ns(100011)));
+
+        /* rescheduling moves the deadline in either direction */
+
+        n_dhcp4_timer_link(&a, &wheel, test_ns(200000));
+        n_dhcp4_timer_link(&b, &wheel, test_ns(100100));
+        n_dhcp4_timer_link(&a, &wheel, test_ns(100050));
+        c_assert(n_dhcp4_timer_wheel_pop(&wheel, test_ns(100050)) == &a);
+        c_assert(!n_dhcp4_timer_wheel_pop(&wheel, test_ns(100050)));
+        n_dhcp4_timer_link(&b, &wheel, test_ns(300000));
+        c_assert(!n_dhcp4_timer_wheel_pop(&wheel, test_ns(299999)));
+
+        /* deadlines in the past expire right away */
+
+        n_dhcp4_timer_link(&a, &wheel, test_ns(1));
+        n_dhcp4_timer_wheel_get_timeout(&wheel, &timeout);
+        c_assert(timeout == test_ns(299999));
+        c_assert(n_dhcp4_timer_wheel_pop(&wheel, test_ns(299999)) == &a);
+
+        /* cancelled timers never expire */
+
+        n_dhcp4_timer_unlink(&b);
+        n_dhcp4_timer_unlink(&b);
+        n_dhcp4_timer_wheel_get_timeout(&wheel, &timeout);
+        c_assert(!timeout);
+        c_assert(!n_dhcp4_timer_wheel_pop(&wheel, UINT64_MAX));
+
+        n_dhcp4_timer_wheel_deinit(&wheel);
+}
+
+/*
+ * Schedule timers spread over all levels of the wheel, and advance the wheel
+ * in steps of random size. Every timer must expire in the first step that
+ * reaches its deadline, and the wheel must never ask to be advanced later
+ * than the earliest deadline.
+ */
+static void test_random(void) {
+        static NDhcp4Timer timers[TEST_N_TIMERS];
+        static bool expired[TEST_N_TIMERS];
+        NDhcp4TimerWheel wheel;
+        NDhcp4Timer *timer;
+        uint64_t now, timeout, min, span;
+        size_t n_expired = 0, i;
+
+        now = 12345;
+        n_dhcp4_timer_wheel_init(&wheel, TEST_SHIFT, test_ns(now));
+
+        for (i = 0; i < TEST_N_TIMERS; ++i) {
+                span = UINT64_C(1) << (rand() % 32);
+                timers[i] = (NDhcp4Timer)N_DHCP4_TIMER_NULL(timers[i]);
+                n_dhcp4_timer_link(&timers[i], &wheel, test_ns(now + 1 + rand() % span));
+        }
+
+        for (size_t step = 0; n_expired < TEST_N_TIMERS; ++step) {
+                min = UINT64_MAX;
+                for (i = 0; i < TEST_N_TIMERS; ++i)
+                        if (!expired[i] && timers[i].tick < min)
+                                min = timers[i].tick;
+
+                n_dhcp4_timer_wheel_get_timeout(&wheel, &timeout);
+                c_assert(timeout && timeout <= test_ns(min));
+
+                /* mostly small steps, and the occasional large jump */
+                if (step < TEST_N_STEPS)
+                        now += (rand() % 8) ? rand() % 64 : UINT64_C(1) << (rand() % 24);
+                else
+                        now = min;
+
+                while ((timer = n_dhcp4_timer_wheel_pop(&wheel, test_ns(now)))) {
+                        i = timer - timers;
+                        c_assert(!expired[i]);
+                        c_assert(timer->tick <= now);
+                        expired[i] = true;
+                        ++n_expired;
+
+                        /* reschedule some of the timers from within expiry */
+                        if (step < TEST_N_STEPS && !(rand() % 4)) {
+                                expired[i] = false;
+                                --n_expired;
+                                n_dhcp4_timer_link(timer, &wheel, test_ns(now + 1 + rand() % 4096));
+                        }
+                }
+
+                for (i = 0; i < TEST_N_TIMERS; ++i)
+                        c_assert(expired[i] || timers[i].tick > now);
+        }
+
+        n_dhcp4_timer_wheel_get_timeout(&wheel, &timeout);
+        c_assert(!timeout);
+
+        n_dhcp4_timer_wheel_deinit(&wheel);
+}
+
+int main(int argc, char **argv) {
+        test_basic();
+        test_random();
+
+        return 0;
+}
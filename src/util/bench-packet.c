@@ -0,0 +1,97 @@
+/*
+ * Packet Checksum Benchmarks
+ *
+ * This measures the throughput of all internet checksum kernels supported by
+ * the CPU, once summing a buffer, and once copying and summing it in a single
+ * pass. The copy is compared against a plain memcpy(3) followed by the sum.
+ * Buffer sizes cover a minimal DHCP message, a full ethernet frame and a
+ * large buffer that is limited by memory bandwidth rather than latency.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <c-stdaux.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "n-dhcp4-private.h"
+#include "packet.h"
+
+#define BENCH_N_BYTES (UINT64_C(1) << 30)
+
+static const char *bench_kernels[_PACKET_CHECKSUM_N] = {
+        [PACKET_CHECKSUM_SCALAR] = "scalar",
+        [PACKET_CHECKSUM_SSE2] = "sse2",
+        [PACKET_CHECKSUM_AVX2] = "avx2",
+};
+
+static double bench_gbps(uint64_t nsec, size_t n_rounds, size_t size) {
+        return (double)n_rounds * size / nsec;
+}
+
+static void bench_size(uint8_t *src, uint8_t *dst, size_t size) {
+        size_t n_rounds = BENCH_N_BYTES / size;
+        uint64_t ts, nsec_sum, nsec_copy, nsec_memcpy;
+        volatile uint16_t sink;
+        int r;
+
+        for (unsigned int k = 0; k < _PACKET_CHECKSUM_N; ++k) {
+                r = packet_internet_checksum_select(k);
+                if (r) {
+                        c_assert(r == -ENOTSUP);
+                        continue;
+                }
+
+                ts = n_dhcp4_gettime(CLOCK_MONOTONIC);
+                for (size_t i = 0; i < n_rounds; ++i)
+                        sink = packet_internet_checksum(src, size);
+                nsec_sum = n_dhcp4_gettime(CLOCK_MONOTONIC) - ts;
+
+                ts = n_dhcp4_gettime(CLOCK_MONOTONIC);
+                for (size_t i = 0; i < n_rounds; ++i)
+                        sink = packet_internet_checksum_copy(dst, src, size);
+                nsec_copy = n_dhcp4_gettime(CLOCK_MONOTONIC) - ts;
+
+                ts = n_dhcp4_gettime(CLOCK_MONOTONIC);
+                for (size_t i = 0; i < n_rounds; ++i) {
+                        memcpy(dst, src, size);
+                        sink = packet_internet_checksum(dst, size);
+                }
+                nsec_memcpy = n_dhcp4_gettime(CLOCK_MONOTONIC) - ts;
+
+                fprintf(stderr,
+                        "%6zu bytes %-6s: sum %6.2f GB/s, copy+sum %6.2f GB/s, memcpy then sum %6.2f GB/s\n",
+                        size,
+                        bench_kernels[k],
+                        bench_gbps(nsec_sum, n_rounds, size),
+                        bench_gbps(nsec_copy, n_rounds, size),
+                        bench_gbps(nsec_memcpy, n_rounds, size));
+        }
+
+        (void)sink;
+}
+
+int main(int argc, char **argv) {
+        static const size_t sizes[] = { 548, 1472, 65536 };
+        uint8_t *src, *dst;
+        int r;
+
+        src = malloc(65536);
+        dst = malloc(65536);
+        c_assert(src && dst);
+
+        for (size_t i = 0; i < 65536; ++i)
+                src[i] = i ^ (i >> 8);
+
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); ++i)
+                bench_size(src, dst, sizes[i]);
+
+        r = packet_internet_checksum_select(_PACKET_CHECKSUM_N);
+        c_assert(!r);
+
+        free(dst);
+        free(src);
+        return 0;
+}
@@ -6,40 +6,69 @@
 #include <c-stdaux.h>
 #include <endian.h>
 #include <errno.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include <linux/filter.h>
 #include <linux/if_ether.h>
 #include <linux/if_packet.h>
 #include <linux/udp.h>
+#include <linux/virtio_net.h>
+#include <net/if.h>
+#include <net/if_arp.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include "packet.h"
 
-/**
- * packet_internet_checksum() - compute the internet checksum
- * @data:               the data to checksum
- * @size:               the length of @data in bytes
- *
- * Computes the internet checksum for a given blob according to RFC1071.
- *
- * The internet checksum is the one's complement of the one's complement sum of
- * the 16-bit words of the data, padded with zero-bytes if the data does not
- * end on a 16-bit boundary.
+/*
+ * Checksum kernels add up @data as 32-bit words in native byte order, padding
+ * the tail with zero-bytes, and return the 64-bit sum. They all compute the
+ * exact same sum, which is then folded into the 16-bit one's complement sum.
+ * The copy variants additionally copy @data to @dst in the same pass.
  *
- * Return: Checksum is returned.
+ * The vector kernels zero-extend 32-bit words into 64-bit lanes, so they
+ * cannot overflow for any packet size, and finish with the scalar kernel for
+ * the tail. The kernel is selected on first use, based on the CPU features.
  */
-uint16_t packet_internet_checksum(const uint8_t *data, size_t size) {
+
+static uint64_t packet_sum_scalar(const uint8_t *data, size_t size) {
+        uint64_t acc = 0;
+        uint32_t local;
+
+        while (size >= sizeof(local)) {
+                memcpy(&local, data, sizeof(local));
+                acc += local;
+
+                data += sizeof(local);
+                size -= sizeof(local);
+        }
+
+        if (size) {
+                local = 0;
+                memcpy(&local, data, size);
+                acc += local;
+        }
+
+        return acc;
+}
+
+static uint64_t packet_sum_copy_scalar(uint8_t *dst, const uint8_t *data, size_t size) {
         uint64_t acc = 0;
         uint32_t local;
 
         while (size >= sizeof(local)) {
                 memcpy(&local, data, sizeof(local));
+                memcpy(dst, &local, sizeof(local));
                 acc += local;
 
+                dst += sizeof(local);
                 data += sizeof(local);
                 size -= sizeof(local);
         }
@@ -47,15 +76,269 @@ uint16_t packet_internet_checksum(const uint8_t *data, size_t size) {
         if (size) {
                 local = 0;
                 memcpy(&local, data, size);
+                memcpy(dst, &local, size);
                 acc += local;
         }
 
+        return acc;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((__target__("sse2")))
+static uint64_t packet_sum_sse2(const uint8_t *data, size_t size) {
+        __m128i v, zero = _mm_setzero_si128(), acc = _mm_setzero_si128();
+        uint64_t lanes[2];
+
+        for ( ; size >= 16; data += 16, size -= 16) {
+                v = _mm_loadu_si128((const __m128i *)data);
+                acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+                acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+        }
+
+        _mm_storeu_si128((__m128i *)lanes, acc);
+        return lanes[0] + lanes[1] + packet_sum_scalar(data, size);
+}
+
+__attribute__((__target__("sse2")))
+static uint64_t packet_sum_copy_sse2(uint8_t *dst, const uint8_t *data, size_t size) {
+        __m128i v, zero = _mm_setzero_si128(), acc = _mm_setzero_si128();
+        uint64_t lanes[2];
+
+        for ( ; size >= 16; dst += 16, data += 16, size -= 16) {
+                v = _mm_loadu_si128((const __m128i *)data);
+                _mm_storeu_si128((__m128i *)dst, v);
+                acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+                acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+        }
+
+        _mm_storeu_si128((__m128i *)lanes, acc);
+        return lanes[0] + lanes[1] + packet_sum_copy_scalar(dst, data, size);
+}
+
+__attribute__((__target__("avx2")))
+static uint64_t packet_sum_avx2(const uint8_t *data, size_t size) {
+        __m256i v, zero = _mm256_setzero_si256(), acc = _mm256_setzero_si256();
+        uint64_t lanes[4];
+
+        for ( ; size >= 32; data += 32, size -= 32) {
+                v = _mm256_loadu_si256((const __m256i *)data);
+                acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(v, zero));
+                acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(v, zero));
+        }
+
+        _mm256_storeu_si256((__m256i *)lanes, acc);
+        return lanes[0] + lanes[1] + lanes[2] + lanes[3] + packet_sum_scalar(data, size);
+}
+
+__attribute__((__target__("avx2")))
+static uint64_t packet_sum_copy_avx2(uint8_t *dst, const uint8_t *data, size_t size) {
+        __m256i v, zero = _mm256_setzero_si256(), acc = _mm256_setzero_si256();
+        uint64_t lanes[4];
+
+        for ( ; size >= 32; dst += 32, data += 32, size -= 32) {
+                v = _mm256_loadu_si256((const __m256i *)data);
+                _mm256_storeu_si256((__m256i *)dst, v);
+                acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(v, zero));
+                acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(v, zero));
+        }
+
+        _mm256_storeu_si256((__m256i *)lanes, acc);
+        return lanes[0] + lanes[1] + lanes[2] + lanes[3] + packet_sum_copy_scalar(dst, data, size);
+}
+
+#endif
+
+static uint64_t packet_sum_resolve(const uint8_t *data, size_t size);
+static uint64_t packet_sum_copy_resolve(uint8_t *dst, const uint8_t *data, size_t size);
+
+/*
+ * The kernels are resolved on first use, which may happen on several threads
+ * at once. They all store the same kernels, so relaxed atomic accesses are
+ * sufficient.
+ */
+static uint64_t (*packet_sum_fn)(const uint8_t *data, size_t size) = packet_sum_resolve;
+static uint64_t (*packet_sum_copy_fn)(uint8_t *dst, const uint8_t *data, size_t size) = packet_sum_copy_resolve;
+
+static uint64_t packet_sum(const uint8_t *data, size_t size) {
+        return __atomic_load_n(&packet_sum_fn, __ATOMIC_RELAXED)(data, size);
+}
+
+static uint64_t packet_sum_copy(uint8_t *dst, const uint8_t *data, size_t size) {
+        return __atomic_load_n(&packet_sum_copy_fn, __ATOMIC_RELAXED)(dst, data, size);
+}
+
+static bool packet_checksum_supported(unsigned int kernel) {
+        switch (kernel) {
+        case PACKET_CHECKSUM_SCALAR:
+                return true;
+#if defined(__x86_64__) || defined(__i386__)
+        case PACKET_CHECKSUM_SSE2:
+                return __builtin_cpu_supports("sse2");
+        case PACKET_CHECKSUM_AVX2:
+                return __builtin_cpu_supports("avx2");
+#endif
+        default:
+                return false;
+        }
+}
+
+/**
+ * packet_internet_checksum_select() - select checksum kernel
+ * @kernel:             kernel to use, or _PACKET_CHECKSUM_N for the best one
+ *
+ * Selects the implementation used by all checksum helpers. By default, the
+ * best kernel supported by the CPU is selected on first use, so this is only
+ * needed to compare the kernels against each other.
+ *
+ * Return: 0 on success, -ENOTSUP if the kernel is not supported.
+ */
+int packet_internet_checksum_select(unsigned int kernel) {
+        if (kernel == _PACKET_CHECKSUM_N) {
+                kernel = PACKET_CHECKSUM_SCALAR;
+                for (unsigned int i = 0; i < _PACKET_CHECKSUM_N; ++i)
+                        if (packet_checksum_supported(i))
+                                kernel = i;
+        } else if (!packet_checksum_supported(kernel)) {
+                return -ENOTSUP;
+        }
+
+        switch (kernel) {
+        case PACKET_CHECKSUM_SCALAR:
+                __atomic_store_n(&packet_sum_fn, packet_sum_scalar, __ATOMIC_RELAXED);
+                __atomic_store_n(&packet_sum_copy_fn, packet_sum_copy_scalar, __ATOMIC_RELAXED);
+                break;
+#if defined(__x86_64__) || defined(__i386__)
+        case PACKET_CHECKSUM_SSE2:
+                __atomic_store_n(&packet_sum_fn, packet_sum_sse2, __ATOMIC_RELAXED);
+                __atomic_store_n(&packet_sum_copy_fn, packet_sum_copy_sse2, __ATOMIC_RELAXED);
+                break;
+        case PACKET_CHECKSUM_AVX2:
+                __atomic_store_n(&packet_sum_fn, packet_sum_avx2, __ATOMIC_RELAXED);
+                __atomic_store_n(&packet_sum_copy_fn, packet_sum_copy_avx2, __ATOMIC_RELAXED);
+                break;
+#endif
+        default:
+                c_assert(0);
+        }
+
+        return 0;
+}
+
+static uint64_t packet_sum_resolve(const uint8_t *data, size_t size) {
+        packet_internet_checksum_select(_PACKET_CHECKSUM_N);
+        return packet_sum(data, size);
+}
+
+static uint64_t packet_sum_copy_resolve(uint8_t *dst, const uint8_t *data, size_t size) {
+        packet_internet_checksum_select(_PACKET_CHECKSUM_N);
+        return packet_sum_copy(dst, data, size);
+}
+
+static uint16_t packet_fold(uint64_t acc) {
         while (acc >> 16)
                 acc = (acc & 0xffff) + (acc >> 16);
 
         return ~acc;
 }
 
+/**
+ * packet_internet_checksum() - compute the internet checksum
+ * @data:               the data to checksum
+ * @size:               the length of @data in bytes
+ *
+ * Computes the internet checksum for a given blob according to RFC1071.
+ *
+ * The internet checksum is the one's complement of the one's complement sum of
+ * the 16-bit words of the data, padded with zero-bytes if the data does not
+ * end on a 16-bit boundary.
+ *
+ * Return: Checksum is returned.
+ */
+uint16_t packet_internet_checksum(const uint8_t *data, size_t size) {
+        return packet_fold(packet_sum(data, size));
+}
+
+/**
+ * packet_internet_checksum_copy() - copy data and compute its checksum
+ * @dst:                destination to copy @data to
+ * @data:               the data to copy and checksum
+ * @size:               the length of @data in bytes
+ *
+ * This is equivalent to copying @data to @dst and then calling
+ * packet_internet_checksum() on it, but reads @data only once.
+ *
+ * Return: Checksum is returned.
+ */
+uint16_t packet_internet_checksum_copy(uint8_t *dst, const uint8_t *data, size_t size) {
+        return packet_fold(packet_sum_copy(dst, data, size));
+}
+
+/**
+ * packet_internet_checksum_update() - update internet checksum incrementally
+ * @checksum:           checksum to update
+ * @old:                previous content of the modified field
+ * @new:                new content of the modified field
+ * @size:               length of the field in bytes, must be even
+ *
+ * Computes the internet checksum of a blob after a field of it was changed
+ * from @old to @new, given its checksum @checksum before the change, as
+ * described in RFC1624. The field must start at an even offset in the
+ * checksummed blob. The cost is independent of the size of the blob.
+ *
+ * Like with packet_internet_checksum_udp(), the caller must flip a resulting
+ * checksum of 0 to 0xffff for UDP.
+ *
+ * Return: Updated checksum is returned.
+ */
+uint16_t packet_internet_checksum_update(uint16_t checksum, const void *old, const void *new, size_t size) {
+        uint64_t acc = (uint16_t)~checksum;
+        uint16_t o, n;
+
+        c_assert(!(size % sizeof(o)));
+
+        for (size_t i = 0; i < size; i += sizeof(o)) {
+                memcpy(&o, (const uint8_t *)old + i, sizeof(o));
+                memcpy(&n, (const uint8_t *)new + i, sizeof(n));
+                acc += (uint16_t)~o;
+                acc += n;
+        }
+
+        return packet_fold(acc);
+}
+
+static uint64_t packet_sum_udp_header(const struct in_addr *src_addr,
+                                      const struct in_addr *dst_addr,
+                                      uint16_t src_port,
+                                      uint16_t dst_port,
+                                      size_t size,
+                                      uint16_t checksum) {
+        struct {
+                uint32_t src;
+                uint32_t dst;
+                uint8_t _zeros;
+                uint8_t protocol;
+                uint16_t length;
+                struct udphdr udp;
+        } _c_packed_ udp_phdr = {
+                .src = src_addr->s_addr,
+                .dst = dst_addr->s_addr,
+                .protocol = IPPROTO_UDP,
+                .length = htons(sizeof(struct udphdr) + size),
+                .udp = {
+                        .source = htons(src_port),
+                        .dest = htons(dst_port),
+                        .len = htons(sizeof(struct udphdr) + size),
+                        .check = checksum,
+                },
+        };
+
+        _Static_assert(!(sizeof(udp_phdr) % sizeof(uint32_t)),
+                       "UDP header structure size is not a multiple of 4");
+
+        return packet_sum_scalar((const uint8_t *)&udp_phdr, sizeof(udp_phdr));
+}
+
 /**
  * packet_internet_checksum_udp() - compute the internet checkum for UDP packets
  * @src_addr:           source IP address
@@ -88,108 +371,253 @@ uint16_t packet_internet_checksum_udp(const struct in_addr *src_addr,
                                       const uint8_t *data,
                                       size_t size,
                                       uint16_t checksum) {
+        return packet_fold(packet_sum_udp_header(src_addr, dst_addr, src_port, dst_port, size, checksum) +
+                           packet_sum(data, size));
+}
+
+static uint64_t packet_sum_pseudo_header(const struct in_addr *src_addr,
+                                         const struct in_addr *dst_addr,
+                                         size_t size) {
         struct {
                 uint32_t src;
                 uint32_t dst;
                 uint8_t _zeros;
                 uint8_t protocol;
                 uint16_t length;
-                struct udphdr udp;
-        } _c_packed_ udp_phdr = {
+        } _c_packed_ phdr = {
                 .src = src_addr->s_addr,
                 .dst = dst_addr->s_addr,
                 .protocol = IPPROTO_UDP,
                 .length = htons(sizeof(struct udphdr) + size),
-                .udp = {
-                        .source = htons(src_port),
-                        .dest = htons(dst_port),
-                        .len = htons(sizeof(struct udphdr) + size),
-                        .check = checksum,
-                },
         };
-        const uint8_t *iter;
-        uint64_t acc = 0;
-        uint32_t local;
 
-        _Static_assert(!(sizeof(udp_phdr) % sizeof(local)),
-                       "UDP header structure size is not a multiple of 4");
+        return packet_sum_scalar((const uint8_t *)&phdr, sizeof(phdr));
+}
 
-        for (iter = (const uint8_t *)&udp_phdr;
-             iter < (const uint8_t *)(&udp_phdr + 1);
-             iter += sizeof(local)) {
-                memcpy(&local, iter, sizeof(local));
-                acc += local;
-        }
+static void packet_init_headers(struct iphdr *ip_hdr,
+                                struct udphdr *udp_hdr,
+                                size_t n_buf,
+                                const struct sockaddr_in *src_paddr,
+                                const struct sockaddr_in *dest_paddr) {
+        *ip_hdr = (struct iphdr){
+                .version = IPVERSION,
+                .ihl = sizeof(*ip_hdr) / 4, /* Length of header in multiples of four bytes */
+                .tos = IPTOS_CLASS_CS6, /* Class Selector for network control */
+                .tot_len = htons(sizeof(struct iphdr) + sizeof(struct udphdr) + n_buf),
+                .frag_off = htons(IP_DF), /* Do not fragment */
+                .ttl = IPDEFTTL,
+                .protocol = IPPROTO_UDP,
+                .saddr = src_paddr->sin_addr.s_addr,
+                .daddr = dest_paddr->sin_addr.s_addr,
+        };
+        *udp_hdr = (struct udphdr){
+                .source = src_paddr->sin_port,
+                .dest = dest_paddr->sin_port,
+                .len = htons(sizeof(*udp_hdr) + n_buf),
+        };
 
-        while (size >= sizeof(local)) {
-                memcpy(&local, data, sizeof(local));
-                acc += local;
+        ip_hdr->check = packet_internet_checksum((void*)ip_hdr, sizeof(*ip_hdr));
+}
 
-                data += sizeof(local);
-                size -= sizeof(local);
-        }
+static void packet_init_headers_sum(struct iphdr *ip_hdr,
+                                    struct udphdr *udp_hdr,
+                                    uint64_t sum,
+                                    size_t n_buf,
+                                    const struct sockaddr_in *src_paddr,
+                                    const struct sockaddr_in *dest_paddr) {
+        packet_init_headers(ip_hdr, udp_hdr, n_buf, src_paddr, dest_paddr);
 
-        if (size) {
-                local = 0;
-                memcpy(&local, data, size);
-                acc += local;
-        }
+        udp_hdr->check = packet_fold(sum + packet_sum_udp_header(&src_paddr->sin_addr,
+                                                                 &dest_paddr->sin_addr,
+                                                                 ntohs(src_paddr->sin_port),
+                                                                 ntohs(dest_paddr->sin_port),
+                                                                 n_buf,
+                                                                 0));
 
-        while (acc >> 16)
-                acc = (acc & 0xffff) + (acc >> 16);
+        /*
+         * 0x0000 and 0xffff are equivalent for computing the UDP checksum,
+         * but 0x0000 is reserved in UDP headers, to mean that the checksum is
+         * not set and should be ignored by the receiver. Hence, flip it to
+         * 0xffff in that case.
+         */
+        udp_hdr->check = udp_hdr->check ?: 0xffff;
+}
 
-        return ~acc;
+/**
+ * packet_init_udp() - initialize IP and UDP headers of a packet
+ * @ip_hdr:             IP header to initialize
+ * @udp_hdr:            UDP header to initialize
+ * @buf:                payload
+ * @n_buf:              length of payload in bytes
+ * @src_paddr:          source protocol address, see ip(7)
+ * @dest_paddr:         destination protocol address, see ip(7)
+ *
+ * Initializes the IP and UDP headers to prepend to @buf when sending it on a
+ * AF_PACKET/SOCK_DGRAM socket, including both checksums.
+ */
+void packet_init_udp(struct iphdr *ip_hdr,
+                     struct udphdr *udp_hdr,
+                     const void *buf,
+                     size_t n_buf,
+                     const struct sockaddr_in *src_paddr,
+                     const struct sockaddr_in *dest_paddr) {
+        packet_init_headers_sum(ip_hdr, udp_hdr, packet_sum(buf, n_buf), n_buf, src_paddr, dest_paddr);
 }
 
 /**
- * packet_sendto_udp() - send UDP packet on AF_PACKET socket
- * @sockfd:             AF_PACKET/SOCK_DGRAM socket
+ * packet_init_udp_copy() - copy payload and initialize headers of a packet
+ * @ip_hdr:             IP header to initialize
+ * @udp_hdr:            UDP header to initialize
+ * @dst:                destination to copy the payload to
  * @buf:                payload
  * @n_buf:              length of payload in bytes
- * @n_transmittedp:     output argument for number of transmitted bytes
  * @src_paddr:          source protocol address, see ip(7)
- * @dest_haddr:         destination hardware address, see packet(7)
  * @dest_paddr:         destination protocol address, see ip(7)
  *
- * Sends an UDP packet on a AF_PACKET socket directly to a hardware
- * address. The difference between this and sendto() on an AF_INET
- * socket is that no routing is performed, so the packet is delivered
- * even if the destination IP is not yet configured on the destination
- * host.
+ * This is like packet_init_udp(), but also copies the payload to @dst, which
+ * is usually the send buffer following the headers. The payload is copied
+ * and checksummed in a single pass.
+ */
+void packet_init_udp_copy(struct iphdr *ip_hdr,
+                          struct udphdr *udp_hdr,
+                          void *dst,
+                          const void *buf,
+                          size_t n_buf,
+                          const struct sockaddr_in *src_paddr,
+                          const struct sockaddr_in *dest_paddr) {
+        packet_init_headers_sum(ip_hdr, udp_hdr, packet_sum_copy(dst, buf, n_buf), n_buf, src_paddr, dest_paddr);
+}
+
+/**
+ * packet_init_udp_partial() - initialize headers of a packet for checksum offload
+ * @vnet_hdr:           virtio-net and ethernet header to initialize
+ * @ip_hdr:             IP header to initialize
+ * @udp_hdr:            UDP header to initialize
+ * @n_buf:              length of payload in bytes
+ * @src_haddr:          source ethernet address
+ * @src_paddr:          source protocol address, see ip(7)
+ * @dest_haddr:         destination ethernet address
+ * @dest_paddr:         destination protocol address, see ip(7)
  *
- * Return: 0 on success, negative error code on failure.
+ * This is like packet_init_udp(), but for sockets with PACKET_VNET_HDR
+ * enabled, see packet_enable_vnet_hdr(). The UDP checksum is left to the
+ * kernel, or the network device: the checksum field only carries the sum of
+ * the pseudo-header, and @vnet_hdr tells the kernel where to complete it, so
+ * the payload is never read.
  */
-int packet_sendto_udp(int sockfd,
-                      const void *buf,
-                      size_t n_buf,
-                      size_t *n_transmittedp,
-                      const struct sockaddr_in *src_paddr,
-                      const struct packet_sockaddr_ll *dest_haddr,
-                      const struct sockaddr_in *dest_paddr) {
-        struct iphdr ip_hdr = {
-                .version = IPVERSION,
-                .ihl = sizeof(ip_hdr) / 4, /* Length of header in multiples of four bytes */
-                .tos = IPTOS_CLASS_CS6, /* Class Selector for network control */
-                .tot_len = htons(sizeof(struct iphdr) + sizeof(struct udphdr) + n_buf),
-                .frag_off = htons(IP_DF), /* Do not fragment */
-                .ttl = IPDEFTTL,
-                .protocol = IPPROTO_UDP,
-                .saddr = src_paddr->sin_addr.s_addr,
-                .daddr = dest_paddr->sin_addr.s_addr,
+void packet_init_udp_partial(struct packet_vnet_hdr *vnet_hdr,
+                             struct iphdr *ip_hdr,
+                             struct udphdr *udp_hdr,
+                             size_t n_buf,
+                             const uint8_t *src_haddr,
+                             const struct sockaddr_in *src_paddr,
+                             const uint8_t *dest_haddr,
+                             const struct sockaddr_in *dest_paddr) {
+        packet_init_headers(ip_hdr, udp_hdr, n_buf, src_paddr, dest_paddr);
+
+        /*
+         * The device computes the checksum from the start of the UDP header
+         * to the end of the packet, including the checksum field itself. Seed
+         * that field with the non-complemented sum of the pseudo-header, so
+         * the result is the checksum over the pseudo-header and the datagram.
+         */
+        udp_hdr->check = ~packet_fold(packet_sum_pseudo_header(&src_paddr->sin_addr,
+                                                              &dest_paddr->sin_addr,
+                                                              n_buf));
+
+        vnet_hdr->vnet = (struct virtio_net_hdr){
+                .flags = VIRTIO_NET_HDR_F_NEEDS_CSUM,
+                .gso_type = VIRTIO_NET_HDR_GSO_NONE,
+                .csum_start = sizeof(vnet_hdr->eth) + sizeof(*ip_hdr),
+                .csum_offset = offsetof(struct udphdr, check),
         };
-        struct udphdr udp_hdr = {
-                .source = src_paddr->sin_port,
-                .dest = dest_paddr->sin_port,
-                .len = htons(sizeof(udp_hdr) + n_buf),
+        memcpy(vnet_hdr->eth.h_dest, dest_haddr, ETH_ALEN);
+        memcpy(vnet_hdr->eth.h_source, src_haddr, ETH_ALEN);
+        vnet_hdr->eth.h_proto = htons(ETH_P_IP);
+}
+
+/**
+ * packet_enable_vnet_hdr() - enable checksum offload on AF_PACKET socket
+ * @sockfd:             AF_PACKET/SOCK_RAW socket
+ * @ifindex:            interface the socket sends on
+ * @haddr:              return argument for the ethernet address of @ifindex
+ *
+ * Enables PACKET_VNET_HDR on @sockfd, see packet(7). Once enabled, every
+ * packet sent on the socket must be prefixed with a virtio-net header, see
+ * packet_init_udp_partial(), and every packet received is prefixed with one.
+ *
+ * The kernel only supports this on SOCK_RAW sockets, hence packets carry the
+ * link-layer header, which is only supported for ethernet interfaces here.
+ * Callers are expected to fall back to a SOCK_DGRAM socket and to computing
+ * checksums in software if this fails.
+ *
+ * Return: 0 on success, -EOPNOTSUPP if @ifindex is not an ethernet
+ *         interface, or a negative error code on failure.
+ */
+int packet_enable_vnet_hdr(int sockfd, int ifindex, uint8_t *haddr) {
+        struct ifreq ifr = {
+                .ifr_ifindex = ifindex,
         };
-        struct iovec iov[3] = {
+        int r, on = 1;
+
+        r = ioctl(sockfd, SIOCGIFNAME, &ifr);
+        if (r < 0)
+                return -errno;
+
+        r = ioctl(sockfd, SIOCGIFHWADDR, &ifr);
+        if (r < 0)
+                return -errno;
+
+        if (ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER)
+                return -EOPNOTSUPP;
+
+        r = setsockopt(sockfd, SOL_PACKET, PACKET_VNET_HDR, &on, sizeof(on));
+        if (r < 0)
+                return -errno;
+
+        memcpy(haddr, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+        return 0;
+}
+
+/**
+ * packet_sendmsg_udp() - send UDP packet with given headers on AF_PACKET socket
+ * @sockfd:             AF_PACKET/SOCK_DGRAM socket
+ * @vnet_hdr:           virtio-net and ethernet header of the packet, or NULL
+ * @ip_hdr:             IP header of the packet
+ * @udp_hdr:            UDP header of the packet
+ * @buf:                payload
+ * @n_buf:              length of payload in bytes
+ * @n_transmittedp:     output argument for number of transmitted bytes
+ * @dest_haddr:         destination hardware address, see packet(7)
+ *
+ * This is like packet_sendto_udp(), but takes the IP and UDP headers as
+ * initialized by packet_init_udp(), so callers can reuse them.
+ *
+ * On SOCK_RAW sockets with PACKET_VNET_HDR enabled, @vnet_hdr must be given,
+ * see packet_init_udp_partial(). On SOCK_DGRAM sockets it must be NULL.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int packet_sendmsg_udp(int sockfd,
+                       const struct packet_vnet_hdr *vnet_hdr,
+                       const struct iphdr *ip_hdr,
+                       const struct udphdr *udp_hdr,
+                       const void *buf,
+                       size_t n_buf,
+                       size_t *n_transmittedp,
+                       const struct packet_sockaddr_ll *dest_haddr) {
+        struct iovec iov[4] = {
                 {
-                        .iov_base = &ip_hdr,
-                        .iov_len = sizeof(ip_hdr),
+                        .iov_base = (void *)vnet_hdr,
+                        .iov_len = sizeof(*vnet_hdr),
                 },
                 {
-                        .iov_base = &udp_hdr,
-                        .iov_len = sizeof(udp_hdr),
+                        .iov_base = (void *)ip_hdr,
+                        .iov_len = sizeof(*ip_hdr),
+                },
+                {
+                        .iov_base = (void *)udp_hdr,
+                        .iov_len = sizeof(*udp_hdr),
                 },
                 {
                         .iov_base = (void *)buf,
@@ -199,28 +627,11 @@ int packet_sendto_udp(int sockfd,
         struct msghdr msg = {
                 .msg_name = (void*)dest_haddr,
                 .msg_namelen = sizeof(*dest_haddr),
-                .msg_iov = iov,
-                .msg_iovlen = sizeof(iov) / sizeof(iov[0]),
+                .msg_iov = vnet_hdr ? iov : iov + 1,
+                .msg_iovlen = vnet_hdr ? 4 : 3,
         };
         ssize_t pktlen;
 
-        ip_hdr.check = packet_internet_checksum((void*)&ip_hdr, sizeof(ip_hdr));
-        udp_hdr.check = packet_internet_checksum_udp(&src_paddr->sin_addr,
-                                                     &dest_paddr->sin_addr,
-                                                     ntohs(src_paddr->sin_port),
-                                                     ntohs(dest_paddr->sin_port),
-                                                     buf,
-                                                     n_buf,
-                                                     0);
-
-        /*
-         * 0x0000 and 0xffff are equivalent for computing the UDP checksum,
-         * but 0x0000 is reserved in UDP headers, to mean that the checksum is
-         * not set and should be ignored by the receiver. Hence, flip it to
-         * 0xffff in that case.
-         */
-        udp_hdr.check = udp_hdr.check ?: 0xffff;
-
         pktlen = sendmsg(sockfd, &msg, 0);
         if (pktlen < 0)
                 return -c_errno();
@@ -233,11 +644,44 @@ int packet_sendto_udp(int sockfd,
          * its own buffer that we sent (which is always exactly the requested
          * size).
          */
-        c_assert((size_t)pktlen >= sizeof(ip_hdr) + sizeof(udp_hdr) + n_buf);
+        c_assert((size_t)pktlen >= sizeof(*ip_hdr) + sizeof(*udp_hdr) + n_buf);
         *n_transmittedp = n_buf;
         return 0;
 }
 
+/**
+ * packet_sendto_udp() - send UDP packet on AF_PACKET socket
+ * @sockfd:             AF_PACKET/SOCK_DGRAM socket
+ * @buf:                payload
+ * @n_buf:              length of payload in bytes
+ * @n_transmittedp:     output argument for number of transmitted bytes
+ * @src_paddr:          source protocol address, see ip(7)
+ * @dest_haddr:         destination hardware address, see packet(7)
+ * @dest_paddr:         destination protocol address, see ip(7)
+ *
+ * Sends an UDP packet on a AF_PACKET socket directly to a hardware
+ * address. The difference between this and sendto() on an AF_INET
+ * socket is that no routing is performed, so the packet is delivered
+ * even if the destination IP is not yet configured on the destination
+ * host.
+ *
+ * Return: 0 on success, negative error code on failure.
+ */
+int packet_sendto_udp(int sockfd,
+                      const void *buf,
+                      size_t n_buf,
+                      size_t *n_transmittedp,
+                      const struct sockaddr_in *src_paddr,
+                      const struct packet_sockaddr_ll *dest_haddr,
+                      const struct sockaddr_in *dest_paddr) {
+        struct iphdr ip_hdr;
+        struct udphdr udp_hdr;
+
+        packet_init_udp(&ip_hdr, &udp_hdr, buf, n_buf, src_paddr, dest_paddr);
+
+        return packet_sendmsg_udp(sockfd, NULL, &ip_hdr, &udp_hdr, buf, n_buf, n_transmittedp, dest_haddr);
+}
+
 /**
  * packet_recvfrom_upd() - receive UDP packet from AF_PACKET socket
  * @sockfd:             AF_PACKET/SOCK_DGRAM socket
@@ -245,75 +689,95 @@ int packet_sendto_udp(int sockfd,
  * @n_buf:              max length of payload in bytes
  * @n_transmittedp:     output argument for number transmitted bytes
  * @src:                return argument for source address, or NULL, see ip(7)
+ * @vnet_hdr:           whether @sockfd is a SOCK_RAW socket with PACKET_VNET_HDR
  *
  * Receives an UDP packet on a AF_PACKET socket. The difference between
  * this and recvfrom() on an AF_INET socket is that the packet will be
  * received even if the destination IP address has not been configured
  * on the interface.
  *
+ * If @vnet_hdr is true, the virtio-net and ethernet headers of each packet are
+ * stripped, see packet_enable_vnet_hdr().
+ *
  * Return: 0 on success, negative error code on failure.
  */
 int packet_recvfrom_udp(int sockfd,
                         void *buf,
                         size_t n_buf,
                         size_t *n_transmittedp,
-                        struct sockaddr_in *src) {
+                        struct sockaddr_in *src,
+                        bool vnet_hdr) {
+        struct packet_vnet_hdr vnet;
         union {
                 struct iphdr hdr;
                 /*
                  * Maximum IP-header length is 15 * 4, since it is specified in
                  * the `ihl` field, which is four bits and interpreted as
-                 * factor of 4. So maximum `ihl` value is `(2^4 - 1) * 4`.
+                 * factor of 4. So maximum `ihl` value is `(2^4 - 1) * 4`. The
+                 * UDP header follows the IP header in the same buffer.
                  */
-                uint8_t data[15 * 4];
+                uint8_t data[15 * 4 + sizeof(struct udphdr)];
         } ip_hdr;
         struct udphdr udp_hdr;
-        struct iovec iov[3] = {
+        uint8_t tail[15 * 4 - sizeof(struct iphdr)];
+        struct iovec iov[4] = {
                 {
-                        .iov_base = &ip_hdr,
+                        .iov_base = &vnet,
+                        .iov_len = sizeof(vnet),
                 },
                 {
-                        .iov_base = &udp_hdr,
-                        .iov_len = sizeof(udp_hdr),
+                        .iov_base = &ip_hdr,
+                        .iov_len = sizeof(struct iphdr) + sizeof(struct udphdr),
                 },
                 {
                         .iov_base = buf,
                         .iov_len = n_buf,
                 },
+                {
+                        .iov_base = tail,
+                        .iov_len = sizeof(tail),
+                },
         };
         uint8_t cmsgbuf[CMSG_LEN(sizeof(struct tpacket_auxdata))];
         struct msghdr msg = {
-                .msg_iov = iov,
-                .msg_iovlen = sizeof(iov) / sizeof(iov[0]),
+                .msg_iov = vnet_hdr ? iov : iov + 1,
+                .msg_iovlen = vnet_hdr ? 4 : 3,
                 .msg_control = cmsgbuf,
                 .msg_controllen = sizeof(cmsgbuf),
         };
+        size_t n_vnet = vnet_hdr ? sizeof(vnet) : 0;
         struct cmsghdr *cmsg;
         bool checksum = true;
         ssize_t pktlen;
-        size_t hdrlen;
+        size_t hdrlen, n_options, n_head;
 
         *n_transmittedp = 0;
 
-        /* Peek packet to obtain the real IP header length */
-        pktlen = recv(sockfd, &ip_hdr.hdr, sizeof(ip_hdr.hdr), MSG_PEEK);
+        /*
+         * Receive the entire packet with a single call. The IP and UDP headers
+         * end up in @ip_hdr, and the payload in @buf. IP options, if any, are
+         * rare, and shift the UDP header and payload into @buf, with the end
+         * of the payload spilling into @tail. The payload is moved back once
+         * the header length is known.
+         */
+        pktlen = recvmsg(sockfd, &msg, 0);
         if (pktlen < 0)
                 return -errno;
 
-        if ((size_t)pktlen < sizeof(ip_hdr.hdr)) {
+        if ((size_t)pktlen < n_vnet + sizeof(ip_hdr.hdr)) {
                 /*
                  * Received packet is smaller than the minimal IP header length,
                  * discard it.
                  */
-                recv(sockfd, NULL, 0, 0);
                 return 0;
         }
 
+        pktlen -= n_vnet;
+
         if (ip_hdr.hdr.version != IPVERSION) {
                 /*
                  * This is not an IPv4 packet, discard it.
                  */
-                recv(sockfd, NULL, 0, 0);
                 return 0;
         }
 
@@ -323,19 +787,9 @@ int packet_recvfrom_udp(int sockfd,
                  * The length given in the header is smaller than the minimum
                  * header length, discard the packet.
                  */
-                recv(sockfd, NULL, 0, 0);
                 return 0;
         }
 
-        /*
-         * Now that we know the ip-header length, we can prepare the iovec to
-         * read the entire packet into the correct buffers.
-         */
-        iov[0].iov_len = hdrlen;
-        pktlen = recvmsg(sockfd, &msg, 0);
-        if (pktlen < 0)
-                return -errno;
-
         cmsg = CMSG_FIRSTHDR(&msg);
         if (cmsg) {
                 if (cmsg->cmsg_level == SOL_PACKET &&
@@ -365,12 +819,31 @@ int packet_recvfrom_udp(int sockfd,
                  * header, so discard it entirely.
                  */
                 return 0;
-        } else if ((size_t)pktlen < hdrlen + ntohs(udp_hdr.len)) {
+        }
+
+        /*
+         * Complete the headers with the part of them that was received into
+         * @buf, if the packet carries IP options.
+         */
+        n_options = hdrlen - sizeof(ip_hdr.hdr);
+        if (n_options > n_buf)
+                return 0;
+
+        memcpy(ip_hdr.data + sizeof(ip_hdr.hdr) + sizeof(udp_hdr), buf, n_options);
+        memcpy(&udp_hdr, ip_hdr.data + hdrlen, sizeof(udp_hdr));
+
+        if ((size_t)pktlen < hdrlen + ntohs(udp_hdr.len)) {
                 /*
                  * The UDP header specified a longer length than the returned
                  * packet, so discard it entirely.
                  */
                 return 0;
+        } else if (ntohs(udp_hdr.len) < sizeof(udp_hdr)) {
+                /*
+                 * The UDP header specified a length shorter than the header
+                 * itself, so discard it entirely.
+                 */
+                return 0;
         }
 
         /*
@@ -378,6 +851,26 @@ int packet_recvfrom_udp(int sockfd,
          * headers, since that is what the caller is interested in.
          */
         pktlen = ntohs(udp_hdr.len) - sizeof(struct udphdr);
+        if ((size_t)pktlen > n_buf) {
+                /*
+                 * The payload does not fit into the buffer of the caller, and
+                 * was only received completely due to @tail. Drop it, like
+                 * any other truncated packet.
+                 */
+                return 0;
+        }
+
+        /*
+         * Move the payload to the start of @buf, linearizing it with the part
+         * that spilled into @tail.
+         */
+        if (n_options) {
+                n_head = n_buf - n_options;
+                if (n_head > (size_t)pktlen)
+                        n_head = pktlen;
+                memmove(buf, (uint8_t *)buf + n_options, n_head);
+                memcpy((uint8_t *)buf + n_head, tail, pktlen - n_head);
+        }
 
         /* IP */
 
@@ -446,3 +939,238 @@ int packet_shutdown(int sockfd) {
 
         return 0;
 }
+
+/*
+ * Blocks of the receive ring. A block must be able to fit the largest packet
+ * the socket filters let through, and is retired to user-space either once it
+ * is full, or once the retire timeout elapsed after its first frame, so the
+ * timeout bounds the latency added by the ring.
+ */
+#define PACKET_RING_BLOCK_SIZE (UINT32_C(1) << 16)
+#define PACKET_RING_N_BLOCKS (4)
+#define PACKET_RING_RETIRE_MSEC (2)
+
+/**
+ * packet_ring_new() - set up a receive ring on a packet socket
+ * @ringp:      output argument for the new ring
+ * @sockfd:     packet socket
+ *
+ * This switches @sockfd to TPACKET_V3 and maps a receive ring into memory.
+ * From then on, packets are only delivered through the ring, and must be read
+ * with packet_ring_recv_udp(). The ring must be set up before the socket is
+ * bound, so no packet can be queued on the socket itself.
+ *
+ * The kernel does not support receive rings together with PACKET_VNET_HDR.
+ *
+ * Return: 0 on success, or a negative error code on failure.
+ */
+int packet_ring_new(struct packet_ring **ringp, int sockfd) {
+        _c_cleanup_(packet_ring_freep) struct packet_ring *ring = NULL;
+        struct tpacket_req3 req = {
+                .tp_block_size = PACKET_RING_BLOCK_SIZE,
+                .tp_block_nr = PACKET_RING_N_BLOCKS,
+                .tp_frame_size = PACKET_RING_BLOCK_SIZE,
+                .tp_frame_nr = PACKET_RING_N_BLOCKS,
+                .tp_retire_blk_tov = PACKET_RING_RETIRE_MSEC,
+        };
+        int r, version = TPACKET_V3;
+        void *map;
+
+        ring = calloc(1, sizeof(*ring));
+        if (!ring)
+                return -ENOMEM;
+
+        r = setsockopt(sockfd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version));
+        if (r < 0)
+                return -errno;
+
+        r = setsockopt(sockfd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req));
+        if (r < 0)
+                return -errno;
+
+        map = mmap(NULL,
+                   (size_t)req.tp_block_size * req.tp_block_nr,
+                   PROT_READ | PROT_WRITE,
+                   MAP_SHARED,
+                   sockfd,
+                   0);
+        if (map == MAP_FAILED)
+                return -errno;
+
+        ring->map = map;
+        ring->n_map = (size_t)req.tp_block_size * req.tp_block_nr;
+        ring->n_block = req.tp_block_size;
+        ring->n_blocks = req.tp_block_nr;
+
+        *ringp = ring;
+        ring = NULL;
+        return 0;
+}
+
+/**
+ * packet_ring_free() - unmap a receive ring
+ * @ring:       ring to operate on, or NULL
+ *
+ * This unmaps the ring from memory. The ring stays attached to its socket
+ * until the socket is closed.
+ *
+ * Return: NULL is returned.
+ */
+struct packet_ring *packet_ring_free(struct packet_ring *ring) {
+        if (!ring)
+                return NULL;
+
+        if (ring->map)
+                munmap(ring->map, ring->n_map);
+        free(ring);
+
+        return NULL;
+}
+
+static int packet_ring_parse_udp(const uint8_t *pkt,
+                                 size_t n_pkt,
+                                 bool checksum,
+                                 void *buf,
+                                 size_t n_buf,
+                                 size_t *n_transmittedp,
+                                 struct sockaddr_in *src) {
+        const struct iphdr *ip_hdr = (const void *)pkt;
+        struct udphdr udp_hdr;
+        size_t hdrlen, len;
+
+        /*
+         * This applies the same checks as packet_recvfrom_udp(), but on a
+         * linear frame in the receive ring. Frames are aligned by the kernel
+         * to TPACKET_ALIGNMENT, so the IP header can be accessed in place.
+         */
+
+        if (n_pkt < sizeof(*ip_hdr))
+                return 0;
+        if (ip_hdr->version != IPVERSION)
+                return 0;
+
+        hdrlen = ip_hdr->ihl * 4;
+        if (hdrlen < sizeof(*ip_hdr))
+                return 0;
+
+        /* drop truncated packets, and truncate trailing garbage */
+        if (ntohs(ip_hdr->tot_len) > n_pkt)
+                return 0;
+        n_pkt = ntohs(ip_hdr->tot_len);
+
+        if (n_pkt < hdrlen + sizeof(udp_hdr))
+                return 0;
+
+        memcpy(&udp_hdr, pkt + hdrlen, sizeof(udp_hdr));
+
+        if (n_pkt < hdrlen + ntohs(udp_hdr.len))
+                return 0;
+        else if (ntohs(udp_hdr.len) < sizeof(udp_hdr))
+                return 0;
+
+        len = ntohs(udp_hdr.len) - sizeof(udp_hdr);
+        if (len > n_buf)
+                return 0;
+
+        /* IP */
+
+        if (ip_hdr->protocol != IPPROTO_UDP)
+                return 0;
+        else if (ip_hdr->frag_off & htons(IP_MF | IP_OFFMASK))
+                return 0;
+        else if (checksum && packet_internet_checksum(pkt, hdrlen))
+                return 0;
+
+        /* UDP */
+
+        if (checksum && udp_hdr.check) {
+                if (packet_internet_checksum_udp(&(struct in_addr){ ip_hdr->saddr },
+                                                 &(struct in_addr){ ip_hdr->daddr },
+                                                 ntohs(udp_hdr.source),
+                                                 ntohs(udp_hdr.dest),
+                                                 pkt + hdrlen + sizeof(udp_hdr),
+                                                 len,
+                                                 udp_hdr.check))
+                        return 0;
+        }
+
+        memcpy(buf, pkt + hdrlen + sizeof(udp_hdr), len);
+
+        if (src) {
+                src->sin_family = AF_INET;
+                src->sin_addr.s_addr = ip_hdr->saddr;
+                src->sin_port = udp_hdr.source;
+        }
+
+        *n_transmittedp = len;
+        return 0;
+}
+
+/**
+ * packet_ring_recv_udp() - receive UDP packet from a receive ring
+ * @ring:               ring to operate on
+ * @buf:                buffer for payload
+ * @n_buf:              max length of payload in bytes
+ * @n_transmittedp:     output argument for number transmitted bytes
+ * @src:                return argument for source address, or NULL
+ *
+ * This is the equivalent of packet_recvfrom_udp() for sockets with a receive
+ * ring. The next frame is taken from the ring and its payload copied to @buf,
+ * without any system call. Once all frames of a block were consumed, the block
+ * is handed back to the kernel.
+ *
+ * If the frame is not a valid UDP packet, it is consumed and 0 is returned
+ * with @n_transmittedp set to 0, same as packet_recvfrom_udp().
+ *
+ * Return: 0 on success, -EAGAIN if the ring is empty.
+ */
+int packet_ring_recv_udp(struct packet_ring *ring,
+                         void *buf,
+                         size_t n_buf,
+                         size_t *n_transmittedp,
+                         struct sockaddr_in *src) {
+        struct tpacket_block_desc *block;
+        struct tpacket3_hdr *frame;
+        int r;
+
+        *n_transmittedp = 0;
+
+        for (;;) {
+                block = (void *)(ring->map + ring->i_block * ring->n_block);
+
+                if (!ring->frame) {
+                        if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+                                return -EAGAIN;
+
+                        ring->frame = (void *)((uint8_t *)block + block->hdr.bh1.offset_to_first_pkt);
+                        ring->n_frames = block->hdr.bh1.num_pkts;
+                }
+
+                if (ring->n_frames)
+                        break;
+
+                /* hand the consumed block back to the kernel */
+                __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+                ring->i_block = (ring->i_block + 1) % ring->n_blocks;
+                ring->frame = NULL;
+        }
+
+        frame = ring->frame;
+
+        r = packet_ring_parse_udp((uint8_t *)frame + frame->tp_net,
+                                  frame->tp_snaplen - (frame->tp_net - frame->tp_mac),
+                                  !(frame->tp_status & TP_STATUS_CSUMNOTREADY),
+                                  buf,
+                                  n_buf,
+                                  n_transmittedp,
+                                  src);
+
+        ring->frame = (void *)((uint8_t *)frame + frame->tp_next_offset);
+        if (!--ring->n_frames) {
+                __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+                ring->i_block = (ring->i_block + 1) % ring->n_blocks;
+                ring->frame = NULL;
+        }
+
+        return r;
+}
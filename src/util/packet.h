@@ -6,11 +6,16 @@
 
 #include <c-stdaux.h>
 #include <inttypes.h>
+#include <linux/if_ether.h>
 #include <linux/if_packet.h>
+#include <linux/virtio_net.h>
 #include <netinet/in.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+struct iphdr;
+struct udphdr;
+
 /*
  * `struct sockaddr_ll` is too small to fit the Infiniband hardware address.
  * Introduce `struct packet_sockaddr_ll` which is the same as the original,
@@ -27,7 +32,42 @@ struct packet_sockaddr_ll {
         unsigned char   sll_addr[32]; /* MAX_ADDR_LEN */
 };
 
+/*
+ * Packets on AF_PACKET/SOCK_RAW sockets with PACKET_VNET_HDR enabled start
+ * with a virtio-net header, followed by the link-layer header, which is always
+ * ethernet here.
+ */
+struct packet_vnet_hdr {
+        struct virtio_net_hdr vnet;
+        struct ethhdr eth;
+} _c_packed_;
+
+/*
+ * Memory-mapped TPACKET_V3 receive ring of a packet socket. The kernel fills
+ * blocks of frames, which are consumed in place and handed back to the kernel
+ * one block at a time, so no system call is needed per received packet.
+ */
+struct packet_ring {
+        uint8_t *map;
+        size_t n_map;
+        size_t n_block;
+        unsigned int n_blocks;
+        unsigned int i_block;           /* block currently owned by us */
+        unsigned int n_frames;          /* frames left in the current block */
+        struct tpacket3_hdr *frame;     /* next frame in the current block */
+};
+
+enum {
+        PACKET_CHECKSUM_SCALAR,
+        PACKET_CHECKSUM_SSE2,
+        PACKET_CHECKSUM_AVX2,
+        _PACKET_CHECKSUM_N,
+};
+
+int packet_internet_checksum_select(unsigned int kernel);
 uint16_t packet_internet_checksum(const uint8_t *data, size_t len);
+uint16_t packet_internet_checksum_copy(uint8_t *dst, const uint8_t *data, size_t len);
+uint16_t packet_internet_checksum_update(uint16_t checksum, const void *old, const void *new, size_t size);
 uint16_t packet_internet_checksum_udp(const struct in_addr *src_addr,
                                       const struct in_addr *dst_addr,
                                       uint16_t src_port,
@@ -36,6 +76,36 @@ uint16_t packet_internet_checksum_udp(const struct in_addr *src_addr,
                                       size_t size,
                                       uint16_t checksum);
 
+void packet_init_udp(struct iphdr *ip_hdr,
+                     struct udphdr *udp_hdr,
+                     const void *buf,
+                     size_t n_buf,
+                     const struct sockaddr_in *src_paddr,
+                     const struct sockaddr_in *dest_paddr);
+void packet_init_udp_copy(struct iphdr *ip_hdr,
+                          struct udphdr *udp_hdr,
+                          void *dst,
+                          const void *buf,
+                          size_t n_buf,
+                          const struct sockaddr_in *src_paddr,
+                          const struct sockaddr_in *dest_paddr);
+void packet_init_udp_partial(struct packet_vnet_hdr *vnet_hdr,
+                             struct iphdr *ip_hdr,
+                             struct udphdr *udp_hdr,
+                             size_t n_buf,
+                             const uint8_t *src_haddr,
+                             const struct sockaddr_in *src_paddr,
+                             const uint8_t *dest_haddr,
+                             const struct sockaddr_in *dest_paddr);
+int packet_enable_vnet_hdr(int sockfd, int ifindex, uint8_t *haddr);
+int packet_sendmsg_udp(int sockfd,
+                       const struct packet_vnet_hdr *vnet_hdr,
+                       const struct iphdr *ip_hdr,
+                       const struct udphdr *udp_hdr,
+                       const void *buf,
+                       size_t n_buf,
+                       size_t *n_transmittedp,
+                       const struct packet_sockaddr_ll *dest_haddr);
 int packet_sendto_udp(int sockfd,
                       const void *buf,
                       size_t n_buf,
@@ -47,15 +117,29 @@ int packet_recvfrom_udp(int sockfd,
                         void *buf,
                         size_t n_buf,
                         size_t *n_transmittedp,
-                        struct sockaddr_in *src);
+                        struct sockaddr_in *src,
+                        bool vnet_hdr);
 
 int packet_shutdown(int sockfd);
 
+int packet_ring_new(struct packet_ring **ringp, int sockfd);
+struct packet_ring *packet_ring_free(struct packet_ring *ring);
+int packet_ring_recv_udp(struct packet_ring *ring,
+                         void *buf,
+                         size_t n_buf,
+                         size_t *n_transmittedp,
+                         struct sockaddr_in *src);
+
 /* inline helpers */
 
 static inline int packet_recv_udp(int sockfd,
                                   void *buf,
                                   size_t n_buf,
                                   size_t *n_transmittedp) {
-        return packet_recvfrom_udp(sockfd, buf, n_buf, n_transmittedp, NULL);
+        return packet_recvfrom_udp(sockfd, buf, n_buf, n_transmittedp, NULL, false);
+}
+
+static inline void packet_ring_freep(struct packet_ring **ring) {
+        if (*ring)
+                packet_ring_free(*ring);
 }
@@ -7,6 +7,8 @@
 #include <c-stdaux.h>
 #include <errno.h>
 #include <net/if_arp.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
 #include <stdlib.h>
 #include <string.h>
 #include "n-dhcp4-private.h"
@@ -91,6 +93,134 @@ static void test_checksum(void) {
         }
 }
 
+/* the internet checksum, computed byte by byte */
+static uint16_t test_checksum_reference(const uint8_t *data, size_t size) {
+        uint32_t acc = 0;
+        uint16_t word;
+
+        for (size_t i = 0; i < size; i += 2) {
+                word = 0;
+                memcpy(&word, data + i, size - i < 2 ? 1 : 2);
+                acc += word;
+        }
+
+        while (acc >> 16)
+                acc = (acc & 0xffff) + (acc >> 16);
+
+        return ~acc;
+}
+
+/*
+ * This cross-checks all checksum kernels supported by the CPU against the
+ * reference, on random data of random size and alignment.
+ */
+static void test_checksum_kernels(void) {
+        const struct sockaddr_in src = {
+                .sin_family = AF_INET,
+                .sin_addr = (struct in_addr){ htonl(10 << 24 | 2) },
+                .sin_port = htons(67),
+        };
+        const struct sockaddr_in dst = {
+                .sin_family = AF_INET,
+                .sin_addr = (struct in_addr){ htonl(10 << 24 | 1) },
+                .sin_port = htons(68),
+        };
+        static uint8_t data[2048 + 64], copy[2048 + 64];
+        struct iphdr ip_hdr, ip_hdr_copy;
+        struct udphdr udp_hdr, udp_hdr_copy;
+        unsigned int seed = 0, n_kernels = 0;
+        size_t size, offset, offset_copy;
+        uint16_t reference, udp, checksum;
+        int r;
+
+        for (unsigned int k = 0; k < _PACKET_CHECKSUM_N; ++k)
+                if (!packet_internet_checksum_select(k))
+                        ++n_kernels;
+
+        c_assert(n_kernels >= 1);
+
+        for (unsigned int i = 0; i < 4096; ++i) {
+                size = rand_r(&seed) % 2048;
+                offset = rand_r(&seed) % 32;
+                offset_copy = rand_r(&seed) % 32;
+
+                for (size_t j = 0; j < sizeof(data); ++j)
+                        data[j] = rand_r(&seed);
+
+                reference = test_checksum_reference(data + offset, size);
+                udp = 0;
+
+                for (unsigned int k = 0; k < _PACKET_CHECKSUM_N; ++k) {
+                        r = packet_internet_checksum_select(k);
+                        if (r) {
+                                c_assert(r == -ENOTSUP);
+                                continue;
+                        }
+
+                        checksum = packet_internet_checksum(data + offset, size);
+                        c_assert(checksum == reference);
+
+                        /* the copy must be exact, and not touch anything else */
+                        memset(copy, 0xaa, sizeof(copy));
+                        checksum = packet_internet_checksum_copy(copy + offset_copy, data + offset, size);
+                        c_assert(checksum == reference);
+                        c_assert(!memcmp(copy + offset_copy, data + offset, size));
+                        for (size_t j = 0; j < sizeof(copy); ++j)
+                                if (j < offset_copy || j >= offset_copy + size)
+                                        c_assert(copy[j] == 0xaa);
+
+                        /* all kernels agree on the UDP checksum, and it verifies */
+                        checksum = packet_internet_checksum_udp(&src.sin_addr, &dst.sin_addr,
+                                                                67, 68, data + offset, size, 0);
+                        c_assert(!udp || checksum == udp);
+                        udp = checksum;
+
+                        checksum = packet_internet_checksum_udp(&src.sin_addr, &dst.sin_addr,
+                                                                67, 68, data + offset, size, udp ?: 0xffff);
+                        c_assert(!checksum);
+
+                        /* copying the payload yields the very same headers */
+                        packet_init_udp(&ip_hdr, &udp_hdr, data + offset, size, &src, &dst);
+                        packet_init_udp_copy(&ip_hdr_copy, &udp_hdr_copy, copy, data + offset, size, &src, &dst);
+                        c_assert(!memcmp(&ip_hdr, &ip_hdr_copy, sizeof(ip_hdr)));
+                        c_assert(!memcmp(&udp_hdr, &udp_hdr_copy, sizeof(udp_hdr)));
+                        c_assert(!memcmp(copy, data + offset, size));
+                }
+        }
+
+        r = packet_internet_checksum_select(_PACKET_CHECKSUM_N);
+        c_assert(!r);
+}
+
+/*
+ * This verifies that incrementally updated checksums match the checksum
+ * computed over the modified data, for random modifications of random fields.
+ */
+static void test_checksum_update(void) {
+        uint8_t data[548], old[8];
+        unsigned int seed = 0;
+        size_t offset, size;
+        uint16_t checksum;
+
+        for (size_t i = 0; i < sizeof(data); ++i)
+                data[i] = rand_r(&seed);
+
+        checksum = packet_internet_checksum(data, sizeof(data));
+
+        for (unsigned int i = 0; i < 65536; ++i) {
+                size = 2 * (1 + rand_r(&seed) % (sizeof(old) / 2));
+                offset = 2 * (rand_r(&seed) % ((sizeof(data) - size) / 2 + 1));
+
+                memcpy(old, data + offset, size);
+                for (size_t j = 0; j < size; ++j)
+                        data[offset + j] = rand_r(&seed);
+
+                checksum = packet_internet_checksum_update(checksum, old, data + offset, size);
+                c_assert(checksum == packet_internet_checksum(data, sizeof(data)) ||
+                         (checksum == 0xffff && !packet_internet_checksum(data, sizeof(data))));
+        }
+}
+
 static void test_new_packet_socket(Link *link, int *skp) {
         struct sockaddr_ll addr = {
                 .sll_family = AF_PACKET,
@@ -328,7 +458,8 @@ static void test_ip_hdr(Link *link_src,
                         const struct sockaddr_in *paddr_dst) {
         _c_cleanup_(c_closep) int sk_src = -1, sk_dst = -1;
         uint8_t ipopts[5] = { 1, 1, 1, 1, 1 };
-        uint8_t buf[1024];
+        uint8_t buf[1024], data[1024];
+        struct sockaddr_in src;
         ssize_t slen;
         size_t len;
         int r;
@@ -337,9 +468,14 @@ static void test_ip_hdr(Link *link_src,
          * This test sends a packet from a UDP socket to a packet socket, but
          * appends 5-bytes of IPOPT_NOOP ip-options. With this we verify our
          * packet socket correctly skips additional ip-options and does not
-         * interpret the ip-header as a fixed size header.
+         * interpret the ip-header as a fixed size header. The options shift
+         * the UDP header into the payload buffer on receive, so verify that
+         * the payload ends up unmodified at the start of the buffer.
          */
 
+        for (size_t i = 0; i < sizeof(data); ++i)
+                data[i] = i ^ (i >> 8);
+
         link_socket(link_src, &sk_src, AF_INET, SOCK_DGRAM | SOCK_CLOEXEC);
         test_new_packet_socket(link_dst, &sk_dst);
         link_add_ip4(link_src, &paddr_src->sin_addr, 8);
@@ -348,13 +484,15 @@ static void test_ip_hdr(Link *link_src,
         r = setsockopt(sk_src, IPPROTO_IP, IP_OPTIONS, ipopts, sizeof(ipopts));
         c_assert(r >= 0);
 
-        slen = sendto(sk_src, buf, sizeof(buf) - 1, 0,
+        slen = sendto(sk_src, data, sizeof(data) - 1, 0,
                       (struct sockaddr*)paddr_dst, sizeof(*paddr_dst));
-        c_assert(slen == (ssize_t)sizeof(buf) - 1);
+        c_assert(slen == (ssize_t)sizeof(data) - 1);
 
-        r = packet_recv_udp(sk_dst, buf, sizeof(buf), &len);
+        r = packet_recvfrom_udp(sk_dst, buf, sizeof(buf), &len, &src, false);
         c_assert(!r);
-        c_assert(len == (ssize_t)sizeof(buf) - 1);
+        c_assert(len == (ssize_t)sizeof(data) - 1);
+        c_assert(!memcmp(buf, data, len));
+        c_assert(src.sin_addr.s_addr == paddr_src->sin_addr.s_addr);
 
         link_del_ip4(link_dst, &paddr_dst->sin_addr, 8);
         link_del_ip4(link_src, &paddr_src->sin_addr, 8);
@@ -405,6 +543,8 @@ int main(int argc, char **argv) {
         test_setup();
 
         test_checksum();
+        test_checksum_kernels();
+        test_checksum_update();
         test_packet();
 
         return 0;